@@ -23,6 +23,72 @@ CREATE TABLE ai_toolkit.ai_memory (
 
 CREATE INDEX idx_ai_memory_category_key ON ai_toolkit.ai_memory(category, key);
 
+-- Error explanations: generated explanations keyed by error class
+-- (SQLSTATE + message template with identifiers and literals abstracted)
+CREATE TABLE ai_toolkit.error_explanations (
+    fingerprint BIGINT PRIMARY KEY,
+    sqlstate TEXT,
+    message_template TEXT NOT NULL,
+    sample_message TEXT NOT NULL,
+    explanation TEXT NOT NULL,
+    model TEXT,
+    created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+);
+
+-- Query log: one row per toolkit request, written in batches by a background worker.
+-- Partitioned by UTC day; the writer creates partitions and drops expired ones.
+CREATE TABLE ai_toolkit.query_log (
+    logged_at TIMESTAMPTZ NOT NULL,
+    pid INTEGER,
+    usesysid OID,
+    function_name TEXT NOT NULL,
+    prompt TEXT,
+    generated_sql TEXT,
+    model TEXT,
+    outcome TEXT NOT NULL,
+    error TEXT,
+    steps INTEGER,
+    tool_calls INTEGER,
+    input_tokens BIGINT,
+    output_tokens BIGINT,
+    rows_returned BIGINT,
+    total_ms FLOAT8,
+    provider_ms FLOAT8,
+    tool_ms FLOAT8,
+    execute_ms FLOAT8
+) PARTITION BY RANGE (logged_at);
+
+CREATE INDEX idx_query_log_logged_at ON ai_toolkit.query_log(logged_at);
+
+-- Verified question/SQL pairs: few-shot examples for query() and its no-model fast path.
+-- embedding is a local hashed bag-of-words vector computed by the extension.
+CREATE TABLE ai_toolkit.query_examples (
+    id SERIAL PRIMARY KEY,
+    question TEXT NOT NULL,
+    normalized_question TEXT NOT NULL UNIQUE,
+    sql TEXT NOT NULL,
+    embedding REAL[],
+    verified BOOLEAN NOT NULL DEFAULT true,
+    uses BIGINT NOT NULL DEFAULT 0,
+    created_by TEXT DEFAULT CURRENT_USER,
+    created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+    updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+    last_used_at TIMESTAMP
+);
+
+-- SQL functions exposed to the model as tools by ai_toolkit.register_tool().
+-- The function's named arguments are the tool's parameters; params maps them to descriptions.
+CREATE TABLE ai_toolkit.tools (
+    name TEXT PRIMARY KEY,
+    description TEXT NOT NULL,
+    params JSONB NOT NULL DEFAULT '{}',
+    function REGPROCEDURE NOT NULL,
+    enabled BOOLEAN NOT NULL DEFAULT true,
+    created_by TEXT DEFAULT CURRENT_USER,
+    created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+    updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+);
+
 -- ==========================================
 -- Core C Functions
 -- ==========================================
@@ -57,15 +123,96 @@ CREATE OR REPLACE FUNCTION ai_toolkit.explain_error(text DEFAULT NULL)
 RETURNS void AS 'ai_toolkit', 'explain_error'
 LANGUAGE C;
 
+-- Store a verified question/SQL example. The only way to write query_examples: the SQL
+-- is validated as the caller (with the caller's search_path), then inserted as the table
+-- owner with the calling role recorded, since the fast path runs it for other users
+CREATE OR REPLACE FUNCTION ai_toolkit.add_example(text, text)
+RETURNS integer AS 'ai_toolkit', 'add_example'
+LANGUAGE C STRICT;
+
+-- Store the session's last query() request as a verified example, optionally with corrected SQL
+CREATE OR REPLACE FUNCTION ai_toolkit.accept_query(text DEFAULT NULL)
+RETURNS integer AS 'ai_toolkit', 'accept_query'
+LANGUAGE C;
+
+-- Register a SQL function as a model tool (replaces a tool of the same name)
+CREATE OR REPLACE FUNCTION ai_toolkit.register_tool(name text, description text, params jsonb, fn regprocedure)
+RETURNS text AS 'ai_toolkit', 'register_tool'
+LANGUAGE C;
+
+-- Recent errors - errors captured in this session, most recent first
+CREATE OR REPLACE FUNCTION ai_toolkit.recent_errors()
+RETURNS TABLE(n INTEGER, logged_at TIMESTAMPTZ, sqlstate TEXT, message TEXT,
+              detail TEXT, hint TEXT, statement TEXT)
+AS 'ai_toolkit', 'recent_errors'
+LANGUAGE C;
+
+-- Query history - ai_toolkit.query() requests of this session, most recent first
+CREATE OR REPLACE FUNCTION ai_toolkit.query_history_status()
+RETURNS TABLE(n INTEGER, requested_at TIMESTAMPTZ, prompt TEXT, generated_sql TEXT,
+              model TEXT, outcome TEXT, rows_returned BIGINT)
+AS 'ai_toolkit', 'query_history_status'
+LANGUAGE C;
+
+-- Session status - latest request of every session, keyed by backend PID
+CREATE OR REPLACE FUNCTION ai_toolkit.session_status()
+RETURNS TABLE(pid INTEGER, datid OID, usesysid OID, requests BIGINT,
+              last_request_at TIMESTAMPTZ, last_outcome TEXT, last_rows BIGINT,
+              last_prompt TEXT, last_sql TEXT)
+AS 'ai_toolkit', 'session_status'
+LANGUAGE C;
+
+-- Rate limit status - provider/model buckets shared by all backends
+CREATE OR REPLACE FUNCTION ai_toolkit.rate_limit_status()
+RETURNS TABLE(target TEXT, in_flight INTEGER, queue_depth INTEGER,
+              request_credit FLOAT8, token_credit FLOAT8,
+              granted BIGINT, waited BIGINT, timeouts BIGINT,
+              avg_wait_ms FLOAT8, max_wait_ms FLOAT8, tokens_charged BIGINT)
+AS 'ai_toolkit', 'rate_limit_status'
+LANGUAGE C;
+
+-- Provider target status - circuit breaker state, latency and hedging per target
+CREATE OR REPLACE FUNCTION ai_toolkit.provider_target_status()
+RETURNS TABLE(target TEXT, breaker_state TEXT, consecutive_failures INTEGER,
+              requests BIGINT, failures BIGINT, p50_ms BIGINT, p95_ms BIGINT,
+              hedges_fired BIGINT, hedges_won BIGINT)
+AS 'ai_toolkit', 'provider_target_status'
+LANGUAGE C;
+
+-- Stat counters - named counters shared by all backends
+CREATE OR REPLACE FUNCTION ai_toolkit.stat_counters()
+RETURNS TABLE(metric TEXT, value BIGINT, since TIMESTAMPTZ)
+AS 'ai_toolkit', 'stat_counters'
+LANGUAGE C;
+
+-- Reset all stat counters
+CREATE OR REPLACE FUNCTION ai_toolkit.reset_stats()
+RETURNS void AS 'ai_toolkit', 'reset_stats'
+LANGUAGE C;
+
+-- Send a relcache invalidation for a relation (used by the comment event trigger)
+CREATE OR REPLACE FUNCTION ai_toolkit.invalidate_relation(oid)
+RETURNS void AS 'ai_toolkit', 'invalidate_relation'
+LANGUAGE C STRICT;
+
 -- ==========================================
 -- Helper SQL Functions
 -- ==========================================
 
+-- Remove a registered tool
+CREATE OR REPLACE FUNCTION ai_toolkit.unregister_tool(tool_name TEXT)
+RETURNS boolean AS $$
+    WITH removed AS (
+        DELETE FROM ai_toolkit.tools WHERE name = tool_name RETURNING 1
+    )
+    SELECT count(*) > 0 FROM removed;
+$$ LANGUAGE sql;
+
 -- View all memories
 CREATE OR REPLACE FUNCTION ai_toolkit.view_memories()
-RETURNS TABLE(category TEXT, key TEXT, value TEXT, notes TEXT, updated_at TIMESTAMP) AS $$
+RETURNS TABLE(category TEXT, key TEXT, value TEXT, notes TEXT, updated_at TIMESTAMP, confidence_score INTEGER) AS $$
 BEGIN
-    RETURN QUERY SELECT m.category, m.key, m.value, m.notes, m.updated_at 
+    RETURN QUERY SELECT m.category, m.key, m.value, m.notes, m.updated_at, m.confidence_score
     FROM ai_toolkit.ai_memory m 
     ORDER BY m.updated_at DESC;
 END;
@@ -84,12 +231,265 @@ BEGIN
 END;
 $$ LANGUAGE plpgsql;
 
+-- Raised by import_memories() for an existing key under the 'error' conflict policy
+CREATE OR REPLACE FUNCTION ai_toolkit.memory_import_conflict(category TEXT, key TEXT)
+RETURNS boolean AS $$
+BEGIN
+    RAISE EXCEPTION 'Memory [%] % already exists', category, key
+        USING ERRCODE = 'unique_violation', HINT = 'Use conflict policy overwrite, skip or newer.';
+END;
+$$ LANGUAGE plpgsql;
+
+-- Import memories in one set-based upsert.
+-- memories: a JSON array of {category, key, value, notes, confidence_score, updated_at}
+-- (or an object with a "memories" array, as produced by export_memories()).
+-- conflict_policy: 'overwrite' (default), 'skip', 'newer' (keep whichever updated_at is later)
+-- or 'error' (fail on any existing key). Later duplicates within the input win.
+-- Imported rows are stamped with the import time, so maintenance decays and expires them
+-- from when they arrived here; the exported updated_at only decides the 'newer' policy.
+CREATE OR REPLACE FUNCTION ai_toolkit.import_memories(memories JSONB, conflict_policy TEXT DEFAULT 'overwrite')
+RETURNS TABLE(inserted BIGINT, updated BIGINT, skipped BIGINT) AS $$
+DECLARE
+    items JSONB := CASE
+        WHEN jsonb_typeof(memories) = 'object' AND memories ? 'memories' THEN memories->'memories'
+        WHEN jsonb_typeof(memories) = 'object' THEN jsonb_build_array(memories)
+        ELSE memories END;
+BEGIN
+    IF conflict_policy NOT IN ('overwrite', 'skip', 'newer', 'error') THEN
+        RAISE EXCEPTION 'Unknown conflict policy "%"', conflict_policy
+            USING HINT = 'Use overwrite, skip, newer or error.';
+    END IF;
+    IF items IS NULL OR jsonb_typeof(items) <> 'array' THEN
+        RAISE EXCEPTION 'Expected a JSON array of memories';
+    END IF;
+
+    WITH incoming AS (
+        SELECT DISTINCT ON (r.category, r.key)
+               r.category, r.key, r.value, r.notes,
+               COALESCE(r.confidence_score, 100) AS confidence_score,
+               COALESCE(r.updated_at, CURRENT_TIMESTAMP::timestamp) AS source_updated_at
+        FROM jsonb_to_recordset(items) WITH ORDINALITY
+             AS r(category TEXT, key TEXT, value TEXT, notes TEXT, confidence_score INTEGER, updated_at TIMESTAMP, n BIGINT)
+        WHERE r.category IS NOT NULL AND r.key IS NOT NULL AND r.value IS NOT NULL
+        ORDER BY r.category, r.key, r.n DESC
+    ),
+    upserted AS (
+        INSERT INTO ai_toolkit.ai_memory AS m (category, key, value, notes, confidence_score, updated_at)
+        SELECT i.category, i.key, i.value, i.notes, i.confidence_score, CURRENT_TIMESTAMP::timestamp
+        FROM incoming i
+        WHERE conflict_policy <> 'newer'
+           OR NOT EXISTS (SELECT 1 FROM ai_toolkit.ai_memory e
+                          WHERE e.category = i.category AND e.key = i.key
+                            AND e.updated_at >= i.source_updated_at)
+        ON CONFLICT (category, key) DO UPDATE SET
+            value = EXCLUDED.value,
+            notes = EXCLUDED.notes,
+            confidence_score = EXCLUDED.confidence_score,
+            updated_at = EXCLUDED.updated_at
+        WHERE conflict_policy IN ('overwrite', 'newer')
+           OR (conflict_policy = 'error' AND ai_toolkit.memory_import_conflict(m.category, m.key))
+        RETURNING (xmax = 0) AS was_inserted
+    )
+    SELECT count(*) FILTER (WHERE was_inserted), count(*) FILTER (WHERE NOT was_inserted)
+    INTO inserted, updated FROM upserted;
+
+    skipped := jsonb_array_length(items) - inserted - updated;
+    RETURN NEXT;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Import memories from text: a JSON document or newline-delimited JSON objects
+CREATE OR REPLACE FUNCTION ai_toolkit.import_memories(memories TEXT, conflict_policy TEXT DEFAULT 'overwrite')
+RETURNS TABLE(inserted BIGINT, updated BIGINT, skipped BIGINT) AS $$
+DECLARE
+    doc JSONB;
+BEGIN
+    BEGIN
+        doc := memories::jsonb;
+    EXCEPTION WHEN invalid_text_representation THEN
+        SELECT jsonb_agg(line::jsonb) INTO doc
+        FROM regexp_split_to_table(memories, E'\r?\n') AS line
+        WHERE btrim(line) <> '';
+    END;
+
+    RETURN QUERY SELECT * FROM ai_toolkit.import_memories(doc, conflict_policy);
+END;
+$$ LANGUAGE plpgsql;
+
+-- Export memories (optionally one category) in the format import_memories() accepts
+CREATE OR REPLACE FUNCTION ai_toolkit.export_memories(category_filter TEXT DEFAULT NULL)
+RETURNS JSONB AS $$
+    SELECT jsonb_build_object(
+        'exported_at', CURRENT_TIMESTAMP,
+        'memories', COALESCE(jsonb_agg(jsonb_build_object(
+            'category', m.category,
+            'key', m.key,
+            'value', m.value,
+            'notes', m.notes,
+            'confidence_score', m.confidence_score,
+            'updated_at', m.updated_at) ORDER BY m.category, m.key), '[]'::jsonb))
+    FROM ai_toolkit.ai_memory m
+    WHERE category_filter IS NULL OR m.category = category_filter;
+$$ LANGUAGE sql STABLE;
+
+-- Memory maintenance, run periodically by the background worker (ai_toolkit.memory_maintenance_interval):
+-- 1. removes table/column memories whose key (table, schema.table, [schema.]table.column) names
+--    a relation or column that no longer exists; unqualified tables match in any schema, and each
+--    name matches exactly or, for unquoted identifiers, in lower case
+-- 2. merges keys that differ only in case, quoting, whitespace or a public. prefix (newest wins)
+-- 3. decays confidence_score to 100 * 0.5^(days since update / half_life_days); updates restore 100
+-- 4. removes memories below min_confidence or not updated for ttl_days (0 disables either)
+CREATE OR REPLACE FUNCTION ai_toolkit.maintain_memories(half_life_days INTEGER DEFAULT 90,
+                                                        min_confidence INTEGER DEFAULT 10,
+                                                        ttl_days INTEGER DEFAULT 0)
+RETURNS TABLE(invalidated BIGINT, decayed BIGINT, expired BIGINT, merged BIGINT) AS $$
+BEGIN
+    WITH gone AS (
+        DELETE FROM ai_toolkit.ai_memory m
+        WHERE (m.category = 'table'
+               AND m.key ~ '^[A-Za-z_][A-Za-z0-9_$]*(\.[A-Za-z_][A-Za-z0-9_$]*)?$'
+               AND NOT EXISTS (
+                   SELECT 1 FROM pg_class c JOIN pg_namespace ns ON ns.oid = c.relnamespace
+                   WHERE c.relkind IN ('r', 'p', 'v', 'm', 'f')
+                     AND c.relname IN (split_part(m.key, '.', -1), lower(split_part(m.key, '.', -1)))
+                     AND (strpos(m.key, '.') = 0
+                          OR ns.nspname IN (split_part(m.key, '.', 1), lower(split_part(m.key, '.', 1))))))
+           OR (m.category = 'column'
+               AND m.key ~ '^[A-Za-z_][A-Za-z0-9_$]*(\.[A-Za-z_][A-Za-z0-9_$]*){1,2}$'
+               AND NOT EXISTS (
+                   SELECT 1 FROM pg_attribute a
+                   JOIN pg_class c ON c.oid = a.attrelid
+                   JOIN pg_namespace ns ON ns.oid = c.relnamespace
+                   WHERE a.attnum > 0 AND NOT a.attisdropped
+                     AND a.attname IN (split_part(m.key, '.', -1), lower(split_part(m.key, '.', -1)))
+                     AND c.relname IN (split_part(m.key, '.', -2), lower(split_part(m.key, '.', -2)))
+                     AND (cardinality(string_to_array(m.key, '.')) = 2
+                          OR ns.nspname IN (split_part(m.key, '.', 1), lower(split_part(m.key, '.', 1))))))
+        RETURNING 1
+    )
+    SELECT count(*) INTO invalidated FROM gone;
+
+    WITH grouped AS (
+        SELECT m.id,
+               row_number() OVER w AS rank,
+               max(m.confidence_score) OVER (PARTITION BY m.category, n.norm_key) AS best_confidence
+        FROM ai_toolkit.ai_memory m,
+             LATERAL (SELECT regexp_replace(regexp_replace(lower(btrim(m.key)), '^public\.|"', '', 'g'),
+                                            '[[:space:]-]+', '_', 'g') AS norm_key) n
+        WINDOW w AS (PARTITION BY m.category, n.norm_key ORDER BY m.updated_at DESC, m.confidence_score DESC, m.id DESC)
+    ),
+    kept AS (
+        UPDATE ai_toolkit.ai_memory m SET confidence_score = g.best_confidence
+        FROM grouped g
+        WHERE m.id = g.id AND g.rank = 1 AND g.best_confidence > m.confidence_score
+        RETURNING 1
+    ),
+    gone AS (
+        DELETE FROM ai_toolkit.ai_memory m USING grouped g
+        WHERE m.id = g.id AND g.rank > 1
+        RETURNING 1
+    )
+    SELECT count(*) INTO merged FROM gone;
+
+    decayed := 0;
+    IF half_life_days > 0 THEN
+        WITH aged AS (
+            SELECT m.id,
+                   floor(100 * power(0.5, extract(epoch FROM CURRENT_TIMESTAMP::timestamp - COALESCE(m.updated_at, m.created_at))
+                                          / 86400.0 / half_life_days))::integer AS score
+            FROM ai_toolkit.ai_memory m
+        )
+        UPDATE ai_toolkit.ai_memory m SET confidence_score = a.score
+        FROM aged a
+        WHERE m.id = a.id AND a.score < m.confidence_score;
+        GET DIAGNOSTICS decayed = ROW_COUNT;
+    END IF;
+
+    WITH gone AS (
+        DELETE FROM ai_toolkit.ai_memory m
+        WHERE (min_confidence > 0 AND m.confidence_score < min_confidence)
+           OR (ttl_days > 0 AND COALESCE(m.updated_at, m.created_at) < CURRENT_TIMESTAMP::timestamp - make_interval(days => ttl_days))
+        RETURNING 1
+    )
+    SELECT count(*) INTO expired FROM gone;
+
+    RETURN NEXT;
+END;
+$$ LANGUAGE plpgsql;
+
+-- View query logs: the caller's own requests, or everyone's for pg_read_all_stats members
+CREATE OR REPLACE FUNCTION ai_toolkit.view_logs(log_limit INTEGER DEFAULT 50)
+RETURNS TABLE(logged_at TIMESTAMPTZ, usename NAME, function_name TEXT, prompt TEXT,
+              generated_sql TEXT, model TEXT, outcome TEXT, error TEXT, steps INTEGER,
+              tool_calls INTEGER, input_tokens BIGINT, output_tokens BIGINT, rows_returned BIGINT,
+              total_ms FLOAT8, provider_ms FLOAT8, tool_ms FLOAT8, execute_ms FLOAT8) AS $$
+BEGIN
+    RETURN QUERY SELECT l.logged_at, r.rolname, l.function_name, l.prompt,
+                        l.generated_sql, l.model, l.outcome, l.error, l.steps,
+                        l.tool_calls, l.input_tokens, l.output_tokens, l.rows_returned,
+                        l.total_ms, l.provider_ms, l.tool_ms, l.execute_ms
+    FROM ai_toolkit.query_log l
+    LEFT JOIN pg_catalog.pg_roles r ON r.oid = l.usesysid
+    WHERE r.rolname = session_user
+       OR pg_catalog.pg_has_role(session_user, 'pg_read_all_stats', 'USAGE')
+    ORDER BY l.logged_at DESC
+    LIMIT log_limit;
+END;
+$$ LANGUAGE plpgsql SECURITY DEFINER SET search_path = pg_catalog, pg_temp;
+
+-- COMMENT ON sends no relcache invalidation: send one for the commented relation so
+-- every backend's catalog search index picks up the new comment
+CREATE OR REPLACE FUNCTION ai_toolkit.comment_changed()
+RETURNS event_trigger AS $$
+DECLARE
+    cmd RECORD;
+BEGIN
+    FOR cmd IN SELECT DISTINCT c.objid FROM pg_catalog.pg_event_trigger_ddl_commands() c
+               WHERE c.classid = 'pg_catalog.pg_class'::pg_catalog.regclass LOOP
+        PERFORM ai_toolkit.invalidate_relation(cmd.objid);
+    END LOOP;
+END;
+$$ LANGUAGE plpgsql SECURITY DEFINER SET search_path = pg_catalog, pg_temp;
+
+CREATE EVENT TRIGGER ai_toolkit_comment_changed ON ddl_command_end
+    WHEN TAG IN ('COMMENT')
+    EXECUTE FUNCTION ai_toolkit.comment_changed();
+
+-- ==========================================
+-- Monitoring Views
+-- ==========================================
+
+CREATE VIEW ai_toolkit.rate_limits AS
+SELECT * FROM ai_toolkit.rate_limit_status();
+
+CREATE VIEW ai_toolkit.provider_targets AS
+SELECT * FROM ai_toolkit.provider_target_status();
+
+CREATE VIEW ai_toolkit.query_history AS
+SELECT * FROM ai_toolkit.query_history_status();
+
+CREATE VIEW ai_toolkit.sessions AS
+SELECT s.pid, d.datname, r.rolname AS usename, s.requests, s.last_request_at,
+       s.last_outcome, s.last_rows, s.last_prompt, s.last_sql
+FROM ai_toolkit.session_status() s
+LEFT JOIN pg_database d ON d.oid = s.datid
+LEFT JOIN pg_roles r ON r.oid = s.usesysid;
+
+CREATE VIEW ai_toolkit.stats AS
+SELECT * FROM ai_toolkit.stat_counters()
+ORDER BY metric;
+
 -- ==========================================
 -- Permissions
 -- ==========================================
 
 GRANT SELECT, INSERT, UPDATE ON ai_toolkit.ai_memory TO PUBLIC;
 GRANT USAGE ON SEQUENCE ai_toolkit.ai_memory_id_seq TO PUBLIC;
+-- error_explanations is shown to every user; only the extension (as the table owner) reads and writes it
+REVOKE ALL ON ai_toolkit.error_explanations FROM PUBLIC;
+GRANT SELECT ON ai_toolkit.query_examples TO PUBLIC;
+GRANT UPDATE (uses, last_used_at) ON ai_toolkit.query_examples TO PUBLIC;
+GRANT SELECT ON ai_toolkit.tools TO PUBLIC;
 
 GRANT EXECUTE ON FUNCTION ai_toolkit.help() TO PUBLIC;
 GRANT EXECUTE ON FUNCTION ai_toolkit.set_memory(text, text, text, text) TO PUBLIC;
@@ -97,5 +497,28 @@ GRANT EXECUTE ON FUNCTION ai_toolkit.get_memory(text, text) TO PUBLIC;
 GRANT EXECUTE ON FUNCTION ai_toolkit.query(text) TO PUBLIC;
 GRANT EXECUTE ON FUNCTION ai_toolkit.explain_query(text) TO PUBLIC;
 GRANT EXECUTE ON FUNCTION ai_toolkit.explain_error(text) TO PUBLIC;
+GRANT EXECUTE ON FUNCTION ai_toolkit.add_example(text, text) TO PUBLIC;
+GRANT EXECUTE ON FUNCTION ai_toolkit.accept_query(text) TO PUBLIC;
+GRANT EXECUTE ON FUNCTION ai_toolkit.recent_errors() TO PUBLIC;
+GRANT EXECUTE ON FUNCTION ai_toolkit.query_history_status() TO PUBLIC;
+GRANT SELECT ON ai_toolkit.query_history TO PUBLIC;
+GRANT EXECUTE ON FUNCTION ai_toolkit.session_status() TO PUBLIC;
+GRANT SELECT ON ai_toolkit.sessions TO PUBLIC;
 GRANT EXECUTE ON FUNCTION ai_toolkit.view_memories() TO PUBLIC;
-GRANT EXECUTE ON FUNCTION ai_toolkit.search_memory(text) TO PUBLIC;
\ No newline at end of file
+GRANT EXECUTE ON FUNCTION ai_toolkit.search_memory(text) TO PUBLIC;
+GRANT EXECUTE ON FUNCTION ai_toolkit.view_logs(integer) TO PUBLIC;
+GRANT EXECUTE ON FUNCTION ai_toolkit.memory_import_conflict(text, text) TO PUBLIC;
+GRANT EXECUTE ON FUNCTION ai_toolkit.import_memories(jsonb, text) TO PUBLIC;
+GRANT EXECUTE ON FUNCTION ai_toolkit.import_memories(text, text) TO PUBLIC;
+GRANT EXECUTE ON FUNCTION ai_toolkit.export_memories(text) TO PUBLIC;
+GRANT EXECUTE ON FUNCTION ai_toolkit.rate_limit_status() TO PUBLIC;
+GRANT SELECT ON ai_toolkit.rate_limits TO PUBLIC;
+GRANT EXECUTE ON FUNCTION ai_toolkit.provider_target_status() TO PUBLIC;
+GRANT SELECT ON ai_toolkit.provider_targets TO PUBLIC;
+GRANT EXECUTE ON FUNCTION ai_toolkit.stat_counters() TO PUBLIC;
+GRANT SELECT ON ai_toolkit.stats TO PUBLIC;
+REVOKE EXECUTE ON FUNCTION ai_toolkit.reset_stats() FROM PUBLIC;
+REVOKE EXECUTE ON FUNCTION ai_toolkit.maintain_memories(integer, integer, integer) FROM PUBLIC;
+REVOKE EXECUTE ON FUNCTION ai_toolkit.register_tool(text, text, jsonb, regprocedure) FROM PUBLIC;
+REVOKE EXECUTE ON FUNCTION ai_toolkit.unregister_tool(text) FROM PUBLIC;
+REVOKE EXECUTE ON FUNCTION ai_toolkit.invalidate_relation(oid) FROM PUBLIC;
\ No newline at end of file
@@ -7,6 +7,20 @@
 #include <filesystem>
 #include <algorithm>
 #include <vector>
+#include <cmath>
+#include <climits>
+#include <map>
+#include <unordered_map>
+#include <regex>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <csignal>
+#include <pthread.h>
 
 #include <ai/ai.h>
 #include <ai/logger.h>
@@ -18,11 +32,49 @@ extern "C"
 {
 #include <postgres.h>
 #include <fmgr.h>
+#include <funcapi.h>
+#include <miscadmin.h>
 #include <utils/builtins.h>
 #include "utils/guc.h"
 #include <executor/spi.h>
+#include <parser/parser.h>
+#include <parser/parse_param.h>
+#include <nodes/nodeFuncs.h>
+#include <utils/lsyscache.h>
+#include <nodes/parsenodes.h>
+#include <common/hashfn.h>
+#include <utils/resowner.h>
+#include <utils/memutils.h>
 #include <catalog/pg_type_d.h>
 #include <utils/elog.h>
+#include <utils/timestamp.h>
+#include <utils/wait_event.h>
+#include <access/xact.h>
+#include <tcop/tcopprot.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <postmaster/bgworker.h>
+#include <postmaster/interrupt.h>
+#include <utils/snapmgr.h>
+#include <utils/datetime.h>
+#include <pgstat.h>
+#include <utils/acl.h>
+#include <utils/inval.h>
+#include <utils/syscache.h>
+#include <utils/timeout.h>
+#include <catalog/pg_class.h>
+#include <catalog/namespace.h>
+#include <catalog/pg_proc.h>
+#include <access/transam.h>
+#include <utils/regproc.h>
+#include <utils/rls.h>
+#include <utils/date.h>
+#include <utils/plancache.h>
+#include <libpq/libpq-be-fe-helpers.h>
+#include <catalog/pg_authid.h>
+#include <storage/condition_variable.h>
+#include <storage/dsm_registry.h>
+#include <storage/lwlock.h>
 
 #ifdef PG_MODULE_MAGIC
     PG_MODULE_MAGIC;
@@ -33,7 +85,98 @@ extern "C"
     static char *ai_api_key = nullptr;  // API key for the selected provider
     static char *ai_model = nullptr;    // Model name
     static char *ai_base_url = nullptr; // Custom base URL (optional)
+    static char *ai_api_keys = nullptr; // Per-provider API keys: "provider=key,..." (optional)
+    static char *ai_targets = nullptr;  // Ordered fallback targets: "provider|model[|base_url],..." (optional)
     static char *prompt_file_path = nullptr;
+    static int input_token_budget = 0; // estimated input tokens allowed per step, 0 = unlimited
+
+    // Tool result encoding
+#define AI_TOOL_OUTPUT_VERBOSE 0
+#define AI_TOOL_OUTPUT_COMPACT 1
+    static int tool_output_format = AI_TOOL_OUTPUT_VERBOSE;
+    static int compact_max_columns = 60; // columns shown with types per table in compact mode, 0 = all
+
+    // Catalog index
+    static int prerank_tables = 10; // likely tables named in the query() prompt, 0 = off
+    static int prefetch_tables = 5; // likely tables whose metadata is warmed during the first step, 0 = off
+    static int max_steps_limit = 10; // upper bound of the adaptive step budget
+
+    // Standby offload for query()
+    static char *standby_conninfo = nullptr; // run generated SELECTs here, empty = locally
+
+    // Answer format for query()
+    static bool structured_output = true; // final answer via the final_answer tool instead of <sql> tags
+
+    // Verified examples for query()
+    static int example_shots = 3;                      // similar examples shown to the model, 0 = none
+    static double example_fast_path_similarity = 0.95; // reuse an example's SQL without the model at or above this, 0 = off
+    static char *example_trusted_roles = nullptr;      // roles whose examples the fast path runs for everyone
+
+    // SQL templates for query()
+    static int template_cache_size = 64; // templates kept per backend, 0 = off
+
+    // sample_rows tool
+    static int sample_page_budget = 32; // pages read per sample of a large table
+    static int sample_timeout = 2000;   // ms before a sample query is cancelled, 0 = no limit
+    static int tool_timeout = 2000;     // ms before a registered tool's call is cancelled, 0 = no limit
+
+    // explain_query / explain_error
+    static bool explain_analyze = false;    // run EXPLAIN ANALYZE, BUFFERS for plain SELECTs
+    static int explain_cache_ttl = 86400;   // seconds a cached explanation stays valid, 0 disables the cache
+
+    // Session state
+    static bool track_sessions = true; // publish each backend's latest request for ai_toolkit.sessions
+
+    // Query log
+    static bool query_log_enabled = true; // queue each request for ai_toolkit.query_log
+    static int log_flush_interval = 1000; // ms between log writer flushes
+    static int log_retention_days = 30;   // days of log partitions kept, 0 = keep all
+
+    // Memory maintenance (run by the database worker)
+    static int memory_maintenance_interval = 0; // seconds between runs, 0 = off (the worker then stays resident)
+    static int memory_half_life = 90;              // days for confidence to halve without updates, 0 = no decay
+    static int memory_min_confidence = 10;         // memories decayed below this are removed
+    static int memory_ttl = 0;                     // days without update before removal, 0 = no TTL
+
+    static const struct config_enum_entry tool_output_format_options[] = {
+        {"verbose", AI_TOOL_OUTPUT_VERBOSE, false},
+        {"compact", AI_TOOL_OUTPUT_COMPACT, false},
+        {nullptr, 0, false}};
+
+    // Provider rate limiting (shared across all backends)
+    static int rate_limit_rpm = 0;      // requests per minute per provider/model, 0 = unlimited
+    static int rate_limit_tpm = 0;      // tokens per minute per provider/model, 0 = unlimited
+    static int max_in_flight = 0;       // concurrent provider calls per provider/model, 0 = unlimited
+    static int rate_limit_max_wait = 0; // max time (ms) to wait for capacity, 0 = wait until cancelled
+
+    // Provider fallback, hedging and circuit breaking
+    static bool hedging_enabled = false;  // race a second request against slow ones
+    static int hedge_min_delay = 2000;    // floor (ms) for the p95-derived hedge delay
+    static int breaker_failure_threshold = 3;
+    static int breaker_cooldown = 30000;  // ms an open circuit stays open before a probe
+
+    // Tiered model routing for query()
+#define AI_ROUTING_OFF 0
+#define AI_ROUTING_TIERED 1
+    static int routing_mode = AI_ROUTING_OFF;
+    static char *explore_model = nullptr;     // small/fast model for schema exploration
+    static double routing_confidence = 0.8;   // accept explore model SQL at or above this confidence
+
+    static const struct config_enum_entry routing_mode_options[] = {
+        {"off", AI_ROUTING_OFF, false},
+        {"tiered", AI_ROUTING_TIERED, false},
+        {nullptr, 0, false}};
+
+    // Result presentation for query()
+#define AI_RESULT_ROWS 0
+#define AI_RESULT_ANSWER 1
+    static int result_mode = AI_RESULT_ROWS;
+    static int answer_max_rows = 20; // answer mode: results up to this size are also shown (and sent) as rows
+
+    static const struct config_enum_entry result_mode_options[] = {
+        {"rows", AI_RESULT_ROWS, false},
+        {"answer", AI_RESULT_ANSWER, false},
+        {nullptr, 0, false}};
 
     /**
      * Core function to set memory in database
@@ -47,7 +190,7 @@ extern "C"
         std::string sql = "INSERT INTO ai_toolkit.ai_memory (category, key, value, notes, updated_at) "
                           "VALUES ($1, $2, $3, $4, CURRENT_TIMESTAMP) "
                           "ON CONFLICT (category, key) DO UPDATE SET "
-                          "value = EXCLUDED.value, notes = EXCLUDED.notes, updated_at = CURRENT_TIMESTAMP";
+                          "value = EXCLUDED.value, notes = EXCLUDED.notes, confidence_score = 100, updated_at = CURRENT_TIMESTAMP";
 
         if (manage_spi && SPI_connect() != SPI_OK_CONNECT)
         {
@@ -166,7 +309,11 @@ extern "C"
             "     * get_memory('relationship', 'table1_table2') - join patterns\n"
             "     * get_memory('business_rule', 'rule_name') - business logic constraints\n"
             "     * get_memory('data_pattern', 'pattern_name') - common data patterns\n"
-            "   - Consider any special filtering rules, calculated fields, or data quirks\n\n"
+            "   - Consider any special filtering rules, calculated fields, or data quirks\n"
+            "   - When the query spans several tables, call find_join_path with all of them\n"
+            "     to get the join conditions from foreign keys instead of guessing them\n"
+            "   - Before filtering on a code or category column, call get_column_stats to see\n"
+            "     which values actually occur instead of guessing literals\n\n"
             "5. GENERATE THE QUERY\n"
             "   - Build the SELECT query based ONLY on the information gathered from tables and schema tools\n"
             "   - Don't worry if you don't have context from the memory you co-relate based on the table structure information\n"
@@ -179,8 +326,13 @@ extern "C"
             "=== AVAILABLE TOOLS ===\n"
             "Schema exploration:\n"
             "- list_schemas() - List all available schemas in the current database\n"
-            "- list_tables_in_schema(schema) - List all tables in a specific schema\n"
-            "- get_schema_for_table(table_name) - Get CREATE TABLE statement for a table\n\n"
+            "- find_relevant_tables(question, k) - Rank tables across all schemas by relevance to the question\n"
+            "- list_tables_in_schema(schema, pattern, limit, offset, order) - List tables in a schema, paged;\n"
+            "  use order 'relevance' in large schemas and 'next_offset' to continue\n"
+            "- get_schema_for_table(table_name) - Get CREATE TABLE statement for a table\n"
+            "- find_join_path(tables) - Get a FROM ... JOIN ... ON clause connecting tables via foreign keys\n"
+            "- get_column_stats(table_name, columns) - Get common values and value ranges of columns\n"
+            "- sample_rows(table_name, n) - Get a few sample rows to see data formats\n\n"
             "Memory operations:\n"
             "- get_memory(category, key) - Retrieve stored information\n"
             "- set_memory(category, key, value, notes) - Store information for future use\n\n"
@@ -211,6 +363,18 @@ extern "C"
                 return default_prompt;
             }
 
+            // Reuse the cached copy while the file is unchanged; re-reading it on every
+            // request costs I/O and risks a different byte prefix for provider prompt caching
+            static std::string cached_path;
+            static std::filesystem::file_time_type cached_mtime;
+            static std::string cached_content;
+
+            std::filesystem::file_time_type mtime = std::filesystem::last_write_time(file_path);
+            if (!cached_content.empty() && cached_path == prompt_file_path && cached_mtime == mtime)
+            {
+                return cached_content;
+            }
+
             // Read file contents
             std::ifstream file(file_path);
             if (!file.is_open())
@@ -232,6 +396,9 @@ extern "C"
             }
 
             elog(LOG, "[load_system_prompt] Successfully loaded prompt from '%s' (%zu bytes)", prompt_file_path, file_content.length());
+            cached_path = prompt_file_path;
+            cached_mtime = mtime;
+            cached_content = file_content;
             return file_content;
         }
         catch (const std::exception &e)
@@ -242,30 +409,89 @@ extern "C"
     }
 
     /**
-     * Build AI client based on GUC configuration
-     * Supports OpenAI, Anthropic, and OpenRouter providers
-     * Returns: Configured AI client
-     * Throws: std::runtime_error if configuration is invalid
+     * Get the configured provider name (lowercased)
+     * Returns: Provider name, defaulting to openrouter
      */
-    ai::Client build_ai_client()
+    std::string get_configured_provider()
     {
-        // Get provider
         std::string provider = ai_provider && strlen(ai_provider) > 0
                                    ? std::string(ai_provider)
                                    : "openrouter";
         std::transform(provider.begin(), provider.end(), provider.begin(), ::tolower);
+        return provider;
+    }
+
+    /**
+     * One provider endpoint the extension can send requests to
+     */
+    struct AiTarget
+    {
+        std::string provider;
+        std::string model;
+        std::string base_url;
+
+        // Key used for rate limiting (limits are per provider/model)
+        std::string rate_limit_key() const { return provider + "/" + model; }
+
+        // Key used for health tracking (a proxy base URL is its own endpoint)
+        std::string health_key() const { return provider + "|" + model + "|" + base_url; }
+    };
+
+    /**
+     * Get the API key for a provider
+     * ai_toolkit.ai_api_keys ("provider=key,...") overrides ai_toolkit.ai_api_key per provider
+     * Throws: std::runtime_error if no key is configured
+     */
+    std::string get_api_key_for_provider(const std::string &provider)
+    {
+        if (ai_api_keys && strlen(ai_api_keys) > 0)
+        {
+            std::stringstream list(ai_api_keys);
+            std::string entry;
+            while (std::getline(list, entry, ','))
+            {
+                size_t eq = entry.find('=');
+                if (eq == std::string::npos)
+                    continue;
+
+                std::string name = entry.substr(0, eq);
+                name.erase(0, name.find_first_not_of(" \t"));
+                name.erase(name.find_last_not_of(" \t") + 1);
+                std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+                if (name == provider)
+                {
+                    std::string key = entry.substr(eq + 1);
+                    key.erase(0, key.find_first_not_of(" \t"));
+                    key.erase(key.find_last_not_of(" \t") + 1);
+                    if (!key.empty())
+                        return key;
+                }
+            }
+        }
 
-        // Get API key
         if (!ai_api_key || strlen(ai_api_key) == 0)
         {
             throw std::runtime_error("API key not configured. Set ai_toolkit.ai_api_key");
         }
-        std::string api_key(ai_api_key);
+        return std::string(ai_api_key);
+    }
+
+    /**
+     * Build AI client for a target
+     * Supports OpenAI, Anthropic, and OpenRouter providers
+     * Returns: Configured AI client
+     * Throws: std::runtime_error if configuration is invalid
+     */
+    ai::Client build_client_for_target(const AiTarget &target)
+    {
+        const std::string &provider = target.provider;
+
+        // Get API key
+        std::string api_key = get_api_key_for_provider(provider);
 
         // Get base URL (optional)
-        std::string base_url = ai_base_url && strlen(ai_base_url) > 0
-                                   ? std::string(ai_base_url)
-                                   : "";
+        std::string base_url = target.base_url;
 
         // Build client based on provider
         if (provider == "openai")
@@ -323,10 +549,7 @@ extern "C"
         }
 
         // Return default based on provider
-        std::string provider = ai_provider && strlen(ai_provider) > 0
-                                   ? std::string(ai_provider)
-                                   : "openrouter";
-        std::transform(provider.begin(), provider.end(), provider.begin(), ::tolower);
+        std::string provider = get_configured_provider();
 
         if (provider == "openai")
         {
@@ -343,386 +566,7728 @@ extern "C"
     }
 
     /**
-     * Tool function for AI to set memory
+     * Get the ordered list of provider targets
+     * ai_toolkit.ai_targets ("provider|model[|base_url], ...") takes precedence;
+     * otherwise the single target from ai_provider/ai_model/ai_base_url is used
+     * Throws: std::runtime_error if an entry is malformed
      */
-    nlohmann::json tool_set_memory(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    std::vector<AiTarget> get_configured_targets()
     {
-        try
-        {
-            if (!params.contains("category") || !params.contains("key") || !params.contains("value"))
-            {
-                return nlohmann::json{{"success", false}, {"error", "Missing required parameters: category, key, value"}};
-            }
-
-            std::string category = params["category"].get<std::string>();
-            std::string key = params["key"].get<std::string>();
-            std::string value = params["value"].get<std::string>();
-            std::optional<std::string> notes = std::nullopt;
+        std::vector<AiTarget> targets;
 
-            if (params.contains("notes") && !params["notes"].is_null())
+        if (ai_targets && strlen(ai_targets) > 0)
+        {
+            std::stringstream list(ai_targets);
+            std::string entry;
+            while (std::getline(list, entry, ','))
             {
-                notes = params["notes"].get<std::string>();
-            }
+                std::vector<std::string> fields;
+                std::stringstream parts(entry);
+                std::string field;
+                while (std::getline(parts, field, '|'))
+                {
+                    field.erase(0, field.find_first_not_of(" \t\n"));
+                    field.erase(field.find_last_not_of(" \t\n") + 1);
+                    fields.push_back(field);
+                }
 
-            std::string error_msg;
-            bool success = memory_set_core(category, key, value, notes, &error_msg, false);
+                if (fields.empty() || (fields.size() == 1 && fields[0].empty()))
+                    continue;
+                if (fields.size() < 2 || fields[0].empty() || fields[1].empty())
+                {
+                    throw std::runtime_error("Invalid ai_toolkit.ai_targets entry '" + entry + "'. Expected provider|model[|base_url]");
+                }
 
-            if (success)
-            {
-                return nlohmann::json{{"success", true}, {"message", "Memory saved successfully"}, {"category", category}, {"key", key}};
-            }
-            else
-            {
-                return nlohmann::json{{"success", false}, {"error", error_msg}};
+                AiTarget target;
+                target.provider = fields[0];
+                std::transform(target.provider.begin(), target.provider.end(), target.provider.begin(), ::tolower);
+                target.model = fields[1];
+                target.base_url = fields.size() > 2 ? fields[2] : "";
+                targets.push_back(target);
             }
         }
-        catch (const std::exception &e)
+
+        if (targets.empty())
         {
-            return nlohmann::json{{"success", false}, {"error", std::string(e.what())}};
+            AiTarget target;
+            target.provider = get_configured_provider();
+            target.model = get_configured_model();
+            target.base_url = ai_base_url && strlen(ai_base_url) > 0 ? std::string(ai_base_url) : "";
+            targets.push_back(target);
         }
+
+        return targets;
     }
 
     /**
-     * Tool function for AI to get memory
+     * Build AI client for the primary (first) configured target
+     * Throws: std::runtime_error if configuration is invalid
      */
-    nlohmann::json tool_get_memory(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    ai::Client build_ai_client()
     {
-        try
-        {
-            if (!params.contains("category") || !params.contains("key"))
-            {
-                return nlohmann::json{{"success", false}, {"error", "Missing required parameters: category, key"}};
-            }
-
-            std::string category = params["category"].get<std::string>();
-            std::string key = params["key"].get<std::string>();
+        return build_client_for_target(get_configured_targets().front());
+    }
 
-            std::string error_msg;
-            auto result = memory_get_core(category, key, &error_msg, false);
+    /**
+     * Common header for the extension's shared memory segments.
+     * Segments are created on first use through the DSM registry, so they work
+     * without shared_preload_libraries. Each segment embeds this header first.
+     */
+    typedef struct AiSharedHeader
+    {
+        int tranche_id;
+        LWLock lock;
+    } AiSharedHeader;
 
-            if (result.has_value())
-            {
-                return nlohmann::json{{"success", true}, {"value", result.value()}, {"category", category}, {"key", key}};
-            }
-            else
-            {
-                return nlohmann::json{{"success", false}, {"error", "Memory not found"}, {"category", category}, {"key", key}};
-            }
-        }
-        catch (const std::exception &e)
-        {
-            return nlohmann::json{{"success", false}, {"error", std::string(e.what())}};
-        }
+    static void shared_header_init(AiSharedHeader *header)
+    {
+        header->tranche_id = LWLockNewTrancheId();
+        LWLockInitialize(&header->lock, header->tranche_id);
     }
 
     /**
-     * Tool function: List all schemas in the PostgreSQL database
+     * Attach (creating on first use) a named shared memory segment
+     * Returns: pointer to the segment, whose first member is an AiSharedHeader
      */
-    nlohmann::json tool_list_schemas(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    static void *shared_segment_attach(const char *name, size_t size, void (*init_callback)(void *ptr))
     {
-        // Check SPI connection state
-        if (SPI_connect() == SPI_ERROR_CONNECT)
-        {
-            // SPI already connected (expected in tool context) - not an error
-        }
-        else
-        {
-            SPI_finish();
-        }
+        bool found;
+        void *ptr = GetNamedDSMSegment(name, size, init_callback, &found);
+        LWLockRegisterTranche(((AiSharedHeader *)ptr)->tranche_id, name);
+        return ptr;
+    }
 
-        const char *sql = "SELECT schema_name FROM information_schema.schemata "
-                          "WHERE schema_name NOT IN ('pg_catalog', 'information_schema', 'pg_toast', 'pg_toast_temp_1') "
-                          "ORDER BY schema_name";
+#define AI_STAT_SLOTS 256
+#define AI_STAT_NAMELEN 64
 
-        int ret = SPI_execute(sql, true, 0);
+    /**
+     * Named counters shared by all backends, shown by the ai_toolkit.stats view.
+     * Names are dotted paths like "tier.explore.calls"; slots are claimed on first use.
+     */
+    typedef struct AiStatCounter
+    {
+        char name[AI_STAT_NAMELEN];
+        int64 value;
+    } AiStatCounter;
 
-        if (ret != SPI_OK_SELECT)
-        {
-            elog(WARNING, "[tool_list_schemas] Query failed with code: %d", ret);
-            nlohmann::json error_result;
-            error_result["success"] = false;
-            error_result["error"] = "Failed to query schemas";
-            return error_result;
-        }
+    typedef struct AiStatState
+    {
+        AiSharedHeader hdr;
+        TimestampTz reset_at;
+        AiStatCounter counters[AI_STAT_SLOTS];
+    } AiStatState;
 
-        uint64 row_count = SPI_processed;
+    static AiStatState *stat_state = nullptr;
 
-        // Use vector first, then convert to json at the end
-        std::vector<std::string> schema_list;
-        schema_list.reserve(row_count);
+    static void stat_init_state(void *ptr)
+    {
+        AiStatState *state = (AiStatState *)ptr;
+        shared_header_init(&state->hdr);
+        state->reset_at = GetCurrentTimestamp();
+        memset(state->counters, 0, sizeof(state->counters));
+    }
 
-        for (uint64 i = 0; i < row_count; i++)
+    static AiStatState *stat_attach()
+    {
+        if (stat_state == nullptr)
         {
-            bool isnull = false;
-            HeapTuple tuple = SPI_tuptable->vals[i];
-            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+            stat_state = (AiStatState *)shared_segment_attach("ai_toolkit_stats", sizeof(AiStatState), stat_init_state);
+        }
+        return stat_state;
+    }
 
-            Datum schema_datum = SPI_getbinval(tuple, tupdesc, 1, &isnull);
+    /**
+     * Add delta to a named counter, creating it on first use
+     * Silently drops the update if all slots are taken
+     */
+    void stat_add(const std::string &name, int64 delta)
+    {
+        AiStatState *state = stat_attach();
 
-            if (isnull)
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        AiStatCounter *free_slot = nullptr;
+        for (int i = 0; i < AI_STAT_SLOTS; i++)
+        {
+            AiStatCounter *counter = &state->counters[i];
+            if (counter->name[0] == '\0')
             {
-                elog(WARNING, "[tool_list_schemas] Skipping NULL schema name at row %lu", (unsigned long)i);
+                if (!free_slot)
+                    free_slot = counter;
                 continue;
             }
+            if (strncmp(counter->name, name.c_str(), AI_STAT_NAMELEN) == 0)
+            {
+                counter->value += delta;
+                LWLockRelease(&state->hdr.lock);
+                return;
+            }
+        }
+        if (free_slot)
+        {
+            strlcpy(free_slot->name, name.c_str(), AI_STAT_NAMELEN);
+            free_slot->value = delta;
+        }
+        LWLockRelease(&state->hdr.lock);
+    }
 
-            // Use SPI_getvalue instead of TextDatumGetCString - it's safer
-            char *schema_name_cstr = SPI_getvalue(tuple, tupdesc, 1);
+    /**
+     * Local token estimate for budgeting before we get real usage numbers back.
+     * Approximates BPE tokenizers: each run of letters/digits costs about one token
+     * per 4 characters, every punctuation character costs one, whitespace is free.
+     * Punctuation-heavy JSON and SQL therefore estimate higher than prose of equal length.
+     */
+    int estimate_tokens(const std::string &text)
+    {
+        int tokens = 0;
+        size_t run = 0;
 
-            if (schema_name_cstr == NULL)
+        for (unsigned char c : text)
+        {
+            if (isalnum(c) || c >= 0x80)
             {
-                elog(WARNING, "[tool_list_schemas] Failed to get schema name at row %lu", (unsigned long)i);
+                run++;
                 continue;
             }
-
-            // Create string and immediately free
-            std::string schema_name(schema_name_cstr);
-            pfree(schema_name_cstr);
-
-            if (!schema_name.empty())
+            if (run > 0)
             {
-                schema_list.push_back(schema_name);
+                tokens += (int)((run + 3) / 4);
+                run = 0;
             }
+            if (!isspace(c))
+                tokens++;
         }
+        if (run > 0)
+            tokens += (int)((run + 3) / 4);
 
-        // Build JSON response
+        return tokens;
+    }
+
+    /**
+     * Cut text down to roughly max_tokens, marking the cut
+     */
+    std::string truncate_to_tokens(const std::string &text, int max_tokens)
+    {
+        int tokens = estimate_tokens(text);
+        if (tokens <= max_tokens)
+            return text;
+        if (max_tokens <= 0)
+            return "";
+
+        size_t keep = (size_t)((double)text.size() * max_tokens / tokens);
+        return text.substr(0, keep) + " ...[trimmed]";
+    }
+
+    /**
+     * A read-only tool result kept for the rest of the request
+     */
+    struct AiCachedToolResult
+    {
         nlohmann::json result;
-        result["success"] = true;
-        result["count"] = schema_list.size();
-        result["schemas"] = schema_list;
+        bool prefetched = false; // computed speculatively before the model asked for it
+    };
 
-        elog(LOG, "[tool_list_schemas] Retrieved %lu schemas", (unsigned long)schema_list.size());
-        return result;
+    /**
+     * State of one tool loop (one generate_text call). Hedged attempts each keep their own,
+     * so one attempt's progress neither limits nor ends the other's.
+     */
+    struct AiToolLoop
+    {
+        int steps_remaining = -1; // model steps left, including the current one; -1 = unknown
+        bool stopping = false;    // the answer is in: further tool calls are refused so the loop ends
+        std::optional<nlohmann::json> final_answer; // validated final_answer tool call
+        std::optional<std::string> final_text;      // text of the step that held every final tag
+        bool wrote = false;       // ran a tool that writes; such an attempt is never hedged
+        int tool_calls = 0;       // added to the request's counters if this loop's result is used
+        double tool_ms = 0;
+    };
+
+    /**
+     * Per-request token accounting, reset by begin_request() at the start of each AI function
+     */
+    struct AiRequestContext
+    {
+        int input_budget = 0;    // estimated input tokens allowed per step, 0 = unlimited
+        int fixed_tokens = 0;    // system prompt + user message
+        int prefix_tokens = 0;   // static system prompt shared by every request (cacheable)
+        int tool_tokens = 0;     // tool output fed back to the model so far
+        TimestampTz started_at = 0;
+        int steps = 0;
+        int tool_calls = 0;
+        double tool_ms = 0;      // time spent running tools on the backend
+        int64 input_tokens = 0;  // measured, summed over steps
+        int64 output_tokens = 0;
+        std::string question;    // the user's request as typed, for tools that rank by relevance
+        AiToolLoop loop;          // the running tool loop, or the winning attempt's once it returns
+        bool hedge_live = false;  // two attempts are racing: tools that write are refused
+        std::vector<std::string> final_tags; // tags whose presence in a step ends the tool loop early
+        std::map<std::string, AiCachedToolResult> tool_cache; // by tool_cache_key()
+        std::deque<std::function<void()>> prefetch;           // run while the provider call is in flight
+    };
+
+    static AiRequestContext current_request;
+
+    void begin_request(const std::string &system_prompt, const std::string &user_prompt)
+    {
+        current_request = AiRequestContext();
+        current_request.input_budget = input_token_budget;
+        current_request.prefix_tokens = estimate_tokens(system_prompt);
+        current_request.fixed_tokens = current_request.prefix_tokens + estimate_tokens(user_prompt);
+        current_request.started_at = GetCurrentTimestamp();
     }
 
     /**
-     * Tool function: List all tables in a specific schema
+     * Keep a tool result within what is left of the per-step input budget.
+     * Tool output is resent on every later step, so an oversized result is replaced
+     * by a truncated rendering that tells the model to narrow its request.
      */
-    nlohmann::json tool_list_tables_in_schema(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    nlohmann::json budget_tool_result(const std::string &tool_name, const nlohmann::json &result)
     {
-        if (!params.contains("schema"))
+        std::string rendered = result.dump();
+        int tokens = estimate_tokens(rendered);
+
+        if (current_request.input_budget > 0)
         {
-            elog(WARNING, "[tool_list_tables_in_schema] Missing schema parameter");
-            return nlohmann::json{{"success", false}, {"error", "Missing required parameter: schema"}};
+            int remaining = current_request.input_budget - current_request.fixed_tokens - current_request.tool_tokens;
+            if (tokens > remaining)
+            {
+                int allowed = std::max(remaining, 64);
+                stat_add("tokens.tool_output_trimmed", tokens - allowed);
+                elog(LOG, "[budget_tool_result] Trimming %s output from %d to %d tokens", tool_name.c_str(), tokens, allowed);
+
+                nlohmann::json trimmed = {
+                    {"success", result.value("success", true)},
+                    {"truncated", true},
+                    {"partial", truncate_to_tokens(rendered, allowed - 32)},
+                    {"note", "Output trimmed to fit the input token budget. Narrow the request (e.g. one table or schema)."}};
+                current_request.tool_tokens += allowed;
+                return trimmed;
+            }
         }
 
-        std::string schema = params["schema"].get<std::string>();
+        current_request.tool_tokens += tokens;
+        return result;
+    }
 
-        // Query tables from a specific schema using information_schema
-        // The table_schema column in information_schema.tables contains the schema name
-        std::string sql = "SELECT table_schema, table_name FROM information_schema.tables "
-                          "WHERE table_schema = $1 "
-                          "AND table_type = 'BASE TABLE' "
-                          "ORDER BY table_schema, table_name";
+    // Registered SQL tools backed by non-volatile functions; their results may be cached per request
+    static std::set<std::string> cacheable_registered_tools;
 
-        Datum values[1];
-        char nulls[1] = {' '};
-        values[0] = CStringGetTextDatum(schema.c_str());
-        Oid argtypes[1] = {TEXTOID};
+    /**
+     * Key for the per-request tool cache, or "" for tools whose result must not be reused.
+     * Parameters are canonicalized (sorted, trimmed, empty and zero values dropped, table
+     * names schema-qualified) so a call spelling out the defaults finds a prefetched result.
+     */
+    std::string tool_cache_key(const std::string &tool_name, const nlohmann::json &params)
+    {
+        static const std::vector<std::string> cacheable = {
+            "list_schemas", "list_tables_in_schema", "get_schema_for_table", "get_memory",
+            "find_join_path", "get_column_stats", "find_relevant_tables"};
+        if (std::find(cacheable.begin(), cacheable.end(), tool_name) == cacheable.end() &&
+            !cacheable_registered_tools.count(tool_name))
+            return "";
+
+        nlohmann::json canonical = nlohmann::json::object();
+        if (params.is_object())
+        {
+            for (const auto &[name, value] : params.items())
+            {
+                if (value.is_string())
+                {
+                    std::string text = value.get<std::string>();
+                    size_t start = text.find_first_not_of(" \t\n\r");
+                    if (start == std::string::npos)
+                        continue;
+                    text = text.substr(start, text.find_last_not_of(" \t\n\r") - start + 1);
+                    if (tool_name == "get_schema_for_table" && name == "table_name" && text.find('.') == std::string::npos)
+                        text = "public." + text;
+                    if (tool_name == "list_tables_in_schema" && name == "order" && text == "name")
+                        continue;
+                    canonical[name] = text;
+                }
+                else if (value.is_number() && value.get<double>() == 0)
+                    continue;
+                else if (tool_name == "list_tables_in_schema" && name == "limit" && value == 100)
+                    continue;
+                else if (!value.is_null())
+                    canonical[name] = value;
+            }
+        }
+        return tool_name + ":" + canonical.dump();
+    }
+
+    /**
+     * Run a read-only tool through the per-request cache.
+     * set_memory drops cached get_memory results so the model reads its own writes.
+     */
+    nlohmann::json cached_tool_call(const std::string &tool_name, const nlohmann::json &params,
+                                    const std::function<nlohmann::json()> &run)
+    {
+        if (tool_name == "set_memory")
+            std::erase_if(current_request.tool_cache, [](const auto &entry)
+                          { return entry.first.starts_with("get_memory:"); });
 
-        int ret = SPI_execute_with_args(sql.c_str(), 1, argtypes, values, nulls, true, 0);
+        std::string key = tool_cache_key(tool_name, params);
+        if (key.empty())
+            return run();
 
-        if (ret != SPI_OK_SELECT)
+        auto it = current_request.tool_cache.find(key);
+        if (it != current_request.tool_cache.end())
         {
-            elog(WARNING, "[tool_list_tables_in_schema] Query execution failed with code: %d for schema: %s", ret, schema.c_str());
-            return nlohmann::json{{"success", false}, {"error", "Failed to query tables"}};
+            stat_add(it->second.prefetched ? "prefetch.hits" : "tool_cache.hits", 1);
+            it->second.prefetched = false;
+            return it->second.result;
         }
 
-        nlohmann::json tables = nlohmann::json::array();
+        nlohmann::json result = run();
+        current_request.tool_cache[key] = {result, false};
+        return result;
+    }
 
-        for (uint64 i = 0; i < SPI_processed; i++)
-        {
-            bool isnull_schema, isnull_table;
-            HeapTuple tuple = SPI_tuptable->vals[i];
-            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+    /**
+     * Queue a speculative tool call; its result lands in the tool cache if the model asks for it later.
+     * Queued work runs only on the backend thread while it would otherwise wait on the provider.
+     */
+    void prefetch_tool(const std::string &tool_name, const nlohmann::json &params,
+                       std::function<nlohmann::json(const nlohmann::json &, const ai::ToolExecutionContext &)> fn)
+    {
+        current_request.prefetch.push_back([tool_name, params, fn]
+                                           {
+            std::string key = tool_cache_key(tool_name, params);
+            if (key.empty() || current_request.tool_cache.count(key))
+                return;
+            ai::ToolExecutionContext context{};
+            current_request.tool_cache[key] = {fn(params, context), true};
+            stat_add("prefetch.items", 1); });
+    }
 
-            Datum schema_datum = SPI_getbinval(tuple, tupdesc, 1, &isnull_schema);
-            Datum table_datum = SPI_getbinval(tuple, tupdesc, 2, &isnull_table);
+    bool run_in_subtransaction(const std::function<void()> &fn, std::string *error, bool rollback = false);
 
-            if (isnull_schema || isnull_table)
-            {
-                elog(WARNING, "[tool_list_tables_in_schema] Skipping row with NULL schema or table");
-                continue;
-            }
+    /**
+     * Run one queued prefetch item in its own subtransaction: a speculative lookup that
+     * fails (dropped table, missing privilege) is discarded instead of failing the request
+     * Returns: false if the queue was empty
+     */
+    bool prefetch_step()
+    {
+        if (current_request.prefetch.empty())
+            return false;
 
-            // Properly handle memory
-            char *schema_cstr = SPI_getvalue(tuple, tupdesc, 1);
-            char *table_cstr = SPI_getvalue(tuple, tupdesc, 2);
+        auto item = std::move(current_request.prefetch.front());
+        current_request.prefetch.pop_front();
 
-            if (schema_cstr == NULL || table_cstr == NULL)
-            {
-                elog(WARNING, "[tool_list_tables_in_schema] Failed to get string values from datum");
-                if (schema_cstr)
-                    pfree(schema_cstr);
-                if (table_cstr)
-                    pfree(table_cstr);
-                continue;
-            }
+        std::string error;
+        if (!run_in_subtransaction(item, &error))
+        {
+            elog(LOG, "[prefetch_step] Skipped a prefetch item: %s", error.c_str());
+            stat_add("prefetch.failed", 1);
+        }
+        return true;
+    }
+
+    /**
+     * Builds the user message from prioritized context sections under a token budget.
+     * Static instructions belong in the system prompt, so every request shares a
+     * byte-identical prefix that providers can serve from their prompt cache; only
+     * per-request content (the question, retrieved memories, hints) is added here.
+     */
+    class PromptAssembler
+    {
+    public:
+        /**
+         * Add a section. Required sections are never trimmed; when over budget,
+         * optional sections are trimmed lowest priority first.
+         */
+        void add(const std::string &title, const std::string &text, int priority, bool required = false)
+        {
+            if (text.empty())
+                return;
+            sections_.push_back({title, text, priority, required});
+        }
+
+        /**
+         * Render sections in insertion order within budget_tokens (<= 0 means unlimited)
+         */
+        std::string build(int budget_tokens) const
+        {
+            std::vector<std::string> texts;
+            for (const auto &section : sections_)
+                texts.push_back(section.text);
+
+            if (budget_tokens > 0)
+            {
+                int used = 0;
+                for (const auto &section : sections_)
+                {
+                    if (section.required)
+                        used += estimate_tokens(section.title) + estimate_tokens(section.text);
+                }
+
+                // Hand out what is left by priority
+                std::vector<size_t> order(sections_.size());
+                for (size_t i = 0; i < order.size(); i++)
+                    order[i] = i;
+                std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                                 { return sections_[a].priority > sections_[b].priority; });
+
+                for (size_t i : order)
+                {
+                    const Section &section = sections_[i];
+                    if (section.required)
+                        continue;
+
+                    int tokens = estimate_tokens(section.title) + estimate_tokens(section.text);
+                    int available = budget_tokens - used;
+                    if (tokens <= available)
+                    {
+                        used += tokens;
+                        continue;
+                    }
+
+                    // Not worth keeping a stub of a section
+                    texts[i] = available > 64 ? truncate_to_tokens(section.text, available - estimate_tokens(section.title)) : "";
+                    used += estimate_tokens(texts[i]);
+                    stat_add("tokens.context_trimmed", tokens - estimate_tokens(texts[i]));
+                }
+            }
+
+            std::string out;
+            for (size_t i = 0; i < sections_.size(); i++)
+            {
+                if (texts[i].empty())
+                    continue;
+                if (!out.empty())
+                    out += "\n\n";
+                if (!sections_[i].title.empty())
+                    out += sections_[i].title + ":\n";
+                out += texts[i];
+            }
+            return out;
+        }
+
+    private:
+        struct Section
+        {
+            std::string title;
+            std::string text;
+            int priority;
+            bool required;
+        };
+        std::vector<Section> sections_;
+    };
+
+    /**
+     * Token budget left for user message context once the system prompt is paid for.
+     * Half of the remainder is held back for tool output fed back during the loop.
+     * Returns: budget in tokens, or 0 for unlimited
+     */
+    int context_token_budget(const std::string &system_prompt)
+    {
+        if (input_token_budget <= 0)
+            return 0;
+        return std::max(256, (input_token_budget - estimate_tokens(system_prompt)) / 2);
+    }
+
+    /**
+     * Record measured and estimated input usage for one finished step
+     */
+    void stat_record_step_usage(const ai::GenerateStep &step)
+    {
+        stat_add("tokens.steps", 1);
+        stat_add("tokens.input", step.usage.prompt_tokens);
+        stat_add("tokens.output", step.usage.completion_tokens);
+        stat_add("tokens.input_estimated", current_request.fixed_tokens + current_request.tool_tokens);
+        stat_add("tokens.cacheable_prefix", current_request.prefix_tokens);
+
+        current_request.steps++;
+        current_request.input_tokens += step.usage.prompt_tokens;
+        current_request.output_tokens += step.usage.completion_tokens;
+    }
+
+#define AI_RATE_LIMIT_SLOTS 32
+#define AI_RATE_LIMIT_KEYLEN 128
+
+    /**
+     * One token bucket per provider/model pair.
+     * Credits may go negative when the real token usage of a call exceeds
+     * the estimate charged at admission; later callers then wait it off.
+     */
+    typedef struct AiRateLimitSlot
+    {
+        char key[AI_RATE_LIMIT_KEYLEN]; // "provider/model", empty if unused
+        double request_credit;
+        double token_credit;
+        TimestampTz last_refill;
+        int in_flight;
+        int waiting;
+        uint64 granted;
+        uint64 waited;
+        uint64 timeouts;
+        uint64 total_wait_us;
+        uint64 max_wait_us;
+        uint64 tokens_charged;
+    } AiRateLimitSlot;
+
+    typedef struct AiRateLimitState
+    {
+        AiSharedHeader hdr;
+        ConditionVariable capacity_cv;
+        AiRateLimitSlot slots[AI_RATE_LIMIT_SLOTS];
+    } AiRateLimitState;
+
+    /**
+     * Admission ticket handed out by rate_limit_acquire
+     * slot is -1 when rate limiting is disabled or no slot was available;
+     * admitted is false only when a non-waiting acquire found no capacity
+     */
+    struct RateLimitTicket
+    {
+        int slot = -1;
+        int reserved_tokens = 0;
+        bool admitted = true;
+    };
+
+    static AiRateLimitState *rate_limit_state = nullptr;
+    static uint32 rate_limit_wait_event = 0;
+
+    // Slots held by this backend, released on transaction end if a call errored out
+    static int rate_limit_held[AI_RATE_LIMIT_SLOTS];
+    static int rate_limit_waiting[AI_RATE_LIMIT_SLOTS];
+
+    static void rate_limit_init_state(void *ptr)
+    {
+        AiRateLimitState *state = (AiRateLimitState *)ptr;
+        shared_header_init(&state->hdr);
+        ConditionVariableInit(&state->capacity_cv);
+        memset(state->slots, 0, sizeof(state->slots));
+    }
+
+    static AiRateLimitState *rate_limit_attach()
+    {
+        if (rate_limit_state == nullptr)
+        {
+            rate_limit_state = (AiRateLimitState *)shared_segment_attach("ai_toolkit_rate_limit",
+                                                                         sizeof(AiRateLimitState),
+                                                                         rate_limit_init_state);
+        }
+        return rate_limit_state;
+    }
+
+    static bool rate_limit_enabled()
+    {
+        return rate_limit_rpm > 0 || rate_limit_tpm > 0 || max_in_flight > 0;
+    }
+
+    /**
+     * Top up a bucket for the time elapsed since its last refill.
+     * Buckets hold at most one minute worth of credit. Caller holds the lock exclusively.
+     */
+    static void rate_limit_refill(AiRateLimitSlot *slot, TimestampTz now)
+    {
+        double elapsed_min = (double)(now - slot->last_refill) / (60.0 * USECS_PER_SEC);
+        if (elapsed_min < 0)
+            elapsed_min = 0;
+
+        if (rate_limit_rpm > 0)
+            slot->request_credit = std::min((double)rate_limit_rpm, slot->request_credit + elapsed_min * rate_limit_rpm);
+        if (rate_limit_tpm > 0)
+            slot->token_credit = std::min((double)rate_limit_tpm, slot->token_credit + elapsed_min * rate_limit_tpm);
+
+        slot->last_refill = now;
+    }
+
+    /**
+     * Find the slot for a provider/model key, claiming a free one if needed.
+     * Caller holds the lock exclusively. Returns -1 if the table is full.
+     */
+    static int rate_limit_find_slot(AiRateLimitState *state, const std::string &key, TimestampTz now)
+    {
+        int free_slot = -1;
+        for (int i = 0; i < AI_RATE_LIMIT_SLOTS; i++)
+        {
+            if (state->slots[i].key[0] == '\0')
+            {
+                if (free_slot < 0)
+                    free_slot = i;
+                continue;
+            }
+            if (strncmp(state->slots[i].key, key.c_str(), AI_RATE_LIMIT_KEYLEN) == 0)
+                return i;
+        }
+
+        if (free_slot >= 0)
+        {
+            AiRateLimitSlot *slot = &state->slots[free_slot];
+            memset(slot, 0, sizeof(AiRateLimitSlot));
+            strlcpy(slot->key, key.c_str(), AI_RATE_LIMIT_KEYLEN);
+            slot->request_credit = rate_limit_rpm;
+            slot->token_credit = rate_limit_tpm;
+            slot->last_refill = now;
+        }
+        return free_slot;
+    }
+
+    /**
+     * How long until the bucket can admit a call needing estimated_tokens.
+     * Returns: wait time in milliseconds (0 if admissible now)
+     */
+    static long rate_limit_wait_ms(const AiRateLimitSlot *slot, int estimated_tokens)
+    {
+        double wait_min = 0;
+
+        if (rate_limit_rpm > 0 && slot->request_credit < 1.0)
+            wait_min = std::max(wait_min, (1.0 - slot->request_credit) / rate_limit_rpm);
+
+        // A single call larger than the whole bucket only waits for a full bucket
+        double needed_tokens = std::min((double)estimated_tokens, (double)rate_limit_tpm);
+        if (rate_limit_tpm > 0 && slot->token_credit < needed_tokens)
+            wait_min = std::max(wait_min, (needed_tokens - slot->token_credit) / rate_limit_tpm);
+
+        return (long)std::ceil(wait_min * 60000.0);
+    }
+
+    /**
+     * Wait for capacity on the provider/model bucket, then take one request,
+     * the estimated tokens and one in-flight slot.
+     * Backends sleep on a condition variable rather than failing, so a burst of
+     * callers is turned into a paced queue. Errors only if ai_toolkit.rate_limit_max_wait
+     * is exceeded (or the statement is cancelled).
+     * wait: if false, return immediately with admitted = false when there is no capacity
+     */
+    RateLimitTicket rate_limit_acquire(const std::string &key, int estimated_tokens, bool wait = true)
+    {
+        RateLimitTicket ticket;
+        if (!rate_limit_enabled())
+            return ticket;
+
+        AiRateLimitState *state = rate_limit_attach();
+        if (rate_limit_wait_event == 0)
+            rate_limit_wait_event = WaitEventExtensionNew("AiToolkitRateLimit");
+
+        TimestampTz wait_start = GetCurrentTimestamp();
+        int waiting_slot = -1;
+
+        for (;;)
+        {
+            TimestampTz now = GetCurrentTimestamp();
+
+            LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+            int index = rate_limit_find_slot(state, key, now);
+            if (index < 0)
+            {
+                LWLockRelease(&state->hdr.lock);
+                elog(WARNING, "[rate_limit_acquire] No free rate limit slot for '%s', call is not governed", key.c_str());
+                break;
+            }
+
+            AiRateLimitSlot *slot = &state->slots[index];
+            rate_limit_refill(slot, now);
+
+            long wait_ms = rate_limit_wait_ms(slot, estimated_tokens);
+            bool slot_free = max_in_flight <= 0 || slot->in_flight < max_in_flight;
+
+            if (wait_ms == 0 && slot_free)
+            {
+                uint64 waited_us = (uint64)(now - wait_start);
+
+                if (rate_limit_rpm > 0)
+                    slot->request_credit -= 1.0;
+                if (rate_limit_tpm > 0)
+                    slot->token_credit -= estimated_tokens;
+                slot->in_flight++;
+                slot->granted++;
+                slot->tokens_charged += estimated_tokens;
+                if (waiting_slot >= 0)
+                {
+                    slot->waiting--;
+                    slot->waited++;
+                    slot->total_wait_us += waited_us;
+                    slot->max_wait_us = std::max(slot->max_wait_us, waited_us);
+                    rate_limit_waiting[index]--;
+                }
+                LWLockRelease(&state->hdr.lock);
+
+                rate_limit_held[index]++;
+                ticket.slot = index;
+                ticket.reserved_tokens = estimated_tokens;
+                break;
+            }
+
+            if (!wait)
+            {
+                LWLockRelease(&state->hdr.lock);
+                ticket.admitted = false;
+                break;
+            }
+
+            if (waiting_slot < 0)
+            {
+                slot->waiting++;
+                waiting_slot = index;
+                rate_limit_waiting[index]++;
+            }
+
+            long elapsed_ms = TimestampDifferenceMilliseconds(wait_start, now);
+            if (rate_limit_max_wait > 0 && elapsed_ms >= rate_limit_max_wait)
+            {
+                slot->waiting--;
+                slot->timeouts++;
+                rate_limit_waiting[index]--;
+                LWLockRelease(&state->hdr.lock);
+                ConditionVariableCancelSleep();
+                ereport(ERROR,
+                        (errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+                         errmsg("Timed out after %ld ms waiting for provider capacity on '%s'", elapsed_ms, key.c_str()),
+                         errhint("Raise ai_toolkit.rate_limit_max_wait or the provider limits.")));
+            }
+            LWLockRelease(&state->hdr.lock);
+
+            // Sleep until credit should be available, but wake early when a call finishes
+            long sleep_ms = slot_free ? std::clamp(wait_ms, 10L, 1000L) : 1000L;
+            if (rate_limit_max_wait > 0)
+                sleep_ms = std::min(sleep_ms, std::max(1L, rate_limit_max_wait - elapsed_ms));
+            ConditionVariableTimedSleep(&state->capacity_cv, sleep_ms, rate_limit_wait_event);
+        }
+
+        ConditionVariableCancelSleep();
+        return ticket;
+    }
+
+    /**
+     * Charge actual usage against the ticket's bucket
+     * tokens may be negative to refund an over-estimate
+     */
+    void rate_limit_charge(const RateLimitTicket &ticket, int tokens, int requests)
+    {
+        if (ticket.slot < 0 || (tokens == 0 && requests == 0))
+            return;
+
+        AiRateLimitState *state = rate_limit_attach();
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        AiRateLimitSlot *slot = &state->slots[ticket.slot];
+        if (rate_limit_tpm > 0)
+            slot->token_credit = std::min((double)rate_limit_tpm, slot->token_credit - tokens);
+        if (rate_limit_rpm > 0)
+            slot->request_credit -= requests;
+        slot->tokens_charged = (uint64)std::max<int64>(0, (int64)slot->tokens_charged + tokens);
+        LWLockRelease(&state->hdr.lock);
+    }
+
+    /**
+     * Return the in-flight slot taken by rate_limit_acquire and wake waiters
+     */
+    void rate_limit_release(RateLimitTicket &ticket)
+    {
+        if (ticket.slot < 0)
+            return;
+
+        AiRateLimitState *state = rate_limit_attach();
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        if (state->slots[ticket.slot].in_flight > 0)
+            state->slots[ticket.slot].in_flight--;
+        LWLockRelease(&state->hdr.lock);
+
+        rate_limit_held[ticket.slot]--;
+        ticket.slot = -1;
+        ConditionVariableBroadcast(&state->capacity_cv);
+    }
+
+    /**
+     * Transaction end callback: give back any slots an aborted call left behind
+     */
+    static void rate_limit_xact_callback(XactEvent event, void *arg)
+    {
+        if (event != XACT_EVENT_ABORT && event != XACT_EVENT_COMMIT &&
+            event != XACT_EVENT_PARALLEL_ABORT && event != XACT_EVENT_PARALLEL_COMMIT)
+            return;
+        if (rate_limit_state == nullptr)
+            return;
+
+        bool released = false;
+        LWLockAcquire(&rate_limit_state->hdr.lock, LW_EXCLUSIVE);
+        for (int i = 0; i < AI_RATE_LIMIT_SLOTS; i++)
+        {
+            AiRateLimitSlot *slot = &rate_limit_state->slots[i];
+            if (rate_limit_held[i] > 0)
+            {
+                slot->in_flight = std::max(0, slot->in_flight - rate_limit_held[i]);
+                rate_limit_held[i] = 0;
+                released = true;
+            }
+            if (rate_limit_waiting[i] > 0)
+            {
+                slot->waiting = std::max(0, slot->waiting - rate_limit_waiting[i]);
+                rate_limit_waiting[i] = 0;
+            }
+        }
+        LWLockRelease(&rate_limit_state->hdr.lock);
+
+        if (released)
+            ConditionVariableBroadcast(&rate_limit_state->capacity_cv);
+    }
+
+#define AI_TARGET_SLOTS 32
+#define AI_TARGET_KEYLEN 256
+#define AI_LATENCY_BUCKETS 20
+
+#define AI_BREAKER_CLOSED 0
+#define AI_BREAKER_OPEN 1
+#define AI_BREAKER_HALF_OPEN 2
+
+    // Outcome of a request as seen by the circuit breaker
+#define AI_OUTCOME_SUCCESS 0
+#define AI_OUTCOME_FAILURE 1 // transport error, 5xx or 429: the target is unhealthy
+#define AI_OUTCOME_NEUTRAL 2 // client error or local abort: says nothing about the target
+
+    /**
+     * Health of one provider target, shared by all backends.
+     * Latency is kept as a log2 histogram in milliseconds so percentiles are cheap.
+     */
+    typedef struct AiTargetHealth
+    {
+        char key[AI_TARGET_KEYLEN]; // provider|model|base_url, empty if unused
+        int breaker_state;
+        int consecutive_failures;
+        bool probe_in_progress;
+        TimestampTz probe_started;
+        TimestampTz opened_at;
+        uint64 requests;
+        uint64 failures;
+        uint64 hedges_fired;
+        uint64 hedges_won;
+        uint64 latency_hist[AI_LATENCY_BUCKETS];
+    } AiTargetHealth;
+
+    typedef struct AiTargetHealthState
+    {
+        AiSharedHeader hdr;
+        AiTargetHealth targets[AI_TARGET_SLOTS];
+    } AiTargetHealthState;
+
+    static AiTargetHealthState *target_health_state = nullptr;
+
+    static void target_health_init_state(void *ptr)
+    {
+        AiTargetHealthState *state = (AiTargetHealthState *)ptr;
+        shared_header_init(&state->hdr);
+        memset(state->targets, 0, sizeof(state->targets));
+    }
+
+    static AiTargetHealthState *target_health_attach()
+    {
+        if (target_health_state == nullptr)
+        {
+            target_health_state = (AiTargetHealthState *)shared_segment_attach("ai_toolkit_targets",
+                                                                               sizeof(AiTargetHealthState),
+                                                                               target_health_init_state);
+        }
+        return target_health_state;
+    }
+
+    /**
+     * Find (or claim) the health slot for a target. Caller holds the lock exclusively.
+     * Returns nullptr if the table is full.
+     */
+    static AiTargetHealth *target_health_slot(AiTargetHealthState *state, const std::string &key)
+    {
+        AiTargetHealth *free_slot = nullptr;
+        for (int i = 0; i < AI_TARGET_SLOTS; i++)
+        {
+            AiTargetHealth *slot = &state->targets[i];
+            if (slot->key[0] == '\0')
+            {
+                if (!free_slot)
+                    free_slot = slot;
+                continue;
+            }
+            if (strncmp(slot->key, key.c_str(), AI_TARGET_KEYLEN) == 0)
+                return slot;
+        }
+
+        if (free_slot)
+        {
+            memset(free_slot, 0, sizeof(AiTargetHealth));
+            strlcpy(free_slot->key, key.c_str(), AI_TARGET_KEYLEN);
+        }
+        return free_slot;
+    }
+
+    /**
+     * Circuit breaker admission check for a target
+     * An open circuit admits a single probe request once the cooldown has passed.
+     */
+    bool target_health_admit(const AiTarget &target)
+    {
+        AiTargetHealthState *state = target_health_attach();
+        bool admit = true;
+
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        AiTargetHealth *slot = target_health_slot(state, target.health_key());
+        if (slot && slot->breaker_state != AI_BREAKER_CLOSED)
+        {
+            TimestampTz now = GetCurrentTimestamp();
+
+            // A probe that never reported back (errored out, or was never sent) expires after a cooldown
+            if (slot->probe_in_progress && !TimestampDifferenceExceeds(slot->probe_started, now, breaker_cooldown))
+                admit = false;
+            else if (slot->breaker_state == AI_BREAKER_OPEN &&
+                     !TimestampDifferenceExceeds(slot->opened_at, now, breaker_cooldown))
+                admit = false;
+            else
+            {
+                slot->breaker_state = AI_BREAKER_HALF_OPEN;
+                slot->probe_in_progress = true;
+                slot->probe_started = now;
+            }
+        }
+        LWLockRelease(&state->hdr.lock);
+
+        return admit;
+    }
+
+    /**
+     * Record the outcome (AI_OUTCOME_*) of a request against a target
+     * Failures open the circuit after ai_toolkit.breaker_failure_threshold in a row,
+     * or immediately if the request was a half-open probe. Neutral outcomes only end a probe.
+     */
+    void target_health_record(const AiTarget &target, long latency_ms, int outcome)
+    {
+        AiTargetHealthState *state = target_health_attach();
+
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        AiTargetHealth *slot = target_health_slot(state, target.health_key());
+        if (slot)
+        {
+            slot->requests++;
+            slot->probe_in_progress = false;
+
+            if (outcome == AI_OUTCOME_SUCCESS)
+            {
+                int bucket = 0;
+                while (bucket < AI_LATENCY_BUCKETS - 1 && (1L << (bucket + 1)) <= latency_ms)
+                    bucket++;
+                slot->latency_hist[bucket]++;
+                slot->consecutive_failures = 0;
+                slot->breaker_state = AI_BREAKER_CLOSED;
+            }
+            else if (outcome == AI_OUTCOME_FAILURE)
+            {
+                slot->failures++;
+                slot->consecutive_failures++;
+                if (slot->breaker_state == AI_BREAKER_HALF_OPEN ||
+                    slot->consecutive_failures >= breaker_failure_threshold)
+                {
+                    if (slot->breaker_state != AI_BREAKER_OPEN)
+                        elog(LOG, "[target_health_record] Opening circuit for target '%s' after %d failures",
+                             slot->key, slot->consecutive_failures);
+                    slot->breaker_state = AI_BREAKER_OPEN;
+                    slot->opened_at = GetCurrentTimestamp();
+                }
+            }
+        }
+        LWLockRelease(&state->hdr.lock);
+    }
+
+    /**
+     * Count a fired hedge (and whether the hedge answered first) against the primary target
+     */
+    void target_health_note_hedge(const AiTarget &primary, bool hedge_won)
+    {
+        AiTargetHealthState *state = target_health_attach();
+
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        AiTargetHealth *slot = target_health_slot(state, primary.health_key());
+        if (slot)
+        {
+            slot->hedges_fired++;
+            if (hedge_won)
+                slot->hedges_won++;
+        }
+        LWLockRelease(&state->hdr.lock);
+    }
+
+    /**
+     * Latency percentile (upper bucket bound) from a target's histogram
+     * Returns: milliseconds, or -1 if fewer than min_samples successful requests
+     */
+    static long target_latency_percentile(const AiTargetHealth *slot, double percentile, uint64 min_samples)
+    {
+        uint64 total = 0;
+        for (int i = 0; i < AI_LATENCY_BUCKETS; i++)
+            total += slot->latency_hist[i];
+        if (total == 0 || total < min_samples)
+            return -1;
+
+        uint64 rank = (uint64)std::ceil(total * percentile);
+        uint64 seen = 0;
+        for (int i = 0; i < AI_LATENCY_BUCKETS; i++)
+        {
+            seen += slot->latency_hist[i];
+            if (seen >= rank)
+                return 1L << (i + 1);
+        }
+        return 1L << AI_LATENCY_BUCKETS;
+    }
+
+    /**
+     * Delay before hedging a request to the given target: its observed p95,
+     * but never below ai_toolkit.hedge_min_delay
+     */
+    long hedge_delay_ms(const AiTarget &target)
+    {
+        AiTargetHealthState *state = target_health_attach();
+        long p95 = -1;
+
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        AiTargetHealth *slot = target_health_slot(state, target.health_key());
+        if (slot)
+            p95 = target_latency_percentile(slot, 0.95, 20);
+        LWLockRelease(&state->hdr.lock);
+
+        return std::max((long)hedge_min_delay, p95);
+    }
+
+    /**
+     * HTTP status of a failed result. The SDK reports provider errors as
+     * "HTTP <status> ..." and failures without a response as network/connection/timeout
+     * errors; only that prefix (before the response body) is looked at.
+     * Returns: the status, 0 if no response was received, -1 if unknown
+     */
+    static int failure_http_status(const ai::GenerateResult &result)
+    {
+        std::string message = result.error.has_value() ? result.error.value() : result.error_message();
+        std::string prefix = message.substr(0, message.find(':'));
+        std::transform(prefix.begin(), prefix.end(), prefix.begin(), ::tolower);
+
+        static const std::regex status_pattern("^\\s*(?:http(?: error)?|status(?: code)?)\\s*\\(?([1-5][0-9]{2})\\b");
+        std::smatch match;
+        if (std::regex_search(prefix, match, status_pattern))
+            return std::stoi(match[1].str());
+
+        static const std::regex transport_pattern("^\\s*(?:network|connection|request timeout|read timeout|timeout|timed out)\\b");
+        if (std::regex_search(prefix, transport_pattern))
+            return 0;
+        return -1;
+    }
+
+    /**
+     * Whether a failed result is worth retrying on another target and counts against
+     * the target's health: transport failures, server errors (5xx) and rate limiting (429).
+     * Client errors such as a rejected API key or a bad request are not.
+     */
+    bool is_transient_failure(const ai::GenerateResult &result)
+    {
+        int status = failure_http_status(result);
+        return status == 0 || status == 429 || status >= 500;
+    }
+
+    /**
+     * Circuit breaker outcome (AI_OUTCOME_*) of a finished request
+     */
+    static int health_outcome(const ai::GenerateResult &result)
+    {
+        if (result)
+            return AI_OUTCOME_SUCCESS;
+        return is_transient_failure(result) ? AI_OUTCOME_FAILURE : AI_OUTCOME_NEUTRAL;
+    }
+
+    /**
+     * Extract the text between <tag> and </tag>, trimmed
+     * Returns: std::nullopt if the tag pair is not present
+     */
+    std::optional<std::string> extract_tag(const std::string &text, const std::string &tag)
+    {
+        std::string open_tag = "<" + tag + ">";
+        std::string close_tag = "</" + tag + ">";
+
+        size_t start = text.find(open_tag);
+        if (start == std::string::npos)
+            return std::nullopt;
+        start += open_tag.size();
+
+        size_t end = text.find(close_tag, start);
+        if (end == std::string::npos)
+            return std::nullopt;
+
+        std::string content = text.substr(start, end - start);
+        size_t first = content.find_first_not_of(" \n\r\t");
+        size_t last = content.find_last_not_of(" \n\r\t");
+        if (first == std::string::npos)
+            return std::string();
+        return content.substr(first, last - first + 1);
+    }
+
+    /**
+     * Check that sql is syntactically valid PostgreSQL without executing or analyzing it
+     * Returns: true if it parses; otherwise false with the parser message in *error
+     */
+    bool sql_parses(const std::string &sql, std::string *error = nullptr)
+    {
+        MemoryContext oldcontext = CurrentMemoryContext;
+        volatile bool ok = true;
+
+        PG_TRY();
+        {
+            raw_parser(sql.c_str(), RAW_PARSE_DEFAULT);
+        }
+        PG_CATCH();
+        {
+            MemoryContextSwitchTo(oldcontext);
+            ErrorData *edata = CopyErrorData();
+            FlushErrorState();
+            if (error)
+                *error = edata->message ? edata->message : "syntax error";
+            FreeErrorData(edata);
+            ok = false;
+        }
+        PG_END_TRY();
+
+        return ok;
+    }
+
+    /**
+     * Whether sql parses as exactly one statement
+     */
+    bool sql_is_single_statement(const std::string &sql)
+    {
+        MemoryContext oldcontext = CurrentMemoryContext;
+        volatile bool single = false;
+
+        PG_TRY();
+        {
+            single = list_length(raw_parser(sql.c_str(), RAW_PARSE_DEFAULT)) == 1;
+        }
+        PG_CATCH();
+        {
+            MemoryContextSwitchTo(oldcontext);
+            FlushErrorState();
+        }
+        PG_END_TRY();
+
+        return single;
+    }
+
+    /**
+     * The model's answer to query(), from the final_answer tool or from <sql>/<disclaimer> tags
+     */
+    struct AiFinalAnswer
+    {
+        std::string sql;
+        std::string disclaimer;
+        bool has_disclaimer = false;
+        std::string explanation;
+        double confidence = 0; // 0 if the model gave none
+    };
+
+    /**
+     * Validate a structured answer ({sql, disclaimer, explanation, confidence})
+     * Returns: "" if it is usable, otherwise what is wrong, phrased for the model
+     */
+    std::string final_answer_problem(const nlohmann::json &answer)
+    {
+        if (!answer.is_object())
+            return "the answer must be a JSON object";
+        if (!answer.contains("sql") || !answer["sql"].is_string() ||
+            answer["sql"].get<std::string>().find_first_not_of(" \t\n\r") == std::string::npos)
+            return "sql is missing";
+
+        std::string error;
+        if (!sql_parses(answer["sql"].get<std::string>(), &error))
+            return "sql does not parse: " + error;
+
+        for (const char *field : {"disclaimer", "explanation"})
+            if (answer.contains(field) && !answer[field].is_null() && !answer[field].is_string())
+                return std::string(field) + " must be a string";
+
+        if (answer.contains("confidence") && !answer["confidence"].is_null())
+        {
+            const nlohmann::json &confidence = answer["confidence"];
+            double value = confidence.is_number() ? confidence.get<double>()
+                           : confidence.is_string() ? strtod(confidence.get<std::string>().c_str(), nullptr)
+                                                    : -1;
+            if (value < 0 || value > 1)
+                return "confidence must be a number from 0.0 to 1.0";
+        }
+        return "";
+    }
+
+    /**
+     * Convert an answer that passed final_answer_problem()
+     */
+    AiFinalAnswer final_answer_from_json(const nlohmann::json &json)
+    {
+        AiFinalAnswer answer;
+        answer.sql = json["sql"].get<std::string>();
+        if (json.contains("disclaimer") && json["disclaimer"].is_string())
+            answer.disclaimer = json["disclaimer"].get<std::string>();
+        answer.has_disclaimer = answer.disclaimer.find_first_not_of(" \t\n\r") != std::string::npos;
+        if (json.contains("explanation") && json["explanation"].is_string())
+            answer.explanation = json["explanation"].get<std::string>();
+        if (json.contains("confidence") && json["confidence"].is_number())
+            answer.confidence = json["confidence"].get<double>();
+        else if (json.contains("confidence") && json["confidence"].is_string())
+            answer.confidence = strtod(json["confidence"].get<std::string>().c_str(), nullptr);
+        return answer;
+    }
+
+    /**
+     * The answer of a finished generation: the final_answer tool call if the model made one,
+     * otherwise its <sql>, <disclaimer> and <confidence> tags
+     * Returns: true if the answer validates; otherwise false with the best-effort answer
+     * in *answer and the reason in *problem
+     */
+    bool final_answer_from(const ai::GenerateResult &result, AiFinalAnswer *answer, std::string *problem)
+    {
+        if (current_request.loop.final_answer.has_value())
+        {
+            *answer = final_answer_from_json(current_request.loop.final_answer.value());
+            return true;
+        }
+
+        *answer = AiFinalAnswer();
+        std::optional<std::string> disclaimer = extract_tag(result.text, "disclaimer");
+        answer->disclaimer = disclaimer.value_or("");
+        answer->has_disclaimer = disclaimer.has_value();
+        answer->sql = extract_tag(result.text, "sql").value_or("");
+        std::optional<std::string> confidence = extract_tag(result.text, "confidence");
+        if (confidence.has_value())
+            answer->confidence = strtod(confidence->c_str(), nullptr);
+
+        if (answer->sql.empty())
+        {
+            *problem = structured_output ? "no final_answer call and no <sql> block" : "no <sql> block";
+            return false;
+        }
+        std::string error;
+        if (!sql_parses(answer->sql, &error))
+        {
+            *problem = "sql does not parse: " + error;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * final_answer tool: the model hands in its answer as structured fields. An invalid
+     * answer is returned to the model with the problem so it can correct it in the next step.
+     * A valid one is recorded by the tool wrapper (create_backend_tool()) in the tool loop
+     * of the attempt that made the call.
+     */
+    nlohmann::json tool_final_answer(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    {
+        std::string problem = final_answer_problem(params);
+        if (!problem.empty())
+        {
+            stat_add("final_answer.invalid", 1);
+            return nlohmann::json{{"success", false},
+                                  {"error", "Invalid final answer: " + problem + ". Call final_answer again with a corrected answer."}};
+        }
+
+        return nlohmann::json{{"success", true},
+                              {"note", "Answer recorded. Make no more tool calls; reply with only: done"}};
+    }
+
+    /**
+     * Bookkeeping after each finished step of a tool loop limited to max_steps.
+     * Publishes the steps left for the tool wrappers (which nudge, then refuse, tool calls
+     * near the end of the budget), and winds the loop down when a final_answer call was
+     * accepted or the step carried tool calls but its text already has every tag in
+     * current_request.final_tags with SQL that parses. Winding down refuses further tool
+     * calls, so the model's next reply ends the loop; nothing is thrown through the SDK.
+     */
+    void step_budget_after_step(const ai::GenerateStep &step, int steps_finished, int max_steps, AiToolLoop &loop)
+    {
+        loop.steps_remaining = max_steps - steps_finished;
+        if (loop.stopping)
+            return;
+
+        if (loop.final_answer.has_value())
+        {
+            loop.stopping = true;
+            stat_add("steps.saved", std::max(max_steps - steps_finished - 1, 0));
+            return;
+        }
+
+        if (current_request.final_tags.empty() || step.tool_calls.empty())
+            return;
+        for (const auto &tag : current_request.final_tags)
+        {
+            std::optional<std::string> content = extract_tag(step.text, tag);
+            if (!content.has_value() || content->empty())
+                return;
+            if (tag == "sql" && !sql_parses(content.value()))
+                return;
+        }
+
+        loop.stopping = true;
+        loop.final_text = step.text;
+        stat_add("steps.early_stops", 1);
+        stat_add("steps.saved", std::max(max_steps - steps_finished - 1, 0));
+        elog(LOG, "[step_budget_after_step] Final answer in step %d of %d, ending the tool loop", steps_finished, max_steps);
+    }
+
+    /**
+     * Runs provider calls on helper threads while the backend thread keeps sole
+     * ownership of everything Postgres. Tool functions and progress callbacks invoked
+     * by the SDK on a helper thread are queued back and executed by the backend thread,
+     * which is the only thread that ever touches SPI, elog or palloc.
+     *
+     * The broker is shared (std::shared_ptr) with its helper threads, so an abandoned
+     * attempt can finish its HTTP call after the backend has moved on; once abandoned,
+     * queued work is refused and nothing is run on the backend's behalf.
+     */
+    class ProviderCallBroker : public std::enable_shared_from_this<ProviderCallBroker>
+    {
+    public:
+        struct BackendTask
+        {
+            std::function<void()> fn;
+            std::exception_ptr error;
+            bool done = false;
+        };
+
+        /**
+         * Helper thread side: run fn on the backend thread and wait for it
+         * Returns: false if the broker was abandoned and fn did not run
+         */
+        bool run_on_backend(const std::function<void()> &fn)
+        {
+            auto task = std::make_shared<BackendTask>();
+            task->fn = fn;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (abandoned_)
+                return false;
+            tasks_.push_back(task);
+            wakeup_.notify_all();
+            task_done_.wait(lock, [&]
+                            { return task->done || abandoned_; });
+
+            if (!task->done)
+                return false;
+            if (task->error)
+                std::rethrow_exception(task->error);
+            return true;
+        }
+
+        /**
+         * Backend side: start generate_text for options on a helper thread; its tool calls
+         * run against loop
+         * Returns: attempt number used with take_result
+         */
+        int start_attempt(ai::Client client, ai::GenerateOptions options, AiToolLoop *loop)
+        {
+            int attempt;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                attempt = (int)results_.size();
+                results_.emplace_back();
+            }
+
+            auto self = shared_from_this();
+
+            // Helper threads must never run Postgres signal handlers
+            sigset_t all_signals, saved_signals;
+            sigfillset(&all_signals);
+            pthread_sigmask(SIG_SETMASK, &all_signals, &saved_signals);
+            try
+            {
+                std::thread([self, attempt, loop, client = std::move(client), options = std::move(options)]() mutable
+                            {
+                    current_broker = self.get();
+                    current_loop = loop;
+
+                    auto on_step_finish = options.on_step_finish;
+                    if (on_step_finish)
+                        options.on_step_finish = [self, on_step_finish](const ai::GenerateStep &step)
+                        { self->run_on_backend([&] { on_step_finish(step); }); };
+
+                    auto on_tool_call_start = options.on_tool_call_start;
+                    if (on_tool_call_start)
+                        options.on_tool_call_start = [self, on_tool_call_start](const ai::ToolCall &call)
+                        { self->run_on_backend([&] { on_tool_call_start(call); }); };
+
+                    auto on_tool_call_finish = options.on_tool_call_finish;
+                    if (on_tool_call_finish)
+                        options.on_tool_call_finish = [self, on_tool_call_finish](const ai::ToolResult &result)
+                        { self->run_on_backend([&] { on_tool_call_finish(result); }); };
+
+                    ai::GenerateResult result;
+                    try
+                    {
+                        result = client.generate_text(options);
+                    }
+                    catch (const std::exception &e)
+                    {
+                        result.error = std::string(e.what());
+                    }
+
+                    current_broker = nullptr;
+                    current_loop = nullptr;
+                    self->finish_attempt(attempt, std::move(result)); })
+                    .detach();
+            }
+            catch (...)
+            {
+                pthread_sigmask(SIG_SETMASK, &saved_signals, nullptr);
+                throw;
+            }
+            pthread_sigmask(SIG_SETMASK, &saved_signals, nullptr);
+
+            return attempt;
+        }
+
+        /**
+         * Backend side: wait up to timeout_ms for work, running at most one queued task.
+         * When nothing is queued, idle (if given) is run once instead of waiting; it
+         * returns false once it has no more work. Tasks always take precedence.
+         * Raises pending query cancels after abandoning the helper threads.
+         */
+        void service(long timeout_ms, const std::function<bool()> &idle = nullptr)
+        {
+            std::shared_ptr<BackendTask> task;
+            bool idle_ran = false;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (idle && tasks_.empty() && unseen_results_ == 0)
+                {
+                    lock.unlock();
+                    PG_TRY();
+                    {
+                        idle_ran = idle();
+                    }
+                    PG_CATCH();
+                    {
+                        abandon();
+                        PG_RE_THROW();
+                    }
+                    PG_END_TRY();
+                    lock.lock();
+                }
+                if (!idle_ran)
+                    wakeup_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&]
+                                     { return !tasks_.empty() || unseen_results_ > 0; });
+                if (!tasks_.empty())
+                {
+                    task = tasks_.front();
+                    tasks_.pop_front();
+                }
+            }
+
+            if (task)
+            {
+                PG_TRY();
+                {
+                    try
+                    {
+                        task->fn();
+                    }
+                    catch (...)
+                    {
+                        task->error = std::current_exception();
+                    }
+                }
+                PG_CATCH();
+                {
+                    abandon();
+                    PG_RE_THROW();
+                }
+                PG_END_TRY();
+
+                std::lock_guard<std::mutex> lock(mutex_);
+                task->done = true;
+                task_done_.notify_all();
+            }
+
+            if (QueryCancelPending || ProcDiePending)
+            {
+                abandon();
+                CHECK_FOR_INTERRUPTS();
+            }
+        }
+
+        /**
+         * Backend side: collect a finished attempt's result
+         * Returns: true (and fills result) if the attempt has finished
+         */
+        bool take_result(int attempt, ai::GenerateResult *result)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!results_[attempt].has_value())
+                return false;
+            *result = std::move(results_[attempt].value());
+            results_[attempt].reset();
+            unseen_results_--;
+            return true;
+        }
+
+        /**
+         * Backend side: stop serving helper threads; their results will be ignored
+         */
+        void abandon()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            abandoned_ = true;
+            tasks_.clear();
+            task_done_.notify_all();
+        }
+
+        // Broker of the helper thread currently running, nullptr on the backend thread
+        static thread_local ProviderCallBroker *current_broker;
+        // Tool loop of the attempt the helper thread runs
+        static thread_local AiToolLoop *current_loop;
+
+    private:
+        void finish_attempt(int attempt, ai::GenerateResult result)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            results_[attempt] = std::move(result);
+            unseen_results_++;
+            wakeup_.notify_all();
+        }
+
+        std::mutex mutex_;
+        std::condition_variable wakeup_;    // backend waits for tasks or results
+        std::condition_variable task_done_; // helpers wait for their task
+        std::deque<std::shared_ptr<BackendTask>> tasks_;
+        std::vector<std::optional<ai::GenerateResult>> results_;
+        int unseen_results_ = 0;
+        bool abandoned_ = false;
+    };
+
+    thread_local ProviderCallBroker *ProviderCallBroker::current_broker = nullptr;
+    thread_local AiToolLoop *ProviderCallBroker::current_loop = nullptr;
+
+    /**
+     * Run fn on the backend thread. Called from tool functions and callbacks, which
+     * the SDK may invoke on a helper thread while a hedged request is in flight.
+     * Throws: std::runtime_error if the request was abandoned
+     */
+    void run_on_backend_thread(const std::function<void()> &fn)
+    {
+        ProviderCallBroker *broker = ProviderCallBroker::current_broker;
+        if (broker == nullptr)
+        {
+            fn();
+            return;
+        }
+        if (!broker->run_on_backend(fn))
+            throw std::runtime_error("AI request was abandoned by the backend");
+    }
+
+    /**
+     * Create a tool whose function always executes on the backend thread
+     * Use this instead of ai::create_simple_tool for anything that touches Postgres.
+     */
+    ai::Tool create_backend_tool(const std::string &name, const std::string &description,
+                                 const std::map<std::string, std::string> &parameters,
+                                 std::function<nlohmann::json(const nlohmann::json &, const ai::ToolExecutionContext &)> fn)
+    {
+        return ai::create_simple_tool(
+            name, description, parameters,
+            [name, fn](const nlohmann::json &params, const ai::ToolExecutionContext &context)
+            {
+                // The attempt making the call: a hedge's tool loop is not the request's
+                AiToolLoop *loop = ProviderCallBroker::current_loop ? ProviderCallBroker::current_loop
+                                                                    : &current_request.loop;
+                nlohmann::json result;
+                run_on_backend_thread([&]
+                                      {
+                    TimestampTz start = GetCurrentTimestamp();
+                    if (loop->stopping)
+                    {
+                        stat_add("steps.tools_refused", 1);
+                        result = nlohmann::json{{"success", false},
+                                                {"error", "The final answer is already in: make no more tool calls. Reply with only: done"}};
+                        return;
+                    }
+                    if (name == "set_memory")
+                    {
+                        // Both racing attempts would write, and the loser's writes would stay
+                        if (current_request.hedge_live)
+                        {
+                            stat_add("hedge.writes_refused", 1);
+                            result = nlohmann::json{{"success", false},
+                                                    {"error", "Memory cannot be saved during this request. Continue without saving it."}};
+                            return;
+                        }
+                        loop->wrote = true;
+                    }
+                    if (loop->steps_remaining == 1 && name != "final_answer")
+                    {
+                        // Nothing would read the result: this step is the model's last
+                        stat_add("steps.tools_refused", 1);
+                        result = nlohmann::json{{"success", false},
+                                                {"error", "Step budget exhausted: no more tool calls. "
+                                                          "Reply now with your final answer using what you already know."}};
+                        return;
+                    }
+                    result = budget_tool_result(name, cached_tool_call(name, params, [&]
+                                                                       { return fn(params, context); }));
+                    if (name == "final_answer" && result.is_object() && result.value("success", false))
+                        loop->final_answer = params;
+                    if (loop->steps_remaining == 2 && result.is_object())
+                        result["note"] = "This is the last tool result you will get: reply with your final answer in the next step.";
+                    loop->tool_calls++;
+                    loop->tool_ms += TimestampDifferenceMilliseconds(start, GetCurrentTimestamp()); });
+                return result;
+            });
+    }
+
+    /**
+     * Run generate_text against one target under the shared rate limiter, on the calling thread.
+     * Admission pays for the first step with an estimate; each further tool-loop step
+     * is charged as another request once it finishes, with the real token usage.
+     */
+    ai::GenerateResult generate_on_target(ai::Client &client, const AiTarget &target, ai::GenerateOptions &options)
+    {
+        options.model = target.model;
+        int estimated_tokens = estimate_tokens(options.system) + estimate_tokens(options.prompt);
+
+        RateLimitTicket ticket = rate_limit_acquire(target.rate_limit_key(), estimated_tokens);
+
+        auto caller_on_step_finish = options.on_step_finish;
+        int steps_finished = 0;
+
+        options.on_step_finish = [&](const ai::GenerateStep &step)
+        {
+            int tokens = step.usage.total_tokens;
+            if (steps_finished == 0)
+                tokens -= ticket.reserved_tokens;
+            rate_limit_charge(ticket, tokens, steps_finished > 0 ? 1 : 0);
+            stat_record_step_usage(step);
+            steps_finished++;
+
+            if (caller_on_step_finish)
+                caller_on_step_finish(step);
+            step_budget_after_step(step, steps_finished, options.max_steps, current_request.loop);
+        };
+
+        current_request.loop = AiToolLoop();
+        current_request.loop.steps_remaining = options.max_steps;
+        TimestampTz start = GetCurrentTimestamp();
+        try
+        {
+            ai::GenerateResult result;
+            if (current_request.prefetch.empty() || ProviderCallBroker::current_broker != nullptr)
+            {
+                result = client.generate_text(options);
+            }
+            else
+            {
+                // Prefetch is queued: wait for the provider on a helper thread so the
+                // backend can warm the tool cache instead of blocking on the network
+                auto broker = std::make_shared<ProviderCallBroker>();
+                int attempt = broker->start_attempt(build_client_for_target(target), options, &current_request.loop);
+                while (!broker->take_result(attempt, &result))
+                    broker->service(10, prefetch_step);
+                broker->abandon();
+            }
+            options.on_step_finish = caller_on_step_finish;
+            current_request.loop.steps_remaining = -1;
+            current_request.tool_calls += current_request.loop.tool_calls;
+            current_request.tool_ms += current_request.loop.tool_ms;
+            if (result && current_request.loop.final_text.has_value())
+                result.text = current_request.loop.final_text.value(); // the answer, not the closing reply
+            rate_limit_release(ticket);
+            target_health_record(target, TimestampDifferenceMilliseconds(start, GetCurrentTimestamp()), health_outcome(result));
+            return result;
+        }
+        catch (...)
+        {
+            options.on_step_finish = caller_on_step_finish;
+            current_request.loop.steps_remaining = -1;
+            current_request.tool_calls += current_request.loop.tool_calls;
+            current_request.tool_ms += current_request.loop.tool_ms;
+            rate_limit_release(ticket);
+            // Cancels and local errors say nothing about the target
+            target_health_record(target, TimestampDifferenceMilliseconds(start, GetCurrentTimestamp()), AI_OUTCOME_NEUTRAL);
+            throw;
+        }
+    }
+
+    /**
+     * Pick the next target to try: the first one not yet tried whose circuit admits a request
+     * Returns: index into targets, or -1 if none is available
+     */
+    static int pick_target(const std::vector<AiTarget> &targets, const std::vector<bool> &tried)
+    {
+        for (size_t i = 0; i < targets.size(); i++)
+        {
+            if (!tried[i] && target_health_admit(targets[i]))
+                return (int)i;
+        }
+        return -1;
+    }
+
+    /**
+     * Race a primary request against a hedge fired after the primary's p95 latency.
+     * Both run on helper threads; the backend thread services their tool calls.
+     * The first successful answer wins and the other attempt is abandoned. Each attempt
+     * has its own tool loop and only the returned one's tool counters are kept; they share
+     * the cache of read-only tool results. A primary that has written (set_memory) is not
+     * hedged, and tools that write are refused while both attempts run.
+     * hedge: index of the hedge target (may equal primary); *hedge_started reports whether it fired
+     */
+    ai::GenerateResult generate_hedged(const std::vector<AiTarget> &targets, int primary, int hedge,
+                                       const ai::GenerateOptions &options, bool *hedge_started)
+    {
+        auto broker = std::make_shared<ProviderCallBroker>();
+        long delay_ms = hedge_delay_ms(targets[primary]);
+        int estimated_tokens = estimate_tokens(options.system) + estimate_tokens(options.prompt);
+
+        struct Attempt
+        {
+            int target = -1;
+            int broker_attempt = -1;
+            RateLimitTicket ticket;
+            TimestampTz started = 0;
+            int steps_finished = 0;
+            AiToolLoop loop;
+            bool finished = false;
+        };
+        Attempt attempts[2];
+        *hedge_started = false;
+        current_request.loop = AiToolLoop();
+
+        // Launch an attempt; the hedge only fires if it can be admitted without waiting
+        auto launch = [&](int which, int target_index, bool wait) -> bool
+        {
+            Attempt &attempt = attempts[which];
+            const AiTarget &target = targets[target_index];
+
+            attempt.ticket = rate_limit_acquire(target.rate_limit_key(), estimated_tokens, wait);
+            if (!attempt.ticket.admitted)
+                return false;
+
+            ai::GenerateOptions attempt_options = options;
+            attempt_options.model = target.model;
+            auto caller_on_step_finish = options.on_step_finish;
+            int max_steps = options.max_steps;
+            attempt_options.on_step_finish = [&attempt, caller_on_step_finish, max_steps](const ai::GenerateStep &step)
+            {
+                int tokens = step.usage.total_tokens;
+                if (attempt.steps_finished == 0)
+                    tokens -= attempt.ticket.reserved_tokens;
+                rate_limit_charge(attempt.ticket, tokens, attempt.steps_finished > 0 ? 1 : 0);
+                stat_record_step_usage(step);
+                attempt.steps_finished++;
+
+                if (caller_on_step_finish)
+                    caller_on_step_finish(step);
+                step_budget_after_step(step, attempt.steps_finished, max_steps, attempt.loop);
+            };
+
+            attempt.target = target_index;
+            attempt.started = GetCurrentTimestamp();
+            attempt.loop.steps_remaining = max_steps;
+            attempt.broker_attempt = broker->start_attempt(build_client_for_target(target), attempt_options, &attempt.loop);
+            return true;
+        };
+
+        auto settle = [&](Attempt &attempt, const ai::GenerateResult &result)
+        {
+            attempt.finished = true;
+            rate_limit_release(attempt.ticket);
+            target_health_record(targets[attempt.target],
+                                 TimestampDifferenceMilliseconds(attempt.started, GetCurrentTimestamp()),
+                                 health_outcome(result));
+        };
+
+        // The losing call keeps running at the provider and its step in flight is never
+        // reported: charge it at the admission estimate (the first step already is)
+        auto abandon_attempt = [&](Attempt &attempt)
+        {
+            attempt.finished = true;
+            if (attempt.steps_finished > 0)
+            {
+                rate_limit_charge(attempt.ticket, estimated_tokens, 1);
+                stat_add("hedge.abandoned_tokens_estimate", estimated_tokens);
+            }
+            rate_limit_release(attempt.ticket);
+        };
+
+        launch(0, primary, true);
+
+        ai::GenerateResult last_failure;
+        int failed = -1;
+        for (;;)
+        {
+            broker->service(10, prefetch_step);
+
+            for (int which = 0; which < 2; which++)
+            {
+                Attempt &attempt = attempts[which];
+                ai::GenerateResult result;
+                if (attempt.broker_attempt < 0 || attempt.finished || !broker->take_result(attempt.broker_attempt, &result))
+                    continue;
+
+                settle(attempt, result);
+                if (result)
+                {
+                    broker->abandon();
+                    for (Attempt &other : attempts)
+                    {
+                        if (other.broker_attempt >= 0 && !other.finished)
+                            abandon_attempt(other);
+                    }
+                    if (*hedge_started)
+                        target_health_note_hedge(targets[primary], which == 1);
+                    // The winner's loop becomes the request's, with its final answer
+                    current_request.hedge_live = false;
+                    current_request.loop = attempt.loop;
+                    current_request.loop.steps_remaining = -1;
+                    current_request.tool_calls += attempt.loop.tool_calls;
+                    current_request.tool_ms += attempt.loop.tool_ms;
+                    if (current_request.loop.final_text.has_value())
+                        result.text = current_request.loop.final_text.value();
+                    return result;
+                }
+                last_failure = result;
+                failed = which;
+            }
+
+            bool primary_done = attempts[0].finished;
+            bool hedge_done = !*hedge_started || attempts[1].finished;
+
+            // Primary failed before the hedge fired: let the caller fall back
+            if (primary_done && !*hedge_started)
+                break;
+            if (primary_done && hedge_done)
+                break;
+
+            if (!*hedge_started && !attempts[0].loop.wrote &&
+                TimestampDifferenceExceeds(attempts[0].started, GetCurrentTimestamp(), (int)delay_ms))
+            {
+                if (launch(1, hedge, false))
+                {
+                    current_request.hedge_live = true;
+                    elog(LOG, "[generate_hedged] Primary '%s' slower than %ld ms, hedging to '%s'",
+                         targets[primary].health_key().c_str(), delay_ms, targets[hedge].health_key().c_str());
+                    *hedge_started = true;
+                }
+                else
+                {
+                    // No capacity for a hedge right now; check again after another delay
+                    delay_ms += hedge_min_delay;
+                }
+            }
+        }
+
+        broker->abandon();
+        if (*hedge_started)
+            target_health_note_hedge(targets[primary], false);
+        current_request.hedge_live = false;
+        if (failed >= 0)
+        {
+            current_request.tool_calls += attempts[failed].loop.tool_calls;
+            current_request.tool_ms += attempts[failed].loop.tool_ms;
+        }
+        return last_failure;
+    }
+
+    /**
+     * Run generate_text with the configured targets
+     * With a single target and hedging off this is one rate-limited call on client.
+     * Otherwise targets are tried in order, skipping those with an open circuit,
+     * falling back to the next on server errors and timeouts, optionally hedging each
+     * attempt against the next healthy target.
+     */
+    ai::GenerateResult governed_generate_text(ai::Client &client, ai::GenerateOptions &options)
+    {
+        std::vector<AiTarget> targets = get_configured_targets();
+
+        if (targets.size() == 1 && !hedging_enabled)
+            return generate_on_target(client, targets[0], options);
+
+        std::vector<bool> tried(targets.size(), false);
+        std::optional<ai::GenerateResult> last_failure;
+
+        for (;;)
+        {
+            int primary = pick_target(targets, tried);
+            if (primary < 0)
+                break;
+            tried[primary] = true;
+
+            ai::GenerateResult result;
+            if (hedging_enabled)
+            {
+                int hedge = pick_target(targets, tried);
+                if (hedge < 0)
+                    hedge = primary;
+
+                bool hedge_started = false;
+                result = generate_hedged(targets, primary, hedge, options, &hedge_started);
+                if (hedge_started)
+                    tried[hedge] = true;
+            }
+            else
+            {
+                if (primary == 0)
+                {
+                    result = generate_on_target(client, targets[primary], options);
+                }
+                else
+                {
+                    ai::Client target_client = build_client_for_target(targets[primary]);
+                    result = generate_on_target(target_client, targets[primary], options);
+                }
+            }
+
+            if (result || !is_transient_failure(result))
+                return result;
+
+            elog(LOG, "[governed_generate_text] Target '%s' failed (%s), trying next target",
+                 targets[primary].health_key().c_str(), result.error_message().c_str());
+            last_failure = result;
+        }
+
+        if (last_failure.has_value())
+            return last_failure.value();
+
+        // Every circuit is open: rather than fail outright, probe the primary target
+        elog(LOG, "[governed_generate_text] All targets have open circuits, trying '%s'", targets[0].health_key().c_str());
+        return generate_on_target(client, targets[0], options);
+    }
+
+    /**
+     * Record latency and token usage of one generation under a routing tier
+     */
+    void stat_record_generation(const std::string &tier, TimestampTz start, const ai::GenerateResult &result)
+    {
+        std::string prefix = "tier." + tier + ".";
+        stat_add(prefix + "calls", 1);
+        stat_add(prefix + "latency_ms", TimestampDifferenceMilliseconds(start, GetCurrentTimestamp()));
+        stat_add(prefix + "prompt_tokens", result.usage.prompt_tokens);
+        stat_add(prefix + "completion_tokens", result.usage.completion_tokens);
+        if (!result)
+            stat_add(prefix + "failures", 1);
+    }
+
+    /**
+     * Generate with the strong (configured) model, recording tier statistics
+     */
+    ai::GenerateResult generate_strong(ai::Client &client, ai::GenerateOptions &options)
+    {
+        TimestampTz start = GetCurrentTimestamp();
+        auto result = governed_generate_text(client, options);
+        stat_record_generation("strong", start, result);
+        return result;
+    }
+
+    /**
+     * Whether query() should route exploration to ai_toolkit.explore_model
+     */
+    bool tiered_routing_enabled()
+    {
+        return routing_mode == AI_ROUTING_TIERED && explore_model && strlen(explore_model) > 0;
+    }
+
+    /**
+     * Tiered generation for query(): the cheap explore model runs the tool loop
+     * (list_schemas, list_tables_in_schema, get_schema_for_table, get_memory) and drafts SQL.
+     * Its draft is used as-is only if it parses and its self-reported confidence reaches
+     * ai_toolkit.routing_confidence. Otherwise (or if exploration fails) the strong model
+     * synthesizes the final SQL from the exploration findings with a short step budget.
+     * Returns: a result whose text carries the usual <sql>/<disclaimer> tags
+     */
+    ai::GenerateResult generate_tiered(ai::Client &client, ai::GenerateOptions &options)
+    {
+        // The explore model runs on the primary target's provider and endpoint
+        AiTarget explore_target = get_configured_targets().front();
+        explore_target.model = explore_model;
+
+        ai::GenerateOptions explore_options = options;
+        explore_options.prompt = options.prompt +
+                                 "\n\nYou are the exploration model. Use the tools to find the relevant schemas, tables, "
+                                 "columns, join conditions and stored memories, then reply with:\n"
+                                 "<context>concise notes: fully qualified tables, needed columns with types, "
+                                 "join conditions and relevant memory facts</context>\n"
+                                 "<sql>your best query</sql>\n"
+                                 "<confidence>a number from 0.0 to 1.0: how sure you are the SQL is correct and complete</confidence>";
+
+        // Keep what the tools returned so the strong model does not have to repeat the calls
+        std::vector<std::string> findings;
+        auto caller_on_tool_call_finish = options.on_tool_call_finish;
+        explore_options.on_tool_call_finish = [&](const ai::ToolResult &tool_result)
+        {
+            findings.push_back(tool_result.tool_name + " -> " + tool_result.result.dump());
+            if (caller_on_tool_call_finish)
+                caller_on_tool_call_finish(tool_result);
+        };
+
+        elog(NOTICE, "🔎 Exploring schema with %s", explore_target.model.c_str());
+
+        // An exploration step only ends the loop early once it has rated its draft
+        std::vector<std::string> final_tags = current_request.final_tags;
+        if (!final_tags.empty())
+            current_request.final_tags.push_back("confidence");
+
+        TimestampTz start = GetCurrentTimestamp();
+        ai::GenerateResult explored;
+        try
+        {
+            explored = generate_on_target(client, explore_target, explore_options);
+        }
+        catch (const std::exception &e)
+        {
+            explored = ai::GenerateResult();
+            explored.error = std::string(e.what());
+        }
+        current_request.final_tags = final_tags;
+        stat_record_generation("explore", start, explored);
+
+        std::string reason;
+        std::optional<std::string> context;
+        if (explored)
+        {
+            context = extract_tag(explored.text, "context");
+            AiFinalAnswer draft;
+            std::string problem;
+            bool valid = final_answer_from(explored, &draft, &problem);
+
+            if (draft.sql.empty())
+                reason = "no_sql";
+            else if (draft.confidence < routing_confidence)
+                reason = "low_confidence";
+            else if (!valid)
+                reason = "invalid_sql";
+            else
+            {
+                stat_add("routing.explore_accepted", 1);
+                elog(LOG, "[generate_tiered] Accepted explore model SQL (confidence %.2f)", draft.confidence);
+                return explored;
+            }
+        }
+        else
+        {
+            reason = "failure";
+            elog(LOG, "[generate_tiered] Explore model failed: %s", explored.error_message().c_str());
+        }
+
+        // The strong model answers afresh; the explore model's answer is only a finding
+        current_request.loop = AiToolLoop();
+        stat_add("routing.escalations", 1);
+        stat_add("routing.escalations." + reason, 1);
+        elog(NOTICE, "⬆️  Escalating to %s (%s)", options.model.c_str(), reason.c_str());
+
+        std::string gathered;
+        if (context.has_value() && !context->empty())
+            gathered += "Exploration notes:\n" + context.value() + "\n\n";
+        if (!findings.empty())
+        {
+            gathered += "Tool results already gathered (do not repeat these calls):\n";
+            for (const auto &finding : findings)
+            {
+                if (gathered.size() + finding.size() > 24000)
+                    break;
+                gathered += finding + "\n";
+            }
+        }
+
+        ai::GenerateOptions strong_options = options;
+        if (!gathered.empty())
+        {
+            strong_options.prompt = options.prompt + "\n\n" + gathered +
+                                    "\nThe schema has already been explored. Only call tools for information that is "
+                                    "still missing, then produce the final SQL.";
+            strong_options.max_steps = std::min(options.max_steps, 4);
+        }
+
+        return generate_strong(client, strong_options);
+    }
+
+    /**
+     * Single-shot repair of an answer that failed validation: one tool-free call shows the
+     * model its reply and the problem and asks for the answer as a JSON object, instead of
+     * rerunning the whole request
+     * Returns: true with *answer replaced if the repaired answer validates
+     */
+    bool repair_final_answer(ai::Client &client, const ai::GenerateOptions &options, const std::string &response_text,
+                             const std::string &problem, AiFinalAnswer *answer)
+    {
+        stat_add("final_answer.repairs", 1);
+        elog(NOTICE, "🩹 Repairing the answer (%s)", problem.c_str());
+
+        std::string repair_prompt =
+            options.prompt + "\n\nYour previous reply could not be used: " + problem + ".\n" +
+            "Previous reply:\n" + truncate_to_tokens(response_text, 2000) + "\n\n" +
+            "Do not call tools. Reply with only this JSON object:\n"
+            "{\"sql\": \"the complete PostgreSQL query\", "
+            "\"disclaimer\": \"a warning if the query is DDL or DML, otherwise empty\", "
+            "\"explanation\": \"one sentence on what the query returns\", "
+            "\"confidence\": a number from 0.0 to 1.0}";
+
+        ai::GenerateOptions repair_options(options.model, options.system, repair_prompt);
+        repair_options.max_steps = 1;
+
+        ai::GenerateResult result;
+        try
+        {
+            result = generate_strong(client, repair_options);
+        }
+        catch (const std::exception &e)
+        {
+            elog(LOG, "[repair_final_answer] Repair call failed: %s", e.what());
+            return false;
+        }
+
+        size_t open = result ? result.text.find('{') : std::string::npos;
+        size_t close = result ? result.text.rfind('}') : std::string::npos;
+        nlohmann::json repaired = open != std::string::npos && close != std::string::npos && close > open
+                                      ? nlohmann::json::parse(result.text.substr(open, close - open + 1), nullptr, false)
+                                      : nlohmann::json();
+
+        std::string repaired_problem = repaired.is_discarded() ? "reply is not JSON" : final_answer_problem(repaired);
+        if (!repaired_problem.empty())
+        {
+            stat_add("final_answer.repairs_failed", 1);
+            elog(LOG, "[repair_final_answer] Repaired answer is still unusable: %s", repaired_problem.c_str());
+            return false;
+        }
+
+        *answer = final_answer_from_json(repaired);
+        return true;
+    }
+
+    /**
+     * Pick the verbose or compact rendering of a tool result per ai_toolkit.tool_output_format,
+     * recording how many estimated tokens the compact form saved
+     */
+    nlohmann::json finish_tool_result(const std::string &tool_name, nlohmann::json verbose, nlohmann::json compact)
+    {
+        if (tool_output_format != AI_TOOL_OUTPUT_COMPACT)
+            return verbose;
+
+        stat_add("tool." + tool_name + ".calls", 1);
+        stat_add("tool." + tool_name + ".tokens_saved", estimate_tokens(verbose.dump()) - estimate_tokens(compact.dump()));
+        return compact;
+    }
+
+    /**
+     * Join names into a comma-separated list (compact tool encoding)
+     */
+    std::string join_names(const std::vector<std::string> &names, const std::string &strip_prefix = "")
+    {
+        std::string out;
+        for (const auto &name : names)
+        {
+            if (!out.empty())
+                out += ",";
+            if (!strip_prefix.empty() && name.compare(0, strip_prefix.size(), strip_prefix) == 0)
+                out += name.substr(strip_prefix.size());
+            else
+                out += name;
+        }
+        return out;
+    }
+
+    /**
+     * Names from a tool result field in either encoding: a JSON array or a comma-separated string
+     */
+    std::vector<std::string> tool_result_names(const nlohmann::json &value)
+    {
+        std::vector<std::string> names;
+        if (value.is_array())
+        {
+            for (const auto &item : value)
+                if (item.is_string())
+                    names.push_back(item.get<std::string>());
+        }
+        else if (value.is_string())
+        {
+            std::stringstream list(value.get<std::string>());
+            std::string name;
+            while (std::getline(list, name, ','))
+                if (!name.empty())
+                    names.push_back(name);
+        }
+        return names;
+    }
+
+    /**
+     * Shorten a column default for compact DDL: sequences become "serial",
+     * casts are dropped, and long expressions are omitted
+     */
+    static std::string compact_default(const std::string &col_default)
+    {
+        if (col_default.rfind("nextval(", 0) == 0)
+            return "serial";
+
+        std::string value = col_default;
+        size_t cast = value.find("::");
+        if (cast != std::string::npos)
+            value = value.substr(0, cast);
+        if (value == "CURRENT_TIMESTAMP")
+            value = "now()";
+
+        return value.size() <= 24 ? value : "";
+    }
+
+    /**
+     * Light suffix stemming so plural and inflected forms share a term
+     * (customers -> customer, categories -> category, shipped -> ship, created -> creat)
+     */
+    static std::string stem_word(std::string word)
+    {
+        auto ends_with = [&](const char *suffix)
+        {
+            size_t n = strlen(suffix);
+            return word.size() > n && word.compare(word.size() - n, n, suffix) == 0;
+        };
+
+        if (word.size() > 4 && ends_with("ies"))
+            word.replace(word.size() - 3, 3, "y");
+        else if (ends_with("sses") || ends_with("xes") || ends_with("ches") || ends_with("shes"))
+            word.resize(word.size() - 2);
+        else if (word.size() > 3 && ends_with("s") && !ends_with("ss") && !ends_with("us") && !ends_with("is"))
+            word.pop_back();
+
+        if (word.size() > 5 && ends_with("ing"))
+            word.resize(word.size() - 3);
+        else if (word.size() > 4 && ends_with("ed"))
+            word.resize(word.size() - 2);
+        else if (word.size() > 4 && ends_with("e") && !ends_with("ee"))
+            word.pop_back(); // create/created -> creat, price/priced -> pric
+
+        // shipp -> ship, bill stays bill
+        if (word.size() > 3 && word.back() == word[word.size() - 2] && !strchr("lsz", word.back()))
+            word.pop_back();
+        return word;
+    }
+
+    /**
+     * Lowercase stemmed words of a text. Splits on punctuation, underscores and camelCase
+     * ("orderItems placed_by Customers" -> order, item, plac, by, customer)
+     */
+    std::vector<std::string> text_words(const std::string &text)
+    {
+        std::vector<std::string> words;
+        std::string word;
+        for (size_t i = 0; i <= text.size(); i++)
+        {
+            char c = i < text.size() ? text[i] : ' ';
+            bool camel_break = isupper((unsigned char)c) && i > 0 && islower((unsigned char)text[i - 1]);
+            if (isalnum((unsigned char)c) && !camel_break)
+            {
+                word += (char)tolower((unsigned char)c);
+                continue;
+            }
+            if (word.size() >= 2)
+                words.push_back(stem_word(word));
+            word.clear();
+            if (camel_break)
+                word += (char)tolower((unsigned char)c);
+        }
+        return words;
+    }
+
+    /**
+     * Integer tool parameter sent either as a JSON number or a numeric string
+     */
+    static int tool_int_param(const nlohmann::json &params, const char *name, int default_value)
+    {
+        if (!params.contains(name))
+            return default_value;
+        if (params[name].is_number())
+            return params[name].get<int>();
+        if (params[name].is_string() && !params[name].get<std::string>().empty())
+            return atoi(params[name].get<std::string>().c_str());
+        return default_value;
+    }
+
+    /**
+     * Per-backend BM25 index over the catalog: one document per table, view or root
+     * partitioned table, built from its schema, name, columns, comments and any
+     * 'table'/'column' memories. Relcache invalidations mark single relations for
+     * reload (COMMENT ON sends one through the ai_toolkit_comment_changed event trigger);
+     * memory changes re-attach memory text. Postings are rebuilt in memory only after
+     * a document actually changed, so searches never touch the catalog and stats
+     * updates or temp tables cost a single lookup.
+     */
+    struct CatalogDocument
+    {
+        Oid oid;
+        std::string schema;
+        std::string table;
+        std::map<std::string, float> catalog_terms; // term -> weighted frequency
+        std::map<std::string, float> memory_terms;
+    };
+
+    struct CatalogIndex
+    {
+        bool full_reload = true;
+        bool memory_stale = true;
+        bool postings_stale = true;
+        std::set<Oid> dirty;
+        std::map<Oid, CatalogDocument> documents;
+        std::map<std::string, std::vector<std::string>> synonyms; // from memory category 'synonym'
+
+        std::vector<const CatalogDocument *> by_id;
+        std::vector<float> length;
+        float average_length = 0;
+        std::unordered_map<std::string, std::vector<std::pair<int, float>>> postings;
+    };
+
+    static CatalogIndex catalog_index;
+
+    static void catalog_index_relcache_callback(Datum arg, Oid relid)
+    {
+        if (relid == InvalidOid)
+            catalog_index.full_reload = true;
+        else
+            catalog_index.dirty.insert(relid);
+    }
+
+    /**
+     * Memory text changed in this session; re-attach memories on the next search
+     */
+    void catalog_index_memory_changed()
+    {
+        catalog_index.memory_stale = true;
+    }
+
+    // Small built-in synonym groups for common business vocabulary
+    static const std::vector<std::vector<std::string>> builtin_synonyms = {
+        {"customer", "client", "user", "account", "buyer"},
+        {"order", "purchase", "sale", "transaction"},
+        {"product", "item", "sku", "article", "good"},
+        {"price", "cost", "amount", "total", "fee"},
+        {"employee", "staff", "worker", "personnel"},
+        {"vendor", "supplier", "seller", "merchant"},
+        {"payment", "charge", "invoice", "billing"},
+        {"address", "location", "shipping"},
+        {"discount", "coupon", "promotion", "voucher"},
+        {"category", "type", "kind", "class"},
+        {"revenue", "income", "earning"},
+        {"stock", "inventory", "quantity"},
+        {"create", "add", "insert", "register"},
+    };
+
+    static void catalog_add_terms(std::map<std::string, float> &terms, const std::string &text, float weight)
+    {
+        for (const auto &word : text_words(text))
+            terms[word] += weight;
+    }
+
+    static void catalog_index_load_memories(const std::set<Oid> &relids);
+
+    /**
+     * Load or reload documents; relids empty means every relation. SPI must be connected.
+     * A partial reload attaches memories to the reloaded documents only and marks the
+     * postings stale only if one of them was added, removed or changed.
+     */
+    static void catalog_index_load(const std::set<Oid> &relids)
+    {
+        std::string sql =
+            "SELECT c.oid, n.nspname, c.relname, coalesce(obj_description(c.oid, 'pg_class'), ''), "
+            "       coalesce((SELECT string_agg(a.attname, ' ' ORDER BY a.attnum) FROM pg_attribute a "
+            "                 WHERE a.attrelid = c.oid AND a.attnum > 0 AND NOT a.attisdropped), ''), "
+            "       coalesce((SELECT string_agg(d.description, ' ') FROM pg_description d "
+            "                 WHERE d.classoid = 'pg_class'::regclass AND d.objoid = c.oid AND d.objsubid > 0), '') "
+            "FROM pg_class c JOIN pg_namespace n ON n.oid = c.relnamespace "
+            "WHERE c.relkind IN ('r', 'p', 'v', 'm', 'f') AND NOT c.relispartition "
+            "AND n.nspname NOT IN ('pg_catalog', 'information_schema') "
+            "AND n.nspname NOT LIKE 'pg_toast%' AND n.nspname NOT LIKE 'pg_temp%'";
+
+        std::string oid_array;
+        std::map<Oid, CatalogDocument> previous;
+        if (!relids.empty())
+        {
+            for (Oid relid : relids)
+            {
+                oid_array += oid_array.empty() ? "{" : ",";
+                oid_array += std::to_string(relid);
+                auto it = catalog_index.documents.find(relid);
+                if (it != catalog_index.documents.end())
+                {
+                    previous[relid] = std::move(it->second);
+                    catalog_index.documents.erase(it);
+                }
+            }
+            oid_array += "}";
+            sql += " AND c.oid = ANY($1::oid[])";
+        }
+        else
+            catalog_index.documents.clear();
+
+        Datum values[1];
+        char nulls[1] = {' '};
+        Oid argtypes[1] = {TEXTOID};
+        int ret;
+        if (relids.empty())
+            ret = SPI_execute(sql.c_str(), true, 0);
+        else
+        {
+            values[0] = CStringGetTextDatum(oid_array.c_str());
+            ret = SPI_execute_with_args(sql.c_str(), 1, argtypes, values, nulls, true, 0);
+        }
+
+        if (ret != SPI_OK_SELECT)
+        {
+            elog(WARNING, "[catalog_index_load] Failed to read the catalog");
+            return;
+        }
+
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+            bool isnull;
+
+            CatalogDocument doc;
+            doc.oid = DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+            doc.schema = SPI_getvalue(tuple, tupdesc, 2);
+            doc.table = SPI_getvalue(tuple, tupdesc, 3);
+
+            // Names weigh most: table name x3, column names x2, schema and comments x1
+            catalog_add_terms(doc.catalog_terms, doc.table, 3);
+            catalog_add_terms(doc.catalog_terms, doc.schema, 1);
+            catalog_add_terms(doc.catalog_terms, SPI_getvalue(tuple, tupdesc, 4), 1);
+            catalog_add_terms(doc.catalog_terms, SPI_getvalue(tuple, tupdesc, 5), 2);
+            catalog_add_terms(doc.catalog_terms, SPI_getvalue(tuple, tupdesc, 6), 1);
+
+            catalog_index.documents[doc.oid] = std::move(doc);
+        }
+
+        if (relids.empty())
+        {
+            catalog_index.memory_stale = true;
+            return;
+        }
+
+        catalog_index_load_memories(relids);
+        for (Oid relid : relids)
+        {
+            auto before = previous.find(relid);
+            auto after = catalog_index.documents.find(relid);
+            bool had = before != previous.end(), has = after != catalog_index.documents.end();
+            if (had != has ||
+                (has && (before->second.schema != after->second.schema || before->second.table != after->second.table ||
+                         before->second.catalog_terms != after->second.catalog_terms ||
+                         before->second.memory_terms != after->second.memory_terms)))
+            {
+                catalog_index.postings_stale = true;
+                break;
+            }
+        }
+    }
+
+    /**
+     * Attach 'table' and 'column' memories to their documents and load 'synonym' memories
+     * (key: a word, value: comma-separated synonyms). relids limits this to the memories
+     * of those documents; empty means all documents and the synonyms.
+     */
+    static void catalog_index_load_memories(const std::set<Oid> &relids)
+    {
+        if (relids.empty())
+            catalog_index.synonyms.clear();
+
+        std::map<std::string, std::vector<CatalogDocument *>> by_qualified, by_table;
+        for (auto &[oid, doc] : catalog_index.documents)
+        {
+            if (!relids.empty() && !relids.count(oid))
+                continue;
+            doc.memory_terms.clear();
+            std::string schema = doc.schema, table = doc.table;
+            std::transform(schema.begin(), schema.end(), schema.begin(), ::tolower);
+            std::transform(table.begin(), table.end(), table.begin(), ::tolower);
+            by_qualified[schema + "." + table].push_back(&doc);
+            by_table[table].push_back(&doc);
+        }
+
+        if (by_table.empty() && !relids.empty())
+            return;
+
+        int ret = SPI_execute(relids.empty() ? "SELECT category, lower(key), value, coalesce(notes, '') FROM ai_toolkit.ai_memory "
+                                               "WHERE category IN ('table', 'column', 'synonym')"
+                                             : "SELECT category, lower(key), value, coalesce(notes, '') FROM ai_toolkit.ai_memory "
+                                               "WHERE category IN ('table', 'column')",
+                              true, 0);
+        if (ret != SPI_OK_SELECT)
+        {
+            elog(WARNING, "[catalog_index_load_memories] Failed to read memories");
+            return;
+        }
+
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+            std::string category = SPI_getvalue(tuple, tupdesc, 1);
+            std::string key = SPI_getvalue(tuple, tupdesc, 2);
+            char *value = SPI_getvalue(tuple, tupdesc, 3);
+            char *notes = SPI_getvalue(tuple, tupdesc, 4);
+            if (!value)
+                continue;
+
+            if (category == "synonym")
+            {
+                std::vector<std::string> words = text_words(key);
+                if (words.size() != 1)
+                    continue;
+                std::stringstream list(value);
+                for (std::string synonym; std::getline(list, synonym, ',');)
+                {
+                    for (const auto &word : text_words(synonym))
+                    {
+                        catalog_index.synonyms[words[0]].push_back(word);
+                        catalog_index.synonyms[word].push_back(words[0]);
+                    }
+                }
+                continue;
+            }
+
+            // schema.table[.column] first, else table[.column] in any schema
+            size_t first_dot = key.find('.');
+            size_t second_dot = first_dot == std::string::npos ? std::string::npos : key.find('.', first_dot + 1);
+            std::vector<CatalogDocument *> *targets = nullptr;
+            if (first_dot != std::string::npos)
+            {
+                auto it = by_qualified.find(key.substr(0, second_dot));
+                if (it != by_qualified.end())
+                    targets = &it->second;
+            }
+            if (!targets)
+            {
+                auto it = by_table.find(key.substr(0, first_dot));
+                if (it != by_table.end())
+                    targets = &it->second;
+            }
+            if (!targets)
+                continue;
+
+            for (CatalogDocument *doc : *targets)
+            {
+                catalog_add_terms(doc->memory_terms, value, 1);
+                catalog_add_terms(doc->memory_terms, notes ? notes : "", 1);
+            }
+        }
+    }
+
+    /**
+     * Bring the index up to date with pending invalidations. SPI must be connected.
+     */
+    static void catalog_index_refresh()
+    {
+        if (catalog_index.full_reload)
+        {
+            catalog_index.full_reload = false;
+            catalog_index.dirty.clear();
+            catalog_index_load({});
+        }
+        else if (!catalog_index.dirty.empty())
+        {
+            std::set<Oid> dirty;
+            dirty.swap(catalog_index.dirty);
+            catalog_index_load(dirty);
+        }
+
+        if (catalog_index.memory_stale)
+        {
+            catalog_index.memory_stale = false;
+            catalog_index_load_memories({});
+            catalog_index.postings_stale = true;
+        }
+
+        if (!catalog_index.postings_stale)
+            return;
+
+        catalog_index.postings_stale = false;
+        catalog_index.by_id.clear();
+        catalog_index.length.clear();
+        catalog_index.postings.clear();
+
+        double total_length = 0;
+        for (const auto &[oid, doc] : catalog_index.documents)
+        {
+            int id = (int)catalog_index.by_id.size();
+            std::map<std::string, float> terms = doc.catalog_terms;
+            for (const auto &[term, tf] : doc.memory_terms)
+                terms[term] += tf;
+
+            float length = 0;
+            for (const auto &[term, tf] : terms)
+            {
+                catalog_index.postings[term].emplace_back(id, tf);
+                length += tf;
+            }
+            catalog_index.by_id.push_back(&doc);
+            catalog_index.length.push_back(length);
+            total_length += length;
+        }
+        catalog_index.average_length = catalog_index.by_id.empty() ? 1 : (float)(total_length / catalog_index.by_id.size());
+
+        elog(LOG, "[catalog_index_refresh] Indexed %zu relations, %zu terms",
+             catalog_index.by_id.size(), catalog_index.postings.size());
+    }
+
+    struct CatalogMatch
+    {
+        Oid oid;
+        std::string name; // schema.table
+        double score;
+        std::vector<std::string> terms;
+    };
+
+    /**
+     * BM25 search of the catalog index. Question words expand to synonyms at half weight.
+     * Only relations the current role can SELECT from are returned. SPI must be connected.
+     * k <= 0 returns every match.
+     */
+    std::vector<CatalogMatch> catalog_index_search(const std::string &question, int k, const std::string &schema = "")
+    {
+        catalog_index_refresh();
+
+        // Query terms with weights: the words themselves, then synonyms not already present
+        std::map<std::string, double> query_terms;
+        for (const auto &word : text_words(question))
+            query_terms[word] = 1.0;
+        std::map<std::string, double> expanded = query_terms;
+        for (const auto &[word, weight] : query_terms)
+        {
+            std::vector<std::string> synonyms;
+            for (const auto &group : builtin_synonyms)
+            {
+                std::vector<std::string> stemmed;
+                for (const auto &s : group)
+                    stemmed.push_back(stem_word(s));
+                if (std::find(stemmed.begin(), stemmed.end(), word) != stemmed.end())
+                    synonyms.insert(synonyms.end(), stemmed.begin(), stemmed.end());
+            }
+            auto custom = catalog_index.synonyms.find(word);
+            if (custom != catalog_index.synonyms.end())
+                synonyms.insert(synonyms.end(), custom->second.begin(), custom->second.end());
+
+            for (const auto &synonym : synonyms)
+            {
+                if (!expanded.count(synonym))
+                    expanded[synonym] = 0.5;
+            }
+        }
+
+        const double k1 = 1.2, b = 0.75;
+        double documents = (double)catalog_index.by_id.size();
+        std::unordered_map<int, double> scores;
+        std::unordered_map<int, std::vector<std::string>> matched;
+
+        for (const auto &[term, weight] : expanded)
+        {
+            auto it = catalog_index.postings.find(term);
+            if (it == catalog_index.postings.end())
+                continue;
+
+            double df = (double)it->second.size();
+            double idf = std::log(1 + (documents - df + 0.5) / (df + 0.5));
+            for (const auto &[id, tf] : it->second)
+            {
+                double norm = 1 - b + b * catalog_index.length[id] / catalog_index.average_length;
+                scores[id] += weight * idf * tf * (k1 + 1) / (tf + k1 * norm);
+                matched[id].push_back(term);
+            }
+        }
+
+        std::vector<std::pair<double, int>> ranked;
+        for (const auto &[id, score] : scores)
+        {
+            if (schema.empty() || catalog_index.by_id[id]->schema == schema)
+                ranked.emplace_back(score, id);
+        }
+        std::sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b)
+                  { return a.first > b.first || (a.first == b.first && a.second < b.second); });
+
+        std::vector<CatalogMatch> results;
+        for (const auto &[score, id] : ranked)
+        {
+            if (k > 0 && (int)results.size() >= k)
+                break;
+
+            const CatalogDocument *doc = catalog_index.by_id[id];
+            bool is_missing = false;
+            if (pg_class_aclcheck_ext(doc->oid, GetUserId(), ACL_SELECT, &is_missing) != ACLCHECK_OK)
+                continue;
+            results.push_back({doc->oid, doc->schema + "." + doc->table, score, matched[id]});
+        }
+
+        stat_add("catalog_index.searches", 1);
+        return results;
+    }
+
+    /**
+     * Tool function for AI to set memory
+     */
+    nlohmann::json tool_set_memory(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    {
+        try
+        {
+            if (!params.contains("category") || !params.contains("key") || !params.contains("value"))
+            {
+                return nlohmann::json{{"success", false}, {"error", "Missing required parameters: category, key, value"}};
+            }
+
+            std::string category = params["category"].get<std::string>();
+            std::string key = params["key"].get<std::string>();
+            std::string value = params["value"].get<std::string>();
+            std::optional<std::string> notes = std::nullopt;
+
+            if (params.contains("notes") && !params["notes"].is_null())
+            {
+                notes = params["notes"].get<std::string>();
+            }
+
+            std::string error_msg;
+            bool success = memory_set_core(category, key, value, notes, &error_msg, false);
+
+            if (success)
+            {
+                catalog_index_memory_changed();
+                return nlohmann::json{{"success", true}, {"message", "Memory saved successfully"}, {"category", category}, {"key", key}};
+            }
+            else
+            {
+                return nlohmann::json{{"success", false}, {"error", error_msg}};
+            }
+        }
+        catch (const std::exception &e)
+        {
+            return nlohmann::json{{"success", false}, {"error", std::string(e.what())}};
+        }
+    }
+
+    /**
+     * Tool function for AI to get memory
+     */
+    nlohmann::json tool_get_memory(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    {
+        try
+        {
+            if (!params.contains("category") || !params.contains("key"))
+            {
+                return nlohmann::json{{"success", false}, {"error", "Missing required parameters: category, key"}};
+            }
+
+            std::string category = params["category"].get<std::string>();
+            std::string key = params["key"].get<std::string>();
+
+            std::string error_msg;
+            auto result = memory_get_core(category, key, &error_msg, false);
+
+            if (result.has_value())
+            {
+                return nlohmann::json{{"success", true}, {"value", result.value()}, {"category", category}, {"key", key}};
+            }
+            else
+            {
+                return nlohmann::json{{"success", false}, {"error", "Memory not found"}, {"category", category}, {"key", key}};
+            }
+        }
+        catch (const std::exception &e)
+        {
+            return nlohmann::json{{"success", false}, {"error", std::string(e.what())}};
+        }
+    }
+
+    /**
+     * Tool function: List all schemas in the PostgreSQL database
+     */
+    nlohmann::json tool_list_schemas(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    {
+        // Check SPI connection state
+        if (SPI_connect() == SPI_ERROR_CONNECT)
+        {
+            // SPI already connected (expected in tool context) - not an error
+        }
+        else
+        {
+            SPI_finish();
+        }
+
+        const char *sql = "SELECT schema_name FROM information_schema.schemata "
+                          "WHERE schema_name NOT IN ('pg_catalog', 'information_schema', 'pg_toast', 'pg_toast_temp_1') "
+                          "ORDER BY schema_name";
+
+        int ret = SPI_execute(sql, true, 0);
+
+        if (ret != SPI_OK_SELECT)
+        {
+            elog(WARNING, "[tool_list_schemas] Query failed with code: %d", ret);
+            nlohmann::json error_result;
+            error_result["success"] = false;
+            error_result["error"] = "Failed to query schemas";
+            return error_result;
+        }
+
+        uint64 row_count = SPI_processed;
+
+        // Use vector first, then convert to json at the end
+        std::vector<std::string> schema_list;
+        schema_list.reserve(row_count);
+
+        for (uint64 i = 0; i < row_count; i++)
+        {
+            bool isnull = false;
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+
+            Datum schema_datum = SPI_getbinval(tuple, tupdesc, 1, &isnull);
+
+            if (isnull)
+            {
+                elog(WARNING, "[tool_list_schemas] Skipping NULL schema name at row %lu", (unsigned long)i);
+                continue;
+            }
+
+            // Use SPI_getvalue instead of TextDatumGetCString - it's safer
+            char *schema_name_cstr = SPI_getvalue(tuple, tupdesc, 1);
+
+            if (schema_name_cstr == NULL)
+            {
+                elog(WARNING, "[tool_list_schemas] Failed to get schema name at row %lu", (unsigned long)i);
+                continue;
+            }
+
+            // Create string and immediately free
+            std::string schema_name(schema_name_cstr);
+            pfree(schema_name_cstr);
+
+            if (!schema_name.empty())
+            {
+                schema_list.push_back(schema_name);
+            }
+        }
+
+        // Build JSON response
+        nlohmann::json result;
+        result["success"] = true;
+        result["count"] = schema_list.size();
+        result["schemas"] = schema_list;
+
+        elog(LOG, "[tool_list_schemas] Retrieved %lu schemas", (unsigned long)schema_list.size());
+        return finish_tool_result("list_schemas", result, nlohmann::json{{"schemas", join_names(schema_list)}});
+    }
+
+    /**
+     * Tool function: List tables in a schema, one page at a time.
+     * Partitions and inheritance children are folded into their root table with a count,
+     * names can be filtered with a pattern, and order 'relevance' ranks tables by their
+     * BM25 score against the user's request in the catalog index.
+     */
+    nlohmann::json tool_list_tables_in_schema(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    {
+        if (!params.contains("schema"))
+        {
+            elog(WARNING, "[tool_list_tables_in_schema] Missing schema parameter");
+            return nlohmann::json{{"success", false}, {"error", "Missing required parameter: schema"}};
+        }
+
+        std::string schema = params["schema"].get<std::string>();
+        std::string pattern = params.contains("pattern") && params["pattern"].is_string() ? params["pattern"].get<std::string>() : "";
+        int limit = std::clamp(tool_int_param(params, "limit", 0), 0, 500);
+        int offset = std::max(0, tool_int_param(params, "offset", 0));
+        bool by_relevance = params.contains("order") && params["order"].is_string() &&
+                            params["order"].get<std::string>() == "relevance" && !current_request.question.empty();
+        if (limit == 0)
+            limit = 100;
+
+        // Glob-style patterns (* and ?) become ILIKE; a plain word matches anywhere in the name
+        std::string like;
+        for (char c : pattern)
+        {
+            if (c == '*')
+                like += '%';
+            else if (c == '?')
+                like += '_';
+            else
+            {
+                if (c == '%' || c == '_' || c == '\\')
+                    like += '\\';
+                like += c;
+            }
+        }
+        if (pattern.find_first_of("*?") == std::string::npos)
+            like = "%" + like + "%";
+
+        // Root tables (no parent in pg_inherits) visible to the role, each with its descendant count
+        std::string sql =
+            "WITH RECURSIVE roots AS ( "
+            "  SELECT c.oid, c.relname FROM pg_class c JOIN pg_namespace n ON n.oid = c.relnamespace "
+            "  WHERE n.nspname = $1 AND c.relkind IN ('r', 'p') AND c.relname ILIKE $2 "
+            "  AND NOT EXISTS (SELECT 1 FROM pg_inherits i WHERE i.inhrelid = c.oid) "
+            "  AND has_table_privilege(c.oid, 'SELECT, INSERT, UPDATE, DELETE, TRUNCATE, REFERENCES, TRIGGER') "
+            "), tree(root, relid) AS ( "
+            "  SELECT oid, oid FROM roots "
+            "  UNION ALL SELECT t.root, i.inhrelid FROM tree t JOIN pg_inherits i ON i.inhparent = t.relid "
+            ") "
+            "SELECT r.relname, (SELECT count(*) - 1 FROM tree t WHERE t.root = r.oid) AS partitions, "
+            "count(*) OVER () AS total FROM roots r ORDER BY r.relname";
+        if (!by_relevance)
+            sql += " LIMIT " + std::to_string(limit) + " OFFSET " + std::to_string(offset);
+
+        Datum values[2];
+        char nulls[2] = {' ', ' '};
+        values[0] = CStringGetTextDatum(schema.c_str());
+        values[1] = CStringGetTextDatum(like.c_str());
+        Oid argtypes[2] = {TEXTOID, TEXTOID};
+
+        int ret = SPI_execute_with_args(sql.c_str(), 2, argtypes, values, nulls, true, 0);
+
+        if (ret != SPI_OK_SELECT)
+        {
+            elog(WARNING, "[tool_list_tables_in_schema] Query execution failed with code: %d for schema: %s", ret, schema.c_str());
+            return nlohmann::json{{"success", false}, {"error", "Failed to query tables"}};
+        }
+
+        struct ListedTable
+        {
+            std::string name;
+            int64 partitions;
+            double score;
+        };
+        std::vector<ListedTable> listed;
+        int64 total = 0;
+
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+
+            char *table_cstr = SPI_getvalue(tuple, tupdesc, 1);
+            char *partitions_cstr = SPI_getvalue(tuple, tupdesc, 2);
+            char *total_cstr = SPI_getvalue(tuple, tupdesc, 3);
+
+            if (table_cstr == NULL)
+            {
+                elog(WARNING, "[tool_list_tables_in_schema] Skipping row with NULL table");
+                continue;
+            }
+
+            ListedTable table{table_cstr, partitions_cstr ? atoll(partitions_cstr) : 0, 0};
+            total = total_cstr ? atoll(total_cstr) : total;
+
+            listed.push_back(table);
+            pfree(table_cstr);
+        }
+
+        if (by_relevance)
+        {
+            std::map<std::string, double> scores;
+            for (const auto &match : catalog_index_search(current_request.question, 0, schema))
+                scores[match.name.substr(schema.size() + 1)] = match.score;
+            for (auto &table : listed)
+                table.score = scores.count(table.name) ? scores[table.name] : 0;
+
+            std::stable_sort(listed.begin(), listed.end(), [](const ListedTable &a, const ListedTable &b)
+                             { return a.score > b.score; });
+            if ((size_t)offset < listed.size())
+                listed.erase(listed.begin(), listed.begin() + offset);
+            else
+                listed.clear();
+            if (listed.size() > (size_t)limit)
+                listed.resize(limit);
+        }
+
+        nlohmann::json tables = nlohmann::json::array();
+        nlohmann::json partitions = nlohmann::json::object();
+        std::vector<std::string> table_names;
+        std::string compact_partitions;
+
+        for (const auto &table : listed)
+        {
+            tables.push_back(schema + "." + table.name);
+            table_names.push_back(table.name);
+            if (table.partitions > 0)
+            {
+                partitions[table.name] = table.partitions;
+                compact_partitions += (compact_partitions.empty() ? "" : ",") + table.name + ":" + std::to_string(table.partitions);
+            }
+        }
+
+        elog(LOG, "[tool_list_tables_in_schema] Retrieved %lu of %ld tables from schema '%s'", (unsigned long)tables.size(), (long)total, schema.c_str());
+
+        nlohmann::json verbose = {{"success", true}, {"schema", schema}, {"tables", tables}, {"count", tables.size()}, {"total", total}};
+        nlohmann::json compact = {{"schema", schema}, {"tables", join_names(table_names)}};
+        if (!partitions.empty())
+        {
+            verbose["partition_counts"] = partitions;
+            compact["partitions"] = compact_partitions;
+        }
+        if (offset + (int64)tables.size() < total)
+        {
+            verbose["next_offset"] = offset + tables.size();
+            compact["more"] = std::to_string(total - offset - tables.size()) + " more, next offset " + std::to_string(offset + tables.size());
+        }
+        return finish_tool_result("list_tables_in_schema", verbose, compact);
+    }
+
+    /**
+     * Tool function: rank tables by BM25 relevance to a question using the catalog index
+     */
+    nlohmann::json tool_find_relevant_tables(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    {
+        std::string question = params.contains("question") && params["question"].is_string() ? params["question"].get<std::string>() : "";
+        if (question.empty())
+            question = current_request.question;
+        if (question.empty())
+        {
+            elog(WARNING, "[tool_find_relevant_tables] Missing question parameter");
+            return nlohmann::json{{"success", false}, {"error", "Missing required parameter: question"}};
+        }
+        int k = std::clamp(tool_int_param(params, "k", 10), 1, 50);
+
+        std::vector<CatalogMatch> matches = catalog_index_search(question, k);
+
+        nlohmann::json tables = nlohmann::json::array();
+        std::vector<std::string> names;
+        for (const auto &match : matches)
+        {
+            tables.push_back({{"table", match.name}, {"score", std::round(match.score * 100) / 100}, {"matched", join_names(match.terms)}});
+            names.push_back(match.name);
+        }
+
+        elog(LOG, "[tool_find_relevant_tables] Found %zu relevant tables", matches.size());
+        return finish_tool_result("find_relevant_tables",
+                                  nlohmann::json{{"success", true}, {"tables", tables}, {"count", tables.size()}},
+                                  nlohmann::json{{"tables", join_names(names)}});
+    }
+
+    /**
+     * Tool function: Get the CREATE TABLE statement (schema) for a specific table
+     */
+    nlohmann::json tool_get_schema_for_table(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    {
+        if (!params.contains("table_name"))
+        {
+            elog(WARNING, "[tool_get_schema_for_table] Missing table_name parameter");
+            return nlohmann::json{{"success", false}, {"error", "Missing required parameter: table_name"}};
+        }
+
+        std::string table_name = params["table_name"].get<std::string>();
+        std::string schema_name = "public";
+
+        // Parse schema.table if provided
+        size_t dot_pos = table_name.find('.');
+        if (dot_pos != std::string::npos)
+        {
+            schema_name = table_name.substr(0, dot_pos);
+            table_name = table_name.substr(dot_pos + 1);
+        }
+
+        std::string columns_sql =
+            "SELECT column_name, data_type, character_maximum_length, "
+            "is_nullable, column_default, udt_name "
+            "FROM information_schema.columns "
+            "WHERE table_schema = $1 AND table_name = $2 "
+            "ORDER BY ordinal_position";
+
+        Datum values[2];
+        char nulls[2] = {' ', ' '};
+        values[0] = CStringGetTextDatum(schema_name.c_str());
+        values[1] = CStringGetTextDatum(table_name.c_str());
+        Oid argtypes[2] = {TEXTOID, TEXTOID};
+
+        int ret = SPI_execute_with_args(columns_sql.c_str(), 2, argtypes, values, nulls, true, 0);
+
+        if (ret != SPI_OK_SELECT || SPI_processed == 0)
+        {
+            elog(WARNING, "[tool_get_schema_for_table] Table '%s.%s' not found or no columns", schema_name.c_str(), table_name.c_str());
+            return nlohmann::json{{"success", false}, {"error", "Table not found or no columns"}};
+        }
+
+        std::stringstream create_sql;
+        create_sql << "CREATE TABLE " << schema_name << "." << table_name << " (\n";
+
+        nlohmann::json columns = nlohmann::json::array();
+
+        // Compact form: one terse DDL line using the short udt names (int4, varchar, timestamptz)
+        std::string compact_ddl = schema_name + "." + table_name + "(";
+        std::vector<std::string> elided_columns;
+        int compact_columns = 0;
+
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            bool isnull;
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+
+            // Get all column attributes
+            Datum col_name_datum = SPI_getbinval(tuple, tupdesc, 1, &isnull);
+            if (isnull)
+                continue;
+
+            Datum col_type_datum = SPI_getbinval(tuple, tupdesc, 2, &isnull);
+            if (isnull)
+                continue;
+
+            Datum col_maxlen_datum = SPI_getbinval(tuple, tupdesc, 3, &isnull);
+            bool maxlen_isnull = isnull;
+
+            Datum col_nullable_datum = SPI_getbinval(tuple, tupdesc, 4, &isnull);
+            if (isnull)
+                continue;
+
+            Datum col_default_datum = SPI_getbinval(tuple, tupdesc, 5, &isnull);
+            bool default_isnull = isnull;
+
+            // Properly handle memory
+            char *col_name_cstr = SPI_getvalue(tuple, tupdesc, 1);
+            char *col_type_cstr = SPI_getvalue(tuple, tupdesc, 2);
+            char *col_nullable_cstr = SPI_getvalue(tuple, tupdesc, 4);
+
+            if (!col_name_cstr || !col_type_cstr || !col_nullable_cstr)
+            {
+                elog(WARNING, "[tool_get_schema_for_table] Failed to retrieve column information");
+                if (col_name_cstr)
+                    pfree(col_name_cstr);
+                if (col_type_cstr)
+                    pfree(col_type_cstr);
+                if (col_nullable_cstr)
+                    pfree(col_nullable_cstr);
+                continue;
+            }
+
+            // Copy to std::string
+            std::string col_name(col_name_cstr);
+            std::string col_type(col_type_cstr);
+            std::string col_nullable(col_nullable_cstr);
+
+            // Free immediately after copying
+            pfree(col_name_cstr);
+            pfree(col_type_cstr);
+            pfree(col_nullable_cstr);
+
+            nlohmann::json col_info;
+            col_info["name"] = col_name;
+            col_info["type"] = col_type;
+            col_info["nullable"] = (col_nullable == "YES");
+
+            std::string compact_col;
+            bool elide = compact_max_columns > 0 && compact_columns >= compact_max_columns;
+            if (elide)
+            {
+                elided_columns.push_back(col_name);
+            }
+            else
+            {
+                char *udt_cstr = SPI_getvalue(tuple, tupdesc, 6);
+                std::string udt = udt_cstr ? std::string(udt_cstr) : col_type;
+                if (udt_cstr)
+                    pfree(udt_cstr);
+                if (!udt.empty() && udt[0] == '_')
+                    udt = udt.substr(1) + "[]";
+
+                compact_col = col_name + " " + udt;
+                if (!maxlen_isnull && col_type == "character varying")
+                    compact_col += "(" + std::to_string(DatumGetInt32(col_maxlen_datum)) + ")";
+                if (col_nullable == "NO")
+                    compact_col += " NN";
+                compact_columns++;
+            }
+
+            create_sql << "  " << col_name << " " << col_type;
+
+            if (!maxlen_isnull && col_type == "character varying")
+            {
+                int maxlen = DatumGetInt32(col_maxlen_datum);
+                create_sql << "(" << maxlen << ")";
+            }
+
+            if (col_nullable == "NO")
+            {
+                create_sql << " NOT NULL";
+            }
+
+            if (!default_isnull)
+            {
+                char *col_default_cstr = SPI_getvalue(tuple, tupdesc, 5);
+                if (col_default_cstr)
+                {
+                    std::string col_default(col_default_cstr);
+                    pfree(col_default_cstr);
+
+                    create_sql << " DEFAULT " << col_default;
+                    col_info["default"] = col_default;
+
+                    std::string short_default = compact_default(col_default);
+                    if (!elide && !short_default.empty())
+                        compact_col += " =" + short_default;
+                }
+            }
+
+            if (i < SPI_processed - 1)
+            {
+                create_sql << ",\n";
+            }
+            columns.push_back(col_info);
+
+            if (!elide)
+            {
+                if (compact_columns > 1)
+                    compact_ddl += ", ";
+                compact_ddl += compact_col;
+            }
+        }
+
+        create_sql << "\n);";
+
+        compact_ddl += ")";
+        nlohmann::json compact = {{"ddl", compact_ddl}};
+        if (!elided_columns.empty())
+        {
+            // Huge tables: keep only the names of the remaining columns
+            compact["more_columns"] = join_names(elided_columns);
+        }
+
+        elog(LOG, "[tool_get_schema_for_table] Retrieved schema for '%s.%s' with %lu columns", schema_name.c_str(), table_name.c_str(), (unsigned long)columns.size());
+        return finish_tool_result("get_schema_for_table",
+                                  nlohmann::json{
+                                      {"success", true},
+                                      {"table", schema_name + "." + table_name},
+                                      {"create_statement", create_sql.str()},
+                                      {"columns", columns}},
+                                  compact);
+    }
+
+    /**
+     * Shorten a sample value for tool output
+     */
+    static std::string truncate_value(const std::string &value, size_t max_chars)
+    {
+        if (value.size() <= max_chars)
+            return value;
+        size_t cut = max_chars;
+        while (cut > 0 && (value[cut] & 0xC0) == 0x80) // don't split a UTF-8 sequence
+            cut--;
+        return value.substr(0, cut) + "...";
+    }
+
+    /**
+     * Tool function: planner statistics for columns, read from pg_stats without touching
+     * the table. pg_stats only shows columns the caller may SELECT, so column privileges
+     * are respected; columns that are hidden or never analyzed are reported as unavailable.
+     */
+    nlohmann::json tool_get_column_stats(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    {
+        if (!params.contains("table_name"))
+        {
+            elog(WARNING, "[tool_get_column_stats] Missing table_name parameter");
+            return nlohmann::json{{"success", false}, {"error", "Missing required parameter: table_name"}};
+        }
+
+        std::string table_name = params["table_name"].get<std::string>();
+        std::string schema_name = "public";
+
+        size_t dot_pos = table_name.find('.');
+        if (dot_pos != std::string::npos)
+        {
+            schema_name = table_name.substr(0, dot_pos);
+            table_name = table_name.substr(dot_pos + 1);
+        }
+
+        std::vector<std::string> requested = params.contains("columns") ? tool_result_names(params["columns"])
+                                                                        : std::vector<std::string>();
+        for (auto &column : requested)
+        {
+            column.erase(0, column.find_first_not_of(" \t"));
+            column.erase(column.find_last_not_of(" \t") + 1);
+        }
+        requested.erase(std::remove(requested.begin(), requested.end(), ""), requested.end());
+
+        std::string columns_array = "{";
+        for (size_t i = 0; i < requested.size(); i++)
+        {
+            std::string escaped;
+            for (char c : requested[i])
+            {
+                if (c == '"' || c == '\\')
+                    escaped += '\\';
+                escaped += c;
+            }
+            columns_array += (i > 0 ? ",\"" : "\"") + escaped + "\"";
+        }
+        columns_array += "}";
+
+        // Inherited statistics cover the whole hierarchy, so prefer them for parents
+        std::string stats_sql =
+            "SELECT DISTINCT ON (s.attname) s.attname, s.null_frac, "
+            "       CASE WHEN s.n_distinct >= 0 THEN s.n_distinct "
+            "            ELSE -s.n_distinct * greatest(c.reltuples, 0) END AS n_distinct, "
+            "       to_jsonb(s.most_common_vals::text::text[]), to_jsonb(s.most_common_freqs), "
+            "       to_jsonb(s.histogram_bounds::text::text[]), s.correlation "
+            "FROM pg_stats s "
+            "JOIN pg_namespace n ON n.nspname = s.schemaname "
+            "JOIN pg_class c ON c.relnamespace = n.oid AND c.relname = s.tablename "
+            "WHERE s.schemaname = $1 AND s.tablename = $2 "
+            "AND (cardinality($3::text[]) = 0 OR s.attname = ANY($3::text[])) "
+            "ORDER BY s.attname, s.inherited DESC";
+
+        Datum values[3];
+        char nulls[3] = {' ', ' ', ' '};
+        values[0] = CStringGetTextDatum(schema_name.c_str());
+        values[1] = CStringGetTextDatum(table_name.c_str());
+        values[2] = CStringGetTextDatum(columns_array.c_str());
+        Oid argtypes[3] = {TEXTOID, TEXTOID, TEXTOID};
+
+        int ret = SPI_execute_with_args(stats_sql.c_str(), 3, argtypes, values, nulls, true, 0);
+        if (ret != SPI_OK_SELECT)
+        {
+            elog(WARNING, "[tool_get_column_stats] Failed to read statistics for '%s.%s'", schema_name.c_str(), table_name.c_str());
+            return nlohmann::json{{"success", false}, {"error", "Failed to read column statistics"}};
+        }
+
+        const size_t max_values = 10;
+        const size_t max_value_chars = 60;
+
+        nlohmann::json columns = nlohmann::json::array();
+        std::string compact_stats;
+        std::set<std::string> found;
+
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+
+            char *attname = SPI_getvalue(tuple, tupdesc, 1);
+            if (!attname)
+                continue;
+            found.insert(attname);
+
+            auto number = [&](int col) -> std::optional<double>
+            {
+                char *text = SPI_getvalue(tuple, tupdesc, col);
+                if (!text)
+                    return std::nullopt;
+                double value = atof(text);
+                pfree(text);
+                return value;
+            };
+            auto array = [&](int col) -> nlohmann::json
+            {
+                char *text = SPI_getvalue(tuple, tupdesc, col);
+                if (!text)
+                    return nlohmann::json::array();
+                nlohmann::json parsed = nlohmann::json::parse(text, nullptr, false);
+                pfree(text);
+                return parsed.is_array() ? parsed : nlohmann::json::array();
+            };
+
+            double null_frac = number(2).value_or(0);
+            double n_distinct = std::round(number(3).value_or(0));
+            nlohmann::json mcv = array(4);
+            nlohmann::json mcf = array(5);
+            nlohmann::json histogram = array(6);
+            std::optional<double> correlation = number(7);
+
+            nlohmann::json column = {
+                {"column", attname},
+                {"null_frac", std::round(null_frac * 1000) / 1000},
+                {"n_distinct", n_distinct}};
+
+            // Most common values with their frequencies: the literals worth filtering on
+            nlohmann::json common = nlohmann::json::array();
+            std::string compact_common;
+            for (size_t v = 0; v < mcv.size() && v < max_values; v++)
+            {
+                std::string value = mcv[v].is_string() ? mcv[v].get<std::string>() : mcv[v].dump();
+                value = truncate_value(value, max_value_chars);
+                double freq = v < mcf.size() && mcf[v].is_number() ? mcf[v].get<double>() : 0;
+                common.push_back({{"value", value}, {"freq", std::round(freq * 1000) / 1000}});
+
+                char freq_text[16];
+                snprintf(freq_text, sizeof(freq_text), "%.2f", freq);
+                compact_common += (v > 0 ? "," : "") + value + "(" + freq_text + ")";
+            }
+            if (mcv.size() > max_values)
+                compact_common += ",...";
+            if (!common.empty())
+                column["most_common_values"] = common;
+
+            // Histogram: keep the bounds plus evenly spaced quantiles in between
+            nlohmann::json bounds = nlohmann::json::array();
+            if (!histogram.empty())
+            {
+                size_t stride = std::max<size_t>(1, (histogram.size() + max_values - 2) / (max_values - 1));
+                for (size_t h = 0; h < histogram.size(); h += stride)
+                    bounds.push_back(truncate_value(histogram[h].get<std::string>(), max_value_chars));
+                if ((histogram.size() - 1) % stride != 0)
+                    bounds.push_back(truncate_value(histogram.back().get<std::string>(), max_value_chars));
+                column["histogram_bounds"] = bounds;
+            }
+            if (correlation)
+                column["correlation"] = std::round(*correlation * 100) / 100;
+
+            columns.push_back(column);
+
+            if (!compact_stats.empty())
+                compact_stats += "; ";
+            char header[64];
+            snprintf(header, sizeof(header), " nd=%.0f null=%.2f", n_distinct, null_frac);
+            compact_stats += std::string(attname) + header;
+            if (!compact_common.empty())
+                compact_stats += " mcv=" + compact_common;
+            if (!bounds.empty())
+                compact_stats += " range=" + bounds.front().get<std::string>() + ".." + bounds.back().get<std::string>();
+
+            pfree(attname);
+        }
+
+        std::vector<std::string> unavailable;
+        for (const auto &column : requested)
+        {
+            if (!found.count(column))
+                unavailable.push_back(column);
+        }
+
+        if (columns.empty() && requested.empty())
+        {
+            elog(LOG, "[tool_get_column_stats] No visible statistics for '%s.%s'", schema_name.c_str(), table_name.c_str());
+            return nlohmann::json{{"success", false},
+                                  {"error", "No statistics for " + schema_name + "." + table_name +
+                                                ": the table does not exist, has not been analyzed, or its columns are not readable"}};
+        }
+
+        elog(LOG, "[tool_get_column_stats] Returned statistics for %zu columns of '%s.%s'", columns.size(), schema_name.c_str(), table_name.c_str());
+
+        nlohmann::json verbose = {
+            {"success", true},
+            {"table", schema_name + "." + table_name},
+            {"columns", columns}};
+        nlohmann::json compact = {{"stats", compact_stats}};
+        if (!unavailable.empty())
+        {
+            verbose["unavailable"] = unavailable;
+            verbose["note"] = "Columns without statistics are not analyzed yet or not readable by the current role";
+            compact["unavailable"] = join_names(unavailable);
+        }
+        return finish_tool_result("get_column_stats", verbose, compact);
+    }
+
+    /**
+     * Foreign-key join graph of the current database, built from pg_constraint on first
+     * use and dropped by syscache invalidation whenever a constraint or relation changes.
+     * Nodes are "schema.table"; every FK is an undirected edge carrying its ON clause.
+     */
+    struct JoinEdge
+    {
+        int from;
+        int to;
+        std::string constraint_name;
+        std::string on_clause; // schema.child.col = schema.parent.col [AND ...]
+    };
+
+    struct JoinGraph
+    {
+        bool valid = false;
+        std::vector<std::string> nodes;
+        std::map<std::string, int> node_index;
+        std::vector<JoinEdge> edges;
+        std::vector<std::vector<int>> adjacency; // node -> edge indexes
+        // Shortest-path trees from terminals, kept until the next invalidation
+        std::map<int, std::pair<std::vector<int>, std::vector<int>>> bfs_cache; // node -> (distance, parent edge)
+    };
+
+    static JoinGraph join_graph;
+
+    static void join_graph_invalidate(Datum arg, int cacheid, uint32 hashvalue)
+    {
+        join_graph.valid = false;
+    }
+
+    static int join_graph_node(const std::string &name)
+    {
+        auto it = join_graph.node_index.find(name);
+        if (it != join_graph.node_index.end())
+            return it->second;
+
+        int index = (int)join_graph.nodes.size();
+        join_graph.nodes.push_back(name);
+        join_graph.node_index[name] = index;
+        join_graph.adjacency.emplace_back();
+        return index;
+    }
+
+    /**
+     * (Re)build the join graph if an invalidation dropped it. SPI must be connected.
+     */
+    static void join_graph_load()
+    {
+        if (join_graph.valid)
+            return;
+
+        join_graph = JoinGraph();
+
+        std::string sql =
+            "SELECT c.conname, "
+            "       quote_ident(cn.nspname) || '.' || quote_ident(cr.relname) AS child, "
+            "       quote_ident(pn.nspname) || '.' || quote_ident(pr.relname) AS parent, "
+            "       string_agg(quote_ident(cn.nspname) || '.' || quote_ident(cr.relname) || '.' || quote_ident(ca.attname) || ' = ' || "
+            "                  quote_ident(pn.nspname) || '.' || quote_ident(pr.relname) || '.' || quote_ident(pa.attname), "
+            "                  ' AND ' ORDER BY k.n) AS on_clause "
+            "FROM pg_constraint c "
+            "JOIN pg_class cr ON cr.oid = c.conrelid JOIN pg_namespace cn ON cn.oid = cr.relnamespace "
+            "JOIN pg_class pr ON pr.oid = c.confrelid JOIN pg_namespace pn ON pn.oid = pr.relnamespace "
+            "CROSS JOIN LATERAL unnest(c.conkey, c.confkey) WITH ORDINALITY AS k(child_attnum, parent_attnum, n) "
+            "JOIN pg_attribute ca ON ca.attrelid = c.conrelid AND ca.attnum = k.child_attnum "
+            "JOIN pg_attribute pa ON pa.attrelid = c.confrelid AND pa.attnum = k.parent_attnum "
+            "WHERE c.contype = 'f' AND c.conrelid <> c.confrelid AND c.conparentid = 0 "
+            "AND cn.nspname NOT IN ('pg_catalog', 'information_schema') "
+            "GROUP BY c.oid, c.conname, cn.nspname, cr.relname, pn.nspname, pr.relname "
+            "ORDER BY c.oid";
+
+        int ret = SPI_execute(sql.c_str(), true, 0);
+        if (ret != SPI_OK_SELECT)
+        {
+            elog(WARNING, "[join_graph_load] Failed to read foreign keys");
+            return;
+        }
+
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+            char *conname = SPI_getvalue(tuple, tupdesc, 1);
+            char *child = SPI_getvalue(tuple, tupdesc, 2);
+            char *parent = SPI_getvalue(tuple, tupdesc, 3);
+            char *on_clause = SPI_getvalue(tuple, tupdesc, 4);
+            if (!conname || !child || !parent || !on_clause)
+                continue;
+
+            JoinEdge edge{join_graph_node(child), join_graph_node(parent), conname, on_clause};
+            join_graph.adjacency[edge.from].push_back((int)join_graph.edges.size());
+            join_graph.adjacency[edge.to].push_back((int)join_graph.edges.size());
+            join_graph.edges.push_back(edge);
+        }
+
+        join_graph.valid = true;
+        elog(LOG, "[join_graph_load] Loaded %zu tables and %zu foreign keys",
+             join_graph.nodes.size(), join_graph.edges.size());
+    }
+
+    /**
+     * Shortest-path tree (unit edge weights) rooted at a node, cached per graph version
+     */
+    static const std::pair<std::vector<int>, std::vector<int>> &join_graph_bfs(int root)
+    {
+        auto it = join_graph.bfs_cache.find(root);
+        if (it != join_graph.bfs_cache.end())
+            return it->second;
+
+        size_t n = join_graph.nodes.size();
+        std::vector<int> distance(n, -1);
+        std::vector<int> parent_edge(n, -1);
+        std::deque<int> queue = {root};
+        distance[root] = 0;
+
+        while (!queue.empty())
+        {
+            int node = queue.front();
+            queue.pop_front();
+            for (int e : join_graph.adjacency[node])
+            {
+                const JoinEdge &edge = join_graph.edges[e];
+                int next = edge.from == node ? edge.to : edge.from;
+                if (distance[next] >= 0)
+                    continue;
+                distance[next] = distance[node] + 1;
+                parent_edge[next] = e;
+                queue.push_back(next);
+            }
+        }
+
+        return join_graph.bfs_cache[root] = {std::move(distance), std::move(parent_edge)};
+    }
+
+    /**
+     * Resolve a table name from the model: "schema.table" as given, or a bare table
+     * name that is unique across schemas (public preferred)
+     * Returns: node index; -1 if no foreign key involves the table, with *ambiguous
+     * set if it names tables in several schemas instead
+     */
+    static int join_graph_resolve(const std::string &name, bool *ambiguous)
+    {
+        *ambiguous = false;
+        std::string lowered = name;
+        std::transform(lowered.begin(), lowered.end(), lowered.begin(), ::tolower);
+        lowered.erase(std::remove(lowered.begin(), lowered.end(), '"'), lowered.end());
+
+        std::vector<int> matches;
+        for (size_t i = 0; i < join_graph.nodes.size(); i++)
+        {
+            std::string node = join_graph.nodes[i];
+            node.erase(std::remove(node.begin(), node.end(), '"'), node.end());
+            std::transform(node.begin(), node.end(), node.begin(), ::tolower);
+
+            if (node == lowered)
+                return (int)i;
+            if (lowered.find('.') == std::string::npos && node.size() > lowered.size() &&
+                node.compare(node.size() - lowered.size() - 1, std::string::npos, "." + lowered) == 0)
+                matches.push_back((int)i);
+        }
+
+        if (matches.size() == 1)
+            return matches[0];
+        for (int m : matches)
+        {
+            if (join_graph.nodes[m].rfind("public.", 0) == 0)
+                return m;
+        }
+
+        *ambiguous = !matches.empty();
+        return -1;
+    }
+
+    /**
+     * Tool function for AI to find how to join a set of tables.
+     * Connects them with an approximate minimum Steiner tree over the FK graph
+     * (repeatedly attach the terminal nearest to the tree by its shortest path)
+     * and returns the joins in an order where each one references an earlier table.
+     */
+    nlohmann::json tool_find_join_path(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    {
+        std::vector<std::string> names = params.contains("tables") ? tool_result_names(params["tables"])
+                                                                   : std::vector<std::string>();
+        for (auto &name : names)
+            name.erase(0, name.find_first_not_of(" \t"));
+
+        if (names.size() < 2)
+        {
+            elog(WARNING, "[tool_find_join_path] Need at least two tables");
+            return nlohmann::json{{"success", false}, {"error", "Provide at least two tables, e.g. tables: 'orders.orders,users.users'"}};
+        }
+
+        join_graph_load();
+
+        // Tables without any foreign key can't be joined via one: report them as unreachable
+        std::vector<int> terminals;
+        std::vector<std::string> unreachable;
+        for (const auto &name : names)
+        {
+            bool ambiguous;
+            int node = join_graph_resolve(name, &ambiguous);
+            if (ambiguous)
+                return nlohmann::json{{"success", false}, {"error", name + " is ambiguous; qualify it with a schema"}};
+            if (node < 0)
+                unreachable.push_back(name);
+            else if (std::find(terminals.begin(), terminals.end(), node) == terminals.end())
+                terminals.push_back(node);
+        }
+
+        if (terminals.empty())
+        {
+            elog(LOG, "[tool_find_join_path] No foreign keys involve any of %zu tables", names.size());
+            nlohmann::json verbose = {{"success", true}, {"tables", nlohmann::json::array()}, {"unreachable", unreachable},
+                                      {"note", "No foreign keys involve these tables; join them on matching columns"}};
+            nlohmann::json compact = {{"unreachable", join_names(unreachable)}};
+            return finish_tool_result("find_join_path", verbose, compact);
+        }
+
+        std::set<int> in_tree = {terminals[0]};
+        std::vector<int> tree_edges;
+        std::vector<int> remaining(terminals.begin() + 1, terminals.end());
+
+        while (!remaining.empty())
+        {
+            // Nearest remaining terminal to any node already in the tree
+            int best_terminal = -1, best_node = -1, best_distance = INT_MAX;
+            for (int t : remaining)
+            {
+                const auto &bfs = join_graph_bfs(t);
+                for (int node : in_tree)
+                {
+                    int d = bfs.first[node];
+                    if (d >= 0 && d < best_distance)
+                    {
+                        best_distance = d;
+                        best_terminal = t;
+                        best_node = node;
+                    }
+                }
+            }
+
+            if (best_terminal < 0)
+            {
+                for (int t : remaining)
+                    unreachable.push_back(join_graph.nodes[t]);
+                break;
+            }
+
+            // Walk from the tree back to the terminal along its shortest-path tree
+            const auto &bfs = join_graph_bfs(best_terminal);
+            for (int node = best_node; node != best_terminal;)
+            {
+                int e = bfs.second[node];
+                const JoinEdge &edge = join_graph.edges[e];
+                int next = edge.from == node ? edge.to : edge.from;
+                if (!in_tree.count(next))
+                {
+                    tree_edges.push_back(e);
+                    in_tree.insert(next);
+                }
+                node = next;
+            }
+            in_tree.insert(best_terminal);
+            remaining.erase(std::find(remaining.begin(), remaining.end(), best_terminal));
+        }
+
+        // Order joins so every ON clause refers to a table joined before it
+        std::vector<std::string> order = {join_graph.nodes[terminals[0]]};
+        std::set<int> placed = {terminals[0]};
+        nlohmann::json joins = nlohmann::json::array();
+        std::string from_clause = "FROM " + join_graph.nodes[terminals[0]];
+
+        for (bool progress = true; progress;)
+        {
+            progress = false;
+            for (int e : tree_edges)
+            {
+                const JoinEdge &edge = join_graph.edges[e];
+                int added = placed.count(edge.from) && !placed.count(edge.to)   ? edge.to
+                            : placed.count(edge.to) && !placed.count(edge.from) ? edge.from
+                                                                                : -1;
+                if (added < 0)
+                    continue;
+
+                placed.insert(added);
+                order.push_back(join_graph.nodes[added]);
+                joins.push_back({{"table", join_graph.nodes[added]}, {"on", edge.on_clause}, {"fk", edge.constraint_name}});
+                from_clause += "\nJOIN " + join_graph.nodes[added] + " ON " + edge.on_clause;
+                progress = true;
+            }
+        }
+
+        std::vector<std::string> intermediate;
+        for (int node : in_tree)
+        {
+            if (std::find(terminals.begin(), terminals.end(), node) == terminals.end())
+                intermediate.push_back(join_graph.nodes[node]);
+        }
+
+        elog(LOG, "[tool_find_join_path] Joined %zu tables with %zu joins", names.size(), tree_edges.size());
+
+        nlohmann::json verbose = {
+            {"success", true},
+            {"tables", order},
+            {"joins", joins},
+            {"from_clause", from_clause}};
+        nlohmann::json compact = {{"from_clause", from_clause}};
+        if (!intermediate.empty())
+        {
+            verbose["intermediate_tables"] = intermediate;
+            compact["via"] = join_names(intermediate);
+        }
+        if (!unreachable.empty())
+        {
+            verbose["unreachable"] = unreachable;
+            compact["unreachable"] = join_names(unreachable);
+        }
+        return finish_tool_result("find_join_path", verbose, compact);
+    }
+
+    static TimeoutId lookup_timeout_id = MAX_TIMEOUTS;
+    static volatile sig_atomic_t lookup_timed_out = false;
+
+    /**
+     * Timeout handler for tool lookups (sample_rows, registered tools): cancel the running
+     * query like statement_timeout does. A cancel that is already pending belongs to the user
+     * or statement_timeout and is left alone, so run_in_subtransaction re-throws it instead
+     * of reporting a lookup timeout.
+     */
+    static void lookup_timeout_handler(void)
+    {
+        if (QueryCancelPending)
+            return;
+        lookup_timed_out = true;
+        QueryCancelPending = true;
+        InterruptPending = true;
+        SetLatch(MyLatch);
+    }
+
+    /**
+     * Run fn inside an internal subtransaction so an ERROR raised by SPI (a bad query,
+     * a permission failure) is caught and rolled back instead of aborting the caller.
+     * Query cancels are re-thrown (the user's Ctrl-C, statement_timeout) unless the
+     * extension's own lookup timer caused them.
+     * rollback: roll the subtransaction back even on success, discarding its side effects
+     * Returns: true on success; false with the error message in *error
+     */
+    bool run_in_subtransaction(const std::function<void()> &fn, std::string *error, bool rollback)
+    {
+        MemoryContext oldcontext = CurrentMemoryContext;
+        ResourceOwner oldowner = CurrentResourceOwner;
+        volatile bool ok = true;
+        std::string cpp_error;
+
+        BeginInternalSubTransaction(NULL);
+        MemoryContextSwitchTo(oldcontext);
+
+        PG_TRY();
+        {
+            try
+            {
+                fn();
+            }
+            catch (const std::exception &e)
+            {
+                cpp_error = e.what();
+            }
+
+            if (cpp_error.empty())
+            {
+                if (rollback)
+                    RollbackAndReleaseCurrentSubTransaction();
+                else
+                    ReleaseCurrentSubTransaction();
+                MemoryContextSwitchTo(oldcontext);
+                CurrentResourceOwner = oldowner;
+            }
+        }
+        PG_CATCH();
+        {
+            MemoryContextSwitchTo(oldcontext);
+            ErrorData *edata = CopyErrorData();
+            FlushErrorState();
+
+            RollbackAndReleaseCurrentSubTransaction();
+            MemoryContextSwitchTo(oldcontext);
+            CurrentResourceOwner = oldowner;
+
+            if (edata->sqlerrcode == ERRCODE_QUERY_CANCELED && !lookup_timed_out)
+                ReThrowError(edata);
+
+            if (error)
+                *error = edata->message ? edata->message : "unknown error";
+            FreeErrorData(edata);
+            ok = false;
+        }
+        PG_END_TRY();
+
+        if (!cpp_error.empty())
+        {
+            RollbackAndReleaseCurrentSubTransaction();
+            MemoryContextSwitchTo(oldcontext);
+            CurrentResourceOwner = oldowner;
+            if (error)
+                *error = cpp_error;
+            return false;
+        }
+
+        return ok;
+    }
+
+    /**
+     * Tool function: a few representative rows of a table at bounded cost.
+     * Large tables are read with TABLESAMPLE SYSTEM sized to ai_toolkit.sample_page_budget pages,
+     * the query is cancelled after ai_toolkit.sample_timeout, wide values are truncated and
+     * columns marked sensitive in memory (category 'permission', value 'sensitive') are masked.
+     */
+    nlohmann::json tool_sample_rows(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    {
+        if (!params.contains("table_name"))
+        {
+            elog(WARNING, "[tool_sample_rows] Missing table_name parameter");
+            return nlohmann::json{{"success", false}, {"error", "Missing required parameter: table_name"}};
+        }
+
+        std::string table_name = params["table_name"].get<std::string>();
+        std::string schema_name = "public";
+
+        size_t dot_pos = table_name.find('.');
+        if (dot_pos != std::string::npos)
+        {
+            schema_name = table_name.substr(0, dot_pos);
+            table_name = table_name.substr(dot_pos + 1);
+        }
+
+        int row_count = 5;
+        if (params.contains("n") && params["n"].is_number())
+            row_count = params["n"].get<int>();
+        else if (params.contains("n") && params["n"].is_string())
+            row_count = atoi(params["n"].get<std::string>().c_str());
+        row_count = std::clamp(row_count, 1, 50);
+
+        // Relation and its size in pages (summed over leaf partitions for partitioned tables)
+        std::string relation_sql =
+            "SELECT c.oid, c.relkind, quote_ident(n.nspname) || '.' || quote_ident(c.relname), "
+            "       CASE WHEN c.relkind = 'p' THEN (SELECT coalesce(sum(p.relpages), 0) FROM pg_partition_tree(c.oid) t "
+            "                                       JOIN pg_class p ON p.oid = t.relid WHERE t.isleaf) "
+            "            ELSE c.relpages END "
+            "FROM pg_class c JOIN pg_namespace n ON n.oid = c.relnamespace "
+            "WHERE n.nspname = $1 AND c.relname = $2 AND c.relkind IN ('r', 'p', 'm', 'v', 'f')";
+
+        Datum values[2];
+        char nulls[2] = {' ', ' '};
+        values[0] = CStringGetTextDatum(schema_name.c_str());
+        values[1] = CStringGetTextDatum(table_name.c_str());
+        Oid argtypes[2] = {TEXTOID, TEXTOID};
+
+        int ret = SPI_execute_with_args(relation_sql.c_str(), 2, argtypes, values, nulls, true, 1);
+        if (ret != SPI_OK_SELECT || SPI_processed == 0)
+        {
+            elog(WARNING, "[tool_sample_rows] Table '%s.%s' not found", schema_name.c_str(), table_name.c_str());
+            return nlohmann::json{{"success", false}, {"error", "Table not found"}};
+        }
+
+        bool isnull;
+        Oid relid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+        char relkind = DatumGetChar(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2, &isnull));
+        std::string qualified = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 3);
+        double pages = atof(SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 4));
+
+        // Columns marked sensitive, keyed schema.table.column or table.column
+        std::set<std::string> sensitive;
+        std::string sensitive_sql =
+            "SELECT lower(key) FROM ai_toolkit.ai_memory "
+            "WHERE category = 'permission' AND lower(value) LIKE 'sensitive%' "
+            "AND (lower(key) LIKE lower($1) || '.' || lower($2) || '.%' OR lower(key) LIKE lower($2) || '.%')";
+        ret = SPI_execute_with_args(sensitive_sql.c_str(), 2, argtypes, values, nulls, true, 0);
+        for (uint64 i = 0; ret == SPI_OK_SELECT && i < SPI_processed; i++)
+        {
+            char *key = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
+            if (key)
+                sensitive.insert(key);
+        }
+
+        // Select only columns the role can read; sensitive ones are never fetched
+        std::string columns_sql =
+            "SELECT attname, quote_ident(attname), has_column_privilege($1, attnum, 'SELECT') "
+            "FROM pg_attribute WHERE attrelid = $1 AND attnum > 0 AND NOT attisdropped ORDER BY attnum";
+        Datum relid_value = ObjectIdGetDatum(relid);
+        Oid relid_type = OIDOID;
+        ret = SPI_execute_with_args(columns_sql.c_str(), 1, &relid_type, &relid_value, nulls, true, 0);
+        if (ret != SPI_OK_SELECT)
+        {
+            elog(WARNING, "[tool_sample_rows] Failed to read columns of '%s'", qualified.c_str());
+            return nlohmann::json{{"success", false}, {"error", "Failed to read table columns"}};
+        }
+
+        std::string lowered_schema = schema_name, lowered_table = table_name;
+        std::transform(lowered_schema.begin(), lowered_schema.end(), lowered_schema.begin(), ::tolower);
+        std::transform(lowered_table.begin(), lowered_table.end(), lowered_table.begin(), ::tolower);
+
+        std::vector<std::string> column_names;
+        std::vector<bool> fetched;
+        std::vector<std::string> masked, unreadable;
+        std::string select_list;
+
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            std::string name = SPI_getvalue(tuple, SPI_tuptable->tupdesc, 1);
+            std::string quoted = SPI_getvalue(tuple, SPI_tuptable->tupdesc, 2);
+            bool readable = DatumGetBool(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 3, &isnull));
+
+            std::string lowered = name;
+            std::transform(lowered.begin(), lowered.end(), lowered.begin(), ::tolower);
+            bool is_sensitive = sensitive.count(lowered_schema + "." + lowered_table + "." + lowered) ||
+                                sensitive.count(lowered_table + "." + lowered);
+
+            column_names.push_back(name);
+            fetched.push_back(readable && !is_sensitive);
+            if (is_sensitive)
+                masked.push_back(name);
+            else if (!readable)
+                unreadable.push_back(name);
+            else
+                select_list += (select_list.empty() ? "" : ", ") + quoted;
+        }
+
+        if (select_list.empty())
+        {
+            elog(LOG, "[tool_sample_rows] No readable columns in '%s'", qualified.c_str());
+            return nlohmann::json{{"success", false}, {"error", "No readable, non-sensitive columns in " + qualified}};
+        }
+
+        // Sample about sample_page_budget pages of larger tables; small tables are read directly
+        std::string sample_sql = "SELECT " + select_list + " FROM " + qualified;
+        double percent = 100;
+        if (relkind != RELKIND_VIEW && relkind != RELKIND_FOREIGN_TABLE && pages > sample_page_budget)
+        {
+            percent = std::max(0.0001, 100.0 * sample_page_budget / pages);
+            char clause[64];
+            snprintf(clause, sizeof(clause), " TABLESAMPLE SYSTEM (%.4f) ORDER BY random()", percent);
+            sample_sql += clause;
+        }
+        sample_sql += " LIMIT " + std::to_string(row_count);
+
+        if (lookup_timeout_id == MAX_TIMEOUTS)
+            lookup_timeout_id = RegisterTimeout(USER_TIMEOUT, lookup_timeout_handler);
+
+        const size_t max_value_chars = 80;
+        nlohmann::json rows = nlohmann::json::array();
+        std::string compact_rows;
+        std::string error;
+
+        lookup_timed_out = false;
+        if (sample_timeout > 0)
+            enable_timeout_after(lookup_timeout_id, sample_timeout);
+
+        bool ok = run_in_subtransaction([&]
+                                        {
+            if (SPI_execute(sample_sql.c_str(), true, row_count) != SPI_OK_SELECT)
+                throw std::runtime_error("sample query failed");
+
+            for (uint64 i = 0; i < SPI_processed; i++)
+            {
+                nlohmann::json row = nlohmann::json::object();
+                std::string line;
+                int attno = 1;
+                for (size_t c = 0; c < column_names.size(); c++)
+                {
+                    std::string shown;
+                    if (!fetched[c])
+                    {
+                        if (std::find(masked.begin(), masked.end(), column_names[c]) == masked.end())
+                            continue;
+                        shown = "***";
+                        row[column_names[c]] = shown;
+                    }
+                    else
+                    {
+                        char *value = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, attno++);
+                        shown = value ? truncate_value(value, max_value_chars) : "NULL";
+                        row[column_names[c]] = value ? nlohmann::json(shown) : nlohmann::json(nullptr);
+                        if (value)
+                            pfree(value);
+                    }
+                    line += (line.empty() ? "" : " | ") + shown;
+                }
+                rows.push_back(row);
+                compact_rows += line + "\n";
+            } },
+                                        &error);
+
+        if (sample_timeout > 0)
+            disable_timeout(lookup_timeout_id, false);
+        // Reset right away: while set, run_in_subtransaction swallows query cancels
+        bool timed_out = lookup_timed_out;
+        lookup_timed_out = false;
+        if (timed_out && ok)
+            QueryCancelPending = false; // fired after the query finished; don't cancel the caller
+
+        if (!ok)
+        {
+            if (timed_out)
+                error = "sampling timed out after " + std::to_string(sample_timeout) + " ms";
+            elog(WARNING, "[tool_sample_rows] Sampling '%s' failed: %s", qualified.c_str(), error.c_str());
+            return nlohmann::json{{"success", false}, {"error", error}};
+        }
+
+        elog(LOG, "[tool_sample_rows] Sampled %zu rows from '%s' (%.4f%% of %.0f pages)", rows.size(), qualified.c_str(), percent, pages);
+
+        std::vector<std::string> header;
+        for (size_t c = 0; c < column_names.size(); c++)
+        {
+            if (fetched[c] || std::find(masked.begin(), masked.end(), column_names[c]) != masked.end())
+                header.push_back(column_names[c]);
+        }
+        std::string compact_header;
+        for (const auto &name : header)
+            compact_header += (compact_header.empty() ? "" : " | ") + name;
+
+        nlohmann::json verbose = {
+            {"success", true},
+            {"table", qualified},
+            {"sampled_percent", percent},
+            {"rows", rows}};
+        nlohmann::json compact = {{"rows", compact_header + "\n" + compact_rows}};
+        if (!masked.empty())
+        {
+            verbose["masked_columns"] = masked;
+            compact["masked"] = join_names(masked);
+        }
+        if (!unreadable.empty())
+        {
+            verbose["unreadable_columns"] = unreadable;
+            compact["unreadable"] = join_names(unreadable);
+        }
+        return finish_tool_result("sample_rows", verbose, compact);
+    }
+
+    /**
+     * A model-callable tool backed by a SQL function, from ai_toolkit.tools
+     */
+    struct AiRegisteredTool
+    {
+        std::string name;
+        Oid function = InvalidOid;
+        std::string call_name; // schema-qualified, quoted
+        std::vector<std::string> arg_names;
+        std::vector<Oid> arg_types;
+        bool returns_rows = false; // set-returning or composite: called in FROM
+        bool volatile_function = false; // may write: called in a subtransaction that is rolled back
+    };
+
+    /**
+     * Tool sets handed to the model, built once per backend instead of on every call.
+     * Registered tools are reloaded when ai_toolkit.tools changes (by its version) or
+     * when any function is altered or dropped (syscache callback).
+     */
+    struct AiToolRegistry
+    {
+        bool builtins_ready = false;
+        std::map<std::string, ai::Tool> query_tools;   // built-ins for query()
+        std::map<std::string, ai::Tool> explain_tools; // built-ins for explain_query() and explain_error()
+        std::map<std::string, ai::Tool> registered;
+        std::string version; // of ai_toolkit.tools when registered was loaded
+        bool functions_changed = true;
+    };
+
+    static AiToolRegistry tool_registry;
+
+#define AI_REGISTERED_TOOL_MAX_ROWS 50
+
+    static void tool_registry_invalidate(Datum arg, int cacheid, uint32 hashvalue)
+    {
+        tool_registry.functions_changed = true;
+    }
+
+    /**
+     * JSON schema type of a function argument as the model sees it
+     */
+    static const char *tool_param_type(Oid type)
+    {
+        switch (type)
+        {
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+            return "integer";
+        case FLOAT4OID:
+        case FLOAT8OID:
+        case NUMERICOID:
+            return "number";
+        case BOOLOID:
+            return "boolean";
+        default:
+            return "string";
+        }
+    }
+
+    /**
+     * Read the named input arguments of a function
+     * Returns: false with the reason in *error if an argument is unnamed or variadic
+     */
+    static bool tool_function_args(Oid function, std::vector<std::string> *names, std::vector<Oid> *types,
+                                   bool *returns_rows, std::string *error)
+    {
+        HeapTuple proc = SearchSysCache1(PROCOID, ObjectIdGetDatum(function));
+        if (!HeapTupleIsValid(proc))
+        {
+            *error = "function does not exist";
+            return false;
+        }
+
+        Form_pg_proc form = (Form_pg_proc)GETSTRUCT(proc);
+        *returns_rows = form->proretset || type_is_rowtype(form->prorettype);
+
+        Oid *arg_types;
+        char **arg_names;
+        char *arg_modes;
+        int nargs = get_func_arg_info(proc, &arg_types, &arg_names, &arg_modes);
+        ReleaseSysCache(proc);
+
+        for (int i = 0; i < nargs; i++)
+        {
+            char mode = arg_modes ? arg_modes[i] : PROARGMODE_IN;
+            if (mode == PROARGMODE_OUT || mode == PROARGMODE_TABLE)
+                continue;
+            if (mode == PROARGMODE_VARIADIC)
+            {
+                *error = "variadic arguments are not supported";
+                return false;
+            }
+            if (arg_names == nullptr || arg_names[i] == nullptr || arg_names[i][0] == '\0')
+            {
+                *error = "every argument must be named; the names become the tool's parameters";
+                return false;
+            }
+            names->push_back(arg_names[i]);
+            types->push_back(arg_types[i]);
+        }
+        return true;
+    }
+
+    /**
+     * Call a registered tool's function with the model's parameters, under the
+     * ai_toolkit.tool_timeout time limit. Rows are returned as JSON objects, at most
+     * AI_REGISTERED_TOOL_MAX_ROWS of them. A volatile function's writes are rolled back.
+     * SPI must be connected.
+     */
+    static nlohmann::json tool_call_registered(const AiRegisteredTool &tool, const nlohmann::json &params)
+    {
+        std::string args;
+        std::vector<Datum> values;
+        std::vector<char> nulls;
+        std::vector<Oid> argtypes;
+        for (size_t i = 0; i < tool.arg_names.size(); i++)
+        {
+            // Named notation: an argument the model left out takes the function's default
+            if (!params.is_object() || !params.contains(tool.arg_names[i]))
+                continue;
+            if (!args.empty())
+                args += ", ";
+            args += std::string(quote_identifier(tool.arg_names[i].c_str())) + " => CAST($" +
+                    std::to_string(values.size() + 1) + " AS " + format_type_be(tool.arg_types[i]) + ")";
+
+            const nlohmann::json *value = &params[tool.arg_names[i]];
+            if (value->is_null())
+            {
+                values.push_back((Datum)0);
+                nulls.push_back('n');
+            }
+            else
+            {
+                std::string text = value->is_string() ? value->get<std::string>() : value->dump();
+                values.push_back(CStringGetTextDatum(text.c_str()));
+                nulls.push_back(' ');
+            }
+            argtypes.push_back(TEXTOID);
+        }
+
+        std::string call = tool.call_name + "(" + args + ")";
+        std::string sql = tool.returns_rows ? "SELECT to_jsonb(r)::text FROM " + call + " AS r"
+                                            : "SELECT to_jsonb(" + call + ")::text";
+        sql += " LIMIT " + std::to_string(AI_REGISTERED_TOOL_MAX_ROWS + 1);
+
+        if (lookup_timeout_id == MAX_TIMEOUTS)
+            lookup_timeout_id = RegisterTimeout(USER_TIMEOUT, lookup_timeout_handler);
+
+        nlohmann::json rows = nlohmann::json::array();
+        bool truncated = false;
+        std::string error;
+
+        lookup_timed_out = false;
+        if (tool_timeout > 0)
+            enable_timeout_after(lookup_timeout_id, tool_timeout);
+
+        bool ok = run_in_subtransaction([&]
+                                        {
+            int ret = SPI_execute_with_args(sql.c_str(), (int)argtypes.size(), argtypes.data(), values.data(),
+                                            nulls.data(), true, AI_REGISTERED_TOOL_MAX_ROWS + 1);
+            if (ret != SPI_OK_SELECT)
+                throw std::runtime_error("function call failed");
+
+            for (uint64 i = 0; i < SPI_processed; i++)
+            {
+                if (i == AI_REGISTERED_TOOL_MAX_ROWS)
+                {
+                    truncated = true;
+                    break;
+                }
+                char *value = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
+                rows.push_back(value ? nlohmann::json::parse(value, nullptr, false) : nlohmann::json(nullptr));
+            } },
+                                        &error, tool.volatile_function);
+
+        if (tool_timeout > 0)
+            disable_timeout(lookup_timeout_id, false);
+        // Reset right away: while set, run_in_subtransaction swallows query cancels
+        bool timed_out = lookup_timed_out;
+        lookup_timed_out = false;
+        if (timed_out && ok)
+            QueryCancelPending = false; // fired after the call finished; don't cancel the caller
+
+        stat_add("tools.registered_calls", 1);
+        if (!ok)
+        {
+            if (timed_out)
+                error = "timed out after " + std::to_string(tool_timeout) + " ms";
+            elog(WARNING, "[tool_call_registered] Tool '%s' failed: %s", tool.name.c_str(), error.c_str());
+            return nlohmann::json{{"success", false}, {"error", error}};
+        }
+
+        if (!tool.returns_rows)
+            return nlohmann::json{{"success", true}, {"result", rows.empty() ? nlohmann::json(nullptr) : rows[0]}};
+
+        nlohmann::json result = {{"success", true}, {"rows", rows}};
+        if (truncated)
+            result["truncated"] = "first " + std::to_string(AI_REGISTERED_TOOL_MAX_ROWS) + " rows; narrow the parameters";
+        return result;
+    }
+
+    /**
+     * Build the built-in tools once per backend
+     */
+    static void tool_registry_build_builtins()
+    {
+        if (tool_registry.builtins_ready)
+            return;
+
+        auto &query_tools = tool_registry.query_tools;
+        auto &explain_tools = tool_registry.explain_tools;
+
+        query_tools.emplace("set_memory", create_backend_tool(
+                                              "set_memory",
+                                              "Store information about database schema, tables, columns, relationships, or business rules for future reference. "
+                                              "Parameters: category (table|column|relationship|business_rule|data_pattern|calculation|permission|custom), "
+                                              "key (identifier like table name or 'table.column'), value (information to store), notes (optional context)",
+                                              {{"category", "string"}, {"key", "string"}, {"value", "string"}, {"notes", "string"}},
+                                              tool_set_memory));
+
+        ai::Tool get_memory_tool = create_backend_tool(
+            "get_memory",
+            "Retrieve previously stored information about database schema, tables, columns, relationships, or business rules. "
+            "Parameters: category (table|column|relationship|business_rule|data_pattern|calculation|permission|custom), "
+            "key (identifier like table name or 'table.column')",
+            {{"category", "string"}, {"key", "string"}},
+            tool_get_memory);
+        query_tools.emplace("get_memory", get_memory_tool);
+        explain_tools.emplace("get_memory", get_memory_tool);
+
+        query_tools.emplace("list_schemas", create_backend_tool(
+                                                "list_schemas",
+                                                "List all available schemas in the current PostgreSQL database. "
+                                                "Schemas: users (user data), products (catalog), cart (shopping), coupon (discounts), "
+                                                "wallet (payments), orders (order mgmt), payments (transactions), ai_toolkit (system). No parameters required.",
+                                                {},
+                                                tool_list_schemas));
+        explain_tools.emplace("list_schemas", create_backend_tool(
+                                                  "list_schemas",
+                                                  "List all available schemas in the current PostgreSQL database. No parameters required.",
+                                                  {},
+                                                  tool_list_schemas));
+
+        query_tools.emplace("list_tables_in_schema", create_backend_tool(
+                                                         "list_tables_in_schema",
+                                                         "List tables in a schema, one page at a time; partitions are folded into their parent with a count. "
+                                                         "Parameters: schema (name of the schema like 'users', 'products', 'orders', etc.), "
+                                                         "pattern (name filter such as 'order*', '' for all), limit (page size, 0 for 100), offset (0 for the first page), "
+                                                         "order ('name', or 'relevance' to rank by the user request)",
+                                                         {{"schema", "string"}, {"pattern", "string"}, {"limit", "integer"}, {"offset", "integer"}, {"order", "string"}},
+                                                         tool_list_tables_in_schema));
+        explain_tools.emplace("list_tables_in_schema", create_backend_tool(
+                                                           "list_tables_in_schema",
+                                                           "List tables in a specific schema (first 100 by name; partitions folded into their parent). Parameters: schema (name of the schema)",
+                                                           {{"schema", "string"}},
+                                                           tool_list_tables_in_schema));
+
+        ai::Tool get_schema_tool = create_backend_tool(
+            "get_schema_for_table",
+            "Get the CREATE TABLE statement (schema) for a specific table. "
+            "Compact results are one line: schema.table(column type, ...) where NN = NOT NULL and =x is the default. "
+            "Parameters: table_name (name of table, optionally prefixed with schema like 'schema.table')",
+            {{"table_name", "string"}},
+            tool_get_schema_for_table);
+        query_tools.emplace("get_schema_for_table", get_schema_tool);
+        explain_tools.emplace("get_schema_for_table", get_schema_tool);
+
+        query_tools.emplace("find_join_path", create_backend_tool(
+                                                  "find_join_path",
+                                                  "Find how to join several tables using their foreign keys, in one call. Returns a ready FROM ... JOIN ... ON "
+                                                  "clause connecting all of them through the fewest joins, including any intermediate tables needed. "
+                                                  "Parameters: tables (comma-separated table names, optionally schema-qualified, e.g. 'orders.orders,users.users')",
+                                                  {{"tables", "string"}},
+                                                  tool_find_join_path));
+
+        query_tools.emplace("get_column_stats", create_backend_tool(
+                                                    "get_column_stats",
+                                                    "Get planner statistics for columns without scanning the table: distinct count, null fraction, most common "
+                                                    "values with frequencies, and histogram bounds. Use it to pick valid filter literals (status codes, categories). "
+                                                    "Parameters: table_name (schema.table), columns (comma-separated column names; empty for all columns)",
+                                                    {{"table_name", "string"}, {"columns", "string"}},
+                                                    tool_get_column_stats));
+
+        query_tools.emplace("sample_rows", create_backend_tool(
+                                               "sample_rows",
+                                               "Get a few sample rows of a table to see what its data looks like (JSON shapes, text formats). Cheap on any "
+                                               "table size; wide values are truncated and sensitive columns are masked. "
+                                               "Parameters: table_name (schema.table), n (number of rows, 1-50)",
+                                               {{"table_name", "string"}, {"n", "integer"}},
+                                               tool_sample_rows));
+
+        query_tools.emplace("find_relevant_tables", create_backend_tool(
+                                                        "find_relevant_tables",
+                                                        "Rank tables in the whole database by relevance to a question, matching table, column and comment names "
+                                                        "and stored memories. Use it first in large databases instead of listing every schema. "
+                                                        "Parameters: question (what the user is asking about), k (number of tables, 1-50)",
+                                                        {{"question", "string"}, {"k", "integer"}},
+                                                        tool_find_relevant_tables));
+
+        query_tools.emplace("final_answer", create_backend_tool(
+                                                "final_answer",
+                                                "Deliver the final answer. Call it once, when you have the query; it ends the request. "
+                                                "Parameters: sql (the complete PostgreSQL query), disclaimer (warning message if the query is DDL or DML, "
+                                                "otherwise empty), explanation (one sentence on what the query returns), confidence (0.0 to 1.0)",
+                                                {{"sql", "string"}, {"disclaimer", "string"}, {"explanation", "string"}, {"confidence", "number"}},
+                                                tool_final_answer));
+
+        tool_registry.builtins_ready = true;
+    }
+
+    /**
+     * Whether name belongs to a built-in tool, which registered tools may not shadow
+     */
+    static bool tool_is_builtin(const std::string &name)
+    {
+        tool_registry_build_builtins();
+        return tool_registry.query_tools.count(name) > 0;
+    }
+
+    /**
+     * (Re)load registered tools if ai_toolkit.tools or a function changed. SPI must be connected.
+     */
+    static void tool_registry_load()
+    {
+        int ret = SPI_execute("SELECT count(*) || '/' || count(*) FILTER (WHERE enabled) || '/' || "
+                              "coalesce(max(updated_at)::text, '') FROM ai_toolkit.tools", true, 1);
+        if (ret != SPI_OK_SELECT || SPI_processed == 0)
+            return;
+
+        char *version = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+        if (!tool_registry.functions_changed && version && tool_registry.version == version)
+            return;
+        tool_registry.version = version ? version : "";
+        tool_registry.functions_changed = false;
+
+        ret = SPI_execute("SELECT t.name, t.description, t.params::text, t.function::oid, p.provolatile "
+                          "FROM ai_toolkit.tools t JOIN pg_catalog.pg_proc p ON p.oid = t.function "
+                          "WHERE t.enabled ORDER BY t.name",
+                          true, 0);
+        if (ret != SPI_OK_SELECT)
+        {
+            elog(WARNING, "[tool_registry_load] Failed to read registered tools");
+            return;
+        }
+
+        // Copy the rows out first: resolving functions below runs catalog lookups
+        struct Row
+        {
+            std::string name, description, params;
+            Oid function;
+            bool stable;
+        };
+        std::vector<Row> rows;
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+            bool isnull;
+            char *params = SPI_getvalue(tuple, tupdesc, 3);
+            char *volatility = SPI_getvalue(tuple, tupdesc, 5);
+            rows.push_back({SPI_getvalue(tuple, tupdesc, 1), SPI_getvalue(tuple, tupdesc, 2), params ? params : "{}",
+                            DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 4, &isnull)),
+                            volatility && volatility[0] != PROVOLATILE_VOLATILE});
+        }
+
+        tool_registry.registered.clear();
+        cacheable_registered_tools.clear();
+        for (const auto &row : rows)
+        {
+            if (tool_is_builtin(row.name))
+                continue;
+
+            AiRegisteredTool tool;
+            std::string error;
+            tool.name = row.name;
+            tool.function = row.function;
+            tool.volatile_function = !row.stable;
+            if (!tool_function_args(row.function, &tool.arg_names, &tool.arg_types, &tool.returns_rows, &error))
+            {
+                elog(WARNING, "[tool_registry_load] Skipping tool '%s': %s", row.name.c_str(), error.c_str());
+                continue;
+            }
+            tool.call_name = quote_qualified_identifier(get_namespace_name(get_func_namespace(row.function)),
+                                                        get_func_name(row.function));
+
+            nlohmann::json param_docs = nlohmann::json::parse(row.params, nullptr, false);
+            std::map<std::string, std::string> parameters;
+            std::string description = row.description;
+            for (size_t i = 0; i < tool.arg_names.size(); i++)
+            {
+                const std::string &arg = tool.arg_names[i];
+                parameters[arg] = tool_param_type(tool.arg_types[i]);
+                description += (i == 0 ? " Parameters: " : ", ") + arg;
+                if (param_docs.is_object() && param_docs.contains(arg) && param_docs[arg].is_string())
+                    description += " (" + param_docs[arg].get<std::string>() + ")";
+            }
+
+            tool_registry.registered.emplace(tool.name, create_backend_tool(tool.name, description, parameters,
+                                                                            [tool](const nlohmann::json &params, const ai::ToolExecutionContext &context)
+                                                                            { return tool_call_registered(tool, params); }));
+            if (row.stable)
+                cacheable_registered_tools.insert(tool.name);
+        }
+
+        elog(LOG, "[tool_registry_load] Loaded %zu registered tools", tool_registry.registered.size());
+    }
+
+    /**
+     * Add the built-in tools of a function ("query" or "explain") and every registered tool.
+     * SPI must be connected.
+     */
+    void tool_registry_apply(const std::string &purpose, ai::GenerateOptions &options)
+    {
+        tool_registry_build_builtins();
+        tool_registry_load();
+
+        for (const auto &[name, tool] : purpose == "query" ? tool_registry.query_tools : tool_registry.explain_tools)
+        {
+            if (name == "final_answer" && !structured_output)
+                continue;
+            options.tools[name] = tool;
+        }
+        for (const auto &[name, tool] : tool_registry.registered)
+            options.tools[name] = tool;
+    }
+
+#define AI_EXPLAIN_CACHE_SLOTS 64
+#define AI_EXPLAIN_CACHE_TEXTLEN 16384
+
+    /**
+     * Shared cache of AI explanations, keyed by a 64-bit fingerprint
+     * (normalized query + plan shape for explain_query). Least recently used entries are evicted.
+     */
+    typedef struct AiExplainCacheEntry
+    {
+        uint64 key; // 0 if unused
+        TimestampTz created_at;
+        TimestampTz last_hit_at;
+        uint64 hits;
+        int length;
+        char text[AI_EXPLAIN_CACHE_TEXTLEN];
+    } AiExplainCacheEntry;
+
+    typedef struct AiExplainCacheState
+    {
+        AiSharedHeader hdr;
+        AiExplainCacheEntry entries[AI_EXPLAIN_CACHE_SLOTS];
+    } AiExplainCacheState;
+
+    static AiExplainCacheState *explain_cache_state = nullptr;
+
+    static void explain_cache_init_state(void *ptr)
+    {
+        AiExplainCacheState *state = (AiExplainCacheState *)ptr;
+        shared_header_init(&state->hdr);
+        memset(state->entries, 0, sizeof(state->entries));
+    }
+
+    static AiExplainCacheState *explain_cache_attach()
+    {
+        if (explain_cache_state == nullptr)
+        {
+            explain_cache_state = (AiExplainCacheState *)shared_segment_attach("ai_toolkit_explain_cache",
+                                                                               sizeof(AiExplainCacheState),
+                                                                               explain_cache_init_state);
+        }
+        return explain_cache_state;
+    }
+
+    /**
+     * Fingerprint a string with Postgres' stable hash (same result in every backend)
+     */
+    uint64 fingerprint(const std::string &text)
+    {
+        uint64 hash = hash_bytes_extended((const unsigned char *)text.data(), (int)text.size(), 0);
+        return hash == 0 ? 1 : hash;
+    }
+
+    /**
+     * Look up a cached explanation, counting the hit
+     * Returns: std::nullopt on a miss, when the entry expired, or when caching is disabled
+     */
+    std::optional<std::string> explain_cache_lookup(uint64 key)
+    {
+        if (explain_cache_ttl <= 0)
+            return std::nullopt;
+
+        AiExplainCacheState *state = explain_cache_attach();
+        std::optional<std::string> found;
+        TimestampTz now = GetCurrentTimestamp();
+
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        for (int i = 0; i < AI_EXPLAIN_CACHE_SLOTS; i++)
+        {
+            AiExplainCacheEntry *entry = &state->entries[i];
+            if (entry->key != key)
+                continue;
+
+            if (TimestampDifferenceExceeds(entry->created_at, now, explain_cache_ttl * 1000))
+            {
+                entry->key = 0;
+                break;
+            }
+            entry->hits++;
+            entry->last_hit_at = now;
+            found = std::string(entry->text, entry->length);
+            break;
+        }
+        LWLockRelease(&state->hdr.lock);
+
+        stat_add(found.has_value() ? "explain_cache.hits" : "explain_cache.misses", 1);
+        return found;
+    }
+
+    /**
+     * Store an explanation, replacing the least recently used entry
+     * Explanations too large for a slot are not cached.
+     */
+    void explain_cache_store(uint64 key, const std::string &text)
+    {
+        if (explain_cache_ttl <= 0 || text.size() >= AI_EXPLAIN_CACHE_TEXTLEN)
+            return;
+
+        AiExplainCacheState *state = explain_cache_attach();
+        TimestampTz now = GetCurrentTimestamp();
+
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        AiExplainCacheEntry *victim = &state->entries[0];
+        for (int i = 0; i < AI_EXPLAIN_CACHE_SLOTS; i++)
+        {
+            AiExplainCacheEntry *entry = &state->entries[i];
+            if (entry->key == key || entry->key == 0)
+            {
+                victim = entry;
+                break;
+            }
+            if (entry->last_hit_at < victim->last_hit_at)
+                victim = entry;
+        }
+
+        victim->key = key;
+        victim->created_at = now;
+        victim->last_hit_at = now;
+        victim->hits = 0;
+        victim->length = (int)text.size();
+        memcpy(victim->text, text.data(), text.size());
+        LWLockRelease(&state->hdr.lock);
+    }
+
+    /**
+     * Normalize SQL text for fingerprinting: lowercase, single spaces, comments dropped,
+     * string and numeric literals replaced by '?'. Quoted identifiers are kept verbatim.
+     */
+    std::string normalize_sql_text(const std::string &sql)
+    {
+        std::string out;
+        out.reserve(sql.size());
+        bool pending_space = false;
+
+        for (size_t i = 0; i < sql.size();)
+        {
+            char c = sql[i];
+
+            if (isspace((unsigned char)c))
+            {
+                pending_space = true;
+                i++;
+                continue;
+            }
+            if (c == '-' && i + 1 < sql.size() && sql[i + 1] == '-')
+            {
+                while (i < sql.size() && sql[i] != '\n')
+                    i++;
+                pending_space = true;
+                continue;
+            }
+            if (c == '/' && i + 1 < sql.size() && sql[i + 1] == '*')
+            {
+                size_t end = sql.find("*/", i + 2);
+                i = end == std::string::npos ? sql.size() : end + 2;
+                pending_space = true;
+                continue;
+            }
+
+            if (pending_space && !out.empty())
+                out += ' ';
+            pending_space = false;
+
+            if (c == '\'')
+            {
+                // String literal, with '' escapes
+                i++;
+                while (i < sql.size())
+                {
+                    if (sql[i] == '\'' && i + 1 < sql.size() && sql[i + 1] == '\'')
+                        i += 2;
+                    else if (sql[i] == '\'')
+                        break;
+                    else
+                        i++;
+                }
+                i++;
+                out += '?';
+            }
+            else if (c == '"')
+            {
+                size_t end = sql.find('"', i + 1);
+                end = end == std::string::npos ? sql.size() : end + 1;
+                out += sql.substr(i, end - i);
+                i = end;
+            }
+            else if (isdigit((unsigned char)c) && (out.empty() || !(isalnum((unsigned char)out.back()) || out.back() == '_')))
+            {
+                while (i < sql.size() && (isalnum((unsigned char)sql[i]) || sql[i] == '.'))
+                    i++;
+                out += '?';
+            }
+            else
+            {
+                out += (char)tolower((unsigned char)c);
+                i++;
+            }
+        }
+
+        return out;
+    }
+
+    /**
+     * Whether EXPLAIN ANALYZE may run sql: a single plain SELECT with no
+     * data-modifying CTEs, SELECT INTO or row locking, so executing it changes nothing
+     */
+    static bool safe_to_analyze(const std::string &sql)
+    {
+        bool safe = false;
+        std::string error;
+
+        run_in_subtransaction([&]
+                              {
+            List *parsetree = raw_parser(sql.c_str(), RAW_PARSE_DEFAULT);
+            if (list_length(parsetree) != 1)
+                return;
+
+            Node *stmt = ((RawStmt *)linitial(parsetree))->stmt;
+            if (!IsA(stmt, SelectStmt))
+                return;
+
+            SelectStmt *select = (SelectStmt *)stmt;
+            if (select->intoClause != NULL || select->lockingClause != NIL)
+                return;
+
+            if (select->withClause != NULL)
+            {
+                ListCell *lc;
+                foreach (lc, select->withClause->ctes)
+                {
+                    CommonTableExpr *cte = (CommonTableExpr *)lfirst(lc);
+                    if (!IsA(cte->ctequery, SelectStmt))
+                        return;
+                }
+            }
+            safe = true; },
+                              &error);
+
+        return safe;
+    }
+
+    /**
+     * Render an EXPLAIN (FORMAT JSON) plan node tree as compact indented lines and
+     * accumulate its shape (node types, relations, indexes, join types; no costs)
+     */
+    static void condense_plan_node(const nlohmann::json &node, int depth, std::string *condensed, std::string *shape)
+    {
+        std::string node_type = node.value("Node Type", "?");
+        std::string line(depth * 2, ' ');
+        line += "-> " + node_type;
+
+        *shape += "(" + node_type;
+        for (const char *field : {"Join Type", "Relation Name", "Index Name", "Strategy", "Parent Relationship"})
+        {
+            if (node.contains(field) && node[field].is_string())
+                *shape += "|" + node[field].get<std::string>();
+        }
+
+        if (node.contains("Relation Name"))
+            line += " on " + node.value("Schema", std::string()) + (node.contains("Schema") ? "." : "") + node["Relation Name"].get<std::string>();
+        if (node.contains("Index Name"))
+            line += " using " + node["Index Name"].get<std::string>();
+        if (node.contains("Join Type"))
+            line += " (" + node["Join Type"].get<std::string>() + ")";
+
+        std::stringstream numbers;
+        numbers << " [est rows=" << node.value("Plan Rows", 0.0) << " cost=" << node.value("Total Cost", 0.0);
+        if (node.contains("Actual Rows"))
+        {
+            numbers << " actual rows=" << node.value("Actual Rows", 0.0) << " loops=" << node.value("Actual Loops", 0.0)
+                    << " time=" << node.value("Actual Total Time", 0.0) << "ms";
+        }
+        if (node.contains("Shared Hit Blocks"))
+        {
+            numbers << " hit=" << node.value("Shared Hit Blocks", 0) << " read=" << node.value("Shared Read Blocks", 0);
+        }
+        if (node.contains("Rows Removed by Filter"))
+        {
+            numbers << " removed=" << node.value("Rows Removed by Filter", 0.0);
+        }
+        numbers << "]";
+        line += numbers.str();
+
+        for (const char *field : {"Index Cond", "Hash Cond", "Merge Cond", "Join Filter", "Filter", "Sort Key", "Group Key"})
+        {
+            if (!node.contains(field))
+                continue;
+            std::string value = node[field].is_string() ? node[field].get<std::string>() : node[field].dump();
+            if (value.size() > 160)
+                value = value.substr(0, 160) + "...";
+            line += " " + std::string(field) + ": " + value + ";";
+        }
+
+        *condensed += line + "\n";
+
+        if (node.contains("Plans") && node["Plans"].is_array())
+        {
+            for (const auto &child : node["Plans"])
+                condense_plan_node(child, depth + 1, condensed, shape);
+        }
+        *shape += ")";
+    }
+
+    /**
+     * Run EXPLAIN (FORMAT JSON) on a single statement, with ANALYZE and BUFFERS when
+     * ai_toolkit.explain_analyze is on and the query is a plain SELECT.
+     * The EXPLAIN runs in a read-only subtransaction that is always rolled back, so even
+     * volatile functions executed by ANALYZE cannot write anything.
+     * SPI must be connected. Errors (invalid query, missing privileges) are caught.
+     * Returns: true with a condensed plan and a plan shape string; false with *error set
+     */
+    bool explain_plan(const std::string &sql, std::string *condensed, std::string *shape, std::string *error)
+    {
+        if (!sql_is_single_statement(sql))
+        {
+            *error = "Only a single SQL statement can be explained";
+            return false;
+        }
+
+        bool analyze = explain_analyze && safe_to_analyze(sql);
+        std::string explain_sql = std::string("EXPLAIN (FORMAT JSON") + (analyze ? ", ANALYZE, BUFFERS" : "") + ") " + sql;
+        std::string plan_text;
+
+        bool ok = run_in_subtransaction([&]
+                                        {
+            // SPI's read_only mode refuses utility statements such as EXPLAIN, so make the
+            // subtransaction itself read-only; the setting ends with the rollback
+            set_config_option("transaction_read_only", "on", PGC_USERSET, PGC_S_SESSION,
+                              GUC_ACTION_LOCAL, true, 0, false);
+
+            int ret = SPI_execute(explain_sql.c_str(), false, 0);
+            if (ret < 0 || SPI_processed == 0)
+                throw std::runtime_error("EXPLAIN returned no plan");
+
+            char *value = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+            if (value)
+            {
+                plan_text = value;
+                pfree(value);
+            } },
+                                        error, true);
+        if (!ok)
+            return false;
+
+        try
+        {
+            nlohmann::json plan = nlohmann::json::parse(plan_text);
+            const nlohmann::json &top = plan.is_array() && !plan.empty() ? plan[0] : plan;
+            if (!top.contains("Plan"))
+            {
+                *error = "EXPLAIN output has no plan";
+                return false;
+            }
+
+            condense_plan_node(top["Plan"], 0, condensed, shape);
+            if (top.contains("Planning Time"))
+                *condensed += "Planning time: " + top["Planning Time"].dump() + " ms\n";
+            if (top.contains("Execution Time"))
+                *condensed += "Execution time: " + top["Execution Time"].dump() + " ms\n";
+            return true;
+        }
+        catch (const std::exception &e)
+        {
+            *error = std::string("Could not read EXPLAIN output: ") + e.what();
+            return false;
+        }
+    }
+
+    /**
+     * OIDs of the relations a statement uses, sorted and comma-separated, so a cache key
+     * does not match a same-named table in another schema or database. SPI must be connected.
+     */
+    static std::string plan_relation_oids(const std::string &sql)
+    {
+        std::set<Oid> oids;
+        std::string error;
+        bool ok = run_in_subtransaction([&]
+                                        {
+            SPIPlanPtr plan = SPI_prepare(sql.c_str(), 0, nullptr);
+            if (plan == nullptr)
+                throw std::runtime_error("prepare failed");
+
+            ListCell *lc;
+            foreach (lc, SPI_plan_get_plan_sources(plan))
+            {
+                CachedPlanSource *source = (CachedPlanSource *)lfirst(lc);
+                ListCell *rc;
+                foreach (rc, source->relationOids)
+                    oids.insert(lfirst_oid(rc));
+            }
+            SPI_freeplan(plan); },
+                                        &error, true);
+        if (!ok)
+            elog(LOG, "[plan_relation_oids] %s", error.c_str());
+
+        std::string out;
+        for (Oid oid : oids)
+            out += std::to_string(oid) + ",";
+        return out;
+    }
+
+    /**
+     * An error reduced to its class: SQLSTATE plus the message with identifiers and
+     * literals abstracted, so "relation \"a\" does not exist" and "relation \"b\" does not exist" match
+     */
+    struct ErrorClass
+    {
+        std::string sqlstate; // empty when unknown
+        std::string message;  // primary message as given
+        std::string message_template;
+        uint64 fingerprint;
+    };
+
+    static bool is_sqlstate(const std::string &code)
+    {
+        if (code.size() != 5)
+            return false;
+        for (char c : code)
+        {
+            if (!(isdigit((unsigned char)c) || (c >= 'A' && c <= 'Z')))
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * Abstract an error message into a template: quoted identifiers, string literals
+     * and numbers become '?'. Syntax errors keep the offending token, since it is the point.
+     */
+    static std::string error_message_template(const std::string &message, bool keep_quoted)
+    {
+        std::string out;
+        out.reserve(message.size());
+
+        for (size_t i = 0; i < message.size();)
+        {
+            char c = message[i];
+            if ((c == '"' || c == '\'') && !keep_quoted)
+            {
+                size_t end = message.find(c, i + 1);
+                if (end == std::string::npos)
+                    end = message.size() - 1;
+                out += '?';
+                i = end + 1;
+            }
+            else if (isdigit((unsigned char)c) && (out.empty() || !(isalnum((unsigned char)out.back()) || out.back() == '_')))
+            {
+                while (i < message.size() && (isdigit((unsigned char)message[i]) || message[i] == '.'))
+                    i++;
+                out += '?';
+            }
+            else
+            {
+                out += c;
+                i++;
+            }
+        }
+
+        while (!out.empty() && isspace((unsigned char)out.back()))
+            out.pop_back();
+        return out;
+    }
+
+    /**
+     * Classify an error. error_text may be psql/server output ("ERROR:  42P01: relation ...",
+     * "SQL state: 42P01") or a bare message; sqlstate, when known, overrides what is parsed.
+     */
+    ErrorClass classify_error(const std::string &error_text, const std::string &sqlstate = "")
+    {
+        ErrorClass cls;
+        cls.sqlstate = sqlstate;
+
+        // Primary message: the first line mentioning a severity, else the first non-empty line
+        std::stringstream lines(error_text);
+        std::string line, first_line;
+        while (std::getline(lines, line))
+        {
+            size_t start = line.find_first_not_of(" \t\r");
+            if (start == std::string::npos)
+                continue;
+            if (first_line.empty())
+                first_line = line.substr(start);
+
+            for (const char *severity : {"ERROR:", "FATAL:", "PANIC:"})
+            {
+                size_t pos = line.find(severity);
+                if (pos != std::string::npos && cls.message.empty())
+                    cls.message = line.substr(pos + strlen(severity));
+            }
+        }
+        if (cls.message.empty())
+            cls.message = first_line;
+
+        size_t start = cls.message.find_first_not_of(" \t");
+        cls.message = start == std::string::npos ? "" : cls.message.substr(start);
+
+        // Verbose format puts the SQLSTATE right after the severity
+        if (cls.message.size() > 6 && cls.message[5] == ':' && is_sqlstate(cls.message.substr(0, 5)))
+        {
+            if (cls.sqlstate.empty())
+                cls.sqlstate = cls.message.substr(0, 5);
+            cls.message = cls.message.substr(6);
+            start = cls.message.find_first_not_of(" \t");
+            cls.message = start == std::string::npos ? "" : cls.message.substr(start);
+        }
+
+        for (const char *marker : {"SQL state:", "SQLSTATE:", "SQLSTATE"})
+        {
+            size_t pos = error_text.find(marker);
+            if (!cls.sqlstate.empty() || pos == std::string::npos)
+                continue;
+            pos = error_text.find_first_not_of(" \t[", pos + strlen(marker));
+            if (pos != std::string::npos && is_sqlstate(error_text.substr(pos, 5)))
+                cls.sqlstate = error_text.substr(pos, 5);
+        }
+
+        bool syntax_error = cls.sqlstate == "42601" || cls.message.rfind("syntax error", 0) == 0;
+        cls.message_template = error_message_template(cls.message, syntax_error);
+        // The front cache is cluster-wide; an explanation may draw on this database's schema
+        cls.fingerprint = fingerprint("error\n" + std::to_string(MyDatabaseId) + "\n" + cls.sqlstate + "\n" +
+                                      cls.message_template);
+        return cls;
+    }
+
+    /**
+     * Run fn in a subtransaction as the owner of an ai_toolkit table, with search_path
+     * restricted to pg_catalog. Callers have no privileges on tables whose contents are
+     * shown to other users; only the extension reads and writes them, this way.
+     * Returns: true on success; false with the error message in *error
+     */
+    static bool run_as_table_owner(const char *table, const std::function<void()> &fn, std::string *error)
+    {
+        return run_in_subtransaction([&]
+                                     {
+            Oid relid = get_relname_relid(table, get_namespace_oid("ai_toolkit", false));
+            HeapTuple tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+            if (!HeapTupleIsValid(tuple))
+                throw std::runtime_error(std::string("table ai_toolkit.") + table + " does not exist");
+            Oid owner = ((Form_pg_class)GETSTRUCT(tuple))->relowner;
+            ReleaseSysCache(tuple);
+
+            // Aborting the subtransaction restores both the role and the search_path
+            Oid save_userid;
+            int save_sec_context;
+            GetUserIdAndSecContext(&save_userid, &save_sec_context);
+            SetUserIdAndSecContext(owner, save_sec_context | SECURITY_LOCAL_USERID_CHANGE | SECURITY_RESTRICTED_OPERATION);
+            int save_nestlevel = NewGUCNestLevel();
+            RestrictSearchPath();
+
+            fn();
+
+            AtEOXact_GUC(false, save_nestlevel);
+            SetUserIdAndSecContext(save_userid, save_sec_context); },
+                                     error);
+    }
+
+    /**
+     * Look up a stored explanation for an error class. A plain read: hits are counted in
+     * the shared-memory stats, not in the row. SPI must be connected.
+     * Entries older than ai_toolkit.explain_cache_ttl are ignored so they get regenerated.
+     */
+    std::optional<std::string> error_explanation_lookup(const ErrorClass &cls)
+    {
+        if (explain_cache_ttl <= 0)
+            return std::nullopt;
+
+        std::string sql = "SELECT explanation FROM ai_toolkit.error_explanations "
+                          "WHERE fingerprint = $1 AND created_at > CURRENT_TIMESTAMP - make_interval(secs => $2)";
+
+        Datum values[2] = {Int64GetDatum((int64)cls.fingerprint), Int32GetDatum(explain_cache_ttl)};
+        Oid argtypes[2] = {INT8OID, INT4OID};
+        std::optional<std::string> found;
+        std::string error;
+
+        bool ok = run_as_table_owner("error_explanations", [&]
+                                     {
+            int ret = SPI_execute_with_args(sql.c_str(), 2, argtypes, values, NULL, true, 1);
+            if (ret == SPI_OK_SELECT && SPI_processed > 0)
+            {
+                char *value = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+                if (value)
+                {
+                    found = std::string(value);
+                    pfree(value);
+                }
+            } },
+                                     &error);
+        if (!ok)
+            elog(LOG, "[error_explanation_lookup] %s", error.c_str());
+
+        return found;
+    }
+
+    /**
+     * Store a generated explanation for an error class. SPI must be connected.
+     */
+    void error_explanation_store(const ErrorClass &cls, const std::string &explanation, const std::string &model)
+    {
+        std::string sql = "INSERT INTO ai_toolkit.error_explanations "
+                          "(fingerprint, sqlstate, message_template, sample_message, explanation, model) "
+                          "VALUES ($1, $2, $3, $4, $5, $6) "
+                          "ON CONFLICT (fingerprint) DO UPDATE SET "
+                          "sample_message = EXCLUDED.sample_message, explanation = EXCLUDED.explanation, "
+                          "model = EXCLUDED.model, created_at = CURRENT_TIMESTAMP";
+
+        Datum values[6];
+        char nulls[6] = {' ', cls.sqlstate.empty() ? 'n' : ' ', ' ', ' ', ' ', ' '};
+        values[0] = Int64GetDatum((int64)cls.fingerprint);
+        values[1] = cls.sqlstate.empty() ? (Datum)0 : CStringGetTextDatum(cls.sqlstate.c_str());
+        values[2] = CStringGetTextDatum(cls.message_template.c_str());
+        values[3] = CStringGetTextDatum(cls.message.c_str());
+        values[4] = CStringGetTextDatum(explanation.c_str());
+        values[5] = CStringGetTextDatum(model.c_str());
+
+        Oid argtypes[6] = {INT8OID, TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID};
+        std::string error;
+
+        // A read-only transaction just means the explanation isn't kept
+        bool ok = run_as_table_owner("error_explanations", [&]
+                                     {
+            int ret = SPI_execute_with_args(sql.c_str(), 6, argtypes, values, nulls, false, 0);
+            if (ret < 0)
+                throw std::runtime_error(SPI_result_code_string(ret)); },
+                                     &error);
+        if (!ok)
+            elog(LOG, "[error_explanation_store] Failed to store explanation: %s", error.c_str());
+    }
+
+#define AI_LOG_QUEUE_SLOTS 256
+#define AI_LOG_WORKERS 8
+#define AI_LOG_BATCH_ROWS 100
+#define AI_LOG_COLUMNS 18
+#define AI_LOG_STALE_MS 60000 // entries of a database without a worker are evicted after this
+
+    /**
+     * Request log queue. Backends copy finished requests into a shared array and a
+     * background worker per database drains it in batches into ai_toolkit.query_log,
+     * so no request pays for an insert. Entries are dropped (and counted) when full,
+     * when every worker slot belongs to another database, or when they were left
+     * behind by a database whose worker is gone.
+     */
+    typedef struct AiLogEntry
+    {
+        bool in_use;
+        Oid database_id;
+        Oid user_id;
+        int pid;
+        TimestampTz logged_at;
+        TimestampTz queued_at;
+        int steps;
+        int tool_calls;
+        int64 input_tokens;
+        int64 output_tokens;
+        int64 rows;
+        double total_ms;
+        double provider_ms;
+        double tool_ms;
+        double execute_ms;
+        char function_name[32];
+        char model[64];
+        char outcome[32];
+        char error[256];
+        char prompt[1024];
+        char sql[2048];
+    } AiLogEntry;
+
+    typedef struct AiLogWorkerSlot
+    {
+        Oid database_id; // InvalidOid if unused
+        int pid;         // 0 while starting
+        TimestampTz launched_at;
+        Latch *latch;
+    } AiLogWorkerSlot;
+
+    typedef struct AiLogQueueState
+    {
+        AiSharedHeader hdr;
+        int pending;
+        AiLogWorkerSlot workers[AI_LOG_WORKERS];
+        AiLogEntry entries[AI_LOG_QUEUE_SLOTS];
+    } AiLogQueueState;
+
+    static AiLogQueueState *log_queue_state = nullptr;
+
+    // The request being logged by this backend; finished on return, or by the abort callback on ERROR
+    static AiLogEntry pending_log;
+    static bool log_pending = false;
+
+    static void log_queue_init_state(void *ptr)
+    {
+        AiLogQueueState *state = (AiLogQueueState *)ptr;
+        shared_header_init(&state->hdr);
+        state->pending = 0;
+        memset(state->workers, 0, sizeof(state->workers));
+        memset(state->entries, 0, sizeof(state->entries));
+    }
+
+    static AiLogQueueState *log_queue_attach()
+    {
+        if (log_queue_state == nullptr)
+        {
+            log_queue_state = (AiLogQueueState *)shared_segment_attach("ai_toolkit_log_queue",
+                                                                      sizeof(AiLogQueueState),
+                                                                      log_queue_init_state);
+        }
+        return log_queue_state;
+    }
+
+    /**
+     * Index of the worker slot of a database, or -1. Caller holds the lock.
+     */
+    static int log_worker_index(AiLogQueueState *state, Oid database_id)
+    {
+        for (int i = 0; i < AI_LOG_WORKERS; i++)
+        {
+            if (state->workers[i].database_id == database_id)
+                return i;
+        }
+        return -1;
+    }
+
+    /**
+     * Free queued entries of one database, or (database_id InvalidOid) the stale
+     * entries of every database that has no worker. Caller holds the lock exclusively.
+     * Returns: number of entries dropped
+     */
+    static int log_queue_evict(AiLogQueueState *state, Oid database_id, TimestampTz now)
+    {
+        int evicted = 0;
+        for (int i = 0; i < AI_LOG_QUEUE_SLOTS; i++)
+        {
+            AiLogEntry *entry = &state->entries[i];
+            if (!entry->in_use)
+                continue;
+            if (database_id != InvalidOid ? entry->database_id != database_id
+                                          : (log_worker_index(state, entry->database_id) >= 0 ||
+                                             !TimestampDifferenceExceeds(entry->queued_at, now, AI_LOG_STALE_MS)))
+                continue;
+            entry->in_use = false;
+            state->pending--;
+            evicted++;
+        }
+        return evicted;
+    }
+
+    /**
+     * Start the dynamic background worker of one database: it writes the query log
+     * and runs memory maintenance
+     */
+    static bool database_worker_launch(Oid database_id)
+    {
+        BackgroundWorker worker;
+
+        memset(&worker, 0, sizeof(worker));
+        worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+        worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+        worker.bgw_restart_time = BGW_NEVER_RESTART;
+        strlcpy(worker.bgw_library_name, "ai_toolkit", BGW_MAXLEN);
+        strlcpy(worker.bgw_function_name, "database_worker_main", BGW_MAXLEN);
+        snprintf(worker.bgw_name, BGW_MAXLEN, "ai_toolkit worker for database %u", database_id);
+        strlcpy(worker.bgw_type, "ai_toolkit worker", BGW_MAXLEN);
+        worker.bgw_main_arg = ObjectIdGetDatum(database_id);
+        worker.bgw_notify_pid = 0;
+
+        return RegisterDynamicBackgroundWorker(&worker, NULL);
+    }
+
+    /**
+     * Make sure a worker is running (or starting) for a database
+     */
+    static void database_worker_ensure(Oid database_id)
+    {
+        AiLogQueueState *state = log_queue_attach();
+        TimestampTz now = GetCurrentTimestamp();
+        AiLogWorkerSlot *slot = nullptr;
+        AiLogWorkerSlot *free_slot = nullptr;
+
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        for (int i = 0; i < AI_LOG_WORKERS; i++)
+        {
+            if (state->workers[i].database_id == database_id)
+                slot = &state->workers[i];
+            else if (state->workers[i].database_id == InvalidOid && !free_slot)
+                free_slot = &state->workers[i];
+        }
+
+        // A worker that never reported in within 10s failed to start
+        if (slot && slot->pid == 0 && TimestampDifferenceExceeds(slot->launched_at, now, 10000))
+        {
+            slot->database_id = InvalidOid;
+            free_slot = free_slot ? free_slot : slot;
+            slot = nullptr;
+        }
+
+        bool launch = slot == nullptr && free_slot != nullptr;
+        if (launch)
+        {
+            free_slot->database_id = database_id;
+            free_slot->pid = 0;
+            free_slot->launched_at = now;
+            free_slot->latch = nullptr;
+            slot = free_slot;
+        }
+        LWLockRelease(&state->hdr.lock);
+
+        if (launch && !database_worker_launch(database_id))
+        {
+            int dropped = 0;
+            LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+            if (slot->database_id == database_id && slot->pid == 0)
+            {
+                slot->database_id = InvalidOid;
+                // Nothing will drain them: don't let them hold queue slots of other databases
+                dropped = log_queue_evict(state, database_id, now);
+            }
+            LWLockRelease(&state->hdr.lock);
+            if (dropped > 0)
+                stat_add("query_log.dropped", dropped);
+            elog(LOG, "[database_worker_ensure] Could not start ai_toolkit worker; increase max_worker_processes");
+        }
+    }
+
+    /**
+     * Queue an entry for this database's worker, starting the worker if needed.
+     * may_launch is false in abort callbacks, which must not attach shared memory:
+     * the entry is dropped if query_log_begin did not attach the queue, and a later
+     * request starts the worker. Entries are refused outright when every worker slot
+     * belongs to another database, since nothing would ever drain them.
+     */
+    static void log_queue_push(const AiLogEntry &entry, bool may_launch)
+    {
+        AiLogQueueState *state = may_launch ? log_queue_attach() : log_queue_state;
+        if (state == nullptr)
+            return;
+
+        TimestampTz now = GetCurrentTimestamp();
+        int dropped = 0;
+        bool queued = false;
+        Latch *wake = nullptr;
+
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        dropped += log_queue_evict(state, InvalidOid, now);
+
+        bool drainable = log_worker_index(state, entry.database_id) >= 0 ||
+                         log_worker_index(state, InvalidOid) >= 0;
+        for (int i = 0; drainable && i < AI_LOG_QUEUE_SLOTS; i++)
+        {
+            if (!state->entries[i].in_use)
+            {
+                state->entries[i] = entry;
+                state->entries[i].in_use = true;
+                state->entries[i].queued_at = now;
+                state->pending++;
+                queued = true;
+                break;
+            }
+        }
+
+        if (state->pending >= AI_LOG_QUEUE_SLOTS / 4)
+        {
+            for (int i = 0; i < AI_LOG_WORKERS; i++)
+            {
+                if (state->workers[i].database_id == entry.database_id && state->workers[i].latch)
+                    wake = state->workers[i].latch;
+            }
+        }
+        LWLockRelease(&state->hdr.lock);
+
+        if (!queued)
+            dropped++;
+        // The stats segment is attached by query_log_begin; never attach it from an abort
+        if (dropped > 0 && (may_launch || stat_state != nullptr))
+            stat_add("query_log.dropped", dropped);
+        if (wake)
+            SetLatch(wake);
+        else if (may_launch && queued)
+            database_worker_ensure(entry.database_id);
+    }
+
+    /**
+     * Start logging a request made through one of the toolkit functions
+     */
+    void query_log_begin(const char *function_name, const std::string &prompt)
+    {
+        log_pending = false;
+        if (!query_log_enabled)
+            return;
+
+        // Attach now: the abort callback that may log this request must not
+        log_queue_attach();
+        stat_attach();
+
+        memset(&pending_log, 0, sizeof(pending_log));
+        pending_log.database_id = MyDatabaseId;
+        // The login role, which view_logs (SECURITY DEFINER) compares with session_user
+        pending_log.user_id = GetSessionUserId();
+        pending_log.pid = MyProcPid;
+        pending_log.logged_at = GetCurrentTimestamp();
+        strlcpy(pending_log.function_name, function_name, sizeof(pending_log.function_name));
+        strlcpy(pending_log.prompt, prompt.c_str(), sizeof(pending_log.prompt));
+        log_pending = true;
+    }
+
+    void query_log_set_sql(const std::string &sql, const std::string &model)
+    {
+        if (!log_pending)
+            return;
+        strlcpy(pending_log.sql, sql.c_str(), sizeof(pending_log.sql));
+        strlcpy(pending_log.model, model.c_str(), sizeof(pending_log.model));
+    }
+
+    /**
+     * Fill in outcome, usage and timings of the pending entry and queue it
+     */
+    static void query_log_complete(const char *outcome, int64 rows, double execute_ms, bool may_launch)
+    {
+        log_pending = false;
+
+        strlcpy(pending_log.outcome, outcome, sizeof(pending_log.outcome));
+        pending_log.rows = rows;
+        pending_log.execute_ms = execute_ms;
+        pending_log.total_ms = TimestampDifferenceMilliseconds(pending_log.logged_at, GetCurrentTimestamp());
+
+        // Usage counters belong to this request only if it reached the model
+        if (current_request.started_at >= pending_log.logged_at)
+        {
+            pending_log.steps = current_request.steps;
+            pending_log.tool_calls = current_request.tool_calls;
+            pending_log.input_tokens = current_request.input_tokens;
+            pending_log.output_tokens = current_request.output_tokens;
+            pending_log.tool_ms = current_request.tool_ms;
+            pending_log.provider_ms = std::max(0.0, pending_log.total_ms - pending_log.tool_ms - execute_ms);
+        }
+
+        log_queue_push(pending_log, may_launch);
+    }
+
+    void query_log_finish(const char *outcome, int64 rows = 0, double execute_ms = 0, const std::string &error = "")
+    {
+        if (!log_pending)
+            return;
+        strlcpy(pending_log.error, error.c_str(), sizeof(pending_log.error));
+        query_log_complete(outcome, rows, execute_ms, true);
+    }
+
+    /**
+     * A request that ended in ERROR is logged from the abort; the error text was
+     * captured by the emit_log_hook while it was reported
+     */
+    static void query_log_xact_callback(XactEvent event, void *arg)
+    {
+        if (log_pending && (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT))
+            query_log_complete("error", 0, 0, false);
+    }
+
+    static void database_worker_detach(int code, Datum arg)
+    {
+        AiLogQueueState *state = log_queue_state;
+        if (state == nullptr)
+            return;
+
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        for (int i = 0; i < AI_LOG_WORKERS; i++)
+        {
+            if (state->workers[i].pid == MyProcPid)
+            {
+                state->workers[i].database_id = InvalidOid;
+                state->workers[i].pid = 0;
+                state->workers[i].latch = nullptr;
+            }
+        }
+        LWLockRelease(&state->hdr.lock);
+    }
+
+    /**
+     * Take all queued entries of one database, oldest first.
+     * With none left and exit_if_idle set, the worker slot is released under the
+     * same lock so no entry can be queued for a writer that is going away.
+     * Returns: false if the caller should exit
+     */
+    static bool log_queue_drain(Oid database_id, bool exit_if_idle, std::vector<AiLogEntry> *batch)
+    {
+        AiLogQueueState *state = log_queue_state;
+        bool keep_running = true;
+
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        for (int i = 0; i < AI_LOG_QUEUE_SLOTS; i++)
+        {
+            AiLogEntry *entry = &state->entries[i];
+            if (entry->in_use && entry->database_id == database_id)
+            {
+                batch->push_back(*entry);
+                entry->in_use = false;
+                state->pending--;
+            }
+        }
+
+        if (batch->empty() && exit_if_idle)
+        {
+            for (int i = 0; i < AI_LOG_WORKERS; i++)
+            {
+                if (state->workers[i].pid == MyProcPid)
+                {
+                    state->workers[i].database_id = InvalidOid;
+                    state->workers[i].pid = 0;
+                    state->workers[i].latch = nullptr;
+                }
+            }
+            keep_running = false;
+        }
+        LWLockRelease(&state->hdr.lock);
+
+        std::sort(batch->begin(), batch->end(), [](const AiLogEntry &a, const AiLogEntry &b)
+                  { return a.logged_at < b.logged_at; });
+        return keep_running;
+    }
+
+    /**
+     * Create the UTC day partition holding ts, plus the next day's so the
+     * boundary is never crossed without one. SPI must be connected.
+     */
+    static void log_ensure_partition(TimestampTz ts, std::set<int64> *created)
+    {
+        int64 day = ts / USECS_PER_DAY - (ts < 0 && ts % USECS_PER_DAY != 0 ? 1 : 0);
+
+        for (int64 d = day; d <= day + 1; d++)
+        {
+            if (created->count(d))
+                continue;
+
+            int year, month, mday, next_year, next_month, next_mday;
+            j2date((int)(d + POSTGRES_EPOCH_JDATE), &year, &month, &mday);
+            j2date((int)(d + 1 + POSTGRES_EPOCH_JDATE), &next_year, &next_month, &next_mday);
+
+            char sql[512];
+            snprintf(sql, sizeof(sql),
+                     "CREATE TABLE IF NOT EXISTS ai_toolkit.query_log_%04d%02d%02d "
+                     "PARTITION OF ai_toolkit.query_log "
+                     "FOR VALUES FROM ('%04d-%02d-%02d 00:00:00+00') TO ('%04d-%02d-%02d 00:00:00+00')",
+                     year, month, mday, year, month, mday, next_year, next_month, next_mday);
+
+            if (SPI_execute(sql, false, 0) < 0)
+                elog(ERROR, "[log_ensure_partition] Failed to create query log partition");
+            created->insert(d);
+        }
+    }
+
+    /**
+     * Insert a batch as multi-row INSERTs in one transaction
+     */
+    static void log_write_batch(const std::vector<AiLogEntry> &batch, std::set<int64> *created)
+    {
+        SetCurrentStatementStartTimestamp();
+        StartTransactionCommand();
+        SPI_connect();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        pgstat_report_activity(STATE_RUNNING, "writing ai_toolkit query log");
+
+        // The extension may have been dropped from this database since the entries were queued
+        int ret = SPI_execute("SELECT to_regclass('ai_toolkit.query_log') IS NOT NULL", true, 1);
+        bool installed = false;
+        if (ret == SPI_OK_SELECT && SPI_processed > 0)
+        {
+            bool isnull;
+            installed = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+        }
+
+        if (installed)
+        {
+            for (const AiLogEntry &entry : batch)
+                log_ensure_partition(entry.logged_at, created);
+
+            static const Oid column_types[AI_LOG_COLUMNS] = {
+                TIMESTAMPTZOID, INT4OID, OIDOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID,
+                INT4OID, INT4OID, INT8OID, INT8OID, INT8OID, FLOAT8OID, FLOAT8OID, FLOAT8OID, FLOAT8OID};
+
+            for (size_t offset = 0; offset < batch.size(); offset += AI_LOG_BATCH_ROWS)
+            {
+                size_t count = std::min((size_t)AI_LOG_BATCH_ROWS, batch.size() - offset);
+                std::vector<Oid> argtypes;
+                std::vector<Datum> values;
+                std::vector<char> nulls;
+                std::string sql = "INSERT INTO ai_toolkit.query_log "
+                                  "(logged_at, pid, usesysid, function_name, prompt, generated_sql, model, outcome, error, "
+                                  "steps, tool_calls, input_tokens, output_tokens, rows_returned, "
+                                  "total_ms, provider_ms, tool_ms, execute_ms) VALUES ";
+
+                for (size_t r = 0; r < count; r++)
+                {
+                    const AiLogEntry &e = batch[offset + r];
+                    sql += r > 0 ? ", (" : "(";
+                    for (int c = 0; c < AI_LOG_COLUMNS; c++)
+                    {
+                        sql += (c > 0 ? ", $" : "$") + std::to_string(r * AI_LOG_COLUMNS + c + 1);
+                        argtypes.push_back(column_types[c]);
+                    }
+                    sql += ")";
+
+                    const char *texts[] = {e.function_name, e.prompt, e.sql, e.model, e.outcome, e.error};
+                    values.push_back(TimestampTzGetDatum(e.logged_at));
+                    values.push_back(Int32GetDatum(e.pid));
+                    values.push_back(ObjectIdGetDatum(e.user_id));
+                    nulls.insert(nulls.end(), {' ', ' ', ' '});
+                    for (const char *t : texts)
+                    {
+                        values.push_back(t[0] ? CStringGetTextDatum(t) : (Datum)0);
+                        nulls.push_back(t[0] ? ' ' : 'n');
+                    }
+                    values.push_back(Int32GetDatum(e.steps));
+                    values.push_back(Int32GetDatum(e.tool_calls));
+                    values.push_back(Int64GetDatum(e.input_tokens));
+                    values.push_back(Int64GetDatum(e.output_tokens));
+                    values.push_back(Int64GetDatum(e.rows));
+                    values.push_back(Float8GetDatum(e.total_ms));
+                    values.push_back(Float8GetDatum(e.provider_ms));
+                    values.push_back(Float8GetDatum(e.tool_ms));
+                    values.push_back(Float8GetDatum(e.execute_ms));
+                    nulls.insert(nulls.end(), {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '});
+                }
+
+                ret = SPI_execute_with_args(sql.c_str(), (int)values.size(), argtypes.data(),
+                                            values.data(), nulls.data(), false, 0);
+                if (ret != SPI_OK_INSERT)
+                    elog(ERROR, "[log_write_batch] Failed to insert query log rows: %s", SPI_result_code_string(ret));
+            }
+        }
+
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+        pgstat_report_activity(STATE_IDLE, NULL);
+
+        if (installed)
+            stat_add("query_log.written", (int64)batch.size());
+    }
+
+    /**
+     * Drop day partitions older than ai_toolkit.log_retention_days
+     */
+    static void log_apply_retention()
+    {
+        if (log_retention_days <= 0)
+            return;
+
+        SetCurrentStatementStartTimestamp();
+        StartTransactionCommand();
+        SPI_connect();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        pgstat_report_activity(STATE_RUNNING, "dropping expired ai_toolkit query log partitions");
+
+        std::string sql = "SELECT c.relname FROM pg_inherits i JOIN pg_class c ON c.oid = i.inhrelid "
+                          "WHERE i.inhparent = to_regclass('ai_toolkit.query_log') "
+                          "AND c.relname ~ '^query_log_[0-9]{8}$' "
+                          "AND to_date(substr(c.relname, 11), 'YYYYMMDD') < (now() AT TIME ZONE 'UTC')::date - $1";
+        Datum values[1] = {Int32GetDatum(log_retention_days)};
+        Oid argtypes[1] = {INT4OID};
+
+        std::vector<std::string> expired;
+        int ret = SPI_execute_with_args(sql.c_str(), 1, argtypes, values, NULL, true, 0);
+        for (uint64 i = 0; ret == SPI_OK_SELECT && i < SPI_processed; i++)
+            expired.push_back(SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1));
+
+        for (const std::string &partition : expired)
+        {
+            std::string drop = "DROP TABLE ai_toolkit." + std::string(quote_identifier(partition.c_str()));
+            SPI_execute(drop.c_str(), false, 0);
+            elog(LOG, "[log_apply_retention] Dropped %s", partition.c_str());
+        }
+
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+        pgstat_report_activity(STATE_IDLE, NULL);
+    }
+
+    /**
+     * Run ai_toolkit.maintain_memories() with the configured decay, floor and TTL
+     */
+    static void memory_run_maintenance()
+    {
+        SetCurrentStatementStartTimestamp();
+        StartTransactionCommand();
+        SPI_connect();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        pgstat_report_activity(STATE_RUNNING, "ai_toolkit memory maintenance");
+
+        int ret = SPI_execute("SELECT to_regprocedure('ai_toolkit.maintain_memories(integer,integer,integer)') IS NOT NULL",
+                              true, 1);
+        bool installed = false;
+        if (ret == SPI_OK_SELECT && SPI_processed > 0)
+        {
+            bool isnull;
+            installed = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+        }
+
+        if (installed)
+        {
+            Datum values[3] = {Int32GetDatum(memory_half_life), Int32GetDatum(memory_min_confidence),
+                               Int32GetDatum(memory_ttl)};
+            Oid argtypes[3] = {INT4OID, INT4OID, INT4OID};
+
+            ret = SPI_execute_with_args("SELECT * FROM ai_toolkit.maintain_memories($1, $2, $3)",
+                                        3, argtypes, values, NULL, false, 1);
+            if (ret == SPI_OK_SELECT && SPI_processed > 0)
+            {
+                const char *names[] = {"memory.invalidated", "memory.decayed", "memory.expired", "memory.merged"};
+                int64 counts[4];
+                for (int i = 0; i < 4; i++)
+                {
+                    bool isnull;
+                    Datum d = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, i + 1, &isnull);
+                    counts[i] = isnull ? 0 : DatumGetInt64(d);
+                    if (counts[i] > 0)
+                        stat_add(names[i], counts[i]);
+                }
+
+                if (counts[0] + counts[2] + counts[3] > 0)
+                {
+                    elog(LOG, "[memory_run_maintenance] invalidated %lld, expired %lld, merged %lld memories",
+                         (long long)counts[0], (long long)counts[2], (long long)counts[3]);
+                }
+            }
+        }
+
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+        pgstat_report_activity(STATE_IDLE, NULL);
+    }
+
+    /**
+     * Start this database's worker if memory maintenance needs it. Checked at most
+     * once a minute per backend, so toolkit calls pay one shared lock now and then.
+     */
+    void memory_maintenance_schedule()
+    {
+        static TimestampTz last_check = 0;
+        TimestampTz now = GetCurrentTimestamp();
+
+        if (memory_maintenance_interval <= 0 || !TimestampDifferenceExceeds(last_check, now, 60 * 1000))
+            return;
+
+        last_check = now;
+        database_worker_ensure(MyDatabaseId);
+    }
+
+    /**
+     * Database worker: one per database. Writes queued log entries every
+     * ai_toolkit.log_flush_interval (or when woken by a filling queue), drops expired
+     * log partitions hourly and runs memory maintenance every
+     * ai_toolkit.memory_maintenance_interval. Without maintenance it exits after five
+     * idle minutes; the next request starts it again.
+     */
+    PGDLLEXPORT void database_worker_main(Datum main_arg)
+    {
+        Oid database_id = DatumGetObjectId(main_arg);
+
+        pqsignal(SIGHUP, SignalHandlerForConfigReload);
+        pqsignal(SIGTERM, die);
+        BackgroundWorkerUnblockSignals();
+        BackgroundWorkerInitializeConnectionByOid(database_id, InvalidOid, 0);
+
+        AiLogQueueState *state = log_queue_attach();
+        bool registered = false;
+
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        for (int i = 0; i < AI_LOG_WORKERS; i++)
+        {
+            AiLogWorkerSlot *slot = &state->workers[i];
+            if (slot->database_id == database_id && slot->pid == 0)
+            {
+                slot->pid = MyProcPid;
+                slot->latch = MyLatch;
+                registered = true;
+                break;
+            }
+        }
+        LWLockRelease(&state->hdr.lock);
+
+        // Our slot was reclaimed (slow start) or another worker already serves this database
+        if (!registered)
+            proc_exit(0);
+
+        before_shmem_exit(database_worker_detach, (Datum)0);
+
+        std::set<int64> partitions;
+        TimestampTz last_activity = GetCurrentTimestamp();
+        TimestampTz last_retention = 0;
+        TimestampTz last_maintenance = 0;
+
+        for (;;)
+        {
+            (void)WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                            log_flush_interval, PG_WAIT_EXTENSION);
+            ResetLatch(MyLatch);
+            CHECK_FOR_INTERRUPTS();
+
+            if (ConfigReloadPending)
+            {
+                ConfigReloadPending = false;
+                ProcessConfigFile(PGC_SIGHUP);
+            }
+
+            TimestampTz now = GetCurrentTimestamp();
+            bool idle = memory_maintenance_interval <= 0 &&
+                        TimestampDifferenceExceeds(last_activity, now, 5 * 60 * 1000);
+
+            std::vector<AiLogEntry> batch;
+            if (!log_queue_drain(database_id, idle, &batch))
+                break;
+
+            if (!batch.empty())
+            {
+                log_write_batch(batch, &partitions);
+                last_activity = now;
+            }
+
+            if (TimestampDifferenceExceeds(last_retention, now, 60 * 60 * 1000))
+            {
+                log_apply_retention();
+                last_retention = now;
+            }
+
+            if (memory_maintenance_interval > 0 &&
+                TimestampDifferenceExceeds(last_maintenance, now, memory_maintenance_interval * 1000))
+            {
+                memory_run_maintenance();
+                last_maintenance = now;
+            }
+        }
+
+        proc_exit(0);
+    }
+
+#define AI_ERROR_RING_SIZE 16
+
+    /**
+     * Errors captured by emit_log_hook for explain_error() / explain_query() without arguments.
+     * Backend-local and written only by this backend, so it needs no locks; fixed-size
+     * buffers keep the hook free of allocations and catalog access.
+     */
+    typedef struct AiCapturedError
+    {
+        TimestampTz logged_at;
+        char sqlstate[6];
+        int cursorpos;
+        char message[1024];
+        char detail[512];
+        char hint[256];
+        char statement[2048];
+    } AiCapturedError;
+
+    static AiCapturedError captured_errors[AI_ERROR_RING_SIZE];
+    static uint64 captured_error_count = 0;
+    static emit_log_hook_type prev_emit_log_hook = NULL;
+
+    static void capture_field(char *dest, size_t size, const char *src)
+    {
+        if (src)
+            strlcpy(dest, src, size);
+        else
+            dest[0] = '\0';
+    }
+
+    /**
+     * Record ERROR-and-above reports into the ring. Anything below ERROR returns
+     * after one comparison; errors raised by this extension itself are not recorded,
+     * so a failed explain_error() does not displace the error it was asked about.
+     */
+    static void capture_error_hook(ErrorData *edata)
+    {
+        if (edata->elevel >= ERROR && log_pending)
+            capture_field(pending_log.error, sizeof(pending_log.error), edata->message);
+
+        if (edata->elevel >= ERROR &&
+            !(edata->filename && strstr(edata->filename, "ai_toolkit") != NULL))
+        {
+            AiCapturedError *entry = &captured_errors[captured_error_count % AI_ERROR_RING_SIZE];
+
+            entry->logged_at = GetCurrentTimestamp();
+            strlcpy(entry->sqlstate, unpack_sql_state(edata->sqlerrcode), sizeof(entry->sqlstate));
+            capture_field(entry->message, sizeof(entry->message), edata->message);
+            capture_field(entry->detail, sizeof(entry->detail), edata->detail);
+            capture_field(entry->hint, sizeof(entry->hint), edata->hint);
+
+            // For SQL run through SPI (such as generated queries) the failing statement is the internal query
+            if (edata->internalquery)
+            {
+                entry->cursorpos = edata->internalpos;
+                capture_field(entry->statement, sizeof(entry->statement), edata->internalquery);
+            }
+            else
+            {
+                entry->cursorpos = edata->cursorpos;
+                capture_field(entry->statement, sizeof(entry->statement), debug_query_string);
+            }
+            captured_error_count++;
+        }
+
+        if (prev_emit_log_hook)
+            prev_emit_log_hook(edata);
+    }
+
+    /**
+     * The n-th most recent captured error (0 = latest)
+     */
+    const AiCapturedError *captured_error(uint64 n)
+    {
+        if (n >= captured_error_count || n >= AI_ERROR_RING_SIZE)
+            return nullptr;
+        return &captured_errors[(captured_error_count - 1 - n) % AI_ERROR_RING_SIZE];
+    }
+
+    /**
+     * Render a captured error the way psql prints it
+     */
+    std::string format_captured_error(const AiCapturedError *entry)
+    {
+        std::string text = std::string("ERROR:  ") + entry->message + "\n";
+        if (entry->detail[0])
+            text += std::string("DETAIL:  ") + entry->detail + "\n";
+        if (entry->hint[0])
+            text += std::string("HINT:  ") + entry->hint + "\n";
+        if (entry->statement[0])
+        {
+            text += std::string("STATEMENT:  ") + entry->statement + "\n";
+            if (entry->cursorpos > 0)
+                text += "(error at character " + std::to_string(entry->cursorpos) + ")\n";
+        }
+        text += std::string("SQL state: ") + entry->sqlstate;
+        return text;
+    }
+
+#define AI_SESSION_HISTORY_SIZE 50
+
+    /**
+     * Session state: what ai_toolkit.query() did in this backend. Kept in backend memory
+     * so requests never write to a shared table row; the latest request is also published
+     * to a PID-keyed shared slot for monitoring (ai_toolkit.sessions).
+     */
+    struct AiQueryHistoryEntry
+    {
+        TimestampTz requested_at;
+        std::string prompt;
+        std::string sql;
+        std::string model;
+        std::string outcome;
+        int64 rows;
+    };
+
+    static std::deque<AiQueryHistoryEntry> query_history;
+
+#define AI_SESSION_PROMPTLEN 256
+#define AI_SESSION_SQLLEN 1024
+
+    typedef struct AiSessionSlot
+    {
+        int pid; // 0 if unused
+        Oid database_id;
+        Oid user_id;
+        uint64 requests;
+        TimestampTz last_request_at;
+        int64 last_rows;
+        char last_outcome[32];
+        char last_prompt[AI_SESSION_PROMPTLEN];
+        char last_sql[AI_SESSION_SQLLEN];
+    } AiSessionSlot;
+
+    typedef struct AiSessionState
+    {
+        AiSharedHeader hdr;
+        int nslots;
+        AiSessionSlot slots[FLEXIBLE_ARRAY_MEMBER];
+    } AiSessionState;
+
+    static AiSessionState *session_state = nullptr;
+    static bool session_exit_registered = false;
+
+    static void session_init_state(void *ptr)
+    {
+        AiSessionState *state = (AiSessionState *)ptr;
+        shared_header_init(&state->hdr);
+        state->nslots = MaxBackends;
+        memset(state->slots, 0, sizeof(AiSessionSlot) * MaxBackends);
+    }
+
+    static AiSessionState *session_attach()
+    {
+        if (session_state == nullptr)
+        {
+            session_state = (AiSessionState *)shared_segment_attach("ai_toolkit_sessions",
+                                                                    offsetof(AiSessionState, slots) + sizeof(AiSessionSlot) * MaxBackends,
+                                                                    session_init_state);
+        }
+        return session_state;
+    }
+
+    static void session_slot_clear(int code, Datum arg)
+    {
+        AiSessionState *state = session_state;
+        if (state == nullptr || MyProcNumber < 0 || MyProcNumber >= state->nslots)
+            return;
+
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        if (state->slots[MyProcNumber].pid == MyProcPid)
+            state->slots[MyProcNumber].pid = 0;
+        LWLockRelease(&state->hdr.lock);
+    }
+
+    /**
+     * Copy the latest history entry into this backend's shared slot
+     */
+    static void session_publish(const AiQueryHistoryEntry &entry, bool new_request)
+    {
+        if (!track_sessions)
+            return;
+
+        AiSessionState *state = session_attach();
+        if (MyProcNumber < 0 || MyProcNumber >= state->nslots)
+            return;
+
+        if (!session_exit_registered)
+        {
+            before_shmem_exit(session_slot_clear, (Datum)0);
+            session_exit_registered = true;
+        }
+
+        AiSessionSlot *slot = &state->slots[MyProcNumber];
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        if (slot->pid != MyProcPid)
+        {
+            memset(slot, 0, sizeof(AiSessionSlot));
+            slot->pid = MyProcPid;
+        }
+        slot->database_id = MyDatabaseId;
+        slot->user_id = GetUserId();
+        if (new_request)
+            slot->requests++;
+        slot->last_request_at = entry.requested_at;
+        slot->last_rows = entry.rows;
+        strlcpy(slot->last_outcome, entry.outcome.c_str(), sizeof(slot->last_outcome));
+        strlcpy(slot->last_prompt, entry.prompt.c_str(), sizeof(slot->last_prompt));
+        strlcpy(slot->last_sql, entry.sql.c_str(), sizeof(slot->last_sql));
+        LWLockRelease(&state->hdr.lock);
+    }
+
+    /**
+     * Record a query() request in the session history
+     */
+    void session_record_query(const std::string &prompt, const std::string &sql,
+                              const std::string &model, const std::string &outcome)
+    {
+        query_history.push_back({GetCurrentTimestamp(), prompt, sql, model, outcome, 0});
+        if (query_history.size() > AI_SESSION_HISTORY_SIZE)
+            query_history.pop_front();
+
+        session_publish(query_history.back(), true);
+    }
+
+    /**
+     * Update the outcome of the most recent request, e.g. once its SQL has run
+     */
+    void session_update_outcome(const std::string &outcome, int64 rows)
+    {
+        if (query_history.empty())
+            return;
+
+        query_history.back().outcome = outcome;
+        query_history.back().rows = rows;
+        session_publish(query_history.back(), false);
+    }
+
+    /**
+     * The most recent SQL generated in this session, if any
+     */
+    std::optional<std::string> session_last_sql()
+    {
+        for (auto it = query_history.rbegin(); it != query_history.rend(); ++it)
+        {
+            if (!it->sql.empty())
+                return it->sql;
+        }
+        return std::nullopt;
+    }
+
+#define AI_EXAMPLE_DIMS 256
+
+    /**
+     * Local text embedding for example retrieval: stemmed words and word bigrams,
+     * with built-in synonyms folded to one term, feature-hashed into a signed vector
+     * and L2-normalized, so a dot product is the cosine similarity
+     */
+    std::vector<float> text_embedding(const std::string &text)
+    {
+        std::vector<std::string> words = text_words(text);
+        for (auto &word : words)
+        {
+            for (const auto &group : builtin_synonyms)
+            {
+                auto member = std::find_if(group.begin(), group.end(), [&](const std::string &s)
+                                           { return stem_word(s) == word; });
+                if (member != group.end())
+                {
+                    word = stem_word(group.front());
+                    break;
+                }
+            }
+        }
+
+        std::vector<float> vector(AI_EXAMPLE_DIMS, 0.0f);
+        auto add = [&](const std::string &feature, float weight)
+        {
+            uint64 hash = fingerprint(feature);
+            vector[hash % AI_EXAMPLE_DIMS] += (hash >> 63) ? weight : -weight;
+        };
+        for (size_t i = 0; i < words.size(); i++)
+        {
+            add(words[i], 1.0f);
+            if (i + 1 < words.size())
+                add(words[i] + " " + words[i + 1], 0.5f);
+        }
+
+        double norm = 0;
+        for (float v : vector)
+            norm += (double)v * v;
+        if (norm > 0)
+        {
+            for (float &v : vector)
+                v = (float)(v / std::sqrt(norm));
+        }
+        return vector;
+    }
+
+    static std::string embedding_literal(const std::vector<float> &vector)
+    {
+        std::string out = "{";
+        char buf[32];
+        for (size_t i = 0; i < vector.size(); i++)
+        {
+            snprintf(buf, sizeof(buf), i > 0 ? ",%.6g" : "%.6g", vector[i]);
+            out += buf;
+        }
+        return out + "}";
+    }
+
+    /**
+     * Verified question/SQL examples, cached per backend and reloaded when the
+     * table's row count or latest update changes
+     */
+    struct AiExample
+    {
+        int id;
+        std::string question;
+        std::string sql;
+        std::string created_by;
+        std::vector<float> embedding;
+    };
+
+    struct AiExampleMatch
+    {
+        int id;
+        std::string question;
+        std::string sql;
+        std::string created_by;
+        double similarity;
+    };
+
+    static std::vector<AiExample> examples_cache;
+    static std::string examples_version;
+
+    static void examples_load()
+    {
+        int ret = SPI_execute("SELECT count(*) || '/' || coalesce(max(updated_at)::text, '') "
+                              "FROM ai_toolkit.query_examples WHERE verified",
+                              true, 1);
+        if (ret != SPI_OK_SELECT || SPI_processed == 0)
+            return;
+
+        char *version = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+        if (version && examples_version == version)
+            return;
+        examples_version = version ? version : "";
+
+        ret = SPI_execute("SELECT id, question, sql, embedding::text, coalesce(created_by, '') "
+                          "FROM ai_toolkit.query_examples WHERE verified",
+                          true, 0);
+        if (ret != SPI_OK_SELECT)
+        {
+            elog(WARNING, "[examples_load] Failed to read query examples");
+            return;
+        }
+
+        examples_cache.clear();
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+            bool isnull;
+
+            AiExample example;
+            example.id = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+            example.question = SPI_getvalue(tuple, tupdesc, 2);
+            example.sql = SPI_getvalue(tuple, tupdesc, 3);
+            example.created_by = SPI_getvalue(tuple, tupdesc, 5);
+
+            char *stored = SPI_getvalue(tuple, tupdesc, 4);
+            if (stored)
+            {
+                for (char *p = stored + 1; *p && *p != '}';)
+                {
+                    char *end;
+                    example.embedding.push_back(strtof(p, &end));
+                    p = *end == ',' ? end + 1 : end;
+                    if (end == p && *p != '}')
+                        break;
+                }
+            }
+            // Stored with a different embedding layout: recompute from the question
+            if (example.embedding.size() != AI_EXAMPLE_DIMS)
+                example.embedding = text_embedding(example.question);
+
+            examples_cache.push_back(std::move(example));
+        }
+
+        elog(LOG, "[examples_load] Loaded %zu verified examples", examples_cache.size());
+    }
+
+    /**
+     * Verified examples most similar to a question, best first. SPI must be connected.
+     */
+    std::vector<AiExampleMatch> example_search(const std::string &question, int k, double min_similarity)
+    {
+        std::vector<AiExampleMatch> matches;
+        if (k <= 0)
+            return matches;
+
+        examples_load();
+
+        std::vector<float> query = text_embedding(question);
+        for (const auto &example : examples_cache)
+        {
+            double similarity = 0;
+            for (int d = 0; d < AI_EXAMPLE_DIMS; d++)
+                similarity += (double)query[d] * example.embedding[d];
+            if (similarity >= min_similarity)
+                matches.push_back({example.id, example.question, example.sql, example.created_by, similarity});
+        }
+
+        std::sort(matches.begin(), matches.end(), [](const AiExampleMatch &a, const AiExampleMatch &b)
+                  { return a.similarity > b.similarity; });
+        if (matches.size() > (size_t)k)
+            matches.resize(k);
+        return matches;
+    }
+
+    /**
+     * Count a use of an example. Best effort: never fails the caller (e.g. read-only transactions).
+     */
+    static void example_touch(int id)
+    {
+        Datum values[1] = {Int32GetDatum(id)};
+        char nulls[1] = {' '};
+        Oid argtypes[1] = {INT4OID};
+        std::string error;
+
+        bool ok = run_in_subtransaction([&]
+                                        {
+            int ret = SPI_execute_with_args("UPDATE ai_toolkit.query_examples SET uses = uses + 1, last_used_at = CURRENT_TIMESTAMP "
+                                            "WHERE id = $1",
+                                            1, argtypes, values, nulls, false, 0);
+            if (ret < 0)
+                throw std::runtime_error(SPI_result_code_string(ret)); },
+                                        &error);
+        if (!ok)
+            elog(LOG, "[example_touch] Failed to count example use: %s", error.c_str());
+    }
+
+    /**
+     * check_functions_in_node callback: true for functions an example may not call,
+     * i.e. volatile ones and anything not built in
+     */
+    static bool example_function_unsafe(Oid func_id, void *context)
+    {
+        return func_id >= FirstNormalObjectId || func_volatile(func_id) == PROVOLATILE_VOLATILE;
+    }
+
+    static bool example_unsafe_walker(Node *node, void *context)
+    {
+        if (node == NULL)
+            return false;
+        if (check_functions_in_node(node, example_function_unsafe, context))
+            return true;
+        if (IsA(node, Query))
+            return query_tree_walker((Query *)node, example_unsafe_walker, context, 0);
+        return expression_tree_walker(node, example_unsafe_walker, context);
+    }
+
+    /**
+     * Whether an example's SQL may run without the model: a single read-only SELECT
+     * that, after view and policy expansion, calls only built-in immutable or stable
+     * functions, so running it for another user can't write anything or run code
+     * someone else defined. SPI must be connected.
+     */
+    static bool example_sql_safe(const std::string &sql, std::string *reason)
+    {
+        if (!safe_to_analyze(sql))
+        {
+            *reason = "not a single read-only SELECT statement";
+            return false;
+        }
+
+        bool unsafe = true;
+        std::string error;
+        bool ok = run_in_subtransaction([&]
+                                        {
+            List *parsetree = raw_parser(sql.c_str(), RAW_PARSE_DEFAULT);
+            List *queries = pg_analyze_and_rewrite_fixedparams((RawStmt *)linitial(parsetree), sql.c_str(),
+                                                               nullptr, 0, nullptr);
+            unsafe = false;
+            ListCell *lc;
+            foreach (lc, queries)
+                unsafe = unsafe || example_unsafe_walker((Node *)lfirst(lc), nullptr); },
+                                        &error, true);
+        if (!ok)
+            *reason = error;
+        else if (unsafe)
+            *reason = "it calls volatile or user-defined functions";
+        return ok && !unsafe;
+    }
+
+    /**
+     * Whether the fast path may run an example for the current user: it was stored by
+     * this user, a superuser or one of ai_toolkit.example_trusted_roles
+     */
+    static bool example_trusted(const std::string &created_by)
+    {
+        if (created_by.empty())
+            return false;
+        if (created_by == GetUserNameFromId(GetUserId(), false))
+            return true;
+
+        Oid creator = get_role_oid(created_by.c_str(), true);
+        if (OidIsValid(creator) && superuser_arg(creator))
+            return true;
+
+        if (example_trusted_roles && example_trusted_roles[0] != '\0')
+        {
+            std::stringstream list(example_trusted_roles);
+            for (std::string role; std::getline(list, role, ',');)
+            {
+                role.erase(0, role.find_first_not_of(" \t"));
+                role.erase(role.find_last_not_of(" \t") + 1);
+                if (role == created_by)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Store a verified example; the SQL must be a single read-only SELECT calling only
+     * built-in immutable or stable functions. It is checked as the caller, with the caller's
+     * search_path, then written as the table owner (callers cannot insert) with the calling
+     * role recorded.
+     * Returns the example id. SPI must be connected.
+     */
+    static int example_store(const std::string &question, const std::string &sql)
+    {
+        std::string reason;
+        if (!example_sql_safe(sql, &reason))
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("Example SQL must be a single read-only SELECT statement calling only built-in, non-volatile functions"),
+                     errdetail("%s", reason.c_str())));
+
+        std::string insert_sql =
+            "INSERT INTO ai_toolkit.query_examples (question, normalized_question, sql, embedding, verified, created_by) "
+            "VALUES ($1, $2, $3, $4::real[], true, $5) "
+            "ON CONFLICT (normalized_question) DO UPDATE SET "
+            "question = EXCLUDED.question, sql = EXCLUDED.sql, embedding = EXCLUDED.embedding, "
+            "verified = true, created_by = EXCLUDED.created_by, updated_at = CURRENT_TIMESTAMP "
+            "RETURNING id";
+
+        std::string normalized;
+        for (const auto &word : text_words(question))
+            normalized += (normalized.empty() ? "" : " ") + word;
+
+        Datum values[5];
+        char nulls[5] = {' ', ' ', ' ', ' ', ' '};
+        values[0] = CStringGetTextDatum(question.c_str());
+        values[1] = CStringGetTextDatum(normalized.c_str());
+        values[2] = CStringGetTextDatum(sql.c_str());
+        values[3] = CStringGetTextDatum(embedding_literal(text_embedding(question)).c_str());
+        values[4] = CStringGetTextDatum(GetUserNameFromId(GetUserId(), false));
+        Oid argtypes[5] = {TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID};
+
+        int id = 0;
+        std::string error;
+        bool ok = run_as_table_owner("query_examples", [&]
+                                     {
+            int ret = SPI_execute_with_args(insert_sql.c_str(), 5, argtypes, values, nulls, false, 1);
+            if (ret != SPI_OK_INSERT_RETURNING || SPI_processed != 1)
+                throw std::runtime_error("no row returned");
+
+            bool isnull;
+            id = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull)); },
+                                     &error);
+        if (!ok)
+            ereport(ERROR,
+                    (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                     errmsg("Failed to store query example: %s", error.c_str())));
+        stat_add("examples.stored", 1);
+        return id;
+    }
+
+    /**
+     * Print the rows of the last SPI query as a table via NOTICE
+     */
+    void print_query_results()
+    {
+        if (SPI_processed > 0)
+        {
+            std::stringstream table_output;
+            table_output << "\n📊 Query Results (" << SPI_processed << " rows):\n";
+            table_output << "═══════════════════════════════════════════════════════════\n";
+
+            SPITupleTable *tuptable = SPI_tuptable;
+            TupleDesc tupdesc = tuptable->tupdesc;
+
+            // Print column headers
+            for (int i = 0; i < tupdesc->natts; i++)
+            {
+                if (i > 0)
+                    table_output << " | ";
+                table_output << SPI_fname(tupdesc, i + 1);
+            }
+            table_output << "\n";
+            table_output << "───────────────────────────────────────────────────────────\n";
+
+            // Print rows
+            for (uint64 row = 0; row < SPI_processed; row++)
+            {
+                HeapTuple tuple = tuptable->vals[row];
+                for (int col = 1; col <= tupdesc->natts; col++)
+                {
+                    if (col > 1)
+                        table_output << " | ";
+
+                    bool isnull;
+                    Datum datum = SPI_getbinval(tuple, tupdesc, col, &isnull);
+
+                    if (isnull)
+                    {
+                        table_output << "NULL";
+                    }
+                    else
+                    {
+                        char *value = SPI_getvalue(tuple, tupdesc, col);
+                        table_output << value;
+                        pfree(value);
+                    }
+                }
+                table_output << "\n";
+            }
+
+            table_output << "═══════════════════════════════════════════════════════════\n";
+            elog(NOTICE, "%s", table_output.str().c_str());
+        }
+        else
+        {
+            elog(NOTICE, "\n✓ Query executed successfully. No rows returned.\n");
+        }
+    }
+
+#define AI_STANDBY_CHUNK_ROWS 1000
+
+    static PGconn *standby_conn = nullptr;
+    static std::string standby_conn_info; // conninfo standby_conn was opened with
+    static uint32 standby_wait_event = 0;
+
+    static void standby_disconnect()
+    {
+        if (standby_conn != nullptr)
+        {
+            libpqsrv_disconnect(standby_conn);
+            standby_conn = nullptr;
+        }
+    }
+
+    /**
+     * The backend's standby connection, reused across requests. It is reopened when
+     * ai_toolkit.standby_conninfo changes or the connection broke or was left mid-query.
+     * Returns: nullptr if the standby cannot be reached
+     */
+    static PGconn *standby_connection()
+    {
+        if (standby_wait_event == 0)
+            standby_wait_event = WaitEventExtensionNew("AiToolkitStandby");
+
+        if (standby_conn != nullptr &&
+            (standby_conn_info != standby_conninfo || PQstatus(standby_conn) != CONNECTION_OK ||
+             PQtransactionStatus(standby_conn) != PQTRANS_IDLE))
+            standby_disconnect();
+        if (standby_conn != nullptr)
+            return standby_conn;
+
+        PGconn *conn = libpqsrv_connect(standby_conninfo, standby_wait_event);
+        if (conn == nullptr || PQstatus(conn) != CONNECTION_OK)
+        {
+            elog(WARNING, "[standby_connection] Cannot connect to the standby: %s",
+                 conn ? PQerrorMessage(conn) : "out of memory");
+            if (conn)
+                libpqsrv_disconnect(conn);
+            stat_add("standby.connect_failures", 1);
+            return nullptr;
+        }
+
+        // Generated queries are read-only; have the remote session enforce it too
+        PGresult *res = libpqsrv_exec(conn, "SET default_transaction_read_only = on", standby_wait_event);
+        bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        PQclear(res);
+        if (!ok)
+        {
+            elog(WARNING, "[standby_connection] Cannot configure the standby session: %s", PQerrorMessage(conn));
+            libpqsrv_disconnect(conn);
+            return nullptr;
+        }
+
+        standby_conn = conn;
+        standby_conn_info = standby_conninfo;
+        elog(LOG, "[standby_connection] Connected to %s:%s", PQhost(conn), PQport(conn));
+        return standby_conn;
+    }
+
+    /**
+     * Make the standby session run the next query as the local current_user with the local
+     * search_path, so names resolve and privileges apply as they would here. The
+     * connection's role must be a member of that role.
+     * Returns: false if the standby refused either setting
+     */
+    static bool standby_adopt_identity(PGconn *conn)
+    {
+        const char *values[2] = {GetUserNameFromId(GetUserId(), false),
+                                 GetConfigOption("search_path", false, false)};
+        PGresult *res = libpqsrv_exec_params(conn,
+                                             "SELECT pg_catalog.set_config('role', $1, false), "
+                                             "pg_catalog.set_config('search_path', $2, false)",
+                                             2, nullptr, values, nullptr, nullptr, 0, standby_wait_event);
+        bool ok = PQresultStatus(res) == PGRES_TUPLES_OK;
+        if (!ok)
+            elog(LOG, "[standby_adopt_identity] Cannot run as role \"%s\" on the standby: %s", values[0],
+                 PQresultErrorMessage(res));
+        PQclear(res);
+        return ok;
+    }
+
+    /**
+     * Whether a generated query may run on the standby: a single read-only SELECT that the
+     * current role may run here (checked by EXPLAIN, which does the executor's permission
+     * checks without executing) and that reads no table under row-level security, since
+     * policies may depend on the session user, which differs on the standby. SPI must be
+     * connected.
+     */
+    static bool standby_eligible(const std::string &sql)
+    {
+        if (!safe_to_analyze(sql))
+            return false;
+
+        bool eligible = true;
+        std::string error;
+        bool ok = run_in_subtransaction([&]
+                                        {
+            if (SPI_execute(("EXPLAIN (COSTS OFF) " + sql).c_str(), true, 0) < 0)
+                throw std::runtime_error("EXPLAIN failed");
+
+            SPIPlanPtr plan = SPI_prepare(sql.c_str(), 0, nullptr);
+            if (plan == nullptr)
+                throw std::runtime_error("prepare failed");
+
+            ListCell *lc;
+            foreach (lc, SPI_plan_get_plan_sources(plan))
+            {
+                CachedPlanSource *source = (CachedPlanSource *)lfirst(lc);
+                ListCell *rc;
+                foreach (rc, source->relationOids)
+                {
+                    if (check_enable_rls(lfirst_oid(rc), InvalidOid, true) == RLS_ENABLED)
+                        eligible = false;
+                }
+            }
+            SPI_freeplan(plan); },
+                                        &error);
+
+        return ok && eligible;
+    }
+
+    /**
+     * Run a read-only query on the standby, streaming rows back in chunks of
+     * AI_STANDBY_CHUNK_ROWS: each chunk is printed as it arrives, so neither side
+     * buffers the whole result.
+     * Returns: false if nothing was printed because the standby was unavailable or the
+     * query failed before returning rows; the caller then runs it locally
+     */
+    static bool standby_execute(const std::string &sql, int64 *rows)
+    {
+        PGconn *conn = standby_connection();
+        if (conn == nullptr)
+            return false;
+
+        if (!standby_adopt_identity(conn))
+        {
+            stat_add("standby.fallbacks", 1);
+            return false;
+        }
+
+        if (!PQsendQuery(conn, sql.c_str()) || !PQsetChunkedRowsMode(conn, AI_STANDBY_CHUNK_ROWS))
+        {
+            elog(WARNING, "[standby_execute] Cannot send the query: %s", PQerrorMessage(conn));
+            standby_disconnect();
+            return false;
+        }
+
+        *rows = 0;
+        std::string error;
+        PG_TRY();
+        {
+            PGresult *res;
+            while ((res = libpqsrv_get_result(conn, standby_wait_event)) != nullptr)
+            {
+                ExecStatusType status = PQresultStatus(res);
+                if ((status == PGRES_TUPLES_CHUNK || status == PGRES_TUPLES_OK) && PQntuples(res) > 0)
+                {
+                    std::stringstream chunk;
+                    if (*rows == 0)
+                    {
+                        chunk << "\n📊 Query Results (from standby):\n";
+                        chunk << "═══════════════════════════════════════════════════════════\n";
+                        for (int col = 0; col < PQnfields(res); col++)
+                            chunk << (col > 0 ? " | " : "") << PQfname(res, col);
+                        chunk << "\n───────────────────────────────────────────────────────────\n";
+                    }
+                    for (int row = 0; row < PQntuples(res); row++)
+                    {
+                        for (int col = 0; col < PQnfields(res); col++)
+                        {
+                            if (col > 0)
+                                chunk << " | ";
+                            chunk << (PQgetisnull(res, row, col) ? "NULL" : PQgetvalue(res, row, col));
+                        }
+                        chunk << "\n";
+                    }
+                    *rows += PQntuples(res);
+                    elog(NOTICE, "%s", chunk.str().c_str());
+                }
+                else if (status != PGRES_TUPLES_CHUNK && status != PGRES_TUPLES_OK)
+                {
+                    error = PQresultErrorMessage(res);
+                }
+                PQclear(res);
+            }
+        }
+        PG_CATCH();
+        {
+            // Cancelled mid-stream: dropping the connection stops the remote query
+            standby_disconnect();
+            PG_RE_THROW();
+        }
+        PG_END_TRY();
+
+        if (!error.empty())
+        {
+            if (*rows == 0)
+            {
+                elog(LOG, "[standby_execute] Query failed on the standby, running locally: %s", error.c_str());
+                stat_add("standby.fallbacks", 1);
+                return false;
+            }
+            ereport(ERROR,
+                    (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                     errmsg("Query failed on the standby after %lld rows: %s", (long long)*rows, error.c_str())));
+        }
+
+        if (*rows > 0)
+            elog(NOTICE, "═══════════════════════════════════════════════════════════\n(%lld rows)", (long long)*rows);
+        else
+            elog(NOTICE, "\n✓ Query executed successfully. No rows returned.\n");
+
+        stat_add("standby.queries", 1);
+        stat_add("standby.rows", *rows);
+        return true;
+    }
+
+    /**
+     * Run a generated read-only query and print its rows via NOTICE, recording the
+     * outcome in the session history and query log. With ai_toolkit.standby_conninfo set,
+     * eligible queries run on the standby and fall back to SPI when it is unavailable.
+     * A template passes its kept plan and parameter values for local execution; sql_query
+     * then has the values inlined. SPI must be connected.
+     */
+    void execute_generated_query(const std::string &sql_query, SPIPlanPtr plan = nullptr, Datum *values = nullptr)
+    {
+        elog(NOTICE, "\n📋 Generated Query:\n%s\n", sql_query.c_str());
+        TimestampTz execute_start = GetCurrentTimestamp();
+
+        int64 standby_rows;
+        if (standby_conninfo && standby_conninfo[0] != '\0' && standby_eligible(sql_query))
+        {
+            if (standby_execute(sql_query, &standby_rows))
+            {
+                session_update_outcome("executed", standby_rows);
+                query_log_finish("executed", standby_rows,
+                                 TimestampDifferenceMilliseconds(execute_start, GetCurrentTimestamp()));
+                return;
+            }
+            execute_start = GetCurrentTimestamp();
+        }
+
+        int ret = plan ? SPI_execute_plan(plan, values, nullptr, true, 0) : SPI_execute(sql_query.c_str(), true, 0);
+
+        if (ret < 0)
+        {
+            SPI_finish();
+            ereport(ERROR,
+                    (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                     errmsg("Query execution failed")));
+        }
+
+        session_update_outcome("executed", (int64)SPI_processed);
+        query_log_finish("executed", (int64)SPI_processed,
+                         TimestampDifferenceMilliseconds(execute_start, GetCurrentTimestamp()));
+        print_query_results();
+    }
+
+#define AI_SUMMARY_TOP_K 5
+#define AI_SUMMARY_COUNTERS (AI_SUMMARY_TOP_K * 4)
+#define AI_SUMMARY_SAMPLE_ROWS 5
+#define AI_SUMMARY_FETCH 1000
+
+    /**
+     * Running summary of one result column. Numeric and temporal columns keep min, max and
+     * (numeric only) the sum; other types keep approximate top values with the space-saving
+     * algorithm in AI_SUMMARY_COUNTERS counters. Memory does not depend on the row count.
+     */
+    struct AiColumnSummary
+    {
+        std::string name;
+        Oid type;
+        bool numeric = false;
+        bool temporal = false;
+        int64 values = 0;
+        int64 nulls = 0;
+        double sum = 0;
+        double min_key = 0, max_key = 0;
+        std::string min_text, max_text, first_text, last_text;
+        std::vector<std::pair<std::string, int64>> counters;
+    };
+
+    /**
+     * Sort key of a numeric or temporal datum
+     */
+    static double summary_key(Oid type, Datum value)
+    {
+        switch (type)
+        {
+        case INT2OID:
+            return DatumGetInt16(value);
+        case INT4OID:
+            return DatumGetInt32(value);
+        case INT8OID:
+            return (double)DatumGetInt64(value);
+        case FLOAT4OID:
+            return DatumGetFloat4(value);
+        case FLOAT8OID:
+            return DatumGetFloat8(value);
+        case NUMERICOID:
+            return DatumGetFloat8(DirectFunctionCall1(numeric_float8, value));
+        case DATEOID:
+            return DatumGetDateADT(value);
+        default: // TIMESTAMPOID, TIMESTAMPTZOID
+            return (double)DatumGetTimestamp(value);
+        }
+    }
+
+    static void summary_add(AiColumnSummary &column, HeapTuple tuple, TupleDesc tupdesc, int attno)
+    {
+        bool isnull;
+        Datum value = SPI_getbinval(tuple, tupdesc, attno, &isnull);
+        if (isnull)
+        {
+            column.nulls++;
+            return;
+        }
+
+        char *raw = SPI_getvalue(tuple, tupdesc, attno);
+        std::string text = truncate_value(raw, 80);
+        pfree(raw);
+
+        if (column.values == 0)
+            column.first_text = text;
+        column.last_text = text;
+
+        if (column.numeric || column.temporal)
+        {
+            double key = summary_key(column.type, value);
+            if (column.values == 0 || key < column.min_key)
+            {
+                column.min_key = key;
+                column.min_text = text;
+            }
+            if (column.values == 0 || key > column.max_key)
+            {
+                column.max_key = key;
+                column.max_text = text;
+            }
+            if (column.numeric)
+                column.sum += key;
+        }
+        else
+        {
+            auto it = std::find_if(column.counters.begin(), column.counters.end(),
+                                   [&](const auto &counter)
+                                   { return counter.first == text; });
+            if (it != column.counters.end())
+                it->second++;
+            else if (column.counters.size() < AI_SUMMARY_COUNTERS)
+                column.counters.emplace_back(text, 1);
+            else
+            {
+                auto least = std::min_element(column.counters.begin(), column.counters.end(),
+                                              [](const auto &a, const auto &b)
+                                              { return a.second < b.second; });
+                *least = {text, least->second + 1};
+            }
+        }
+        column.values++;
+    }
+
+    /**
+     * Run a read-only query through a cursor and summarize it in one pass: the row count,
+     * each column's nulls, min/max/avg (numbers), min/max (dates and times), first and last
+     * value in result order, and approximate top values (other types). Only the first
+     * answer_max_rows rows are kept. A kept plan with its parameter values is run instead
+     * of sql when given. SPI must be connected.
+     * Returns: the summary as JSON; "rows" holds the kept rows if that was all of them
+     */
+    static nlohmann::json summarize_query(const std::string &sql, int64 *row_count, SPIPlanPtr kept_plan = nullptr,
+                                          Datum *values = nullptr)
+    {
+        SPIPlanPtr plan = kept_plan ? kept_plan : SPI_prepare(sql.c_str(), 0, nullptr);
+        if (plan == nullptr)
+        {
+            SPI_finish();
+            ereport(ERROR,
+                    (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                     errmsg("Query execution failed")));
+        }
+        Portal portal = SPI_cursor_open(nullptr, plan, values, nullptr, true);
+
+        std::vector<AiColumnSummary> columns;
+        nlohmann::json head = nlohmann::json::array();
+        *row_count = 0;
+
+        for (;;)
+        {
+            SPI_cursor_fetch(portal, true, AI_SUMMARY_FETCH);
+            if (SPI_processed == 0)
+                break;
+
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+            if (columns.empty())
+            {
+                for (int i = 0; i < tupdesc->natts; i++)
+                {
+                    AiColumnSummary column;
+                    column.name = SPI_fname(tupdesc, i + 1);
+                    column.type = SPI_gettypeid(tupdesc, i + 1);
+                    column.numeric = column.type == INT2OID || column.type == INT4OID || column.type == INT8OID ||
+                                     column.type == FLOAT4OID || column.type == FLOAT8OID || column.type == NUMERICOID;
+                    column.temporal = column.type == DATEOID || column.type == TIMESTAMPOID || column.type == TIMESTAMPTZOID;
+                    columns.push_back(column);
+                }
+            }
+
+            for (uint64 row = 0; row < SPI_processed; row++)
+            {
+                HeapTuple tuple = SPI_tuptable->vals[row];
+                if (*row_count < answer_max_rows)
+                {
+                    nlohmann::json kept = nlohmann::json::array();
+                    for (int col = 1; col <= tupdesc->natts; col++)
+                    {
+                        char *value = SPI_getvalue(tuple, tupdesc, col);
+                        kept.push_back(value ? nlohmann::json(truncate_value(value, 80)) : nlohmann::json(nullptr));
+                        if (value)
+                            pfree(value);
+                    }
+                    head.push_back(kept);
+                }
+                for (size_t col = 0; col < columns.size(); col++)
+                    summary_add(columns[col], tuple, tupdesc, (int)col + 1);
+                (*row_count)++;
+            }
+            SPI_freetuptable(SPI_tuptable);
+        }
+        SPI_cursor_close(portal);
+        if (plan != kept_plan)
+            SPI_freeplan(plan);
+
+        nlohmann::json summary_columns = nlohmann::json::array();
+        for (auto &column : columns)
+        {
+            nlohmann::json entry = {{"name", column.name}, {"type", format_type_be(column.type)}};
+            if (column.nulls > 0)
+                entry["nulls"] = column.nulls;
+            if (column.values > 0)
+            {
+                if (column.numeric || column.temporal)
+                {
+                    entry["min"] = column.min_text;
+                    entry["max"] = column.max_text;
+                    if (column.numeric)
+                        entry["avg"] = column.sum / column.values;
+                }
+                else
+                {
+                    std::sort(column.counters.begin(), column.counters.end(), [](const auto &a, const auto &b)
+                              { return a.second > b.second; });
+                    nlohmann::json top = nlohmann::json::array();
+                    for (size_t i = 0; i < column.counters.size() && i < AI_SUMMARY_TOP_K; i++)
+                        top.push_back({column.counters[i].first, column.counters[i].second});
+                    entry["top"] = top;
+                    // Counters were never evicted: the counts are exact and complete
+                    entry["distinct"] = column.counters.size() < AI_SUMMARY_COUNTERS ? nlohmann::json(column.counters.size())
+                                                                                     : nlohmann::json("many");
+                }
+                entry["first"] = column.first_text;
+                entry["last"] = column.last_text;
+            }
+            summary_columns.push_back(entry);
+        }
+
+        nlohmann::json summary = {{"row_count", *row_count}, {"columns", summary_columns}};
+        if (*row_count <= answer_max_rows)
+            summary["rows"] = head;
+        else
+        {
+            head.erase(head.begin() + std::min<size_t>(head.size(), AI_SUMMARY_SAMPLE_ROWS), head.end());
+            summary["sample_rows"] = head;
+        }
+        return summary;
+    }
+
+    /**
+     * Answer mode of query(): summarize the result in-engine and have the model answer the
+     * question from the summary alone, so neither memory nor tokens grow with the row count.
+     * Small results are printed as rows as well. SPI must be connected.
+     */
+    void answer_generated_query(ai::Client &client, const std::string &request_text, const std::string &sql_query,
+                                SPIPlanPtr plan = nullptr, Datum *values = nullptr)
+    {
+        elog(NOTICE, "\n📋 Generated Query:\n%s\n", sql_query.c_str());
+        TimestampTz execute_start = GetCurrentTimestamp();
+
+        int64 row_count;
+        nlohmann::json summary = summarize_query(sql_query, &row_count, plan, values);
+        double execute_ms = TimestampDifferenceMilliseconds(execute_start, GetCurrentTimestamp());
+        session_update_outcome("executed", row_count);
+
+        if (summary.contains("rows") && row_count > 0)
+        {
+            std::stringstream table_output;
+            table_output << "\n📊 Query Results (" << row_count << " rows):\n";
+            table_output << "═══════════════════════════════════════════════════════════\n";
+            for (size_t i = 0; i < summary["columns"].size(); i++)
+                table_output << (i > 0 ? " | " : "") << summary["columns"][i]["name"].get<std::string>();
+            table_output << "\n───────────────────────────────────────────────────────────\n";
+            for (const auto &row : summary["rows"])
+            {
+                for (size_t i = 0; i < row.size(); i++)
+                    table_output << (i > 0 ? " | " : "") << (row[i].is_null() ? "NULL" : row[i].get<std::string>());
+                table_output << "\n";
+            }
+            table_output << "═══════════════════════════════════════════════════════════\n";
+            elog(NOTICE, "%s", table_output.str().c_str());
+        }
+        else if (row_count > 0)
+        {
+            elog(NOTICE, "\n📊 %lld rows summarized in-engine\n", (long long)row_count);
+        }
+
+        if (row_count == 0)
+        {
+            query_log_finish("executed", 0, execute_ms);
+            elog(NOTICE, "\n✓ Query executed successfully. No rows returned.\n");
+            return;
+        }
+
+        std::string system_prompt =
+            "You are a data analyst. Answer the user's question from the summary of the query result: "
+            "row count, per-column min/max/avg, approximate top values, first and last values in result order, "
+            "and a few rows. Be concise (2-5 sentences), quote concrete numbers from the summary, describe trends "
+            "from first/last values and ordering when asked, and say when the summary is not enough to answer precisely. "
+            "Never invent values.";
+        std::string user_prompt = "Question: " + request_text + "\n\nSQL:\n" + sql_query +
+                                  "\n\nResult summary (JSON):\n" + truncate_to_tokens(summary.dump(), 4000);
+
+        ai::GenerateOptions options(get_configured_model(), system_prompt, user_prompt);
+        options.max_steps = 1;
+
+        ai::GenerateResult result;
+        try
+        {
+            result = generate_strong(client, options);
+        }
+        catch (const std::exception &e)
+        {
+            result = ai::GenerateResult();
+            result.error = std::string(e.what());
+        }
+        stat_add("answers.rows_summarized", row_count);
+        query_log_finish("executed", row_count, execute_ms);
+
+        if (!result)
+        {
+            elog(WARNING, "[answer_generated_query] Answer failed (%s); result summary: %s",
+                 result.error_message().c_str(), summary.dump(2).c_str());
+            return;
+        }
+        stat_add("answers.generated", 1);
+        elog(NOTICE, "\n💬 Answer:\n%s\n", result.text.c_str());
+    }
+
+    /**
+     * Run the query that answers a request, whether the model wrote it or it came from a
+     * verified example or a template: per ai_toolkit.result_mode either answered from its
+     * summary or printed as rows (on the standby when eligible). The client is built on
+     * first use when none is passed, so the fast paths only build one in answer mode.
+     * SPI must be connected.
+     */
+    void run_request_query(ai::Client *client, const std::string &request_text, const std::string &sql_query,
+                           SPIPlanPtr plan = nullptr, Datum *values = nullptr)
+    {
+        if (result_mode != AI_RESULT_ANSWER)
+        {
+            execute_generated_query(sql_query, plan, values);
+            return;
+        }
+
+        ai::Client built;
+        if (client == nullptr)
+        {
+            try
+            {
+                built = build_ai_client();
+            }
+            catch (const std::exception &e)
+            {
+                SPI_finish();
+                ereport(ERROR,
+                        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                         errmsg("Failed to build AI client: %s", e.what()),
+                         errhint("Set ai_toolkit.result_mode = 'rows' to print rows without the model.")));
+            }
+            client = &built;
+        }
+        answer_generated_query(*client, request_text, sql_query, plan, values);
+    }
+
+    /**
+     * Parameterized SQL templates learned from query(). A successful generated SELECT is
+     * split into a template (literals replaced by $n, found via the raw parse tree) and a
+     * prompt skeleton in which the words that produced each literal become slots.
+     * A later prompt that matches a skeleton with different slot text runs the kept plan
+     * with the new values, skipping the model and re-planning.
+     */
+    enum AiSlotKind
+    {
+        AI_SLOT_TEXT,
+        AI_SLOT_NUMBER,
+        AI_SLOT_INTERVAL
+    };
+
+    struct AiTemplateSegment
+    {
+        std::string fixed; // lowercased prompt text before the slot (or the tail if param < 0)
+        int param;         // 0-based parameter filled by the slot, -1 for the trailing text
+        AiSlotKind kind;
+        std::string literal; // value in the original SQL, for casing
+        std::string span;    // prompt text that produced it
+    };
+
+    struct AiSqlTemplate
+    {
+        std::string sql;                     // with $n placeholders
+        std::vector<size_t> param_offsets;   // where each $n starts in sql
+        std::vector<std::string> values;     // literal values of the original query
+        std::vector<Oid> types;
+        std::vector<AiTemplateSegment> skeleton;
+        SPIPlanPtr plan;
+        uint64 last_used;
+    };
+
+    static std::vector<AiSqlTemplate> sql_templates;
+    static uint64 sql_template_clock = 0;
+
+    struct AiSqlLiteral
+    {
+        int start;        // byte offset of the replaced span
+        int end;
+        int const_start;  // the literal itself
+        std::string value;
+        std::string cast_type; // for prefix casts like INTERVAL '7 days'
+    };
+
+    struct AiLiteralWalkerState
+    {
+        const char *sql;
+        std::vector<AiSqlLiteral> *literals;
+        std::set<int> seen;
+    };
+
+    /**
+     * End offset of the string or numeric literal at location, or -1
+     */
+    static int sql_literal_end(const char *sql, int location, std::string *value)
+    {
+        int len = (int)strlen(sql);
+        int i = location;
+        if (sql[i] == '\'')
+        {
+            for (i++; i < len; i++)
+            {
+                if (sql[i] == '\'' && i + 1 < len && sql[i + 1] == '\'')
+                {
+                    *value += '\'';
+                    i++;
+                }
+                else if (sql[i] == '\'')
+                    return i + 1;
+                else
+                    *value += sql[i];
+            }
+            return -1;
+        }
+
+        if (sql[i] == '-')
+        {
+            *value += '-';
+            for (i++; i < len && isspace((unsigned char)sql[i]); i++)
+                ;
+        }
+        int digits_start = i;
+        while (i < len && (isdigit((unsigned char)sql[i]) || sql[i] == '.'))
+            *value += sql[i++];
+        if (i < len && (sql[i] == 'e' || sql[i] == 'E'))
+        {
+            *value += sql[i++];
+            if (i < len && (sql[i] == '+' || sql[i] == '-'))
+                *value += sql[i++];
+            while (i < len && isdigit((unsigned char)sql[i]))
+                *value += sql[i++];
+        }
+        return i > digits_start ? i : -1;
+    }
+
+    static void sql_literal_add(AiLiteralWalkerState *state, A_Const *constant, int cast_location, TypeName *cast_type)
+    {
+        if (constant->isnull || constant->location < 0 || state->seen.count(constant->location))
+            return;
+        NodeTag tag = nodeTag(&constant->val.node);
+        if (tag != T_Integer && tag != T_Float && tag != T_String)
+            return;
+        state->seen.insert(constant->location);
+
+        AiSqlLiteral literal;
+        literal.const_start = constant->location;
+        literal.start = constant->location;
+        literal.end = sql_literal_end(state->sql, constant->location, &literal.value);
+        if (literal.end < 0)
+            return;
+
+        // Prefix form (INTERVAL '7 days', DATE '...') becomes CAST($n AS type);
+        // qualifiers after the literal (INTERVAL '1' DAY) can't be, so keep those inline
+        if (cast_type && cast_location >= 0 && cast_location < constant->location &&
+            pg_strncasecmp(state->sql + cast_location, "cast", 4) != 0)
+        {
+            if (cast_type->typmods != NIL || cast_type->arrayBounds != NIL)
+                return;
+            literal.start = cast_location;
+            literal.cast_type = std::string(state->sql + cast_location, constant->location - cast_location);
+            literal.cast_type.erase(literal.cast_type.find_last_not_of(" \t\n") + 1);
+        }
+        state->literals->push_back(literal);
+    }
 
-            // Copy to std::string
-            std::string schema_str(schema_cstr);
-            std::string table_str(table_cstr);
+    static bool sql_literal_walker(Node *node, void *context)
+    {
+        if (node == NULL)
+            return false;
 
-            // Free memory
-            pfree(schema_cstr);
-            pfree(table_cstr);
+        AiLiteralWalkerState *state = (AiLiteralWalkerState *)context;
+        if (IsA(node, TypeCast) && ((TypeCast *)node)->arg && IsA(((TypeCast *)node)->arg, A_Const))
+        {
+            TypeCast *cast = (TypeCast *)node;
+            sql_literal_add(state, (A_Const *)cast->arg, cast->location, cast->typeName);
+            return false;
+        }
+        if (IsA(node, A_Const))
+        {
+            sql_literal_add(state, (A_Const *)node, -1, nullptr);
+            return false;
+        }
+        return raw_expression_tree_walker(node, sql_literal_walker, context);
+    }
 
-            if (!schema_str.empty() && !table_str.empty())
+    /**
+     * Prompt text normalized for skeleton matching: single spaces, trimmed, no trailing punctuation
+     */
+    static std::string template_prompt_text(const std::string &prompt)
+    {
+        std::string out;
+        for (char c : prompt)
+        {
+            if (isspace((unsigned char)c))
             {
-                std::string full_name = schema_str + "." + table_str;
-                tables.push_back(full_name);
+                if (!out.empty() && out.back() != ' ')
+                    out += ' ';
             }
+            else
+                out += c;
         }
+        while (!out.empty() && (out.back() == ' ' || strchr("?.!;", out.back())))
+            out.pop_back();
+        return out;
+    }
 
-        elog(LOG, "[tool_list_tables_in_schema] Retrieved %lu tables from schema '%s'", (unsigned long)tables.size(), schema.c_str());
-        return nlohmann::json{{"success", true}, {"schema", schema}, {"tables", tables}, {"count", tables.size()}};
+    static std::string lowercase(std::string text)
+    {
+        std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+        return text;
     }
 
     /**
-     * Tool function: Get the CREATE TABLE statement (schema) for a specific table
+     * Interval for a relative time phrase ("last week", "past 3 months", "yesterday"), if it is one
      */
-    nlohmann::json tool_get_schema_for_table(const nlohmann::json &params, const ai::ToolExecutionContext &context)
+    static std::optional<std::string> interval_phrase(const std::string &phrase)
     {
-        if (!params.contains("table_name"))
-        {
-            elog(WARNING, "[tool_get_schema_for_table] Missing table_name parameter");
-            return nlohmann::json{{"success", false}, {"error", "Missing required parameter: table_name"}};
-        }
+        static const std::map<std::string, std::string> fixed = {
+            {"yesterday", "1 day"}, {"last day", "1 day"}, {"past day", "1 day"},
+            {"last week", "7 days"}, {"past week", "7 days"},
+            {"last month", "1 month"}, {"past month", "1 month"},
+            {"last quarter", "3 months"}, {"past quarter", "3 months"},
+            {"last year", "1 year"}, {"past year", "1 year"}};
+
+        std::string lower = lowercase(phrase);
+        auto it = fixed.find(lower);
+        if (it != fixed.end())
+            return it->second;
+
+        static const std::regex counted("^(last|past) (\\d+) (minute|hour|day|week|month|year)s?$");
+        std::smatch match;
+        if (std::regex_match(lower, match, counted))
+            return match[2].str() + " " + match[3].str() + "s";
+        return std::nullopt;
+    }
 
-        std::string table_name = params["table_name"].get<std::string>();
-        std::string schema_name = "public";
+    static std::string canonical_interval(const std::string &text)
+    {
+        Datum value = DirectFunctionCall3(interval_in, CStringGetDatum(text.c_str()),
+                                          ObjectIdGetDatum(InvalidOid), Int32GetDatum(-1));
+        return DatumGetCString(DirectFunctionCall1(interval_out, value));
+    }
 
-        // Parse schema.table if provided
-        size_t dot_pos = table_name.find('.');
-        if (dot_pos != std::string::npos)
+    /**
+     * Carry the literal's casing relative to its prompt text over to new slot text
+     */
+    static std::string apply_literal_casing(const std::string &literal, const std::string &span, const std::string &text)
+    {
+        std::string upper = text, title = lowercase(text);
+        std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+        for (size_t i = 0; i < title.size(); i++)
         {
-            schema_name = table_name.substr(0, dot_pos);
-            table_name = table_name.substr(dot_pos + 1);
+            if (i == 0 || title[i - 1] == ' ')
+                title[i] = (char)toupper((unsigned char)title[i]);
         }
 
-        std::string columns_sql =
-            "SELECT column_name, data_type, character_maximum_length, "
-            "is_nullable, column_default "
-            "FROM information_schema.columns "
-            "WHERE table_schema = $1 AND table_name = $2 "
-            "ORDER BY ordinal_position";
+        std::string span_upper = span;
+        std::transform(span_upper.begin(), span_upper.end(), span_upper.begin(), ::toupper);
+        if (literal == span)
+            return text;
+        if (literal == span_upper)
+            return upper;
+        if (literal == lowercase(span))
+            return lowercase(text);
+        return title;
+    }
 
-        Datum values[2];
-        char nulls[2] = {' ', ' '};
-        values[0] = CStringGetTextDatum(schema_name.c_str());
-        values[1] = CStringGetTextDatum(table_name.c_str());
-        Oid argtypes[2] = {TEXTOID, TEXTOID};
+    static void template_parser_setup(ParseState *pstate, void *arg)
+    {
+        auto *state = (std::pair<Oid *, int> *)arg;
+        setup_parse_variable_parameters(pstate, &state->first, &state->second);
+    }
 
-        int ret = SPI_execute_with_args(columns_sql.c_str(), 2, argtypes, values, nulls, true, 0);
+    /**
+     * Learn a template from a prompt and the SELECT that answered it. SPI must be connected.
+     */
+    void template_learn(const std::string &prompt, const std::string &sql)
+    {
+        if (template_cache_size <= 0)
+            return;
+
+        std::string error;
+        run_in_subtransaction([&]
+                              {
+            List *parsetree = raw_parser(sql.c_str(), RAW_PARSE_DEFAULT);
+            if (list_length(parsetree) != 1)
+                return;
+
+            std::vector<AiSqlLiteral> literals;
+            AiLiteralWalkerState state{sql.c_str(), &literals, {}};
+            sql_literal_walker(((RawStmt *)linitial(parsetree))->stmt, &state);
+            if (literals.empty())
+                return;
+
+            std::sort(literals.begin(), literals.end(), [](const AiSqlLiteral &a, const AiSqlLiteral &b)
+                      { return a.start < b.start; });
+
+            AiSqlTemplate tpl;
+            int copied = 0;
+            for (const auto &literal : literals)
+            {
+                if (literal.start < copied)
+                    return; // overlapping spans; not a shape we can rewrite
+                std::string param = "$" + std::to_string(tpl.values.size() + 1);
+                tpl.sql += sql.substr(copied, literal.start - copied);
+                tpl.param_offsets.push_back(tpl.sql.size() + (literal.cast_type.empty() ? 0 : strlen("CAST(")));
+                tpl.sql += literal.cast_type.empty() ? param : "CAST(" + param + " AS " + literal.cast_type + ")";
+                tpl.values.push_back(literal.value);
+                copied = literal.end;
+            }
+            tpl.sql += sql.substr(copied);
+
+            // Let the parser infer parameter types from context, then keep a plan with them fixed
+            std::pair<Oid *, int> param_state{nullptr, 0};
+            SPIPlanPtr probe = SPI_prepare_params(tpl.sql.c_str(), template_parser_setup, &param_state, 0);
+            if (probe == nullptr)
+                return;
+            for (int i = 0; i < (int)tpl.values.size(); i++)
+            {
+                Oid type = SPI_getargtypeid(probe, i);
+                tpl.types.push_back(type == UNKNOWNOID || type == InvalidOid ? TEXTOID : type);
+            }
+            SPI_freeplan(probe);
+
+            // Map literals to the prompt words that produced them
+            std::string text = template_prompt_text(prompt);
+            std::string lower = lowercase(text);
+            struct Slot { size_t start, end; int param; AiSlotKind kind; };
+            std::vector<Slot> slots;
+            auto overlaps = [&](size_t start, size_t end)
+            {
+                for (const auto &s : slots)
+                    if (start < s.end && s.start < end)
+                        return true;
+                return false;
+            };
+            auto is_word_boundary = [&](size_t start, size_t end)
+            {
+                return (start == 0 || !isalnum((unsigned char)lower[start - 1])) &&
+                       (end >= lower.size() || !isalnum((unsigned char)lower[end]));
+            };
 
-        if (ret != SPI_OK_SELECT || SPI_processed == 0)
-        {
-            elog(WARNING, "[tool_get_schema_for_table] Table '%s.%s' not found or no columns", schema_name.c_str(), table_name.c_str());
-            return nlohmann::json{{"success", false}, {"error", "Table not found or no columns"}};
-        }
+            for (int i = 0; i < (int)tpl.values.size(); i++)
+            {
+                Oid type = tpl.types[i];
+                if (type == INTERVALOID)
+                {
+                    std::string target = canonical_interval(tpl.values[i]);
+                    static const std::regex phrase("(yesterday|(last|past) (\\d+ )?(minute|hour|day|week|month|quarter|year)s?)");
+                    for (std::sregex_iterator it(lower.begin(), lower.end(), phrase), end; it != end; ++it)
+                    {
+                        size_t start = it->position(), stop = start + it->length();
+                        auto interval = interval_phrase(it->str());
+                        if (interval && canonical_interval(*interval) == target && !overlaps(start, stop))
+                        {
+                            slots.push_back({start, stop, i, AI_SLOT_INTERVAL});
+                            break;
+                        }
+                    }
+                    continue;
+                }
 
-        std::stringstream create_sql;
-        create_sql << "CREATE TABLE " << schema_name << "." << table_name << " (\n";
+                std::string needle = lowercase(tpl.values[i]);
+                if (needle.empty())
+                    continue;
+                for (size_t pos = lower.find(needle); pos != std::string::npos; pos = lower.find(needle, pos + 1))
+                {
+                    if (is_word_boundary(pos, pos + needle.size()) && !overlaps(pos, pos + needle.size()))
+                    {
+                        bool numeric = type == INT2OID || type == INT4OID || type == INT8OID ||
+                                       type == NUMERICOID || type == FLOAT4OID || type == FLOAT8OID;
+                        slots.push_back({pos, pos + needle.size(), i, numeric ? AI_SLOT_NUMBER : AI_SLOT_TEXT});
+                        break;
+                    }
+                }
+            }
+            if (slots.empty())
+                return; // nothing varies; verified examples cover exact repeats
 
-        nlohmann::json columns = nlohmann::json::array();
+            // A prompt value that also appears as a literal not bound to the prompt ("top 2"
+            // with ROUND(x, 2) ... LIMIT 2) can't tell which one should follow the request
+            auto same_value = [&](int a, int b)
+            {
+                if (tpl.types[a] == INTERVALOID && tpl.types[b] == INTERVALOID)
+                    return canonical_interval(tpl.values[a]) == canonical_interval(tpl.values[b]);
+                return lowercase(tpl.values[a]) == lowercase(tpl.values[b]);
+            };
+            for (const auto &slot : slots)
+            {
+                for (int i = 0; i < (int)tpl.values.size(); i++)
+                {
+                    bool bound = std::any_of(slots.begin(), slots.end(), [&](const Slot &s)
+                                             { return s.param == i; });
+                    if (!bound && same_value(slot.param, i))
+                    {
+                        stat_add("templates.ambiguous", 1);
+                        return;
+                    }
+                }
+            }
 
-        for (uint64 i = 0; i < SPI_processed; i++)
-        {
-            bool isnull;
-            HeapTuple tuple = SPI_tuptable->vals[i];
-            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+            std::sort(slots.begin(), slots.end(), [](const Slot &a, const Slot &b)
+                      { return a.start < b.start; });
+            size_t position = 0;
+            for (size_t s = 0; s < slots.size(); s++)
+            {
+                std::string fixed = lower.substr(position, slots[s].start - position);
+                if (s > 0 && fixed.find_first_not_of(' ') == std::string::npos)
+                    return; // adjacent slots can't be told apart
+                tpl.skeleton.push_back({fixed, slots[s].param, slots[s].kind, tpl.values[slots[s].param],
+                                        text.substr(slots[s].start, slots[s].end - slots[s].start)});
+                position = slots[s].end;
+            }
+            tpl.skeleton.push_back({lower.substr(position), -1, AI_SLOT_TEXT, "", ""});
+
+            SPIPlanPtr plan = SPI_prepare(tpl.sql.c_str(), (int)tpl.types.size(), tpl.types.data());
+            if (plan == nullptr || SPI_keepplan(plan) != 0)
+                return;
+            tpl.plan = plan;
+            tpl.last_used = ++sql_template_clock;
+
+            // Same skeleton replaces the old template; otherwise evict the least recently used
+            auto same = std::find_if(sql_templates.begin(), sql_templates.end(), [&](const AiSqlTemplate &t)
+                                     {
+                if (t.skeleton.size() != tpl.skeleton.size())
+                    return false;
+                for (size_t s = 0; s < t.skeleton.size(); s++)
+                    if (t.skeleton[s].fixed != tpl.skeleton[s].fixed || t.skeleton[s].kind != tpl.skeleton[s].kind)
+                        return false;
+                return true; });
+            if (same == sql_templates.end() && (int)sql_templates.size() >= template_cache_size)
+                same = std::min_element(sql_templates.begin(), sql_templates.end(), [](const AiSqlTemplate &a, const AiSqlTemplate &b)
+                                        { return a.last_used < b.last_used; });
+            if (same != sql_templates.end())
+            {
+                SPI_freeplan(same->plan);
+                *same = std::move(tpl);
+            }
+            else
+                sql_templates.push_back(std::move(tpl));
 
-            // Get all column attributes
-            Datum col_name_datum = SPI_getbinval(tuple, tupdesc, 1, &isnull);
-            if (isnull)
-                continue;
+            stat_add("templates.learned", 1); },
+                              &error);
 
-            Datum col_type_datum = SPI_getbinval(tuple, tupdesc, 2, &isnull);
-            if (isnull)
-                continue;
+        if (!error.empty())
+            elog(LOG, "[template_learn] Not templated: %s", error.c_str());
+    }
 
-            Datum col_maxlen_datum = SPI_getbinval(tuple, tupdesc, 3, &isnull);
-            bool maxlen_isnull = isnull;
+    struct AiTemplateMatch
+    {
+        AiSqlTemplate *tpl = nullptr;
+        std::vector<std::string> values;
+    };
 
-            Datum col_nullable_datum = SPI_getbinval(tuple, tupdesc, 4, &isnull);
-            if (isnull)
-                continue;
+    /**
+     * Find a template whose skeleton matches the prompt and fill its slots
+     */
+    AiTemplateMatch template_match(const std::string &prompt)
+    {
+        AiTemplateMatch result;
+        if (template_cache_size <= 0 || sql_templates.empty())
+            return result;
 
-            Datum col_default_datum = SPI_getbinval(tuple, tupdesc, 5, &isnull);
-            bool default_isnull = isnull;
+        std::string text = template_prompt_text(prompt);
+        std::string lower = lowercase(text);
 
-            // Properly handle memory
-            char *col_name_cstr = SPI_getvalue(tuple, tupdesc, 1);
-            char *col_type_cstr = SPI_getvalue(tuple, tupdesc, 2);
-            char *col_nullable_cstr = SPI_getvalue(tuple, tupdesc, 4);
+        for (auto &tpl : sql_templates)
+        {
+            std::vector<std::string> values = tpl.values;
+            size_t position = 0;
+            bool matched = true;
 
-            if (!col_name_cstr || !col_type_cstr || !col_nullable_cstr)
+            for (size_t s = 0; s < tpl.skeleton.size() && matched; s++)
             {
-                elog(WARNING, "[tool_get_schema_for_table] Failed to retrieve column information");
-                if (col_name_cstr)
-                    pfree(col_name_cstr);
-                if (col_type_cstr)
-                    pfree(col_type_cstr);
-                if (col_nullable_cstr)
-                    pfree(col_nullable_cstr);
-                continue;
-            }
-
-            // Copy to std::string
-            std::string col_name(col_name_cstr);
-            std::string col_type(col_type_cstr);
-            std::string col_nullable(col_nullable_cstr);
-
-            // Free immediately after copying
-            pfree(col_name_cstr);
-            pfree(col_type_cstr);
-            pfree(col_nullable_cstr);
+                const AiTemplateSegment &segment = tpl.skeleton[s];
+                if (lower.compare(position, segment.fixed.size(), segment.fixed) != 0)
+                {
+                    matched = false;
+                    break;
+                }
+                position += segment.fixed.size();
+                if (segment.param < 0)
+                {
+                    matched = position == lower.size();
+                    break;
+                }
 
-            nlohmann::json col_info;
-            col_info["name"] = col_name;
-            col_info["type"] = col_type;
-            col_info["nullable"] = (col_nullable == "YES");
+                // The slot runs to the next fixed text; before the trailing text it runs to where that must start
+                const AiTemplateSegment &next = tpl.skeleton[s + 1];
+                size_t stop;
+                if (next.param < 0)
+                    stop = lower.size() >= position + next.fixed.size() ? lower.size() - next.fixed.size() : std::string::npos;
+                else
+                    stop = lower.find(next.fixed, position + 1);
+                if (stop == std::string::npos || stop <= position)
+                {
+                    matched = false;
+                    break;
+                }
 
-            create_sql << "  " << col_name << " " << col_type;
+                std::string slot = text.substr(position, stop - position);
+                if (slot.size() >= 2 && (slot.front() == '\'' || slot.front() == '"') && slot.back() == slot.front())
+                    slot = slot.substr(1, slot.size() - 2);
 
-            if (!maxlen_isnull && col_type == "character varying")
-            {
-                int maxlen = DatumGetInt32(col_maxlen_datum);
-                create_sql << "(" << maxlen << ")";
+                if (segment.kind == AI_SLOT_NUMBER)
+                {
+                    static const std::regex number("^-?\\d+(\\.\\d+)?$");
+                    matched = std::regex_match(slot, number);
+                    values[segment.param] = slot;
+                }
+                else if (segment.kind == AI_SLOT_INTERVAL)
+                {
+                    auto interval = interval_phrase(slot);
+                    matched = interval.has_value();
+                    if (matched)
+                        values[segment.param] = *interval;
+                }
+                else
+                {
+                    // Text slots may grow by one word at most, so trailing words aren't swallowed
+                    auto words = [](const std::string &t)
+                    { return (size_t)std::count(t.begin(), t.end(), ' ') + 1; };
+                    matched = !slot.empty() && words(slot) <= words(segment.span) + 1;
+                    values[segment.param] = apply_literal_casing(segment.literal, segment.span, slot);
+                }
+                position = stop;
             }
 
-            if (col_nullable == "NO")
+            if (matched)
             {
-                create_sql << " NOT NULL";
+                tpl.last_used = ++sql_template_clock;
+                result.tpl = &tpl;
+                result.values = values;
+                return result;
             }
+        }
+        return result;
+    }
 
-            if (!default_isnull)
-            {
-                char *col_default_cstr = SPI_getvalue(tuple, tupdesc, 5);
-                if (col_default_cstr)
-                {
-                    std::string col_default(col_default_cstr);
-                    pfree(col_default_cstr);
+    /**
+     * A template's SQL with the given values inlined as typed literals, for display, the
+     * standby and the session history
+     */
+    static std::string template_inline(const AiSqlTemplate &tpl, const std::vector<std::string> &values)
+    {
+        std::string sql;
+        size_t copied = 0;
+        for (size_t i = 0; i < tpl.param_offsets.size(); i++)
+        {
+            sql += tpl.sql.substr(copied, tpl.param_offsets[i] - copied);
+            char *literal = quote_literal_cstr(values[i].c_str());
+            sql += std::string("(") + literal + "::" + format_type_be(tpl.types[i]) + ")";
+            pfree(literal);
+            copied = tpl.param_offsets[i] + 1 + std::to_string(i + 1).size();
+        }
+        sql += tpl.sql.substr(copied);
+        return sql;
+    }
 
-                    create_sql << " DEFAULT " << col_default;
-                    col_info["default"] = col_default;
-                }
-            }
+    /**
+     * Run a matched template's kept plan like any other answer (run_request_query()).
+     * Returns false (nothing run) if a slot value doesn't convert to its parameter type,
+     * so the caller can fall back to the model.
+     */
+    bool template_execute(const std::string &prompt, const AiTemplateMatch &match)
+    {
+        const AiSqlTemplate &tpl = *match.tpl;
+        std::vector<Datum> values(tpl.types.size());
+        std::string error;
 
-            if (i < SPI_processed - 1)
+        bool ok = run_in_subtransaction([&]
+                                        {
+            for (size_t i = 0; i < tpl.types.size(); i++)
             {
-                create_sql << ",\n";
-            }
-            columns.push_back(col_info);
+                Oid typinput, typioparam;
+                getTypeInputInfo(tpl.types[i], &typinput, &typioparam);
+                values[i] = OidInputFunctionCall(typinput, (char *)match.values[i].c_str(), typioparam, -1);
+            } },
+                                        &error);
+        if (!ok)
+        {
+            elog(LOG, "[template_execute] Slot value rejected: %s", error.c_str());
+            return false;
         }
 
-        create_sql << "\n);";
+        std::string sql = template_inline(tpl, match.values);
+        elog(NOTICE, "\n⚡ Reusing a learned query template\n");
+        stat_add("templates.hits", 1);
+        session_record_query(prompt, sql, "template", "failed");
+        query_log_set_sql(sql, "template");
+        run_request_query(nullptr, prompt, sql, tpl.plan, values.data());
+        return true;
+    }
 
-        elog(LOG, "[tool_get_schema_for_table] Retrieved schema for '%s.%s' with %lu columns", schema_name.c_str(), table_name.c_str(), (unsigned long)columns.size());
-        return nlohmann::json{
-            {"success", true},
-            {"table", schema_name + "." + table_name},
-            {"create_statement", create_sql.str()},
-            {"columns", columns}};
+    /**
+     * Step budget for query(), capped by ai_toolkit.max_steps. Starts from the minimum
+     * useful loop (explore, inspect, answer) and adds a step per complexity cue in the
+     * request (joins, grouping, ranking, comparisons), per table the catalog index
+     * matches strongly, and for a large catalog where listing takes longer.
+     */
+    int adaptive_step_budget(const std::string &request_text, const std::vector<CatalogMatch> &likely_tables)
+    {
+        static const std::set<std::string> cues = {
+            "join", "joined", "per", "each", "by", "group", "grouped", "compare", "compared", "versus", "vs",
+            "top", "rank", "ranked", "average", "avg", "total", "sum", "count", "trend", "between", "without",
+            "never", "not", "both", "either", "ratio", "percentage", "share", "growth", "previous", "latest"};
+
+        std::string text = lowercase(request_text);
+        for (char &c : text)
+            if (!isalnum((unsigned char)c))
+                c = ' ';
+
+        int complexity = 0;
+        std::stringstream words(text);
+        std::string word;
+        while (words >> word && complexity < 4)
+            if (cues.count(word))
+                complexity++;
+
+        int strong_tables = 0;
+        for (const auto &match : likely_tables)
+            if (strong_tables < 4 && match.score >= likely_tables.front().score * 0.5)
+                strong_tables++;
+
+        int budget = 3 + complexity + std::max(strong_tables, 1);
+        if (catalog_index.documents.size() > 50)
+            budget++;
+        if (catalog_index.documents.size() > 500)
+            budget++;
+
+        return std::clamp(budget, std::min(3, max_steps_limit), max_steps_limit);
     }
 
     PG_FUNCTION_INFO_V1(help);
@@ -731,6 +8296,17 @@ extern "C"
     PG_FUNCTION_INFO_V1(query);
     PG_FUNCTION_INFO_V1(explain_query);
     PG_FUNCTION_INFO_V1(explain_error);
+    PG_FUNCTION_INFO_V1(add_example);
+    PG_FUNCTION_INFO_V1(accept_query);
+    PG_FUNCTION_INFO_V1(register_tool);
+    PG_FUNCTION_INFO_V1(recent_errors);
+    PG_FUNCTION_INFO_V1(query_history_status);
+    PG_FUNCTION_INFO_V1(session_status);
+    PG_FUNCTION_INFO_V1(rate_limit_status);
+    PG_FUNCTION_INFO_V1(provider_target_status);
+    PG_FUNCTION_INFO_V1(stat_counters);
+    PG_FUNCTION_INFO_V1(reset_stats);
+    PG_FUNCTION_INFO_V1(invalidate_relation);
 
     /**
      * Help function - provides toolkit documentation
@@ -748,17 +8324,23 @@ extern "C"
             "      Supports SELECT, DDL (CREATE/ALTER/DROP), and DML (INSERT/UPDATE/DELETE)\n"
             "      ⚠️  DDL/DML queries are generated with disclaimers and NOT executed\n"
             "      Example: SELECT ai_toolkit.query('show active users');\n"
-            "      Example: SELECT ai_toolkit.query('create a users table');\n\n"
+            "      Example: SELECT ai_toolkit.query('create a users table');\n"
+            "      History: SELECT * FROM ai_toolkit.query_history;  -- this session\n"
+            "               SELECT * FROM ai_toolkit.sessions;       -- all sessions\n\n"
+            "  • ai_toolkit.accept_query([corrected_sql])  \n"
+            "      Save the last query() request and its SQL as a verified example\n"
+            "      Similar requests get it as a few-shot example; near-identical ones reuse it directly\n"
+            "      Also: ai_toolkit.add_example(question, sql)\n\n"
             "  • ai_toolkit.explain_query([text])  \n"
             "      Get AI-powered explanation of a SQL query (returns void, shows via NOTICE)\n"
-            "      If no query provided, explains the last executed query in session\n"
-            "      🔄 Auto-tracks ALL queries from any source (CLI, apps, tools)\n"
+            "      If no query provided, explains the last failed statement in session,\n"
+            "      or else the last query generated by ai_toolkit.query()\n"
             "      Example: SELECT ai_toolkit.explain_query('SELECT * FROM users');\n"
             "      Example: SELECT * FROM orders; -- then: SELECT ai_toolkit.explain_query();\n\n"
             "  • ai_toolkit.explain_error([text])  \n"
             "      Get AI-powered explanation and solution for an error (returns void, shows via NOTICE)\n"
             "      If no error provided, explains the last error in session\n"
-            "      🔄 Auto-tracks ALL errors from any source\n"
+            "      🔄 Auto-tracks ALL errors from any source (see ai_toolkit.recent_errors())\n"
             "      Example: SELECT ai_toolkit.explain_error('syntax error at...');\n"
             "      Example: After any error, call: SELECT ai_toolkit.explain_error();\n\n"
             "  • ai_toolkit.set_memory(category, key, value, notes)\n"
@@ -771,13 +8353,42 @@ extern "C"
             "📊 HELPER FUNCTIONS:\n\n"
             "  • ai_toolkit.view_memories()  - View all stored memories\n"
             "  • ai_toolkit.search_memory(keyword)  - Search memories\n"
-            "  • ai_toolkit.view_logs(limit)  - View query logs\n\n"
+            "  • ai_toolkit.maintain_memories()  - Expire, decay and dedupe memories now\n"
+            "      (runs in the background every ai_toolkit.memory_maintenance_interval)\n"
+            "  • ai_toolkit.export_memories([category])  - Memories as a JSON document\n"
+            "  • ai_toolkit.import_memories(json, [policy])  - Bulk upsert; policy:\n"
+            "      overwrite (default) | skip | newer | error\n"
+            "  • ai_toolkit.view_logs(limit)  - View query logs\n"
+            "  • ai_toolkit.register_tool(name, description, params, function)  - Expose a SQL\n"
+            "      function to the model as a tool (admin); ai_toolkit.unregister_tool(name)\n"
+            "  • SELECT * FROM ai_toolkit.rate_limits;  - Provider queue depth and wait times\n"
+            "  • SELECT * FROM ai_toolkit.provider_targets;  - Target health, latency and hedging\n"
+            "  • SELECT * FROM ai_toolkit.stats;  - Per-tier calls, latency, tokens and escalations\n\n"
             "⚙️  CONFIGURATION:\n\n"
             "  -- Choose your AI provider:\n"
             "  SET ai_toolkit.ai_provider = 'openai';      -- or 'anthropic', 'openrouter'\n"
             "  SET ai_toolkit.ai_api_key = 'your-key';\n"
             "  SET ai_toolkit.ai_model = 'gpt-4o-mini';    -- model name for your provider\n"
             "  SET ai_toolkit.ai_base_url = 'custom-url';  -- optional, for custom endpoints\n\n"
+            "  -- Cluster-wide provider limits (postgresql.conf, per provider/model):\n"
+            "  ai_toolkit.rate_limit_rpm = 500             -- requests per minute, 0 = off\n"
+            "  ai_toolkit.rate_limit_tpm = 200000          -- tokens per minute, 0 = off\n"
+            "  ai_toolkit.max_in_flight = 16               -- concurrent calls, 0 = off\n"
+            "  SET ai_toolkit.rate_limit_max_wait = '30s'; -- queueing limit, 0 = until cancelled\n\n"
+            "  -- Fallback chain and hedging for tail latency:\n"
+            "  SET ai_toolkit.ai_targets = 'openai|gpt-4o-mini, anthropic|claude-haiku-4-5';\n"
+            "  SET ai_toolkit.ai_api_keys = 'openai=sk-...,anthropic=sk-ant-...';  -- superuser\n"
+            "  SET ai_toolkit.hedging = on;                -- race a 2nd request after p95 latency\n\n"
+            "  -- Cheap model for exploration, configured model only for final SQL:\n"
+            "  SET ai_toolkit.routing = 'tiered';\n"
+            "  SET ai_toolkit.explore_model = 'gpt-4o-mini';\n"
+            "  SET ai_toolkit.routing_confidence = 0.8;   -- accept explore SQL at/above this\n\n"
+            "  -- Cap estimated input tokens per step (trims tool output/context):\n"
+            "  SET ai_toolkit.input_token_budget = 16000;  -- 0 = no budget\n"
+            "  SET ai_toolkit.tool_output_format = 'compact';  -- terse DDL tool results\n\n"
+            "  -- explain_query plans (superuser):\n"
+            "  SET ai_toolkit.explain_analyze = on;        -- ANALYZE, BUFFERS for plain SELECTs\n"
+            "  SET ai_toolkit.explain_cache_ttl = '1d';    -- explanation caches, 0 = off\n\n"
             "  📌 Provider Examples:\n"
             "     OpenAI:     gpt-4o, gpt-4o-mini, gpt-3.5-turbo\n"
             "     Anthropic:  claude-sonnet-4-5, claude-haiku-3-5\n"
@@ -806,6 +8417,8 @@ extern "C"
         text *value_text = PG_GETARG_TEXT_PP(2);
         text *notes_text = PG_ARGISNULL(3) ? nullptr : PG_GETARG_TEXT_PP(3);
 
+        memory_maintenance_schedule();
+
         try
         {
             std::string category(VARDATA_ANY(category_text), VARSIZE_ANY_EXHDR(category_text));
@@ -827,6 +8440,7 @@ extern "C"
                         (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
                          errmsg("Failed to set memory: %s", error_msg.c_str())));
             }
+            catalog_index_memory_changed();
 
             std::string result = "Memory saved: [" + category + "] " + key;
             PG_RETURN_TEXT_P(cstring_to_text(result.c_str()));
@@ -881,7 +8495,9 @@ extern "C"
 
         try
         {
-            std::string user_prompt(VARDATA_ANY(prompt_text), VARSIZE_ANY_EXHDR(prompt_text));
+            std::string request_text(VARDATA_ANY(prompt_text), VARSIZE_ANY_EXHDR(prompt_text));
+            query_log_begin("query", request_text);
+            memory_maintenance_schedule();
 
             // Connect to SPI for tool functions to use
             if (SPI_connect() != SPI_OK_CONNECT)
@@ -891,6 +8507,49 @@ extern "C"
                          errmsg("Failed to connect to SPI")));
             }
 
+            // Verified examples: the closest one answers the request outright if it is near enough,
+            // otherwise similar ones become few-shot examples for the model
+            std::vector<AiExampleMatch> examples = example_search(request_text, std::max(example_shots, 1), 0.5);
+            bool fast_path = !examples.empty() && example_fast_path_similarity > 0 &&
+                             examples[0].similarity >= example_fast_path_similarity;
+            std::string unsafe_reason;
+            if (fast_path && !example_trusted(examples[0].created_by))
+            {
+                // Its SQL would run as this user: only trust examples this user could have written
+                elog(LOG, "[query] Not reusing example #%d stored by untrusted role '%s'",
+                     examples[0].id, examples[0].created_by.c_str());
+                stat_add("examples.fast_path_untrusted", 1);
+                fast_path = false;
+            }
+            else if (fast_path && !example_sql_safe(examples[0].sql, &unsafe_reason))
+            {
+                elog(LOG, "[query] Not reusing example #%d: %s", examples[0].id, unsafe_reason.c_str());
+                stat_add("examples.fast_path_rejected", 1);
+                fast_path = false;
+            }
+            if (fast_path)
+            {
+                const AiExampleMatch &example = examples[0];
+                elog(NOTICE, "\n⚡ Reusing verified example #%d (similarity %.2f): %s\n",
+                     example.id, example.similarity, example.question.c_str());
+                stat_add("examples.fast_path", 1);
+                session_record_query(request_text, example.sql, "example", "failed");
+                query_log_set_sql(example.sql, "example");
+                example_touch(example.id);
+                run_request_query(nullptr, request_text, example.sql);
+                SPI_finish();
+                PG_RETURN_VOID();
+            }
+            if ((int)examples.size() > example_shots)
+                examples.resize(example_shots);
+
+            // Same question shape as an earlier one with different literals: reuse its plan
+            if (AiTemplateMatch match = template_match(request_text); match.tpl && template_execute(request_text, match))
+            {
+                SPI_finish();
+                PG_RETURN_VOID();
+            }
+
             // Build AI client based on configuration
             ai::Client client;
             std::string model;
@@ -908,65 +8567,78 @@ extern "C"
                          errhint("Configure using: SET ai_toolkit.ai_provider = 'openai|anthropic|openrouter'; SET ai_toolkit.ai_api_key = 'your-key';")));
             }
 
-            // Define tools for memory operations using helper functions
-            ai::Tool set_memory_tool = ai::create_simple_tool(
-                "set_memory",
-                "Store information about database schema, tables, columns, relationships, or business rules for future reference. "
-                "Parameters: category (table|column|relationship|business_rule|data_pattern|calculation|permission|custom), "
-                "key (identifier like table name or 'table.column'), value (information to store), notes (optional context)",
-                {{"category", "string"}, {"key", "string"}, {"value", "string"}, {"notes", "string"}},
-                tool_set_memory);
-
-            ai::Tool get_memory_tool = ai::create_simple_tool(
-                "get_memory",
-                "Retrieve previously stored information about database schema, tables, columns, relationships, or business rules. "
-                "Parameters: category (table|column|relationship|business_rule|data_pattern|calculation|permission|custom), "
-                "key (identifier like table name or 'table.column')",
-                {{"category", "string"}, {"key", "string"}},
-                tool_get_memory);
-
-            // Define database exploration tools
-            ai::Tool list_schemas_tool = ai::create_simple_tool(
-                "list_schemas",
-                "List all available schemas in the current PostgreSQL database. "
-                "Schemas: users (user data), products (catalog), cart (shopping), coupon (discounts), "
-                "wallet (payments), orders (order mgmt), payments (transactions), ai_toolkit (system). No parameters required.",
-                {},
-                tool_list_schemas);
-
-            ai::Tool list_tables_tool = ai::create_simple_tool(
-                "list_tables_in_schema",
-                "List all tables in a specific schema. Parameters: schema (name of the schema like 'users', 'products', 'orders', etc.)",
-                {{"schema", "string"}},
-                tool_list_tables_in_schema);
-
-            ai::Tool get_schema_tool = ai::create_simple_tool(
-                "get_schema_for_table",
-                "Get the CREATE TABLE statement (schema) for a specific table. "
-                "Parameters: table_name (name of table, optionally prefixed with schema like 'schema.table')",
-                {{"table_name", "string"}},
-                tool_get_schema_for_table);
-
-            // Build system prompt with step-by-step process
-            std::string system_prompt = load_system_prompt();
-
-            user_prompt = "User request: `" + user_prompt + "`\n"
-                                                            "Generate a valid Postgres query based on the request. "
-                                                            "Follow the strict step-by-step process in the system prompt. "
-                                                            "Use the available tools to explore the database schema and retrieve necessary information. "
-                                                            "Only 10 Tools Calls are available use them very wisely, if you really don't have information then only call, do not spam it."
-                                                            "If the query involves DDL (CREATE, ALTER, DROP) or DML (INSERT, UPDATE, DELETE), "
-                                                            "you MUST include a <disclaimer> tag at the beginning of your response with a warning message, "
-                                                            "followed by the SQL query in <sql> tags. The query will NOT be executed, only shown to the user.";
+            // Build system prompt with step-by-step process. Everything static goes here,
+            // ahead of the per-request content, so providers can reuse the cached prefix
+            std::string system_prompt = load_system_prompt() +
+                                        "\n\n=== REQUEST HANDLING ===\n"
+                                        "Generate a valid Postgres query based on the user request. "
+                                        "Follow the strict step-by-step process above. "
+                                        "Use the available tools to explore the database schema and retrieve necessary information. "
+                                        "Model steps are limited by the step budget given with each request, so use tool calls very wisely: "
+                                        "only call a tool if you really don't have the information, do not spam it. "
+                                        "If the query involves DDL (CREATE, ALTER, DROP) or DML (INSERT, UPDATE, DELETE), "
+                                        "you MUST include a <disclaimer> tag at the beginning of your response with a warning message, "
+                                        "followed by the SQL query in <sql> tags. The query will NOT be executed, only shown to the user.";
+            system_prompt += "\nTools beyond the built-in ones are lookups registered for this database: when one fits "
+                             "the request, prefer it over composing exploratory SQL.";
+            if (structured_output)
+                system_prompt += "\n\n=== FINAL ANSWER ===\n"
+                                 "Deliver the answer by calling the final_answer tool instead of writing <sql> and <disclaimer> tags: "
+                                 "sql is the query, disclaimer the warning for DDL/DML (empty otherwise), explanation one sentence "
+                                 "and confidence how sure you are (0.0 to 1.0). If it reports a problem, fix it and call it again.";
+
+            PromptAssembler prompt;
+            prompt.add("", "User request: `" + request_text + "`", 100, true);
+            if (!examples.empty())
+            {
+                std::string shots;
+                for (const auto &example : examples)
+                    shots += "Q: " + example.question + "\n<sql>\n" + example.sql + "\n</sql>\n";
+                prompt.add("Verified examples of similar requests (adapt them; they are known to be correct)", shots, 60);
+                stat_add("examples.few_shot", 1);
+            }
+            std::vector<CatalogMatch> likely_tables = catalog_index_search(request_text, std::max({prerank_tables, prefetch_tables, 4}));
+            int step_budget = adaptive_step_budget(request_text, likely_tables);
+            prompt.add("", "Step budget: " + std::to_string(step_budget) +
+                               " model steps. Batch independent tool calls into one step and answer as soon as you have the SQL.",
+                       90, true);
+            if (prerank_tables > 0)
+            {
+                std::vector<std::string> likely;
+                for (int i = 0; i < std::min((int)likely_tables.size(), prerank_tables); i++)
+                    likely.push_back(likely_tables[i].name);
+                prompt.add("Likely relevant tables (by name/comment match; verify with tools)", join_names(likely), 40);
+            }
+            std::string user_prompt = prompt.build(context_token_budget(system_prompt));
+            begin_request(system_prompt, user_prompt);
+            current_request.question = request_text;
+            current_request.final_tags = {"sql"};
+            stat_add("steps.budget", step_budget);
+
+            // Warm what the model is likely to ask for first while it is still thinking
+            if (prefetch_tables > 0 && !likely_tables.empty())
+            {
+                int count = std::min((int)likely_tables.size(), prefetch_tables);
+                std::set<std::string> schemas;
+                for (int i = 0; i < count; i++)
+                    schemas.insert(likely_tables[i].name.substr(0, likely_tables[i].name.find('.')));
+
+                // In the order the system prompt tells the model to explore
+                prefetch_tool("list_schemas", nlohmann::json::object(), tool_list_schemas);
+                for (const auto &schema : schemas)
+                    prefetch_tool("list_tables_in_schema", {{"schema", schema}}, tool_list_tables_in_schema);
+                for (int i = 0; i < count; i++)
+                {
+                    prefetch_tool("get_schema_for_table", {{"table_name", likely_tables[i].name}}, tool_get_schema_for_table);
+                    prefetch_tool("get_memory", {{"category", "table"}, {"key", likely_tables[i].name}}, tool_get_memory);
+                }
+                current_request.prefetch.push_back(join_graph_load);
+            }
 
             // Configure generation options with tools
             ai::GenerateOptions options(model, system_prompt, user_prompt);
-            options.tools["set_memory"] = set_memory_tool;
-            options.tools["get_memory"] = get_memory_tool;
-            options.tools["list_schemas"] = list_schemas_tool;
-            options.tools["list_tables_in_schema"] = list_tables_tool;
-            options.tools["get_schema_for_table"] = get_schema_tool;
-            options.max_steps = 10; // Allow multi-step reasoning with tool calls
+            tool_registry_apply("query", options);
+            options.max_steps = step_budget; // Allow multi-step reasoning with tool calls
 
             // Add callbacks for intermediate logging
             std::stringstream log_output;
@@ -1015,53 +8687,86 @@ extern "C"
                 // Show a summary of the result
                 if (!result.result.empty() && !result.result.is_null())
                 {
-                    if (result.result.contains("success") && result.result["success"] == true)
+                    // Compact results carry no "success" flag, only "error" on failure
+                    bool succeeded = result.result.contains("success") ? result.result["success"] == true
+                                                                       : !result.result.contains("error");
+                    if (succeeded)
                     {
                         // Format based on tool type
-                        if (result.tool_name == "list_schemas" && result.result.contains("count"))
+                        if (result.tool_name == "list_schemas" && result.result.contains("schemas"))
                         {
-                            int count = result.result["count"];
+                            auto schemas = tool_result_names(result.result["schemas"]);
                             std::string preview;
-                            if (result.result.contains("schemas") && result.result["schemas"].is_array())
+                            int show = std::min(5, (int)schemas.size());
+                            for (int i = 0; i < show; i++)
                             {
-                                auto schemas = result.result["schemas"];
-                                int show = std::min(5, (int)schemas.size());
-                                for (int i = 0; i < show; i++)
-                                {
-                                    if (i > 0)
-                                        preview += " - ";
-                                    preview += schemas[i].get<std::string>();
-                                }
-                                if (schemas.size() > 5)
-                                    preview += "...";
+                                if (i > 0)
+                                    preview += " - ";
+                                preview += schemas[i];
                             }
-                            log_output << "  └─ Found " << count << " schemas: " << preview << "\n";
+                            if (schemas.size() > 5)
+                                preview += "...";
+                            log_output << "  └─ Found " << schemas.size() << " schemas: " << preview << "\n";
                         }
-                        else if (result.tool_name == "list_tables_in_schema" && result.result.contains("count"))
+                        else if (result.tool_name == "list_tables_in_schema" && result.result.contains("tables"))
                         {
-                            int count = result.result["count"];
+                            auto tables = tool_result_names(result.result["tables"]);
                             std::string schema = result.result.value("schema", "");
                             std::string preview;
-                            if (result.result.contains("tables") && result.result["tables"].is_array())
+                            int show = std::min(5, (int)tables.size());
+                            for (int i = 0; i < show; i++)
                             {
-                                auto tables = result.result["tables"];
-                                int show = std::min(5, (int)tables.size());
-                                for (int i = 0; i < show; i++)
-                                {
-                                    if (i > 0)
-                                        preview += " - ";
-                                    preview += tables[i].get<std::string>();
-                                }
-                                if (tables.size() > 5)
-                                    preview += "...";
+                                if (i > 0)
+                                    preview += " - ";
+                                preview += tables[i];
                             }
-                            log_output << "  └─ Found " << count << " tables in schema '" << schema << "': " << preview << "\n";
+                            if (tables.size() > 5)
+                                preview += "...";
+                            log_output << "  └─ Found " << tables.size() << " tables in schema '" << schema << "': " << preview << "\n";
+                        }
+                        else if (result.tool_name == "get_schema_for_table" && result.result.contains("ddl"))
+                        {
+                            std::string ddl = result.result["ddl"];
+                            log_output << "  └─ Retrieved schema for '" << ddl.substr(0, ddl.find('(')) << "'\n";
+                        }
+                        else if (result.tool_name == "get_schema_for_table" && result.result.contains("table"))
+                        {
+                            std::string table = result.result["table"];
+                            int col_count = result.result.contains("columns") ? result.result["columns"].size() : 0;
+                            log_output << "  └─ Retrieved schema for '" << table << "' (" << col_count << " columns)\n";
+                        }
+                        else if (result.tool_name == "find_relevant_tables" && result.result.contains("tables"))
+                        {
+                            size_t count = result.result["tables"].is_array() ? result.result["tables"].size()
+                                                                              : tool_result_names(result.result["tables"]).size();
+                            log_output << "  └─ Ranked " << count << " relevant tables\n";
+                        }
+                        else if (result.tool_name == "find_join_path" && result.result.contains("from_clause"))
+                        {
+                            size_t joins = 0;
+                            std::string clause = result.result["from_clause"];
+                            for (size_t pos = clause.find("\nJOIN "); pos != std::string::npos; pos = clause.find("\nJOIN ", pos + 1))
+                                joins++;
+                            log_output << "  └─ Found join path with " << joins << " joins\n";
+                        }
+                        else if (result.tool_name == "get_column_stats" && result.result.contains("columns"))
+                        {
+                            log_output << "  └─ Retrieved statistics for " << result.result["columns"].size() << " columns\n";
+                        }
+                        else if (result.tool_name == "get_column_stats" && result.result.contains("stats"))
+                        {
+                            log_output << "  └─ Retrieved column statistics\n";
+                        }
+                        else if (result.tool_name == "sample_rows" && result.result.contains("rows"))
+                        {
+                            if (result.result["rows"].is_array())
+                                log_output << "  └─ Sampled " << result.result["rows"].size() << " rows\n";
+                            else
+                                log_output << "  └─ Sampled rows\n";
                         }
-                        else if (result.tool_name == "get_schema_for_table" && result.result.contains("table"))
+                        else if (result.tool_name == "final_answer")
                         {
-                            std::string table = result.result["table"];
-                            int col_count = result.result.contains("columns") ? result.result["columns"].size() : 0;
-                            log_output << "  └─ Retrieved schema for '" << table << "' (" << col_count << " columns)\n";
+                            log_output << "  └─ Answer accepted\n";
                         }
                         else if (result.tool_name == "set_memory")
                         {
@@ -1099,60 +8804,41 @@ extern "C"
                 log_output.clear();
             };
 
-            // Generate response
-            auto result = client.generate_text(options);
+            // Generate response, exploring with the cheap model first when tiered routing is on
+            auto result = tiered_routing_enabled() ? generate_tiered(client, options)
+                                                   : generate_strong(client, options);
 
             if (result)
             {
-                // Parse SQL query and disclaimer from response
-                std::string response_text = result.text;
-                std::string sql_query;
-                std::string disclaimer;
-                bool has_disclaimer = false;
-
-                // Look for <disclaimer> ... </disclaimer> pattern
-                size_t disclaimer_start = response_text.find("<disclaimer>");
-                if (disclaimer_start != std::string::npos)
+                // Take the answer from the final_answer call (or tags); repair it once if it is unusable
+                AiFinalAnswer answer;
+                std::string problem;
+                if (!final_answer_from(result, &answer, &problem) &&
+                    !repair_final_answer(client, options, result.text, problem, &answer) &&
+                    !answer.sql.empty())
                 {
-                    disclaimer_start += 12; // Move past "<disclaimer>"
-                    size_t disclaimer_end = response_text.find("</disclaimer>", disclaimer_start);
-                    if (disclaimer_end != std::string::npos)
-                    {
-                        disclaimer = response_text.substr(disclaimer_start, disclaimer_end - disclaimer_start);
-                        // Trim whitespace
-                        size_t first = disclaimer.find_first_not_of(" \n\r\t");
-                        size_t last = disclaimer.find_last_not_of(" \n\r\t");
-                        if (first != std::string::npos && last != std::string::npos)
-                        {
-                            disclaimer = disclaimer.substr(first, last - first + 1);
-                        }
-                        has_disclaimer = true;
-                    }
+                    // The repair did not produce a usable answer: show the SQL, never run it
+                    session_record_query(request_text, answer.sql, model, "invalid answer");
+                    query_log_set_sql(answer.sql, model);
+                    query_log_finish("invalid answer");
+                    elog(NOTICE, "📋 Generated Query (NOT EXECUTED):\n%s", answer.sql.c_str());
+                    SPI_finish();
+                    ereport(ERROR,
+                            (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                             errmsg("Generated answer is invalid and could not be repaired: %s", problem.c_str())));
                 }
 
-                // Look for <sql> ... </sql> pattern
-                size_t sql_start = response_text.find("<sql>");
-                if (sql_start != std::string::npos)
-                {
-                    sql_start += 5; // Move past "<sql>"
-                    size_t sql_end = response_text.find("</sql>", sql_start);
-                    if (sql_end != std::string::npos)
-                    {
-                        sql_query = response_text.substr(sql_start, sql_end - sql_start);
-                        // Trim whitespace
-                        size_t first = sql_query.find_first_not_of(" \n\r\t");
-                        size_t last = sql_query.find_last_not_of(" \n\r\t");
-                        if (first != std::string::npos && last != std::string::npos)
-                        {
-                            sql_query = sql_query.substr(first, last - first + 1);
-                        }
-                    }
-                }
+                std::string disclaimer = answer.disclaimer;
+                bool has_disclaimer = answer.has_disclaimer;
+                std::string sql_query = answer.sql;
+                if (!answer.explanation.empty())
+                    elog(NOTICE, "💡 %s (confidence %.2f)", answer.explanation.c_str(), answer.confidence);
 
                 if (!sql_query.empty())
                 {
-                    // Store the query in session memory for explain_query function
-                    memory_set_core("session", "last_query", sql_query, "Last executed query in session", nullptr, false);
+                    // Until it runs successfully the request counts as failed
+                    session_record_query(request_text, sql_query, model, "failed");
+                    query_log_set_sql(sql_query, model);
 
                     // Check if query is DDL or DML by examining the first keyword
                     std::string query_upper = sql_query;
@@ -1210,85 +8896,24 @@ extern "C"
                         output << "\nℹ️  This query was generated for reference only and has NOT been executed.\n";
                         output << "   Please review carefully before running it manually.\n";
 
+                        session_update_outcome("not executed", 0);
+                        query_log_finish("not executed");
                         elog(NOTICE, "%s", output.str().c_str());
                         SPI_finish();
                         PG_RETURN_VOID();
                     }
 
                     // Execute the SQL query (only for SELECT and other safe queries)
-                    elog(NOTICE, "\n📋 Generated Query:\n%s\n", sql_query.c_str()); // SPI is already connected from the beginning of the function
-                    int ret = SPI_execute(sql_query.c_str(), true, 0);
-
-                    if (ret < 0)
-                    {
-                        std::string error_info = "Query execution failed with SPI error code: " + std::to_string(ret);
-                        memory_set_core("session", "last_error", error_info, "Last error in session", nullptr, false);
-
-                        SPI_finish();
-                        ereport(ERROR,
-                                (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
-                                 errmsg("Query execution failed")));
-                    }
-
-                    // Print results as a table
-                    if (SPI_processed > 0)
-                    {
-                        std::stringstream table_output;
-                        table_output << "\n📊 Query Results (" << SPI_processed << " rows):\n";
-                        table_output << "═══════════════════════════════════════════════════════════\n";
-
-                        SPITupleTable *tuptable = SPI_tuptable;
-                        TupleDesc tupdesc = tuptable->tupdesc;
-
-                        // Print column headers
-                        for (int i = 0; i < tupdesc->natts; i++)
-                        {
-                            if (i > 0)
-                                table_output << " | ";
-                            table_output << SPI_fname(tupdesc, i + 1);
-                        }
-                        table_output << "\n";
-                        table_output << "───────────────────────────────────────────────────────────\n";
-
-                        // Print rows
-                        for (uint64 row = 0; row < SPI_processed; row++)
-                        {
-                            HeapTuple tuple = tuptable->vals[row];
-                            for (int col = 1; col <= tupdesc->natts; col++)
-                            {
-                                if (col > 1)
-                                    table_output << " | ";
-
-                                bool isnull;
-                                Datum datum = SPI_getbinval(tuple, tupdesc, col, &isnull);
-
-                                if (isnull)
-                                {
-                                    table_output << "NULL";
-                                }
-                                else
-                                {
-                                    char *value = SPI_getvalue(tuple, tupdesc, col);
-                                    table_output << value;
-                                    pfree(value);
-                                }
-                            }
-                            table_output << "\n";
-                        }
-
-                        table_output << "═══════════════════════════════════════════════════════════\n";
-                        elog(NOTICE, "%s", table_output.str().c_str());
-                    }
-                    else
-                    {
-                        elog(NOTICE, "\n✓ Query executed successfully. No rows returned.\n");
-                    }
-
+                    run_request_query(&client, request_text, sql_query);
+                    template_learn(request_text, sql_query);
                     SPI_finish();
                     PG_RETURN_VOID();
                 }
                 else
                 {
+                    session_record_query(request_text, "", model, "no sql");
+                    query_log_set_sql("", model);
+                    query_log_finish("no sql");
                     SPI_finish();
                     ereport(ERROR,
                             (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
@@ -1303,6 +8928,9 @@ extern "C"
                     error_msg += " | " + result.error.value();
                 }
 
+                session_record_query(request_text, "", model, "ai error");
+                query_log_set_sql("", model);
+                query_log_finish("ai error", 0, 0, error_msg);
                 SPI_finish();
                 ereport(ERROR,
                         (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
@@ -1326,17 +8954,31 @@ extern "C"
     {
         try
         {
-            // Query parameter is now required
-            if (PG_ARGISNULL(0))
+            // Without an argument, explain the statement that failed last, else the last generated query
+            std::string query_to_explain;
+            if (!PG_ARGISNULL(0))
+            {
+                text *query_text = PG_GETARG_TEXT_PP(0);
+                query_to_explain = std::string(VARDATA_ANY(query_text), VARSIZE_ANY_EXHDR(query_text));
+            }
+            else if (const AiCapturedError *last_error = captured_error(0); last_error && last_error->statement[0])
+            {
+                query_to_explain = last_error->statement;
+            }
+            else
+            {
+                query_to_explain = session_last_sql().value_or("");
+            }
+
+            if (query_to_explain.empty())
             {
                 ereport(ERROR,
                         (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                         errmsg("Query parameter is required. Usage: SELECT ai_toolkit.explain_query('your query here');")));
+                         errmsg("No query to explain in this session"),
+                         errhint("Pass the query: SELECT ai_toolkit.explain_query('your query here');")));
             }
 
-            // Get the query from the parameter
-            text *query_text = PG_GETARG_TEXT_PP(0);
-            std::string query_to_explain = std::string(VARDATA_ANY(query_text), VARSIZE_ANY_EXHDR(query_text));
+            query_log_begin("explain_query", query_to_explain);
 
             if (SPI_connect() != SPI_OK_CONNECT)
             {
@@ -1345,6 +8987,32 @@ extern "C"
                          errmsg("Failed to connect to SPI")));
             }
 
+            // Plan the query first: the plan grounds the explanation and, together with the
+            // normalized text, the database and the relations it uses, keys the explanation cache
+            std::string plan, plan_shape, plan_error;
+            bool have_plan = explain_plan(query_to_explain, &plan, &plan_shape, &plan_error);
+            if (!have_plan)
+                elog(LOG, "[explain_query] EXPLAIN failed: %s", plan_error.c_str());
+
+            uint64 cache_key = fingerprint("query\n" + std::to_string(MyDatabaseId) + "\n" +
+                                           plan_relation_oids(query_to_explain) + "\n" +
+                                           normalize_sql_text(query_to_explain) + "\n" + plan_shape);
+            std::optional<std::string> cached = explain_cache_lookup(cache_key);
+            if (cached)
+            {
+                query_log_finish("cached");
+                SPI_finish();
+                std::string explanation = "\n📖 Query Explanation (cached)\n"
+                                          "═══════════════════════════════════════════════════════════\n"
+                                          "Query:\n" +
+                                          query_to_explain + "\n\n"
+                                                             "Explanation:\n" +
+                                          *cached + "\n"
+                                                    "═══════════════════════════════════════════════════════════\n";
+                elog(NOTICE, "%s", explanation.c_str());
+                PG_RETURN_VOID();
+            }
+
             // Build AI client based on configuration
             ai::Client client;
             std::string model;
@@ -1361,34 +9029,6 @@ extern "C"
                          errmsg("Failed to build AI client: %s", e.what())));
             }
 
-            // Define tools
-            ai::Tool get_memory_tool = ai::create_simple_tool(
-                "get_memory",
-                "Retrieve previously stored information about database schema, tables, columns, relationships, or business rules. "
-                "Parameters: category (table|column|relationship|business_rule|data_pattern|calculation|permission|custom), "
-                "key (identifier like table name or 'table.column')",
-                {{"category", "string"}, {"key", "string"}},
-                tool_get_memory);
-
-            ai::Tool list_schemas_tool = ai::create_simple_tool(
-                "list_schemas",
-                "List all available schemas in the current PostgreSQL database. No parameters required.",
-                {},
-                tool_list_schemas);
-
-            ai::Tool list_tables_tool = ai::create_simple_tool(
-                "list_tables_in_schema",
-                "List all tables in a specific schema. Parameters: schema (name of the schema)",
-                {{"schema", "string"}},
-                tool_list_tables_in_schema);
-
-            ai::Tool get_schema_tool = ai::create_simple_tool(
-                "get_schema_for_table",
-                "Get the CREATE TABLE statement (schema) for a specific table. "
-                "Parameters: table_name (name of table, optionally prefixed with schema like 'schema.table')",
-                {{"table_name", "string"}},
-                tool_get_schema_for_table);
-
             // Build explanation prompt
             std::string system_prompt =
                 "You are a PostgreSQL database expert. Your role is to explain SQL queries in detail.\n\n"
@@ -1397,30 +9037,41 @@ extern "C"
                 "2. Break down the query into logical components\n"
                 "3. Explain what each part does\n"
                 "4. Identify potential issues or optimization opportunities\n"
-                "5. Use get_memory to check for stored context about tables/columns\n\n"
+                "5. Use get_memory to check for stored context about tables/columns\n"
+                "6. When an execution plan is provided, base performance remarks on it: "
+                "scan types, join strategies, estimated vs actual rows, and buffer reads\n\n"
                 "Provide your explanation in clear, structured format with:\n"
                 "- Query purpose/goal\n"
                 "- Step-by-step breakdown\n"
                 "- Performance considerations\n"
                 "- Any recommendations\n";
 
-            std::string user_prompt = "Explain this SQL query in detail:\n\n" + query_to_explain;
+            PromptAssembler prompt;
+            prompt.add("", "Explain this SQL query in detail:\n\n" + query_to_explain, 100, true);
+            if (have_plan)
+                prompt.add("Execution plan", plan, 50);
+            else
+                prompt.add("EXPLAIN failed", plan_error, 50);
+            std::string user_prompt = prompt.build(context_token_budget(system_prompt));
+            begin_request(system_prompt, user_prompt);
 
             // Configure generation options
             ai::GenerateOptions options(model, system_prompt, user_prompt);
-            options.tools["get_memory"] = get_memory_tool;
-            options.tools["list_schemas"] = list_schemas_tool;
-            options.tools["list_tables_in_schema"] = list_tables_tool;
-            options.tools["get_schema_for_table"] = get_schema_tool;
-            options.max_steps = 8;
+            tool_registry_apply("explain", options);
+            options.max_steps = std::min(8, max_steps_limit);
 
             // Generate explanation
-            auto result = client.generate_text(options);
+            auto result = governed_generate_text(client, options);
 
             SPI_finish();
 
+            query_log_set_sql("", model);
             if (result)
             {
+                query_log_finish("explained");
+                if (have_plan)
+                    explain_cache_store(cache_key, result.text);
+
                 std::string explanation = "\n📖 Query Explanation\n"
                                           "═══════════════════════════════════════════════════════════\n"
                                           "Query:\n" +
@@ -1435,6 +9086,7 @@ extern "C"
             else
             {
                 std::string error_msg = "Failed to generate explanation: " + result.error_message();
+                query_log_finish("ai error", 0, 0, error_msg);
                 ereport(ERROR,
                         (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
                          errmsg("%s", error_msg.c_str())));
@@ -1457,17 +9109,29 @@ extern "C"
     {
         try
         {
-            // Error parameter is now required
-            if (PG_ARGISNULL(0))
+            // Without an argument, explain the last error captured in this session
+            std::string error_to_explain;
+            std::string error_sqlstate;
+            if (!PG_ARGISNULL(0))
+            {
+                text *error_text = PG_GETARG_TEXT_PP(0);
+                error_to_explain = std::string(VARDATA_ANY(error_text), VARSIZE_ANY_EXHDR(error_text));
+            }
+            else if (const AiCapturedError *last_error = captured_error(0))
+            {
+                error_to_explain = format_captured_error(last_error);
+                error_sqlstate = last_error->sqlstate;
+            }
+            else
             {
                 ereport(ERROR,
                         (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                         errmsg("Error message parameter is required. Usage: SELECT ai_toolkit.explain_error('your error message here');")));
+                         errmsg("No error captured in this session"),
+                         errhint("Pass the error text: SELECT ai_toolkit.explain_error('your error message here'); "
+                                 "Add ai_toolkit to session_preload_libraries to capture errors from session start.")));
             }
 
-            // Get the error from the parameter
-            text *error_text = PG_GETARG_TEXT_PP(0);
-            std::string error_to_explain = std::string(VARDATA_ANY(error_text), VARSIZE_ANY_EXHDR(error_text));
+            query_log_begin("explain_error", error_to_explain);
 
             if (SPI_connect() != SPI_OK_CONNECT)
             {
@@ -1476,6 +9140,33 @@ extern "C"
                          errmsg("Failed to connect to SPI")));
             }
 
+            // Recurring error classes are answered from the shared front cache, then the table
+            ErrorClass error_class = classify_error(error_to_explain, error_sqlstate);
+            std::optional<std::string> cached = explain_cache_lookup(error_class.fingerprint);
+            if (!cached)
+            {
+                cached = error_explanation_lookup(error_class);
+                if (cached)
+                {
+                    stat_add("error_explanations.hits", 1);
+                    explain_cache_store(error_class.fingerprint, *cached);
+                }
+            }
+            if (cached)
+            {
+                query_log_finish("cached");
+                SPI_finish();
+                std::string explanation = "\n🔧 Error Explanation (cached for this error class)\n"
+                                          "═══════════════════════════════════════════════════════════\n"
+                                          "Error:\n" +
+                                          error_to_explain + "\n\n"
+                                                             "Analysis & Solution:\n" +
+                                          *cached + "\n"
+                                                    "═══════════════════════════════════════════════════════════\n";
+                elog(NOTICE, "%s", explanation.c_str());
+                PG_RETURN_VOID();
+            }
+
             // Build AI client based on configuration
             ai::Client client;
             std::string model;
@@ -1492,34 +9183,6 @@ extern "C"
                          errmsg("Failed to build AI client: %s", e.what())));
             }
 
-            // Define tools
-            ai::Tool get_memory_tool = ai::create_simple_tool(
-                "get_memory",
-                "Retrieve previously stored information about database schema, tables, columns, relationships, or business rules. "
-                "Parameters: category (table|column|relationship|business_rule|data_pattern|calculation|permission|custom), "
-                "key (identifier like table name or 'table.column')",
-                {{"category", "string"}, {"key", "string"}},
-                tool_get_memory);
-
-            ai::Tool list_schemas_tool = ai::create_simple_tool(
-                "list_schemas",
-                "List all available schemas in the current PostgreSQL database. No parameters required.",
-                {},
-                tool_list_schemas);
-
-            ai::Tool list_tables_tool = ai::create_simple_tool(
-                "list_tables_in_schema",
-                "List all tables in a specific schema. Parameters: schema (name of the schema)",
-                {{"schema", "string"}},
-                tool_list_tables_in_schema);
-
-            ai::Tool get_schema_tool = ai::create_simple_tool(
-                "get_schema_for_table",
-                "Get the CREATE TABLE statement (schema) for a specific table. "
-                "Parameters: table_name (name of table, optionally prefixed with schema like 'schema.table')",
-                {{"table_name", "string"}},
-                tool_get_schema_for_table);
-
             // Build explanation prompt
             std::string system_prompt =
                 "You are a PostgreSQL database expert specializing in debugging and error resolution.\n\n"
@@ -1536,22 +9199,29 @@ extern "C"
                 "- Prevention tips\n";
 
             std::string user_prompt = "Explain this PostgreSQL error and provide solutions:\n\n" + error_to_explain;
+            begin_request(system_prompt, user_prompt);
 
             // Configure generation options
             ai::GenerateOptions options(model, system_prompt, user_prompt);
-            options.tools["get_memory"] = get_memory_tool;
-            options.tools["list_schemas"] = list_schemas_tool;
-            options.tools["list_tables_in_schema"] = list_tables_tool;
-            options.tools["get_schema_for_table"] = get_schema_tool;
-            options.max_steps = 8;
+            tool_registry_apply("explain", options);
+            options.max_steps = std::min(8, max_steps_limit);
 
             // Generate explanation
-            auto result = client.generate_text(options);
+            auto result = governed_generate_text(client, options);
+
+            if (result && explain_cache_ttl > 0)
+            {
+                error_explanation_store(error_class, result.text, model);
+                explain_cache_store(error_class.fingerprint, result.text);
+                stat_add("error_explanations.generated", 1);
+            }
 
             SPI_finish();
 
+            query_log_set_sql("", model);
             if (result)
             {
+                query_log_finish("explained");
                 std::string explanation = "\n🔧 Error Explanation\n"
                                           "═══════════════════════════════════════════════════════════\n"
                                           "Error:\n" +
@@ -1566,6 +9236,7 @@ extern "C"
             else
             {
                 std::string error_msg = "Failed to generate explanation: " + result.error_message();
+                query_log_finish("ai error", 0, 0, error_msg);
                 ereport(ERROR,
                         (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
                          errmsg("%s", error_msg.c_str())));
@@ -1579,6 +9250,390 @@ extern "C"
                      errmsg("Exception in explain_error: %s", e.what())));
         }
     }
+
+    /**
+     * Add example - store a verified question/SQL pair for few-shot prompts and the fast path
+     */
+    Datum add_example(PG_FUNCTION_ARGS)
+    {
+        std::string question = text_to_cstring(PG_GETARG_TEXT_PP(0));
+        std::string sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+        if (SPI_connect() != SPI_OK_CONNECT)
+            ereport(ERROR,
+                    (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                     errmsg("Failed to connect to SPI")));
+
+        int id = example_store(question, sql);
+        SPI_finish();
+        PG_RETURN_INT32(id);
+    }
+
+    /**
+     * Accept query - store the last query() request of this session as a verified example,
+     * optionally with corrected SQL
+     */
+    Datum accept_query(PG_FUNCTION_ARGS)
+    {
+        const AiQueryHistoryEntry *last = nullptr;
+        for (auto it = query_history.rbegin(); it != query_history.rend(); ++it)
+        {
+            if (!it->sql.empty())
+            {
+                last = &*it;
+                break;
+            }
+        }
+        if (last == nullptr)
+            ereport(ERROR,
+                    (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                     errmsg("No query generated in this session to accept"),
+                     errhint("Run ai_toolkit.query() first, or use ai_toolkit.add_example(question, sql).")));
+
+        std::string sql = PG_ARGISNULL(0) ? last->sql : text_to_cstring(PG_GETARG_TEXT_PP(0));
+        if (PG_ARGISNULL(0) && last->outcome != "executed")
+            ereport(ERROR,
+                    (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                     errmsg("The last generated query was not executed successfully (%s)", last->outcome.c_str()),
+                     errhint("Pass the corrected SQL: SELECT ai_toolkit.accept_query('SELECT ...');")));
+
+        std::string question = last->prompt;
+
+        if (SPI_connect() != SPI_OK_CONNECT)
+            ereport(ERROR,
+                    (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                     errmsg("Failed to connect to SPI")));
+
+        int id = example_store(question, sql);
+        SPI_finish();
+
+        elog(NOTICE, "Stored example #%d: %s", id, question.c_str());
+        PG_RETURN_INT32(id);
+    }
+
+    /**
+     * Register tool - expose a SQL function to the model as a tool. Its named arguments
+     * become the tool's parameters; params maps argument names to descriptions.
+     */
+    Datum register_tool(PG_FUNCTION_ARGS)
+    {
+        if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(3))
+            ereport(ERROR,
+                    (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                     errmsg("name, description and function are required")));
+
+        std::string name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+        std::string description = text_to_cstring(PG_GETARG_TEXT_PP(1));
+        std::string params = PG_ARGISNULL(2) ? "{}" : DatumGetCString(DirectFunctionCall1(jsonb_out, PG_GETARG_DATUM(2)));
+        Oid function = PG_GETARG_OID(3);
+
+        if (!std::regex_match(name, std::regex("[a-z][a-z0-9_]{0,63}")))
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("Invalid tool name '%s'", name.c_str()),
+                     errhint("Use lowercase letters, digits and underscores, starting with a letter.")));
+        if (tool_is_builtin(name))
+            ereport(ERROR,
+                    (errcode(ERRCODE_DUPLICATE_OBJECT),
+                     errmsg("'%s' is a built-in tool", name.c_str())));
+
+        std::vector<std::string> arg_names;
+        std::vector<Oid> arg_types;
+        bool returns_rows;
+        std::string error;
+        if (!tool_function_args(function, &arg_names, &arg_types, &returns_rows, &error))
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_FUNCTION_DEFINITION),
+                     errmsg("Cannot register %s as a tool: %s", format_procedure(function), error.c_str())));
+
+        nlohmann::json param_docs = nlohmann::json::parse(params, nullptr, false);
+        if (!param_docs.is_object())
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("params must be a JSON object mapping argument names to descriptions")));
+        for (const auto &[arg, doc] : param_docs.items())
+        {
+            if (std::find(arg_names.begin(), arg_names.end(), arg) == arg_names.end())
+                ereport(ERROR,
+                        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                         errmsg("%s has no argument named '%s'", format_procedure(function), arg.c_str())));
+            if (!doc.is_string())
+                ereport(ERROR,
+                        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                         errmsg("The description of '%s' must be a string", arg.c_str())));
+        }
+
+        if (SPI_connect() != SPI_OK_CONNECT)
+            ereport(ERROR,
+                    (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                     errmsg("Failed to connect to SPI")));
+
+        Datum values[4] = {CStringGetTextDatum(name.c_str()), CStringGetTextDatum(description.c_str()),
+                           CStringGetTextDatum(params.c_str()), ObjectIdGetDatum(function)};
+        Oid argtypes[4] = {TEXTOID, TEXTOID, TEXTOID, OIDOID};
+        int ret = SPI_execute_with_args(
+            "INSERT INTO ai_toolkit.tools (name, description, params, function) "
+            "VALUES ($1, $2, $3::jsonb, $4::regprocedure) "
+            "ON CONFLICT (name) DO UPDATE SET description = EXCLUDED.description, params = EXCLUDED.params, "
+            "function = EXCLUDED.function, enabled = true, updated_at = CURRENT_TIMESTAMP",
+            4, argtypes, values, nullptr, false, 0);
+        SPI_finish();
+
+        if (ret != SPI_OK_INSERT)
+            ereport(ERROR,
+                    (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                     errmsg("Failed to register tool '%s'", name.c_str())));
+
+        std::string message = "Tool '" + name + "' registered with " + std::to_string(arg_names.size()) + " parameters";
+        PG_RETURN_TEXT_P(cstring_to_text(message.c_str()));
+    }
+
+    /**
+     * Recent errors - errors captured in this session, most recent first
+     */
+    Datum recent_errors(PG_FUNCTION_ARGS)
+    {
+        ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+        InitMaterializedSRF(fcinfo, 0);
+
+        for (uint64 n = 0; const AiCapturedError *entry = captured_error(n); n++)
+        {
+            Datum values[7];
+            bool nulls[7] = {false, false, false, false, entry->detail[0] == '\0', entry->hint[0] == '\0',
+                             entry->statement[0] == '\0'};
+
+            values[0] = Int32GetDatum((int32)n + 1);
+            values[1] = TimestampTzGetDatum(entry->logged_at);
+            values[2] = CStringGetTextDatum(entry->sqlstate);
+            values[3] = CStringGetTextDatum(entry->message);
+            values[4] = nulls[4] ? (Datum)0 : CStringGetTextDatum(entry->detail);
+            values[5] = nulls[5] ? (Datum)0 : CStringGetTextDatum(entry->hint);
+            values[6] = nulls[6] ? (Datum)0 : CStringGetTextDatum(entry->statement);
+
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+
+        return (Datum)0;
+    }
+
+    /**
+     * Query history - ai_toolkit.query() requests of this session, most recent first
+     */
+    Datum query_history_status(PG_FUNCTION_ARGS)
+    {
+        ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+        InitMaterializedSRF(fcinfo, 0);
+
+        int n = 0;
+        for (auto it = query_history.rbegin(); it != query_history.rend(); ++it)
+        {
+            Datum values[7];
+            bool nulls[7] = {false, false, false, it->sql.empty(), false, false, false};
+
+            values[0] = Int32GetDatum(++n);
+            values[1] = TimestampTzGetDatum(it->requested_at);
+            values[2] = CStringGetTextDatum(it->prompt.c_str());
+            values[3] = nulls[3] ? (Datum)0 : CStringGetTextDatum(it->sql.c_str());
+            values[4] = CStringGetTextDatum(it->model.c_str());
+            values[5] = CStringGetTextDatum(it->outcome.c_str());
+            values[6] = Int64GetDatum(it->rows);
+
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+
+        return (Datum)0;
+    }
+
+    /**
+     * Session status - latest request of every backend that used ai_toolkit.query()
+     * Prompts and SQL of other roles' sessions are only shown to pg_read_all_stats members.
+     */
+    Datum session_status(PG_FUNCTION_ARGS)
+    {
+        ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+        InitMaterializedSRF(fcinfo, 0);
+
+        AiSessionState *state = session_attach();
+        bool read_all = has_privs_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS);
+
+        LWLockAcquire(&state->hdr.lock, LW_SHARED);
+        for (int i = 0; i < state->nslots; i++)
+        {
+            const AiSessionSlot *slot = &state->slots[i];
+            if (slot->pid == 0)
+                continue;
+
+            bool visible = read_all || slot->user_id == GetUserId();
+            Datum values[9];
+            bool nulls[9] = {false, false, false, false, false, false, false, !visible, !visible || slot->last_sql[0] == '\0'};
+
+            values[0] = Int32GetDatum(slot->pid);
+            values[1] = ObjectIdGetDatum(slot->database_id);
+            values[2] = ObjectIdGetDatum(slot->user_id);
+            values[3] = Int64GetDatum((int64)slot->requests);
+            values[4] = TimestampTzGetDatum(slot->last_request_at);
+            values[5] = CStringGetTextDatum(slot->last_outcome);
+            values[6] = Int64GetDatum(slot->last_rows);
+            values[7] = nulls[7] ? (Datum)0 : CStringGetTextDatum(slot->last_prompt);
+            values[8] = nulls[8] ? (Datum)0 : CStringGetTextDatum(slot->last_sql);
+
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+        LWLockRelease(&state->hdr.lock);
+
+        return (Datum)0;
+    }
+
+    /**
+     * Rate limit status - one row per provider/model bucket
+     * Shows in-flight calls, queue depth, remaining credit and wait statistics
+     */
+    Datum rate_limit_status(PG_FUNCTION_ARGS)
+    {
+        ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+        InitMaterializedSRF(fcinfo, 0);
+
+        AiRateLimitState *state = rate_limit_attach();
+        TimestampTz now = GetCurrentTimestamp();
+
+        LWLockAcquire(&state->hdr.lock, LW_SHARED);
+        for (int i = 0; i < AI_RATE_LIMIT_SLOTS; i++)
+        {
+            const AiRateLimitSlot *slot = &state->slots[i];
+            if (slot->key[0] == '\0')
+                continue;
+
+            // Project credit forward without mutating the bucket under a shared lock
+            double elapsed_min = (double)(now - slot->last_refill) / (60.0 * USECS_PER_SEC);
+            Datum values[11];
+            bool nulls[11] = {false};
+
+            values[0] = CStringGetTextDatum(slot->key);
+            values[1] = Int32GetDatum(slot->in_flight);
+            values[2] = Int32GetDatum(slot->waiting);
+            if (rate_limit_rpm > 0)
+                values[3] = Float8GetDatum(std::min((double)rate_limit_rpm, slot->request_credit + elapsed_min * rate_limit_rpm));
+            else
+                nulls[3] = true;
+            if (rate_limit_tpm > 0)
+                values[4] = Float8GetDatum(std::min((double)rate_limit_tpm, slot->token_credit + elapsed_min * rate_limit_tpm));
+            else
+                nulls[4] = true;
+            values[5] = Int64GetDatum((int64)slot->granted);
+            values[6] = Int64GetDatum((int64)slot->waited);
+            values[7] = Int64GetDatum((int64)slot->timeouts);
+            values[8] = Float8GetDatum(slot->waited > 0 ? (double)slot->total_wait_us / slot->waited / 1000.0 : 0.0);
+            values[9] = Float8GetDatum((double)slot->max_wait_us / 1000.0);
+            values[10] = Int64GetDatum((int64)slot->tokens_charged);
+
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+        LWLockRelease(&state->hdr.lock);
+
+        return (Datum)0;
+    }
+
+    /**
+     * Provider target status - circuit breaker state and latency per target
+     */
+    Datum provider_target_status(PG_FUNCTION_ARGS)
+    {
+        ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+        InitMaterializedSRF(fcinfo, 0);
+
+        AiTargetHealthState *state = target_health_attach();
+        static const char *breaker_states[] = {"closed", "open", "half_open"};
+
+        LWLockAcquire(&state->hdr.lock, LW_SHARED);
+        for (int i = 0; i < AI_TARGET_SLOTS; i++)
+        {
+            const AiTargetHealth *slot = &state->targets[i];
+            if (slot->key[0] == '\0')
+                continue;
+
+            Datum values[9];
+            bool nulls[9] = {false};
+
+            long p50 = target_latency_percentile(slot, 0.50, 1);
+            long p95 = target_latency_percentile(slot, 0.95, 1);
+
+            values[0] = CStringGetTextDatum(slot->key);
+            values[1] = CStringGetTextDatum(breaker_states[slot->breaker_state]);
+            values[2] = Int32GetDatum(slot->consecutive_failures);
+            values[3] = Int64GetDatum((int64)slot->requests);
+            values[4] = Int64GetDatum((int64)slot->failures);
+            values[5] = Int64GetDatum((int64)p50);
+            nulls[5] = p50 < 0;
+            values[6] = Int64GetDatum((int64)p95);
+            nulls[6] = p95 < 0;
+            values[7] = Int64GetDatum((int64)slot->hedges_fired);
+            values[8] = Int64GetDatum((int64)slot->hedges_won);
+
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+        LWLockRelease(&state->hdr.lock);
+
+        return (Datum)0;
+    }
+
+    /**
+     * Stat counters - one row per named counter, with the time of the last reset
+     */
+    Datum stat_counters(PG_FUNCTION_ARGS)
+    {
+        ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+        InitMaterializedSRF(fcinfo, 0);
+
+        AiStatState *state = stat_attach();
+
+        LWLockAcquire(&state->hdr.lock, LW_SHARED);
+        for (int i = 0; i < AI_STAT_SLOTS; i++)
+        {
+            const AiStatCounter *counter = &state->counters[i];
+            if (counter->name[0] == '\0')
+                continue;
+
+            Datum values[3];
+            bool nulls[3] = {false};
+            values[0] = CStringGetTextDatum(counter->name);
+            values[1] = Int64GetDatum(counter->value);
+            values[2] = TimestampTzGetDatum(state->reset_at);
+
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+        LWLockRelease(&state->hdr.lock);
+
+        return (Datum)0;
+    }
+
+    /**
+     * Reset all stat counters
+     */
+    Datum reset_stats(PG_FUNCTION_ARGS)
+    {
+        AiStatState *state = stat_attach();
+
+        LWLockAcquire(&state->hdr.lock, LW_EXCLUSIVE);
+        memset(state->counters, 0, sizeof(state->counters));
+        state->reset_at = GetCurrentTimestamp();
+        LWLockRelease(&state->hdr.lock);
+
+        PG_RETURN_VOID();
+    }
+
+    /**
+     * Send a relcache invalidation for a relation so every backend reindexes it.
+     * Called by the ai_toolkit_comment_changed event trigger, since COMMENT ON sends none.
+     */
+    Datum invalidate_relation(PG_FUNCTION_ARGS)
+    {
+        Oid relid = PG_GETARG_OID(0);
+
+        if (SearchSysCacheExists1(RELOID, ObjectIdGetDatum(relid)))
+            CacheInvalidateRelcacheByRelid(relid);
+
+        PG_RETURN_VOID();
+    }
 }
 
 extern "C"
@@ -1632,6 +9687,473 @@ extern "C"
                                    nullptr,
                                    nullptr);
 
+        DefineCustomStringVariable("ai_toolkit.ai_api_keys",
+                                   "Per-provider AI API keys",
+                                   "Comma-separated provider=key pairs used for fallback targets, "
+                                   "e.g. 'openai=sk-...,anthropic=sk-ant-...'. Falls back to ai_toolkit.ai_api_key.",
+                                   &ai_api_keys,
+                                   nullptr,
+                                   PGC_SUSET,
+                                   GUC_SUPERUSER_ONLY,
+                                   nullptr,
+                                   nullptr,
+                                   nullptr);
+
+        DefineCustomStringVariable("ai_toolkit.ai_targets",
+                                   "AI provider targets",
+                                   "Ordered, comma-separated list of provider|model[|base_url] targets. "
+                                   "Requests go to the first healthy target and fall back to the next on "
+                                   "server errors and timeouts. Overrides ai_provider/ai_model/ai_base_url when set.",
+                                   &ai_targets,
+                                   nullptr,
+                                   PGC_USERSET,
+                                   0,
+                                   nullptr,
+                                   nullptr,
+                                   nullptr);
+
+        DefineCustomBoolVariable("ai_toolkit.hedging",
+                                 "Hedge slow provider requests",
+                                 "Fire a second request at the next healthy target (or the same one) when the "
+                                 "first has not answered within its p95 latency, and use whichever answers first.",
+                                 &hedging_enabled,
+                                 false,
+                                 PGC_USERSET,
+                                 0,
+                                 nullptr,
+                                 nullptr,
+                                 nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.hedge_min_delay",
+                                "Minimum hedge delay",
+                                "Lower bound for the p95-derived delay before a hedge request is fired.",
+                                &hedge_min_delay,
+                                2000,
+                                0,
+                                INT_MAX,
+                                PGC_USERSET,
+                                GUC_UNIT_MS,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.breaker_failure_threshold",
+                                "Circuit breaker failure threshold",
+                                "Consecutive failures after which a target's circuit opens and it is skipped.",
+                                &breaker_failure_threshold,
+                                3,
+                                1,
+                                1000,
+                                PGC_SIGHUP,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.breaker_cooldown",
+                                "Circuit breaker cooldown",
+                                "How long an open circuit stays open before a single probe request is allowed.",
+                                &breaker_cooldown,
+                                30000,
+                                0,
+                                INT_MAX,
+                                PGC_SIGHUP,
+                                GUC_UNIT_MS,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomEnumVariable("ai_toolkit.routing",
+                                 "Model routing policy for query()",
+                                 "off: every step uses ai_model. tiered: ai_toolkit.explore_model runs schema "
+                                 "exploration and drafts SQL; the configured model is used only to synthesize the "
+                                 "final SQL when the draft is invalid or below ai_toolkit.routing_confidence.",
+                                 &routing_mode,
+                                 AI_ROUTING_OFF,
+                                 routing_mode_options,
+                                 PGC_USERSET,
+                                 0,
+                                 nullptr,
+                                 nullptr,
+                                 nullptr);
+
+        DefineCustomStringVariable("ai_toolkit.explore_model",
+                                   "Exploration model",
+                                   "Small/fast model used for schema exploration when ai_toolkit.routing = tiered. "
+                                   "Must be served by the primary provider.",
+                                   &explore_model,
+                                   nullptr,
+                                   PGC_USERSET,
+                                   0,
+                                   nullptr,
+                                   nullptr,
+                                   nullptr);
+
+        DefineCustomRealVariable("ai_toolkit.routing_confidence",
+                                 "Confidence needed to skip escalation",
+                                 "Explore model SQL with a self-reported confidence at or above this value is used "
+                                 "without calling the configured model. Set above 1 to always escalate.",
+                                 &routing_confidence,
+                                 0.8,
+                                 0.0,
+                                 2.0,
+                                 PGC_USERSET,
+                                 0,
+                                 nullptr,
+                                 nullptr,
+                                 nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.input_token_budget",
+                                "Input token budget per step",
+                                "Estimated input tokens (system prompt, user message and tool output) allowed per "
+                                "model step. Tool output and optional context are trimmed to fit. 0 disables the budget.",
+                                &input_token_budget,
+                                0,
+                                0,
+                                INT_MAX,
+                                PGC_USERSET,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomEnumVariable("ai_toolkit.result_mode",
+                                 "How query() presents results",
+                                 "rows: print every row. answer: summarize the result in-engine in one pass "
+                                 "(row count, per-column min/max/avg and top values) and have the model answer "
+                                 "the question from that summary.",
+                                 &result_mode,
+                                 AI_RESULT_ROWS,
+                                 result_mode_options,
+                                 PGC_USERSET,
+                                 0,
+                                 nullptr,
+                                 nullptr,
+                                 nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.answer_max_rows",
+                                "Largest result shown as rows in answer mode",
+                                "In answer mode, results with at most this many rows are printed and sent to the model "
+                                "in full; larger ones only as a summary with a few sample rows.",
+                                &answer_max_rows,
+                                20,
+                                0,
+                                1000,
+                                PGC_USERSET,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomEnumVariable("ai_toolkit.tool_output_format",
+                                 "Encoding of schema tool results",
+                                 "verbose: JSON with CREATE TABLE text and a column array. "
+                                 "compact: one terse DDL line per table with short type names and bare name lists, "
+                                 "which cuts the tokens resent on every later step.",
+                                 &tool_output_format,
+                                 AI_TOOL_OUTPUT_VERBOSE,
+                                 tool_output_format_options,
+                                 PGC_USERSET,
+                                 0,
+                                 nullptr,
+                                 nullptr,
+                                 nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.compact_max_columns",
+                                "Columns described per table in compact mode",
+                                "Columns beyond this are listed by name only. 0 describes all columns.",
+                                &compact_max_columns,
+                                60,
+                                0,
+                                10000,
+                                PGC_USERSET,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomBoolVariable("ai_toolkit.explain_analyze",
+                                 "Run EXPLAIN ANALYZE, BUFFERS in explain_query",
+                                 "Only plain SELECT statements without data-modifying CTEs, INTO or row locks are executed; "
+                                 "everything else gets a plain EXPLAIN.",
+                                 &explain_analyze,
+                                 false,
+                                 PGC_SUSET,
+                                 0,
+                                 nullptr,
+                                 nullptr,
+                                 nullptr);
+
+        DefineCustomBoolVariable("ai_toolkit.structured_output",
+                                 "Have query() answer through the final_answer tool",
+                                 "The model hands in {sql, disclaimer, explanation, confidence} as a validated tool call "
+                                 "instead of <sql> and <disclaimer> tags. Tagged answers are still accepted.",
+                                 &structured_output,
+                                 true,
+                                 PGC_USERSET,
+                                 0,
+                                 nullptr,
+                                 nullptr,
+                                 nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.max_steps",
+                                "Maximum model steps per request",
+                                "query() sizes its step budget from the request and catalog up to this limit; "
+                                "explain_query and explain_error use at most 8.",
+                                &max_steps_limit,
+                                10,
+                                1,
+                                50,
+                                PGC_USERSET,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.prefetch_tables",
+                                "Tables whose metadata is prefetched while the model thinks",
+                                "query() warms the tool cache with schemas, table lists and memories for this many "
+                                "likely tables during the provider call. 0 disables prefetching.",
+                                &prefetch_tables,
+                                5,
+                                0,
+                                50,
+                                PGC_USERSET,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.prerank_tables",
+                                "Tables suggested to the model before its first step",
+                                "query() names this many tables ranked by the catalog index against the request. 0 disables the hint.",
+                                &prerank_tables,
+                                10,
+                                0,
+                                100,
+                                PGC_USERSET,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.example_shots",
+                                "Verified examples shown to the model",
+                                "query() adds up to this many stored question/SQL pairs similar to the request to the prompt. 0 disables.",
+                                &example_shots,
+                                3,
+                                0,
+                                20,
+                                PGC_USERSET,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomRealVariable("ai_toolkit.example_fast_path_similarity",
+                                 "Similarity at which a verified example is reused without the model",
+                                 "When a stored example is at least this similar to the request, query() runs its SQL directly. 0 disables the fast path.",
+                                 &example_fast_path_similarity,
+                                 0.95,
+                                 0.0,
+                                 1.0,
+                                 PGC_USERSET,
+                                 0,
+                                 nullptr,
+                                 nullptr,
+                                 nullptr);
+
+        DefineCustomStringVariable("ai_toolkit.example_trusted_roles",
+                                   "Roles whose examples the fast path runs for every user",
+                                   "Comma-separated role names. The fast path runs an example's SQL only if the example was "
+                                   "stored by the current user, a superuser or one of these roles.",
+                                   &example_trusted_roles,
+                                   "",
+                                   PGC_SUSET,
+                                   0,
+                                   nullptr,
+                                   nullptr,
+                                   nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.template_cache_size",
+                                "SQL templates kept per session",
+                                "Generated queries are turned into parameterized templates with kept plans; a request that differs only in literals reuses one without calling the model. 0 disables.",
+                                &template_cache_size,
+                                64,
+                                0,
+                                10000,
+                                PGC_USERSET,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.sample_page_budget",
+                                "Pages read when the sample_rows tool samples a table",
+                                "Tables larger than this are read with TABLESAMPLE SYSTEM sized to about this many pages.",
+                                &sample_page_budget,
+                                32,
+                                1,
+                                1000000,
+                                PGC_USERSET,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomStringVariable("ai_toolkit.standby_conninfo",
+                                   "Connection string of a standby for generated queries",
+                                   "query() runs generated read-only SELECTs there over a reused libpq connection, "
+                                   "falling back to the local server when it is unavailable. Empty runs them locally.",
+                                   &standby_conninfo,
+                                   "",
+                                   PGC_SUSET,
+                                   0,
+                                   nullptr,
+                                   nullptr,
+                                   nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.tool_timeout",
+                                "Time limit for a call to a registered tool",
+                                "The function call is cancelled after this long. 0 disables the limit.",
+                                &tool_timeout,
+                                2000,
+                                0,
+                                INT_MAX,
+                                PGC_SUSET,
+                                GUC_UNIT_MS,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.sample_timeout",
+                                "Time limit for a sample_rows query",
+                                "The sample query is cancelled after this long. 0 disables the limit.",
+                                &sample_timeout,
+                                2000,
+                                0,
+                                INT_MAX,
+                                PGC_SUSET,
+                                GUC_UNIT_MS,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.explain_cache_ttl",
+                                "Lifetime of cached query explanations",
+                                "Explanations are shared across sessions and keyed by the normalized query and its plan shape. 0 disables the cache.",
+                                &explain_cache_ttl,
+                                86400,
+                                0,
+                                INT_MAX / 1000,
+                                PGC_SUSET,
+                                GUC_UNIT_S,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomBoolVariable("ai_toolkit.track_sessions",
+                                 "Publish each session's latest request for monitoring",
+                                 "Shown by the ai_toolkit.sessions view. Session history itself is always kept in backend memory.",
+                                 &track_sessions,
+                                 true,
+                                 PGC_SUSET,
+                                 0,
+                                 nullptr,
+                                 nullptr,
+                                 nullptr);
+
+        DefineCustomBoolVariable("ai_toolkit.query_log",
+                                 "Log requests to ai_toolkit.query_log",
+                                 "Entries are queued in shared memory and written in batches by a background worker.",
+                                 &query_log_enabled,
+                                 true,
+                                 PGC_SUSET,
+                                 0,
+                                 nullptr,
+                                 nullptr,
+                                 nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.log_flush_interval",
+                                "Interval between query log writes",
+                                "The writer also flushes early when the queue is a quarter full.",
+                                &log_flush_interval,
+                                1000,
+                                10,
+                                60 * 60 * 1000,
+                                PGC_SIGHUP,
+                                GUC_UNIT_MS,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.log_retention_days",
+                                "Days of query log kept",
+                                "Older daily partitions of ai_toolkit.query_log are dropped. 0 keeps everything.",
+                                &log_retention_days,
+                                30,
+                                0,
+                                36500,
+                                PGC_SIGHUP,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.memory_maintenance_interval",
+                                "Interval between background memory maintenance runs",
+                                "Removes memories about dropped tables and columns, merges near-duplicate keys, "
+                                "decays confidence and expires stale memories. While enabled, each database's "
+                                "worker stays running and holds a max_worker_processes slot. 0 disables maintenance.",
+                                &memory_maintenance_interval,
+                                0,
+                                0,
+                                INT_MAX / 1000,
+                                PGC_SIGHUP,
+                                GUC_UNIT_S,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.memory_half_life",
+                                "Days for memory confidence to halve without updates",
+                                "Updating a memory restores full confidence. 0 disables decay.",
+                                &memory_half_life,
+                                90,
+                                0,
+                                36500,
+                                PGC_SIGHUP,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.memory_min_confidence",
+                                "Confidence below which memories are removed",
+                                "0 keeps memories regardless of confidence.",
+                                &memory_min_confidence,
+                                10,
+                                0,
+                                100,
+                                PGC_SIGHUP,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.memory_ttl",
+                                "Days without update after which a memory is removed",
+                                "0 disables the TTL.",
+                                &memory_ttl,
+                                0,
+                                0,
+                                36500,
+                                PGC_SIGHUP,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
         DefineCustomStringVariable("ai_toolkit.prompt_file",
                                    "AI Prompt File Path",
                                    "Path to a text file containing the system prompt for the AI. "
@@ -1645,11 +10167,78 @@ extern "C"
                                    nullptr,
                                    nullptr);
 
+        DefineCustomIntVariable("ai_toolkit.rate_limit_rpm",
+                                "Provider requests per minute",
+                                "Cluster-wide limit on provider requests per minute for each provider/model. "
+                                "Each tool-loop step counts as one request. 0 disables the limit.",
+                                &rate_limit_rpm,
+                                0,
+                                0,
+                                INT_MAX,
+                                PGC_SIGHUP,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.rate_limit_tpm",
+                                "Provider tokens per minute",
+                                "Cluster-wide limit on prompt plus completion tokens per minute for each provider/model. "
+                                "0 disables the limit.",
+                                &rate_limit_tpm,
+                                0,
+                                0,
+                                INT_MAX,
+                                PGC_SIGHUP,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.max_in_flight",
+                                "Maximum concurrent provider calls",
+                                "Cluster-wide limit on concurrent AI calls for each provider/model. "
+                                "Further callers wait for a slot. 0 disables the limit.",
+                                &max_in_flight,
+                                0,
+                                0,
+                                10000,
+                                PGC_SIGHUP,
+                                0,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        DefineCustomIntVariable("ai_toolkit.rate_limit_max_wait",
+                                "Maximum wait for provider capacity",
+                                "How long a call may queue for rate limit capacity before failing. "
+                                "0 waits until the statement is cancelled.",
+                                &rate_limit_max_wait,
+                                0,
+                                0,
+                                INT_MAX,
+                                PGC_USERSET,
+                                GUC_UNIT_MS,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+
+        RegisterXactCallback(rate_limit_xact_callback, nullptr);
+        RegisterXactCallback(query_log_xact_callback, nullptr);
+        CacheRegisterRelcacheCallback(catalog_index_relcache_callback, (Datum)0);
+        CacheRegisterSyscacheCallback(CONSTROID, join_graph_invalidate, (Datum)0);
+        CacheRegisterSyscacheCallback(RELOID, join_graph_invalidate, (Datum)0);
+        CacheRegisterSyscacheCallback(PROCOID, tool_registry_invalidate, (Datum)0);
+
+        prev_emit_log_hook = emit_log_hook;
+        emit_log_hook = capture_error_hook;
+
         ereport(LOG, (errmsg("ai_toolkit extension loaded")));
     }
 
     void _PG_fini(void)
     {
+        emit_log_hook = prev_emit_log_hook;
         ereport(LOG, (errmsg("ai_toolkit extension unloaded")));
     }
 }